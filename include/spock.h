@@ -42,6 +42,7 @@ extern bool spock_synchronous_commit;
 extern char *spock_temp_directory;
 extern bool spock_use_spi;
 extern bool spock_batch_inserts;
+extern bool spock_batch_updates;
 extern char *spock_extra_connection_options;
 extern bool spock_ch_stats;
 extern bool spock_deny_ddl;
@@ -51,6 +52,7 @@ extern bool allow_ddl_from_functions;
 extern int	restart_delay_default;
 extern int	restart_delay_on_exception;
 extern int	spock_replay_queue_size;	/* Deprecated - no longer used */
+extern int	spock_replay_queue_memory_limit;
 extern bool check_all_uc_indexes;
 extern bool	spock_enable_quiet_mode;
 extern int	log_origin_change;
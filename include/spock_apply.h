@@ -31,12 +31,28 @@ typedef void (*spock_apply_mi_add_tuple_fn) (SpockRelation *rel,
 											 SpockTupleData *tup);
 typedef void (*spock_apply_mi_finish_fn) (SpockRelation *rel);
 
+typedef bool (*spock_apply_can_batch_fn) (SpockRelation *rel);
+typedef void (*spock_apply_batch_add_fn) (SpockRelation *rel,
+										  SpockTupleData *oldtup,
+										  SpockTupleData *newtup);
+typedef void (*spock_apply_batch_finish_fn) (SpockRelation *rel);
+
 /* my_exception_log_index belongs here, and not in the exception handler
  * since it's specific to each apply worker.
  */
 extern int	my_exception_log_index;
 
+extern int	spock_apply_readahead_size;
+extern int	spock_apply_coalesce_xacts;
+extern int	spock_apply_coalesce_size;
+extern int	spock_apply_coalesce_timeout;
+extern bool spock_update_changed_columns_only;
+
 extern void wait_for_previous_transaction(void);
+extern void spock_apply_poll_stream(void);
 extern void awake_transaction_waiters(void);
+extern bool spock_apply_in_coalesced_subxact(void);
+extern bool spock_apply_coalesced_commit_ts(TransactionId xid,
+											TimestampTz *commit_time);
 
 #endif							/* SPOCK_APPLY_H */
@@ -0,0 +1,27 @@
+/*-------------------------------------------------------------------------
+ *
+ * spock_apply_delay.h
+ * 		spock buffering of transactions held back by apply_delay
+ *
+ * Copyright (c) 2022-2026, pgEdge, Inc.
+ * Portions Copyright (c) 1996-2021, PostgreSQL Global Development Group
+ * Portions Copyright (c) 1994, The Regents of the University of California
+ *
+ *-------------------------------------------------------------------------
+ */
+#ifndef SPOCK_APPLY_DELAY_H
+#define SPOCK_APPLY_DELAY_H
+
+#include "access/xlogdefs.h"
+#include "lib/stringinfo.h"
+#include "utils/timestamp.h"
+
+extern void spock_apply_delay_init(void);
+extern bool spock_apply_delay_pending(void);
+extern void spock_apply_delay_push(StringInfo msg, TimestampTz apply_at,
+								   XLogRecPtr feedback_lsn);
+extern TimestampTz spock_apply_delay_next_time(void);
+extern XLogRecPtr spock_apply_delay_feedback_lsn(void);
+extern char *spock_apply_delay_pop(TimestampTz now, int *len);
+
+#endif							/* SPOCK_APPLY_DELAY_H */
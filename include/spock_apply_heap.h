@@ -15,8 +15,12 @@
 #include "spock_relcache.h"
 #include "spock_proto_native.h"
 
+extern int	spock_replica_identity_full_hash_mem;
+
 extern void spock_apply_heap_begin(void);
 extern void spock_apply_heap_commit(void);
+extern void spock_apply_heap_invalidate(Oid reloid);
+extern void spock_apply_heap_release_cache(void);
 
 extern void spock_apply_heap_insert(SpockRelation *rel,
 									SpockTupleData *newtup);
@@ -31,4 +35,11 @@ void		spock_apply_heap_mi_add_tuple(SpockRelation *rel,
 										  SpockTupleData *tup);
 void		spock_apply_heap_mi_finish(SpockRelation *rel);
 
+bool		spock_apply_heap_can_batch(SpockRelation *rel);
+void		spock_apply_heap_batch_add(SpockRelation *rel,
+									   SpockTupleData *oldtup,
+									   SpockTupleData *newtup);
+void		spock_apply_heap_batch_finish(SpockRelation *rel);
+void		spock_apply_heap_batch_discard(void);
+
 #endif							/* SPOCK_APPLY_HEAP_H */
@@ -0,0 +1,48 @@
+/*-------------------------------------------------------------------------
+ *
+ * spock_apply_parallel.h
+ * 		spock parallel apply of independent remote transactions
+ *
+ * Copyright (c) 2022-2026, pgEdge, Inc.
+ * Portions Copyright (c) 1996-2021, PostgreSQL Global Development Group
+ * Portions Copyright (c) 1994, The Regents of the University of California
+ *
+ *-------------------------------------------------------------------------
+ */
+#ifndef SPOCK_APPLY_PARALLEL_H
+#define SPOCK_APPLY_PARALLEL_H
+
+#include "access/xlogdefs.h"
+#include "lib/stringinfo.h"
+#include "replication/origin.h"
+
+/* GUC */
+extern int	spock_apply_parallel_workers;
+
+/* Set in the parallel apply worker processes */
+extern bool is_parallel_apply_worker;
+
+/* Apply worker (leader) side */
+extern bool spock_apply_parallel_start(RepOriginId originid);
+extern bool spock_apply_parallel_active(void);
+extern bool spock_apply_parallel_busy(void);
+extern void spock_apply_parallel_relation(StringInfo s);
+extern void spock_apply_parallel_txn_reset(void);
+extern void spock_apply_parallel_txn_add(uint32 relid, int nkeys,
+										 uint32 *keys);
+extern int	spock_apply_parallel_dispatch_begin(XLogRecPtr end_lsn);
+extern void spock_apply_parallel_send(int worker, const char *data,
+									  Size len, bool flush);
+extern void spock_apply_parallel_wait_all(void);
+extern bool spock_apply_parallel_next_finished(XLogRecPtr *remote_end,
+											   XLogRecPtr *local_end);
+extern XLogRecPtr spock_apply_parallel_last_dispatched(void);
+
+/* Parallel apply worker side */
+extern void spock_apply_parallel_wait_for_turn(void);
+
+/* Provided by spock_apply.c */
+extern void apply_parallel_worker_init(void);
+extern void apply_parallel_worker_message(StringInfo s);
+
+#endif							/* SPOCK_APPLY_PARALLEL_H */
@@ -0,0 +1,29 @@
+/*-------------------------------------------------------------------------
+ *
+ * spock_apply_stream.h
+ * 		spock spooling of streamed in-progress transactions
+ *
+ * Copyright (c) 2022-2026, pgEdge, Inc.
+ * Portions Copyright (c) 1996-2021, PostgreSQL Global Development Group
+ * Portions Copyright (c) 1994, The Regents of the University of California
+ *
+ *-------------------------------------------------------------------------
+ */
+#ifndef SPOCK_APPLY_STREAM_H
+#define SPOCK_APPLY_STREAM_H
+
+#include "lib/stringinfo.h"
+
+/* GUC */
+extern bool spock_stream_in_progress;
+
+extern void spock_apply_stream_init(void);
+extern void spock_apply_stream_start(TransactionId xid, bool first_segment);
+extern void spock_apply_stream_write(TransactionId xid, StringInfo s);
+extern void spock_apply_stream_stop(void);
+extern void spock_apply_stream_abort(TransactionId xid, TransactionId subxid);
+extern void spock_apply_stream_replay_begin(TransactionId xid);
+extern StringInfo spock_apply_stream_replay_next(void);
+extern void spock_apply_stream_cleanup(void);
+
+#endif							/* SPOCK_APPLY_STREAM_H */
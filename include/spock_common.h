@@ -77,6 +77,22 @@ extern bool SpockRelationFindReplTupleByIndex(EState *estate,
 											  LockTupleMode lockmode,
 											  TupleTableSlot *searchslot,
 											  TupleTableSlot *outslot);
+extern bool SpockRelationFindReplTupleByIndexKey(EState *estate,
+												 Relation rel,
+												 Relation idxrel,
+												 ScanKey skey,
+												 int nkeys,
+												 LockTupleMode lockmode,
+												 TupleTableSlot *searchslot,
+												 TupleTableSlot *outslot);
+extern bool SpockRelationFindReplTupleByFullIndex(EState *estate,
+												  Relation rel,
+												  Relation idxrel,
+												  LockTupleMode lockmode,
+												  TupleTableSlot *searchslot,
+												  TupleTableSlot *outslot);
+extern bool spock_tuples_equal(TupleTableSlot *slot1, TupleTableSlot *slot2);
+extern int	spock_replindex_scan_key_init(ScanKey skey, Relation idxrel);
 
 extern void read_buf(int fd, void *buf, size_t nbytes, const char *filename);
 extern void write_buf(int fd, const void *buf, size_t nbytes, const char *filename);
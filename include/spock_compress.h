@@ -0,0 +1,44 @@
+/*-------------------------------------------------------------------------
+ *
+ * spock_compress.h
+ * 		spock compression of replication stream messages
+ *
+ * Copyright (c) 2022-2026, pgEdge, Inc.
+ * Portions Copyright (c) 1996-2021, PostgreSQL Global Development Group
+ * Portions Copyright (c) 1994, The Regents of the University of California
+ *
+ *-------------------------------------------------------------------------
+ */
+#ifndef SPOCK_COMPRESS_H
+#define SPOCK_COMPRESS_H
+
+#include "lib/stringinfo.h"
+
+typedef enum SpockCompression
+{
+	SPOCK_COMPRESSION_NONE = 0,
+	SPOCK_COMPRESSION_LZ4,
+	SPOCK_COMPRESSION_ZSTD
+} SpockCompression;
+
+/* Action byte of a compressed message, no other message starts with it */
+#define SPOCK_COMPRESSED_MSG		'Z'
+
+/* Action byte, method and uncompressed length */
+#define SPOCK_COMPRESSED_HDR_SIZE	6
+
+/* Messages shorter than this are sent as they are */
+#define SPOCK_COMPRESS_MIN_SIZE		256
+
+extern int	spock_stream_compression;
+
+extern SpockCompression spock_compression_from_name(const char *name);
+extern const char *spock_compression_name(SpockCompression method);
+
+extern bool spock_compress(SpockCompression method, const char *src,
+						   int srclen, StringInfo dst);
+extern int	spock_decompressed_size(const char *src, int srclen);
+extern void spock_decompress(const char *src, int srclen, char *dst,
+							 int rawlen);
+
+#endif							/* SPOCK_COMPRESS_H */
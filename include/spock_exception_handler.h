@@ -60,6 +60,8 @@ typedef struct SpockExceptionLog
 	HeapTuple	local_tuple;
 	char		initial_error_message[1024];
 	char		initial_operation[16];
+	XLogRecPtr	serial_apply_lsn;	/* apply serially up to here after a
+									 * parallel apply failure */
 } SpockExceptionLog;
 
 typedef enum SpockExceptionBehaviour
@@ -138,10 +138,20 @@ typedef struct SpockApplyProgress
 									 * in versions <=5.x.x only */
 } SpockApplyProgress;
 
-/* Hash entry: one per group (stable pointer; not moved by dynahash) */
+/*
+ * Hash entry: one per group (stable pointer; not moved by dynahash)
+ *
+ * The progress payload is not protected by apply_group_master_lock, that lock
+ * only guards inserting entries into the hash.  Writers of a group serialize
+ * on 'mutex' and bump 'changecount' before and after the change, readers copy
+ * the payload without locking and retry until they see an even, unchanged
+ * counter (see spock_group_progress_read).
+ */
 typedef struct SpockGroupEntry
 {
 	SpockApplyProgress	progress;
+	slock_t				mutex;			/* serializes progress writers */
+	pg_atomic_uint32	changecount;	/* odd while progress is written */
 	pg_atomic_uint32	nattached;
 	ConditionVariable	prev_processed_cv;
 } SpockGroupEntry;
@@ -156,6 +166,8 @@ extern void spock_group_detach(void);
 extern bool spock_group_progress_update(const SpockApplyProgress *sap);
 extern void spock_group_progress_update_ptr(SpockGroupEntry *entry,
 											const SpockApplyProgress *sap);
+extern void spock_group_progress_read(SpockGroupEntry *entry,
+									  SpockApplyProgress *sap);
 extern TimestampTz apply_worker_get_prev_remote_ts(void);
 
 extern void spock_group_resource_dump(void);
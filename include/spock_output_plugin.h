@@ -12,6 +12,7 @@
 #ifndef SPOCK_OUTPUT_PLUGIN_H
 #define SPOCK_OUTPUT_PLUGIN_H
 
+#include "fmgr.h"
 #include "nodes/pg_list.h"
 #include "nodes/primnodes.h"
 #include "replication/logical.h"
@@ -36,6 +37,16 @@ typedef struct SpockOutputData
 	bool		forward_changeset_origins;
 	int			field_datum_encoding;
 
+	/* Streaming of in-progress transactions, see pg_decode_stream_start() */
+	bool		allow_streaming;
+	bool		in_streaming;
+
+	/* Compression of the messages sent, see spock_compress.c */
+	int			compression;
+
+	/* Send only the changed columns of REPLICA IDENTITY FULL updates */
+	bool		update_changed_only;
+
 	/*
 	 * client info
 	 *
@@ -65,6 +76,9 @@ typedef struct SpockOutputData
 	bool		client_binary_intdatetimes_set;
 	bool		client_binary_intdatetimes;
 	bool		client_no_txinfo;
+	bool		client_stream_in_progress;
+	const char *client_compression;
+	bool		client_update_changed_only;
 
 	/* Spock version related parameters. */
 	int			startup_params_format;
@@ -81,6 +95,20 @@ typedef struct SpockOutputData
 	RangeVar   *replicate_only_table;
 } SpockOutputData;
 
+/*
+ * How spock_write_tuple() sends one column of a relation.  Decided once per
+ * relation and kept in the output plugin's relation metadata cache.
+ */
+typedef struct SpockAttrEncoding
+{
+	bool		skip;			/* dropped or generated, never sent */
+	char		transfer;		/* 'i'nternal, 'b'inary or 't'ext */
+	FmgrInfo	func;			/* typsend or typoutput, unused for 'i' */
+} SpockAttrEncoding;
+
+extern SpockAttrEncoding *spock_output_rel_encoding(SpockOutputData *data,
+													Relation rel);
+
 /*
  * Shared memory information per slot-group
  */
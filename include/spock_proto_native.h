@@ -23,11 +23,18 @@
 /* Flag bit to indicate origin_name is present in ORIGIN message */
 #define ORIGIN_FLAG_HAS_NAME		0x01
 
+/*
+ * Remote tuple converted to the local relation format.  The arrays are sized
+ * to the local relation's natts and are carved out of a shared arena (see
+ * spock_tuple_data_init), so they stay valid only until the next change is
+ * read from the stream.
+ */
 typedef struct SpockTupleData
 {
-	Datum		values[MaxTupleAttributeNumber];
-	bool		nulls[MaxTupleAttributeNumber];
-	bool		changed[MaxTupleAttributeNumber];
+	int			natts;			/* length of the arrays below */
+	Datum	   *values;
+	bool	   *nulls;
+	bool	   *changed;
 } SpockTupleData;
 
 extern void spock_write_commit_order(StringInfo out,
@@ -67,10 +74,30 @@ extern SpockRelation *spock_read_update(StringInfo in, LOCKMODE lockmode, bool *
 extern SpockRelation *spock_read_delete(StringInfo in, LOCKMODE lockmode,
 										SpockTupleData *oldtup);
 extern List *spock_read_truncate(StringInfo in, bool *cascade, bool *restart_seqs);
+extern SpockAttrEncoding *spock_build_attr_encoding(SpockOutputData *data,
+													Relation rel);
+extern void spock_tuple_data_init(SpockTupleData *tuple, int natts);
+extern int	spock_read_change_keys(StringInfo in, char action, uint32 *relid,
+								   uint32 keys[2]);
 extern void spock_write_message(StringInfo out, TransactionId xid, XLogRecPtr lsn,
 								bool transactional, const char *prefix, Size sz,
 								const char *message);
 
+/* Streaming of in-progress transactions */
+extern void spock_write_stream_start(StringInfo out, TransactionId xid,
+									 bool first_segment);
+extern void spock_write_stream_stop(StringInfo out);
+extern void spock_write_stream_abort(StringInfo out, TransactionId xid,
+									 TransactionId subxid);
+extern void spock_write_stream_commit(StringInfo out, TransactionId xid);
+extern void spock_write_stream_change(StringInfo out, TransactionId xid);
+extern void spock_read_stream_start(StringInfo in, TransactionId *xid,
+									bool *first_segment);
+extern void spock_read_stream_abort(StringInfo in, TransactionId *xid,
+									TransactionId *subxid);
+extern TransactionId spock_read_stream_commit(StringInfo in);
+extern TransactionId spock_read_stream_change(StringInfo in);
+
 /* Protocol version management for publisher */
 extern void spock_set_proto_version(uint32 version);
 extern uint32 spock_get_proto_version(void);
@@ -12,6 +12,8 @@
 #ifndef SPOCK_RELCACHE_H
 #define SPOCK_RELCACHE_H
 
+#include "fmgr.h"
+#include "access/skey.h"
 #include "storage/lock.h"
 
 typedef struct SpockRemoteRel
@@ -28,6 +30,22 @@ typedef struct SpockRemoteRel
 	bool		ispartition;
 } SpockRemoteRel;
 
+/* Cached input function of a remote column, see spock_read_tuple(). */
+typedef struct SpockAttrInput
+{
+	char		kind;			/* 'b' or 't' once func is set up, else 0 */
+	FmgrInfo	func;			/* typreceive or typinput of the local type */
+	Oid			typioparam;
+} SpockAttrInput;
+
+/* Unique index checked for conflicts with spock.check_all_uc_indexes. */
+typedef struct SpockUCIndex
+{
+	Oid			indexoid;
+	int			nkeys;
+	ScanKey		skey;			/* without the values to search for */
+} SpockUCIndex;
+
 typedef struct SpockRelation
 {
 	/* Info coming from the remote side. */
@@ -38,10 +56,13 @@ typedef struct SpockRelation
 	char	  **attnames;
 	Oid		   *attrtypes;
 	Oid		   *attrtypmods;
+	bool	   *attidentity;	/* is column part of remote replica identity */
 
 	/* Mapping to local relation, filled as needed. */
 	Oid			reloid;
 	Oid			idxoid;
+	Oid			fullidxoid;		/* index to search REPLICA IDENTITY FULL
+								 * rows with when there is no idxoid */
 	Relation	rel;
 	int		   *attmap;
 
@@ -50,22 +71,37 @@ typedef struct SpockRelation
 
 	Oid		   *delta_apply_functions;
 	bool		has_delta_columns;
+
+	/* Per remote column input functions, rebuilt with the mapping. */
+	SpockAttrInput *attinput;
+	MemoryContext attinput_cxt;
+
+	/* Unique indexes, see spock_relation_get_uc_indexes(). */
+	bool		ucindexes_valid;
+	int			nucindexes;
+	SpockUCIndex *ucindexes;
+	MemoryContext ucindex_cxt;
 } SpockRelation;
 
 extern void spock_relation_cache_update(uint32 remoteid,
 										char *schemaname, char *relname,
 										int natts, char **attnames,
 										Oid *attrtypes,
-										Oid *attrtypmods);
+										Oid *attrtypmods,
+										bool *attidentity);
 extern void spock_relation_cache_updater(SpockRemoteRel *remoterel);
+extern SpockRelation *spock_relation_lookup(uint32 remoteid);
 
 extern SpockRelation *spock_relation_open(uint32 remoteid,
 										  LOCKMODE lockmode);
+extern SpockUCIndex *spock_relation_get_uc_indexes(SpockRelation *rel,
+												   int *nindexes);
 extern void spock_relation_close(SpockRelation *rel,
 								 LOCKMODE lockmode);
 extern void spock_relation_invalidate_cb(Datum arg, Oid reloid);
 
 extern void spock_relation_cache_reset(void);
+extern void spock_relation_cache_reset_open(void);
 
 extern Oid	spock_lookup_delta_function(char *fname, Oid typeoid);
 
@@ -12,6 +12,7 @@
 #ifndef SPOCK_REPSET_H
 #define SPOCK_REPSET_H
 
+#include "nodes/execnodes.h"
 #include "replication/reorderbuffer.h"
 
 typedef struct SpockRepSet
@@ -45,6 +46,11 @@ typedef struct SpockTableRepInfo
 								 * replicated otherwise each replicated column
 								 * is a member */
 	List	   *row_filter;		/* compiled row_filter nodes */
+
+	/* Executor state for evaluating row_filter, NULL if there is none. */
+	EState	   *row_filter_estate;
+	ExprContext *row_filter_econtext;	/* per-tuple context, scan slot set */
+	List	   *row_filter_exprs;	/* ExprState for each row_filter node */
 } SpockTableRepInfo;
 
 /* forward declaration */
@@ -46,6 +46,7 @@ extern void spock_rmgr_startup(void);
 extern void spock_rmgr_cleanup(void);
 
 /* WAL helpers */
-extern XLogRecPtr spock_apply_progress_add_to_wal(const SpockApplyProgress *sap);
+extern XLogRecPtr spock_apply_progress_add_to_wal(const SpockApplyProgress *sap,
+												  bool flush);
 
 #endif							/* SPOCK_RMGR_H */
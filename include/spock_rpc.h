@@ -19,6 +19,10 @@ extern List *spock_get_remote_repset_tables(PGconn *conn,
 											List *replication_sets);
 extern SpockRemoteRel *spock_get_remote_repset_table(PGconn *conn,
 													 RangeVar *rv, List *replication_sets);
+extern int64 *spock_get_remote_table_sizes(PGconn *conn, List *tables);
+extern Oid *spock_get_remote_column_types(PGconn *conn,
+											 SpockRemoteRel *remoterel,
+											 List *attnames);
 
 extern bool spock_remote_slot_active(PGconn *conn, const char *slot_name);
 extern void spock_drop_remote_slot(PGconn *conn, const char *slot_name);
@@ -63,6 +63,9 @@ typedef struct SpockSyncStatus
 #define SYNC_STATUS_READY		'r' /* Done. */
 #define SYNC_STATUS_FAILED		'f' /* Operation has failed. */
 
+extern int	spock_sync_connections;
+extern int	spock_sync_table_split_size;
+
 extern void spock_sync_worker_finish(void);
 
 extern void spock_sync_subscription(SpockSubscription *sub);
@@ -120,7 +120,12 @@ typedef enum spockStatsType
 	SPOCK_STATS_CONFLICT_COUNT,
 	SPOCK_STATS_DCA_COUNT,
 
-	SPOCK_STATS_NUM_COUNTERS = SPOCK_STATS_DCA_COUNT + 1
+	/* Stream compression, counted with relid InvalidOid */
+	SPOCK_STATS_STREAM_BYTES,	/* message bytes before compression */
+	SPOCK_STATS_STREAM_WIRE_BYTES,	/* message bytes sent or received */
+	SPOCK_STATS_COMPRESS_TIME,	/* microseconds (de)compressing */
+
+	SPOCK_STATS_NUM_COUNTERS = SPOCK_STATS_COMPRESS_TIME + 1
 } spockStatsType;
 
 typedef struct spockStatsKey
@@ -177,6 +182,11 @@ extern void spock_worker_kill(SpockWorker *worker);
 extern const char *spock_worker_type_name(SpockWorkerType type);
 extern void handle_stats_counter(Relation relation, Oid subid,
 								 spockStatsType typ, int ntup);
+extern void handle_stream_stats_counter(Oid subid, spockStatsType typ,
+										int64 value);
+extern void spock_stats_flush(bool force);
+extern void spock_stats_hold(void);
+extern void spock_stats_release(bool keep);
 extern void spock_worker_shmem_startup(bool found);
 extern void spock_worker_shmem_request(int nworkers);
 
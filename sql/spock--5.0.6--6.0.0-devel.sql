@@ -281,3 +281,71 @@ BEGIN
 	CALL spock.wait_for_sync_event(result, origin_id, lsn, timeout, wait_if_disabled);
 END;
 $$ LANGUAGE plpgsql;
+
+-- ----
+-- Join the replication origin session of another backend, used by the
+-- parallel initial data copy
+-- ----
+CREATE FUNCTION spock.sync_origin_session_share(origin_name name, leader_pid integer)
+RETURNS void STRICT VOLATILE LANGUAGE c
+AS 'MODULE_PATHNAME', 'spock_sync_origin_session_share';
+REVOKE ALL ON FUNCTION spock.sync_origin_session_share(name, integer) FROM PUBLIC;
+
+-- ----
+-- Stream compression counters in the channel stats
+-- ----
+DROP VIEW IF EXISTS spock.channel_summary_stats;
+DROP VIEW IF EXISTS spock.channel_table_stats;
+DROP FUNCTION IF EXISTS spock.get_channel_stats();
+
+CREATE FUNCTION spock.get_channel_stats(
+    OUT subid oid,
+	OUT relid oid,
+    OUT n_tup_ins bigint,
+    OUT n_tup_upd bigint,
+    OUT n_tup_del bigint,
+	OUT n_conflict bigint,
+	OUT n_dca bigint,
+	OUT stream_bytes bigint,
+	OUT stream_wire_bytes bigint,
+	OUT compress_time_us bigint)
+RETURNS SETOF record
+LANGUAGE c AS 'MODULE_PATHNAME', 'get_channel_stats';
+
+CREATE VIEW spock.channel_table_stats AS
+  SELECT H.subid, H.relid,
+	 CASE H.subid
+	 	WHEN 0 THEN '<output>'
+		ELSE S.sub_name
+	 END AS sub_name,
+	 pg_catalog.quote_ident(N.nspname) || '.' || pg_catalog.quote_ident(C.relname) AS table_name,
+	 H.n_tup_ins, H.n_tup_upd, H.n_tup_del,
+	 H.n_conflict, H.n_dca
+  FROM spock.get_channel_stats() AS H
+  LEFT JOIN spock.subscription AS S ON S.sub_id = H.subid
+  LEFT JOIN pg_catalog.pg_class AS C ON C.oid = H.relid
+  LEFT JOIN pg_catalog.pg_namespace AS N ON N.oid = C.relnamespace
+  WHERE H.relid <> 0;
+
+CREATE VIEW spock.channel_summary_stats AS
+  SELECT subid, sub_name,
+     sum(n_tup_ins) AS n_tup_ins,
+     sum(n_tup_upd) AS n_tup_upd,
+     sum(n_tup_del) AS n_tup_del,
+     sum(n_conflict) AS n_conflict,
+     sum(n_dca) AS n_dca
+  FROM spock.channel_table_stats
+  GROUP BY subid, sub_name;
+
+CREATE VIEW spock.channel_compression_stats AS
+  SELECT H.subid,
+	 CASE H.subid
+	 	WHEN 0 THEN '<output>'
+		ELSE S.sub_name
+	 END AS sub_name,
+	 H.stream_bytes, H.stream_wire_bytes,
+	 round(H.stream_bytes::numeric / nullif(H.stream_wire_bytes, 0), 2) AS compression_ratio,
+	 H.compress_time_us
+  FROM spock.get_channel_stats() AS H
+  LEFT JOIN spock.subscription AS S ON S.sub_id = H.subid
+  WHERE H.relid = 0;
@@ -549,7 +549,10 @@ CREATE FUNCTION spock.get_channel_stats(
     OUT n_tup_upd bigint,
     OUT n_tup_del bigint,
 	OUT n_conflict bigint,
-	OUT n_dca bigint)
+	OUT n_dca bigint,
+	OUT stream_bytes bigint,
+	OUT stream_wire_bytes bigint,
+	OUT compress_time_us bigint)
 RETURNS SETOF record
 LANGUAGE c AS 'MODULE_PATHNAME', 'get_channel_stats';
 
@@ -568,7 +571,8 @@ CREATE VIEW spock.channel_table_stats AS
   FROM spock.get_channel_stats() AS H
   LEFT JOIN spock.subscription AS S ON S.sub_id = H.subid
   LEFT JOIN pg_catalog.pg_class AS C ON C.oid = H.relid
-  LEFT JOIN pg_catalog.pg_namespace AS N ON N.oid = C.relnamespace;
+  LEFT JOIN pg_catalog.pg_namespace AS N ON N.oid = C.relnamespace
+  WHERE H.relid <> 0;
 
 CREATE VIEW spock.channel_summary_stats AS
   SELECT subid, sub_name,
@@ -580,6 +584,19 @@ CREATE VIEW spock.channel_summary_stats AS
   FROM spock.channel_table_stats
   GROUP BY subid, sub_name;
 
+CREATE VIEW spock.channel_compression_stats AS
+  SELECT H.subid,
+	 CASE H.subid
+	 	WHEN 0 THEN '<output>'
+		ELSE S.sub_name
+	 END AS sub_name,
+	 H.stream_bytes, H.stream_wire_bytes,
+	 round(H.stream_bytes::numeric / nullif(H.stream_wire_bytes, 0), 2) AS compression_ratio,
+	 H.compress_time_us
+  FROM spock.get_channel_stats() AS H
+  LEFT JOIN spock.subscription AS S ON S.sub_id = H.subid
+  WHERE H.relid = 0;
+
 CREATE VIEW spock.lag_tracker AS
 	SELECT
 		origin.node_name AS origin_name,
@@ -668,6 +685,15 @@ AS 'MODULE_PATHNAME', 'spock_repair_mode';
 CREATE FUNCTION spock.get_lsn_from_commit_ts(slot_name name, commit_ts timestamptz)
 RETURNS pg_lsn STRICT VOLATILE LANGUAGE c AS 'MODULE_PATHNAME', 'spock_get_lsn_from_commit_ts';
 
+-- ----
+-- Join the replication origin session of another backend, used by the
+-- parallel initial data copy
+-- ----
+CREATE FUNCTION spock.sync_origin_session_share(origin_name name, leader_pid integer)
+RETURNS void STRICT VOLATILE LANGUAGE c
+AS 'MODULE_PATHNAME', 'spock_sync_origin_session_share';
+REVOKE ALL ON FUNCTION spock.sync_origin_session_share(name, integer) FROM PUBLIC;
+
 CREATE OR REPLACE FUNCTION spock.get_apply_worker_status(
     OUT worker_pid bigint, -- Changed from int to bigint
     OUT worker_dboid int,
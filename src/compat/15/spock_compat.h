@@ -35,6 +35,9 @@
 #define WaitLatch(latch, wakeEvents, timeout) \
 	WaitLatch(latch, wakeEvents, timeout, PG_WAIT_EXTENSION)
 
+#define SPKCreateWaitEventSet(nevents) \
+	CreateWaitEventSet(CurrentMemoryContext, nevents)
+
 #define GetCurrentIntegerTimestamp() GetCurrentTimestamp()
 
 #define pg_analyze_and_rewrite(parsetree, query_string, paramTypes, numParams) \
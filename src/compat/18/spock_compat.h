@@ -47,6 +47,9 @@
 #define WaitLatch(latch, wakeEvents, timeout) \
 	WaitLatch(latch, wakeEvents, timeout, PG_WAIT_EXTENSION)
 
+#define SPKCreateWaitEventSet(nevents) \
+	CreateWaitEventSet(CurrentResourceOwner, nevents)
+
 #define GetCurrentIntegerTimestamp() GetCurrentTimestamp()
 
 #define pg_analyze_and_rewrite(parsetree, query_string, paramTypes, numParams) \
@@ -101,6 +104,10 @@
 #define replorigin_session_setup(node) \
 	replorigin_session_setup(node, 0)
 
+/* Join an origin session already acquired by another backend. */
+#define replorigin_session_setup_shared(node, acquired_by) \
+	(replorigin_session_setup)(node, acquired_by)
+
 #define simple_heap_update(relation, otid, tup) \
 	do \
 	{ \
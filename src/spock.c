@@ -53,6 +53,10 @@
 #include "pgstat.h"
 
 #include "spock_apply.h"
+#include "spock_apply_heap.h"
+#include "spock_apply_parallel.h"
+#include "spock_apply_stream.h"
+#include "spock_compress.h"
 #include "spock_executor.h"
 #include "spock_node.h"
 #include "spock_conflict.h"
@@ -63,6 +67,7 @@
 #include "spock_exception_handler.h"
 #include "spock_readonly.h"
 #include "spock_shmem.h"
+#include "spock_sync.h"
 #include "spock.h"
 
 PG_MODULE_MAGIC;
@@ -120,6 +125,17 @@ static const struct config_enum_entry exception_logging_options[] = {
 	{NULL, 0, false}
 };
 
+static const struct config_enum_entry stream_compression_options[] = {
+	{"none", SPOCK_COMPRESSION_NONE, false},
+#ifdef USE_LZ4
+	{"lz4", SPOCK_COMPRESSION_LZ4, false},
+#endif
+#ifdef USE_ZSTD
+	{"zstd", SPOCK_COMPRESSION_ZSTD, false},
+#endif
+	{NULL, 0, false}
+};
+
 static const struct config_enum_entry readonly_options[] = {
 	{"off", READONLY_OFF, false},
 	{"user", READONLY_USER, false},
@@ -130,6 +146,7 @@ static const struct config_enum_entry readonly_options[] = {
 bool		spock_synchronous_commit = false;
 char	   *spock_temp_directory = "";
 bool		spock_batch_inserts = true;
+bool		spock_batch_updates = true;
 static char *spock_temp_directory_config;
 bool		spock_ch_stats = true;
 static char *spock_country_code;
@@ -140,6 +157,7 @@ bool		allow_ddl_from_functions = false;
 int			restart_delay_default;
 int			restart_delay_on_exception;
 int			spock_replay_queue_size;	/* Deprecated - no longer used */
+int			spock_replay_queue_memory_limit;
 bool		check_all_uc_indexes = false;
 bool		spock_enable_quiet_mode = false;
 int			log_origin_change = SPOCK_ORIGIN_NONE;
@@ -610,6 +628,20 @@ spock_start_replication(PGconn *streamConn, const char *slot_name,
 		appendStringInfoString(&command, quote_literal_cstr(replication_sets));
 	}
 
+	/* Ask for large transactions to be sent before they commit */
+	if (spock_stream_in_progress)
+		appendStringInfoString(&command, ", \"spock.stream_in_progress\" '1'");
+
+	/* Only the changed columns of REPLICA IDENTITY FULL updates */
+	if (spock_update_changed_columns_only)
+		appendStringInfoString(&command,
+							   ", \"spock.update_changed_columns_only\" '1'");
+
+	/* Ask for the messages to be compressed */
+	if (spock_stream_compression != SPOCK_COMPRESSION_NONE)
+		appendStringInfo(&command, ", \"spock.compression\" '%s'",
+						 spock_compression_name(spock_stream_compression));
+
 	/* general info about the downstream */
 	appendStringInfo(&command, ", pg_version '%u'", PG_VERSION_NUM);
 	appendStringInfo(&command, ", spock_version '%s'", SPOCK_VERSION);
@@ -1034,6 +1066,15 @@ _PG_init(void)
 							 0,
 							 NULL, NULL, NULL);
 
+	DefineCustomBoolVariable("spock.batch_updates",
+							 "Look up the rows of runs of updates and deletes together",
+							 NULL,
+							 &spock_batch_updates,
+							 true,
+							 PGC_SIGHUP,
+							 0,
+							 NULL, NULL, NULL);
+
 	/* May be set only internally */
 	DefineCustomBoolVariable("spock.replication_repair_mode",
 							 "Switch to the repair mode",
@@ -1162,6 +1203,167 @@ _PG_init(void)
 							NULL,
 							NULL);
 
+	DefineCustomIntVariable("spock.replay_queue_memory_limit",
+							"Memory the apply worker may use to keep the current remote transaction for exception replay",
+							"Beyond this, the transaction is spilled to a file in spock.temp_directory. "
+							"-1 keeps the whole transaction in memory.",
+							&spock_replay_queue_memory_limit,
+							64 * 1024,
+							-1,
+							MAX_KILOBYTES,
+							PGC_SIGHUP,
+							GUC_UNIT_KB,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("spock.apply_parallel_workers",
+							"Number of parallel apply workers per subscription",
+							"Independent remote transactions are applied by up "
+							"to this many background workers, committing in "
+							"the original order. 0 disables parallel apply.",
+							&spock_apply_parallel_workers,
+							0,
+							0,
+							64,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("spock.apply_readahead_size",
+							"Amount of replication data the apply worker reads ahead",
+							"While applying, the apply worker keeps reading "
+							"the stream into memory up to this amount, so the "
+							"provider doesn't have to wait for it. 0 disables "
+							"reading ahead.",
+							&spock_apply_readahead_size,
+							16 * 1024,
+							0,
+							MAX_KILOBYTES,
+							PGC_SIGHUP,
+							GUC_UNIT_KB,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("spock.apply_coalesce_xacts",
+							"Number of remote transactions the apply worker may commit at once",
+							"While more data is waiting to be applied, up to "
+							"this many consecutive small remote transactions "
+							"are committed together in one local transaction. "
+							"1 commits every remote transaction on its own.",
+							&spock_apply_coalesce_xacts,
+							1,
+							1,
+							10000,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("spock.apply_coalesce_size",
+							"Amount of data of the remote transactions committed at once",
+							"Once the remote transactions left open reach this "
+							"size, they are committed.",
+							&spock_apply_coalesce_size,
+							256,
+							0,
+							MAX_KILOBYTES,
+							PGC_SIGHUP,
+							GUC_UNIT_KB,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("spock.apply_coalesce_timeout",
+							"Time the first of the remote transactions committed at once may be left open",
+							NULL,
+							&spock_apply_coalesce_timeout,
+							10,
+							0,
+							INT_MAX,
+							PGC_SIGHUP,
+							GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("spock.sync_connections",
+							"Number of connection pairs used to copy table data",
+							"The initial data synchronization copies up to this "
+							"many tables at once, largest first, each pair "
+							"using the same snapshot of the provider. Needs "
+							"PostgreSQL 16 or later on the subscriber.",
+							&spock_sync_connections,
+							1,
+							1,
+							64,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("spock.sync_table_split_size",
+							"Size above which a table is copied in block ranges",
+							"With spock.sync_connections above 1, tables larger "
+							"than this are split into block ranges of about "
+							"this size which are copied in parallel. 0 disables "
+							"splitting.",
+							&spock_sync_table_split_size,
+							1024,
+							0,
+							1024 * 1024,
+							PGC_SIGHUP,
+							GUC_UNIT_MB,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomBoolVariable("spock.stream_in_progress",
+							 "Receive large transactions while they are still in progress",
+							 "The provider streams transactions exceeding its "
+							 "logical_decoding_work_mem before they commit; they "
+							 "are spooled to spock.temp_directory and applied at "
+							 "commit. Takes effect on reconnect.",
+							 &spock_stream_in_progress,
+							 false,
+							 PGC_SIGHUP,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomEnumVariable("spock.stream_compression",
+							 "Compression of the messages received from the provider",
+							 "Asks the provider to compress larger messages with "
+							 "lz4 or zstd, if both sides are built with it. "
+							 "Takes effect on reconnect.",
+							 &spock_stream_compression,
+							 SPOCK_COMPRESSION_NONE,
+							 stream_compression_options,
+							 PGC_SIGHUP,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomBoolVariable("spock.update_changed_columns_only",
+							 "Receive only the changed columns of updates of REPLICA IDENTITY FULL tables",
+							 "The provider sends the columns an UPDATE didn't "
+							 "change as unchanged, the local row keeps its values "
+							 "for them. Takes effect on reconnect.",
+							 &spock_update_changed_columns_only,
+							 false,
+							 PGC_SIGHUP,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
 	DefineCustomEnumVariable("spock.readonly",
 							 gettext_noop("Controls cluster read-only mode."),
 							 NULL,
@@ -1180,6 +1382,22 @@ _PG_init(void)
 							 0,
 							 NULL, NULL, NULL);
 
+	DefineCustomIntVariable("spock.replica_identity_full_hash_mem",
+							"Memory for looking up rows of REPLICA IDENTITY FULL tables without an index",
+							"A transaction updating or deleting rows of such a "
+							"table more than once hashes all its rows in up to "
+							"this much memory instead of scanning it for every "
+							"row. 0 disables the hash.",
+							&spock_replica_identity_full_hash_mem,
+							0,
+							0,
+							MAX_KILOBYTES,
+							PGC_SIGHUP,
+							GUC_UNIT_KB,
+							NULL,
+							NULL,
+							NULL);
+
 	DefineCustomIntVariable("spock.output_delay",
 							"For testing conflicts, delay in output plugin in ms",
 							"For testing conflicts, delay in output plugin in milliseconds",
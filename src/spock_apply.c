@@ -11,11 +11,16 @@
  */
 #include "postgres.h"
 
+#include <unistd.h>
+
 #include "miscadmin.h"
 #include "libpq-fe.h"
 #include "pgstat.h"
 
+#include "access/commit_ts.h"
+#include "access/genam.h"
 #include "access/htup_details.h"
+#include "access/table.h"
 #include "access/xact.h"
 
 #include "catalog/namespace.h"
@@ -26,6 +31,7 @@
 #include "commands/dbcommands.h"
 #include "commands/sequence.h"
 #include "commands/tablecmds.h"
+#include "commands/trigger.h"
 
 #include "executor/executor.h"
 
@@ -37,6 +43,7 @@
 #include "nodes/parsenodes.h"
 
 #include "optimizer/planner.h"
+#include "portability/instr_time.h"
 #include "postmaster/interrupt.h"
 #include "replication/origin.h"
 #include "replication/reorderbuffer.h"
@@ -44,6 +51,7 @@
 
 #include "rewrite/rewriteHandler.h"
 
+#include "storage/fd.h"
 #include "storage/ipc.h"
 #include "storage/lmgr.h"
 #include "storage/proc.h"
@@ -57,6 +65,7 @@
 
 #include "utils/acl.h"
 #include "utils/fmgroids.h"
+#include "utils/inval.h"
 #include "utils/jsonb.h"
 #include "utils/lsyscache.h"
 #include "utils/memutils.h"
@@ -67,6 +76,7 @@
 
 #include "spock_autoddl.h"
 #include "spock_common.h"
+#include "spock_compress.h"
 #include "spock_conflict.h"
 #include "spock_executor.h"
 #include "spock_node.h"
@@ -79,6 +89,9 @@
 #include "spock_worker.h"
 #include "spock_apply.h"
 #include "spock_apply_heap.h"
+#include "spock_apply_parallel.h"
+#include "spock_apply_delay.h"
+#include "spock_apply_stream.h"
 #include "spock_exception_handler.h"
 #include "spock_common.h"
 #include "spock_readonly.h"
@@ -107,6 +120,19 @@ static Oid	QueueRelid = InvalidOid;
 
 static List *SyncingTables = NIL;
 
+/* Origin of the replication origin session of this apply worker */
+static RepOriginId apply_session_origin = InvalidRepOriginId;
+
+/* Can changes of a remote relation be tracked by rows? */
+typedef struct ParallelRelSafeEntry
+{
+	uint32		relid;
+	bool		safe;
+} ParallelRelSafeEntry;
+
+static HTAB *ParallelRelSafeHash = NULL;
+static bool ParallelRelSafeValid = false;
+
 SpockApplyWorker *MyApplyWorker = NULL;
 SpockSubscription *MySubscription = NULL;
 int			my_exception_log_index = -1;
@@ -123,7 +149,109 @@ static MemoryContext ApplyReplayContext = NULL;
 static ApplyReplayEntry * apply_replay_head = NULL;
 static ApplyReplayEntry * apply_replay_tail = NULL;
 static ApplyReplayEntry * apply_replay_next = NULL;
-static int	apply_replay_bytes = 0;
+static Size apply_replay_bytes = 0;
+
+/*
+ * Once the queued messages exceed spock.replay_queue_memory_limit, the rest
+ * of the transaction goes to a spill file instead, stored as length-prefixed
+ * messages. Replay continues from the file after the in-memory entries.
+ */
+static File apply_replay_file = -1;
+static char apply_replay_file_path[MAXPGPATH];
+static off_t apply_replay_file_size = 0;
+static off_t apply_replay_file_readpos = -1;
+static StringInfoData apply_replay_file_wbuf = {NULL, 0, 0, 0};
+static ApplyReplayEntry * apply_replay_file_entry = NULL;
+
+/* A position in the replay queue, see apply_replay_seek() */
+typedef struct ApplyReplayPos
+{
+	ApplyReplayEntry *entry;	/* in-memory entry, or NULL */
+	off_t		fileoff;		/* offset in the spill file otherwise */
+} ApplyReplayPos;
+
+/* Position of the message last fetched from or appended to the queue */
+static ApplyReplayPos apply_replay_pos = {NULL, -1};
+
+#define APPLY_REPLAY_FILE_WBUF_SIZE		(64 * 1024)
+
+/*
+ * State of the parallel apply of the transaction being received, see
+ * parallel_apply_route().
+ */
+static bool parallel_buffering = false;
+static bool parallel_serial = false;
+static ApplyReplayEntry * parallel_begin_entry = NULL;
+
+/* Set while spooling a message of a streamed transaction */
+static bool stream_spooling = false;
+
+/*
+ * Messages read from the stream ahead of applying them, see
+ * apply_readahead(). A circular array of PQgetCopyData() results.
+ */
+typedef struct ApplyRecvEntry
+{
+	int			r;
+	char	   *buf;
+	TimestampTz received;		/* when it was read off the socket */
+} ApplyRecvEntry;
+
+#define APPLY_READAHEAD_INTERVAL_MS		1
+
+int			spock_apply_readahead_size = 16 * 1024;
+
+static ApplyRecvEntry *apply_recv_queue = NULL;
+static int	apply_recv_size = 0;
+static int	apply_recv_head = 0;
+static int	apply_recv_count = 0;
+static Size apply_recv_bytes = 0;
+static TimestampTz apply_recv_last_read = 0;
+
+/* End of what was read ahead, and of what apply_work() handled so far */
+static XLogRecPtr apply_recv_lsn = InvalidXLogRecPtr;
+static XLogRecPtr apply_feedback_lsn = InvalidXLogRecPtr;
+static TimestampTz apply_last_feedback = 0;
+
+/* Ask for UPDATEs of REPLICA IDENTITY FULL tables to leave out unchanged columns */
+bool		spock_update_changed_columns_only = false;
+
+/* Compression of the received messages, agreed on in the startup message */
+static SpockCompression apply_compression = SPOCK_COMPRESSION_NONE;
+
+/* Where the body of a 'w' message starts: header and remote insert LSN */
+#define APPLY_MSG_BODY_OFFSET	((int) (1 + 4 * sizeof(int64)))
+
+/*
+ * Small remote transactions may be committed together in one local
+ * transaction, see apply_coalesce_hold(). The first one of such a group is
+ * applied in the local transaction itself and each of the following ones in
+ * a subtransaction, so that the rows of every remote transaction keep an xid
+ * of their own to carry its commit timestamp.
+ */
+int			spock_apply_coalesce_xacts = 1;
+int			spock_apply_coalesce_size = 256;
+int			spock_apply_coalesce_timeout = 10;
+
+static int	coalesce_nxacts = 0;	/* remote transactions left open */
+static bool coalesce_subxact = false;	/* current one is in a subxact */
+static bool coalesce_xact_ok = true;	/* current one may be left open */
+static Size coalesce_bytes = 0;	/* received since the last local commit */
+static TimestampTz coalesce_start = 0;
+static XLogRecPtr coalesce_commit_lsn = InvalidXLogRecPtr;
+static XLogRecPtr coalesce_end_lsn = InvalidXLogRecPtr;
+static TimestampTz coalesce_commit_time = 0;
+
+/* Commit timestamps of the open ones, in xid order, for conflict resolution */
+typedef struct CoalescedXact
+{
+	TransactionId xid;
+	TimestampTz commit_time;
+} CoalescedXact;
+
+static CoalescedXact *coalesce_xacts = NULL;
+static int	coalesce_xacts_len = 0;
+static int	coalesce_xacts_size = 0;
 
 /* Number of tuples inserted after which we switch to multi-insert. */
 #define MIN_MULTI_INSERT_TUPLES 5
@@ -131,6 +259,35 @@ static SpockRelation *last_insert_rel = NULL;
 static int	last_insert_rel_cnt = 0;
 static bool use_multi_insert = false;
 
+/* Number of same-relation UPDATE/DELETE changes after which we batch them. */
+#define MIN_CHANGE_BATCH 5
+static SpockRelation *last_change_rel = NULL;
+static int	last_change_rel_cnt = 0;
+static bool last_change_rel_batch = false;
+static bool use_change_batch = false;
+
+/*
+ * Exception handling replay in DISCARD mode applies consecutive row changes
+ * in chunks sharing one subtransaction instead of one subtransaction per
+ * change. When a change of a chunk fails, the chunk is rolled back and
+ * replayed from the queue split at the failing change: the changes before
+ * it go in a chunk of their own (which is split again if it fails) and the
+ * failing change is applied alone through the regular per-change path, so
+ * it is logged exactly as before.
+ */
+#define EXCEPTION_CHUNK_INITIAL_SIZE 16
+#define EXCEPTION_CHUNK_MAX_SIZE 1024
+static bool exception_chunk_open = false;
+static int	exception_chunk_size = EXCEPTION_CHUNK_INITIAL_SIZE;
+static int	exception_chunk_nchanges = 0;
+/* Number of changes up to and including the one that last failed */
+static int	exception_chunk_suspect = 0;
+/* Where the open chunk starts and the state to restore on its rollback */
+static ApplyReplayPos exception_chunk_start;
+static uint32 exception_chunk_action_counter;
+static int	exception_chunk_command_counter;
+static bool exception_chunk_had_exception;
+
 /*
  * A message counter for the xact, for debugging. We don't send
  * the remote change LSN with messages, so this aids identification
@@ -213,6 +370,14 @@ static void stop_skipping_changes(void);
 static void clear_subscription_skip_lsn(XLogRecPtr finish_lsn);
 
 static void multi_insert_finish(void);
+static bool change_batch_add(SpockRelation *rel, SpockTupleData *oldtup,
+							 SpockTupleData *newtup);
+static void change_batch_finish(void);
+static void change_batch_discard(void);
+static bool exception_chunk_eligible(StringInfo s);
+static void exception_chunk_apply(StringInfo s);
+static void exception_chunk_close(void);
+static void exception_chunk_reset(void);
 
 static void handle_queued_message(HeapTuple msgtup, bool tx_just_started);
 static void handle_startup_param(const char *key, const char *value);
@@ -228,6 +393,10 @@ static bool should_log_exception(bool failed);
 
 static ApplyReplayEntry * apply_replay_entry_create(int r, char *buf);
 static void apply_replay_entry_free(ApplyReplayEntry * entry);
+static ApplyReplayEntry * apply_replay_append(ApplyReplayEntry * entry);
+static ApplyReplayEntry * apply_replay_fetch(void);
+static void apply_replay_rewind(ApplyReplayEntry * from);
+static void apply_replay_seek(ApplyReplayPos * pos);
 static void apply_replay_queue_reset(void);
 static void maybe_send_feedback(PGconn *applyconn, XLogRecPtr lsn_to_send,
 								TimestampTz *last_receive_timestamp);
@@ -236,6 +405,19 @@ static void get_feedback_position(XLogRecPtr *recvpos, XLogRecPtr *writepos,
 								  XLogRecPtr *flushpos, XLogRecPtr *max_recvpos);
 static void UpdateWorkerStats(XLogRecPtr last_received, XLogRecPtr last_inserted);
 static void maybe_advance_forwarded_origin(XLogRecPtr end_lsn, bool xact_had_exception);
+static void apply_progress_update(XLogRecPtr commit_lsn, XLogRecPtr end_lsn,
+								  TimestampTz commit_time);
+static void apply_coalesce_finish(void);
+static bool parallel_apply_route(StringInfo s, bool from_stream);
+static void parallel_apply_collect(void);
+static void replication_handler(StringInfo s);
+static bool apply_stream_message(StringInfo s);
+static bool apply_delay_hold(StringInfo s, XLogRecPtr feedback_lsn);
+static ApplyReplayEntry * apply_delay_fetch(void);
+static XLogRecPtr apply_delay_feedback_pos(XLogRecPtr recvpos);
+static void apply_readahead(void);
+static int	apply_recv(char **buf, TimestampTz *received);
+static char *apply_decompress(char *buf, int *len);
 
 /* Wrapper for latch for waiting for previous transaction to commit */
 void
@@ -437,6 +619,15 @@ begin_replication_step(void)
 		spock_apply_heap_begin();
 		result = true;
 	}
+	else if (coalesce_nxacts > 0 && !coalesce_subxact && in_remote_transaction)
+	{
+		MemoryContext oldctx = CurrentMemoryContext;
+
+		/* Joining the open local transaction of the previous ones */
+		BeginInternalSubTransaction(NULL);
+		MemoryContextSwitchTo(oldctx);
+		coalesce_subxact = true;
+	}
 
 	PushActiveSnapshot(GetTransactionSnapshot());
 
@@ -460,6 +651,222 @@ end_replication_step(void)
 	MemoryContextSwitchTo(MessageContext);
 }
 
+/*
+ * Should the remote transaction being committed be left open, to be
+ * committed together with the ones following it?
+ *
+ * This is only done while the stream keeps delivering transactions, for
+ * plain transactions of our provider applied by the apply worker itself,
+ * up to spock.apply_coalesce_xacts transactions, spock.apply_coalesce_size
+ * of data and spock.apply_coalesce_timeout since the first one. Whatever is
+ * left open is committed as soon as nothing more has been received, see
+ * apply_work().
+ */
+static bool
+apply_coalesce_hold(XLogRecPtr commit_lsn)
+{
+	if (spock_apply_coalesce_xacts <= 1 ||
+		!coalesce_xact_ok ||
+		is_parallel_apply_worker ||
+		xact_had_exception ||
+		MyApplyWorker->use_try_block ||
+		MySpockWorker->worker_type != SPOCK_WORKER_APPLY ||
+		MyApplyWorker->replay_stop_lsn != InvalidXLogRecPtr ||
+		MyApplyWorker->sync_pending ||
+		SyncingTables != NIL ||
+		!XLogRecPtrIsInvalid(MySubscription->skiplsn))
+		return false;
+
+	/*
+	 * Forwarded transactions advance an origin of their own, and slot-group
+	 * members wait for the commit of the transaction preceding theirs.
+	 */
+	if ((remote_origin_id != InvalidRepOriginId &&
+		 remote_origin_id != MySubscription->origin->id) ||
+		required_commit_ts != 0)
+		return false;
+
+	/* Restarted after a failure in a group, apply one by one up to it */
+	if (commit_lsn < exception_log_ptr[my_exception_log_index].serial_apply_lsn)
+		return false;
+
+	if (coalesce_nxacts + 1 >= spock_apply_coalesce_xacts ||
+		coalesce_bytes >= (Size) spock_apply_coalesce_size * 1024)
+		return false;
+
+	if (coalesce_nxacts > 0 &&
+		TimestampDifferenceExceeds(coalesce_start, GetCurrentTimestamp(),
+								   spock_apply_coalesce_timeout))
+		return false;
+
+	return true;
+}
+
+/*
+ * Leave the remote transaction being committed open, see
+ * apply_coalesce_hold().
+ */
+static void
+apply_coalesce_add(XLogRecPtr commit_lsn, XLogRecPtr end_lsn,
+				   TimestampTz commit_time)
+{
+	TransactionId xid = InvalidTransactionId;
+
+	/*
+	 * The local commit records the timestamp of the last transaction of the
+	 * group. Make the rows of this one keep its own timestamp and origin for
+	 * conflict resolution.
+	 */
+	if (coalesce_subxact)
+		xid = GetCurrentTransactionIdIfAny();
+	else if (coalesce_nxacts == 0)
+		xid = GetTopTransactionIdIfAny();
+
+	if (track_commit_timestamp && TransactionIdIsValid(xid))
+	{
+		SubTransactionIdSetCommitTsData(xid, commit_time,
+										replorigin_session_origin);
+
+		/*
+		 * The commit timestamp isn't visible before the local commit, so
+		 * remember it for rows the following ones of the group run into.
+		 */
+		if (coalesce_xacts_len >= coalesce_xacts_size)
+		{
+			coalesce_xacts_size = Max(64, coalesce_xacts_size * 2);
+			if (coalesce_xacts == NULL)
+				coalesce_xacts = MemoryContextAlloc(TopMemoryContext,
+													coalesce_xacts_size *
+													sizeof(CoalescedXact));
+			else
+				coalesce_xacts = repalloc(coalesce_xacts,
+										  coalesce_xacts_size *
+										  sizeof(CoalescedXact));
+		}
+		coalesce_xacts[coalesce_xacts_len].xid = xid;
+		coalesce_xacts[coalesce_xacts_len].commit_time = commit_time;
+		coalesce_xacts_len++;
+	}
+
+	if (coalesce_subxact)
+	{
+		MemoryContext oldctx = CurrentMemoryContext;
+
+		ReleaseCurrentSubTransaction();
+		MemoryContextSwitchTo(oldctx);
+		coalesce_subxact = false;
+	}
+
+	if (coalesce_nxacts == 0)
+		coalesce_start = GetCurrentTimestamp();
+	coalesce_nxacts++;
+	coalesce_commit_lsn = commit_lsn;
+	coalesce_end_lsn = end_lsn;
+	coalesce_commit_time = commit_time;
+}
+
+/*
+ * Forget the group of remote transactions, committed or not.
+ */
+static void
+apply_coalesce_reset(void)
+{
+	coalesce_nxacts = 0;
+	coalesce_subxact = false;
+	coalesce_bytes = 0;
+	coalesce_xacts_len = 0;
+}
+
+/*
+ * Is the remote transaction being applied in a subtransaction of its own,
+ * joining the local transaction of the ones left open before it?
+ */
+bool
+spock_apply_in_coalesced_subxact(void)
+{
+	return coalesce_subxact;
+}
+
+/*
+ * Commit timestamp of a remote transaction left open by apply_coalesce_add(),
+ * given the local xid its rows carry. Returns false if xid isn't one of them.
+ */
+bool
+spock_apply_coalesced_commit_ts(TransactionId xid, TimestampTz *commit_time)
+{
+	int			low = 0;
+	int			high = coalesce_xacts_len - 1;
+
+	/* Xids of the group are assigned, and recorded, in ascending order */
+	while (low <= high)
+	{
+		int			mid = (low + high) / 2;
+
+		if (coalesce_xacts[mid].xid == xid)
+		{
+			*commit_time = coalesce_xacts[mid].commit_time;
+			return true;
+		}
+		if (TransactionIdPrecedes(coalesce_xacts[mid].xid, xid))
+			low = mid + 1;
+		else
+			high = mid - 1;
+	}
+
+	return false;
+}
+
+/*
+ * Commit the remote transactions left open by apply_coalesce_add(), the same
+ * way handle_commit() commits the last of them.
+ */
+static void
+apply_coalesce_finish(void)
+{
+	XLogRecPtr	origin_lsn = replorigin_session_origin_lsn;
+	TimestampTz origin_timestamp = replorigin_session_origin_timestamp;
+	SPKFlushPosition *flushpos;
+
+	if (coalesce_nxacts == 0)
+		return;
+
+	Assert(!coalesce_subxact);
+
+	elog(DEBUG1, "SPOCK %s: committing %d coalesced transactions up to %X/%X",
+		 MySubscription->name, coalesce_nxacts,
+		 LSN_FORMAT_ARGS(coalesce_end_lsn));
+
+	/* The BEGIN of the next transaction may have set these already */
+	replorigin_session_origin_lsn = coalesce_end_lsn;
+	replorigin_session_origin_timestamp = coalesce_commit_time;
+
+	remoteTransactionStopTimestamp = coalesce_commit_time;
+
+	CommitTransactionCommand();
+
+	if (WalSndCtl->sync_standbys_status & SYNC_STANDBY_DEFINED)
+		append_feedback_position(XactLastCommitEnd);
+
+	remoteTransactionStopTimestamp = 0;
+
+	MemoryContextSwitchTo(TopMemoryContext);
+	flushpos = (SPKFlushPosition *) palloc(sizeof(SPKFlushPosition));
+	flushpos->local_end = XactLastCommitEnd;
+	flushpos->remote_end = coalesce_end_lsn;
+	dlist_push_tail(&lsn_mapping, &flushpos->node);
+	MemoryContextSwitchTo(MessageContext);
+
+	apply_progress_update(coalesce_commit_lsn, coalesce_end_lsn,
+						  coalesce_commit_time);
+	awake_transaction_waiters();
+	spock_stats_flush(false);
+
+	replorigin_session_origin_lsn = origin_lsn;
+	replorigin_session_origin_timestamp = origin_timestamp;
+
+	apply_coalesce_reset();
+}
+
 static void
 handle_begin(StringInfo s)
 {
@@ -481,6 +888,8 @@ handle_begin(StringInfo s)
 
 	xact_action_counter = 1;
 	xact_had_exception = false;
+	coalesce_xact_ok = true;
+	exception_chunk_reset();
 	errcallback_arg.action_name = "BEGIN";
 
 	spock_read_begin(s, &commit_lsn, &commit_time, &remote_xid);
@@ -651,29 +1060,10 @@ handle_begin(StringInfo s)
 	exception_log = &exception_log_ptr[my_exception_log_index];
 	exception_log->commit_lsn = commit_lsn;
 
-	/* don't want the overhead otherwise */
-	if (apply_delay > 0)
-	{
-		TimestampTz current;
-
-		current = GetCurrentIntegerTimestamp();
-
-		/* ensure no weirdness due to clock drift */
-		if (current > replorigin_session_origin_timestamp)
-		{
-			long		sec;
-			int			usec;
-
-			current = TimestampTzPlusMilliseconds(current,
-												  -apply_delay);
-
-			TimestampDifference(current, replorigin_session_origin_timestamp,
-								&sec, &usec);
-			/* FIXME: deal with overflow? */
-			pg_usleep(usec + (sec * USECS_PER_SEC));
-		}
-	}
-
+	/*
+	 * With apply_delay, apply_work() only hands us the transaction once its
+	 * time has come, see apply_delay_hold().
+	 */
 	in_remote_transaction = true;
 
 	pgstat_report_activity(STATE_RUNNING, NULL);
@@ -705,6 +1095,9 @@ handle_commit(StringInfo s)
 
 	Assert(commit_time == replorigin_session_origin_timestamp);
 
+	/* Parallel apply workers commit in the order transactions were received */
+	spock_apply_parallel_wait_for_turn();
+
 	/* Wait for the previous transaction to commit */
 	wait_for_previous_transaction();
 
@@ -869,12 +1262,31 @@ handle_commit(StringInfo s)
 			goto transdiscard_skip_commit;
 		}
 
+		if (apply_coalesce_hold(commit_lsn))
+		{
+			apply_coalesce_add(commit_lsn, end_lsn, commit_time);
+			MemoryContextSwitchTo(MessageContext);
+			goto coalesce_held;
+		}
+
+		/* Committed along with the ones left open before it */
+		if (coalesce_subxact)
+		{
+			ReleaseCurrentSubTransaction();
+			coalesce_subxact = false;
+		}
+
 		/* Have the commit code adjust our logical clock if needed */
 		remoteTransactionStopTimestamp = commit_time;
 
 		CommitTransactionCommand();
 
-		if (WalSndCtl->sync_standbys_status & SYNC_STANDBY_DEFINED)
+		/*
+		 * The apply worker tracks the flush position of transactions applied
+		 * by parallel apply workers itself.
+		 */
+		if (!is_parallel_apply_worker &&
+			(WalSndCtl->sync_standbys_status & SYNC_STANDBY_DEFINED))
 			append_feedback_position(XactLastCommitEnd);
 
 		remoteTransactionStopTimestamp = 0;
@@ -913,11 +1325,14 @@ handle_commit(StringInfo s)
 		}
 
 		/* Track commit lsn  */
-		flushpos = (SPKFlushPosition *) palloc(sizeof(SPKFlushPosition));
-		flushpos->local_end = XactLastCommitEnd;
-		flushpos->remote_end = end_lsn;
+		if (!is_parallel_apply_worker)
+		{
+			flushpos = (SPKFlushPosition *) palloc(sizeof(SPKFlushPosition));
+			flushpos->local_end = XactLastCommitEnd;
+			flushpos->remote_end = end_lsn;
 
-		dlist_push_tail(&lsn_mapping, &flushpos->node);
+			dlist_push_tail(&lsn_mapping, &flushpos->node);
+		}
 		MemoryContextSwitchTo(MessageContext);
 	}
 	else
@@ -946,52 +1361,17 @@ handle_commit(StringInfo s)
 	maybe_advance_forwarded_origin(end_lsn, xact_had_exception);
 
 transdiscard_skip_commit:
-	/* Update the entry in the progress table. */
-	elog(DEBUG1, "SPOCK %s: updating progress table for node_id %d" \
-		 " and remote node id %d with remote commit ts" \
-		 " to " INT64_FORMAT,
-		 MySubscription->name,
-		 MySubscription->target->id,
-		 MySubscription->origin->id,
-		 replorigin_session_origin_timestamp);
-
-	{
-		/* build new/update entry */
-		SpockApplyProgress sap = {
-			.key.dbid = MyDatabaseId,
-			.key.node_id = MySubscription->target->id,
-			.key.remote_node_id = MySubscription->origin->id,
-			.remote_commit_ts = commit_time,
-			.prev_remote_ts = replorigin_session_origin_timestamp,
-			.remote_commit_lsn = commit_lsn,
-			/* Ensure invariant: received_lsn >= remote_commit_lsn */
-			.received_lsn = end_lsn,
-			/*
-			 * Include remote_insert_lsn for WAL persistence. This was already
-			 * updated in shmem by UpdateWorkerStats() earlier (either from
-			 * apply_work for protocol 5+, or from handle_commit for protocol 4).
-			 * Without this, crash recovery would lose remote_insert_lsn.
-			 */
-			.remote_insert_lsn = MyApplyWorker->apply_group->progress.remote_insert_lsn,
-			/* XXX: Could we use commit_ts value instead? */
-			.last_updated_ts = GetCurrentTimestamp(),
-			.updated_by_decode = true,
-		};
-
-		/* XXX: Don't care in production yet */
-		Assert(sap.last_updated_ts >= sap.remote_commit_ts);
-
-		/* WAL after commit, then to shmem */
-		spock_apply_progress_add_to_wal(&sap);
+	apply_coalesce_reset();
 
-		Assert(MyApplyWorker && MyApplyWorker->apply_group);
-
-		spock_group_progress_update_ptr(MyApplyWorker->apply_group, &sap);
-	}
+	apply_progress_update(commit_lsn, end_lsn, commit_time);
 
 	/* Wakeup all waiters for waiting for the previous transaction to commit */
 	awake_transaction_waiters();
 
+	/* Publish the channel counters of applied rows now and then */
+	spock_stats_flush(false);
+
+coalesce_held:
 	in_remote_transaction = false;
 
 	/*
@@ -1061,11 +1441,65 @@ transdiscard_skip_commit:
 	/* Reset the ApplyReplayContext and poiners */
 	apply_replay_queue_reset();
 
-	process_syncing_tables(end_lsn);
+	if (!is_parallel_apply_worker && coalesce_nxacts == 0)
+		process_syncing_tables(end_lsn);
 
 	pgstat_report_activity(STATE_IDLE, NULL);
 }
 
+/*
+ * Record that the remote transaction committed at commit_lsn has been
+ * applied, in the progress table.
+ */
+static void
+apply_progress_update(XLogRecPtr commit_lsn, XLogRecPtr end_lsn,
+					  TimestampTz commit_time)
+{
+	/* build new/update entry */
+	SpockApplyProgress sap = {
+		.key.dbid = MyDatabaseId,
+		.key.node_id = MySubscription->target->id,
+		.key.remote_node_id = MySubscription->origin->id,
+		.remote_commit_ts = commit_time,
+		.prev_remote_ts = replorigin_session_origin_timestamp,
+		.remote_commit_lsn = commit_lsn,
+		/* Ensure invariant: received_lsn >= remote_commit_lsn */
+		.received_lsn = end_lsn,
+		/*
+		 * Include remote_insert_lsn for WAL persistence. This was already
+		 * updated in shmem by UpdateWorkerStats() earlier (either from
+		 * apply_work for protocol 5+, or from handle_commit for protocol 4).
+		 * Without this, crash recovery would lose remote_insert_lsn.
+		 */
+		.remote_insert_lsn = MyApplyWorker->apply_group->progress.remote_insert_lsn,
+		/* XXX: Could we use commit_ts value instead? */
+		.last_updated_ts = GetCurrentTimestamp(),
+		.updated_by_decode = true,
+	};
+
+	/* Update the entry in the progress table. */
+	elog(DEBUG1, "SPOCK %s: updating progress table for node_id %d" \
+		 " and remote node id %d with remote commit ts" \
+		 " to " INT64_FORMAT,
+		 MySubscription->name,
+		 MySubscription->target->id,
+		 MySubscription->origin->id,
+		 replorigin_session_origin_timestamp);
+
+	/* XXX: Don't care in production yet */
+	Assert(sap.last_updated_ts >= sap.remote_commit_ts);
+
+	/*
+	 * WAL after commit, then to shmem.  The record is flushed lazily, see
+	 * spock_apply_progress_add_to_wal().
+	 */
+	spock_apply_progress_add_to_wal(&sap, false);
+
+	Assert(MyApplyWorker && MyApplyWorker->apply_group);
+
+	spock_group_progress_update_ptr(MyApplyWorker->apply_group, &sap);
+}
+
 /*
  * Handle ORIGIN message.
  */
@@ -1076,9 +1510,11 @@ handle_origin(StringInfo s)
 
 	/*
 	 * ORIGIN message can only come inside remote transaction and before any
-	 * actual writes.
+	 * actual writes. The local transaction may be open for the previous
+	 * remote transactions, see apply_coalesce_add().
 	 */
-	if (!in_remote_transaction || IsTransactionState())
+	if (!in_remote_transaction ||
+		(IsTransactionState() && (coalesce_nxacts == 0 || coalesce_subxact)))
 		elog(ERROR, "SPOCK %s: ORIGIN message sent out of order",
 			 MySubscription->name);
 
@@ -1101,6 +1537,11 @@ handle_origin(StringInfo s)
 	 * advance the forwarded origin's LSN tracking.
 	 */
 	remote_origin_id = spock_read_origin(s, &remote_origin_lsn, &remote_origin_name);
+
+	/* A local commit carries one origin, for all of the group */
+	if (remote_origin_id != replorigin_session_origin)
+		apply_coalesce_finish();
+
 	replorigin_session_origin = remote_origin_id;
 }
 
@@ -1116,7 +1557,8 @@ handle_commit_order(StringInfo s)
 	 * LAST commit ts message can only come inside remote transaction,
 	 * immediately after origin information, and before any actual writes.
 	 */
-	if (!in_remote_transaction || IsTransactionState()
+	if (!in_remote_transaction ||
+		(IsTransactionState() && (coalesce_nxacts == 0 || coalesce_subxact))
 		|| replorigin_session_origin == InvalidRepOriginId)
 		elog(ERROR, "SPOCK %s: LATEST commit order message sent out of order",
 			 MySubscription->name);
@@ -1128,6 +1570,10 @@ handle_commit_order(StringInfo s)
 	 */
 	required_commit_ts = spock_read_commit_order(s);
 
+	/* The predecessor may be one of the transactions we left open */
+	if (required_commit_ts != 0)
+		apply_coalesce_finish();
+
 	elog(DEBUG1, "SPOCK: slot-group '%s' previous commit ts received: "
 		 INT64_FORMAT " - commit ts " INT64_FORMAT,
 		 MySubscription->slot_name,
@@ -1195,6 +1641,23 @@ log_insert_exception(bool failed, char *errmsg, SpockRelation *rel,
 							   errmsg);
 }
 
+/*
+ * Log a change applied in a chunk of the exception handling replay like the
+ * per-change path logs a successful one.
+ */
+static void
+log_chunk_change(SpockRelation *rel, SpockTupleData *oldtup,
+				 SpockTupleData *newtup, const char *action_name)
+{
+	SpockExceptionLog *exception_log;
+
+	exception_log = &exception_log_ptr[my_exception_log_index];
+	log_insert_exception(false,
+						 exception_log->initial_error_message[0] ?
+						 exception_log->initial_error_message : NULL,
+						 rel, oldtup, newtup, action_name);
+}
+
 static void
 handle_insert(StringInfo s)
 {
@@ -1299,7 +1762,14 @@ handle_insert(StringInfo s)
 	/* Normal insert. */
 
 	/* TODO: Handle multiple inserts */
-	if (MyApplyWorker->use_try_block)
+	if (exception_chunk_open)
+	{
+		/* Covered by the chunk subtransaction, see exception_chunk_apply() */
+		exception_command_counter++;
+		spock_apply_heap_insert(rel, &newtup);
+		log_chunk_change(rel, NULL, &newtup, "INSERT");
+	}
+	else if (MyApplyWorker->use_try_block)
 	{
 		PG_TRY();
 		{
@@ -1410,35 +1880,127 @@ multi_insert_finish(void)
 	}
 }
 
-static void
-handle_update(StringInfo s)
+/*
+ * Queue an UPDATE or DELETE if it continues a run of changes to the same
+ * relation, so that the local tuples of the run are looked up together, see
+ * spock_apply_heap_batch_finish().
+ *
+ * Returns false if the change has to be applied right away.
+ */
+static bool
+change_batch_add(SpockRelation *rel, SpockTupleData *oldtup,
+				 SpockTupleData *newtup)
 {
-	SpockTupleData oldtup;
-	SpockTupleData newtup;
-	SpockRelation *rel;
-	ErrorData  *edata = NULL;
-	bool		hasoldtup;
-	bool		failed = false;
-
-	/*
-	 * Quick return if we are skipping data modification changes.
-	 */
-	if (is_skipping_changes())
-		return;
+	if (!spock_batch_updates || MyApplyWorker->use_try_block)
+		return false;
 
-	begin_replication_step();
+	if (rel != last_change_rel)
+	{
+		change_batch_finish();
+		last_change_rel = rel;
+		last_change_rel_cnt = 0;
+		last_change_rel_batch = spock_apply_heap_can_batch(rel);
+		return false;
+	}
 
-	errcallback_arg.action_name = "UPDATE";
-	xact_action_counter++;
+	if (!use_change_batch)
+	{
+		if (!last_change_rel_batch ||
+			++last_change_rel_cnt < MIN_CHANGE_BATCH)
+			return false;
+		use_change_batch = true;
+	}
 
-	multi_insert_finish();
+	spock_apply_heap_batch_add(rel, oldtup, newtup);
+	return true;
+}
 
-	rel = spock_read_update(s, RowExclusiveLock, &hasoldtup, &oldtup, &newtup);
-	if (unlikely(rel == NULL))
+/*
+ * Apply the queued UPDATE/DELETE changes, before anything else is applied.
+ */
+static void
+change_batch_finish(void)
+{
+	if (use_change_batch)
 	{
-		Assert(MyApplyWorker->use_try_block);
+		const char *old_action = errcallback_arg.action_name;
+		SpockRelation *old_rel = errcallback_arg.rel;
+		SpockRelation *rel = last_change_rel;
+		bool		close_rel = false;
 
-		/*
+		errcallback_arg.action_name = "batched UPDATE/DELETE";
+		errcallback_arg.rel = rel;
+
+		begin_replication_step();
+
+		/* The relation was closed after queueing the last change. */
+		if (rel->rel == NULL)
+		{
+			rel = spock_relation_open(rel->remoteid, RowExclusiveLock);
+			if (rel == NULL)
+				elog(ERROR, "SPOCK %s: can't open relation %s.%s to apply batched changes",
+					 MySubscription->name, last_change_rel->nspname,
+					 last_change_rel->relname);
+			close_rel = true;
+		}
+
+		spock_apply_heap_batch_finish(rel);
+
+		if (close_rel)
+			spock_relation_close(rel, NoLock);
+
+		end_replication_step();
+
+		errcallback_arg.rel = old_rel;
+		errcallback_arg.action_name = old_action;
+	}
+
+	use_change_batch = false;
+	last_change_rel = NULL;
+	last_change_rel_cnt = 0;
+}
+
+/*
+ * Forget the queued changes, they went away with the failed transaction.
+ */
+static void
+change_batch_discard(void)
+{
+	spock_apply_heap_batch_discard();
+	use_change_batch = false;
+	last_change_rel = NULL;
+	last_change_rel_cnt = 0;
+}
+
+static void
+handle_update(StringInfo s)
+{
+	SpockTupleData oldtup;
+	SpockTupleData newtup;
+	SpockRelation *rel;
+	ErrorData  *edata = NULL;
+	bool		hasoldtup;
+	bool		failed = false;
+
+	/*
+	 * Quick return if we are skipping data modification changes.
+	 */
+	if (is_skipping_changes())
+		return;
+
+	begin_replication_step();
+
+	errcallback_arg.action_name = "UPDATE";
+	xact_action_counter++;
+
+	multi_insert_finish();
+
+	rel = spock_read_update(s, RowExclusiveLock, &hasoldtup, &oldtup, &newtup);
+	if (unlikely(rel == NULL))
+	{
+		Assert(MyApplyWorker->use_try_block);
+
+		/*
 		 * Correctly interrupt the process: set exception flag and log the
 		 * exception itself.
 		 */
@@ -1468,7 +2030,14 @@ handle_update(StringInfo s)
 		return;
 	}
 
-	if (MyApplyWorker->use_try_block == true)
+	if (exception_chunk_open)
+	{
+		/* Covered by the chunk subtransaction, see exception_chunk_apply() */
+		exception_command_counter++;
+		spock_apply_heap_update(rel, hasoldtup ? &oldtup : &newtup, &newtup);
+		log_chunk_change(rel, hasoldtup ? &oldtup : NULL, &newtup, "UPDATE");
+	}
+	else if (MyApplyWorker->use_try_block == true)
 	{
 		PG_TRY();
 		{
@@ -1508,7 +2077,7 @@ handle_update(StringInfo s)
 								 hasoldtup ? &oldtup : NULL, &newtup, "UPDATE");
 		}
 	}
-	else
+	else if (!change_batch_add(rel, hasoldtup ? &oldtup : &newtup, &newtup))
 	{
 		spock_apply_heap_update(rel, hasoldtup ? &oldtup : &newtup, &newtup);
 	}
@@ -1575,7 +2144,14 @@ handle_delete(StringInfo s)
 		return;
 	}
 
-	if (MyApplyWorker->use_try_block)
+	if (exception_chunk_open)
+	{
+		/* Covered by the chunk subtransaction, see exception_chunk_apply() */
+		exception_command_counter++;
+		spock_apply_heap_delete(rel, &oldtup);
+		log_chunk_change(rel, &oldtup, NULL, "DELETE");
+	}
+	else if (MyApplyWorker->use_try_block)
 	{
 		PG_TRY();
 		{
@@ -1615,7 +2191,7 @@ handle_delete(StringInfo s)
 								 &oldtup, NULL, "DELETE");
 		}
 	}
-	else
+	else if (!change_batch_add(rel, &oldtup, NULL))
 	{
 		spock_apply_heap_delete(rel, &oldtup);
 	}
@@ -1650,6 +2226,9 @@ handle_truncate(StringInfo s)
 
 	begin_replication_step();
 
+	/* TRUNCATE refuses to touch relations still in use. */
+	spock_apply_heap_release_cache();
+
 	errcallback_arg.action_name = "TRUNCATE";
 	remote_relids = spock_read_truncate(s, &cascade, &restart_seqs);
 
@@ -1928,6 +2507,19 @@ handle_startup_param(const char *key, const char *value)
 			 MySubscription->name, proto_version);
 	}
 
+	/* The publisher compresses the messages it sends, see spock_compress.c */
+	if (strcmp(key, "compression") == 0)
+	{
+		apply_compression = spock_compression_from_name(value);
+
+		if (apply_compression == SPOCK_COMPRESSION_NONE &&
+			strcmp(value, "none") != 0)
+			ereport(ERROR,
+					(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+					 errmsg("SPOCK %s: publisher uses unsupported stream compression %s",
+							MySubscription->name, value)));
+	}
+
 	/*
 	 * We just ignore a bunch of parameters here because we specify what we
 	 * require when we send our params to the upstream. It's required to ERROR
@@ -2315,6 +2907,12 @@ handle_queued_message(HeapTuple msgtup, bool tx_just_started)
 	old_action_name = errcallback_arg.action_name;
 	errcallback_arg.is_ddl_or_drop = true;
 
+	/* Don't keep more transactions waiting on DDL or a table sync */
+	coalesce_xact_ok = false;
+
+	/* Queued commands may alter or drop relations we keep open. */
+	spock_apply_heap_release_cache();
+
 	queued_message = queued_message_from_tuple(msgtup);
 
 	switch (queued_message->message_type)
@@ -2405,6 +3003,36 @@ handle_message(StringInfo s)
 	}
 }
 
+/*
+ * Handle STREAM COMMIT, sent between BEGIN and COMMIT of a transaction whose
+ * changes were streamed before, by applying the spooled changes.
+ */
+static void
+handle_stream_commit(StringInfo s)
+{
+	TransactionId xid = spock_read_stream_commit(s);
+	StringInfo	msg;
+
+	if (!in_remote_transaction)
+		elog(ERROR, "SPOCK %s: STREAM COMMIT for transaction %u outside of a remote transaction",
+			 MySubscription->name, xid);
+
+	spock_apply_stream_replay_begin(xid);
+
+	while ((msg = spock_apply_stream_replay_next()) != NULL)
+	{
+		char		action = msg->data[0];
+
+		if (action == 'B' || action == 'C' || action == 'c')
+			elog(ERROR, "SPOCK %s: unexpected message type %c in streamed transaction %u",
+				 MySubscription->name, action, xid);
+
+		replication_handler(msg);
+
+		spock_apply_poll_stream();
+	}
+}
+
 static void
 replication_handler(StringInfo s)
 {
@@ -2423,6 +3051,12 @@ replication_handler(StringInfo s)
 
 	Assert(CurrentMemoryContext == MessageContext);
 
+	coalesce_bytes += s->len;
+
+	/* Runs of UPDATE/DELETE changes end at any other message. */
+	if (action != 'U' && action != 'D')
+		change_batch_finish();
+
 	switch (action)
 	{
 			/* BEGIN */
@@ -2469,6 +3103,10 @@ replication_handler(StringInfo s)
 		case 'M':
 			handle_message(s);
 			break;
+			/* STREAM COMMIT */
+		case 'c':
+			handle_stream_commit(s);
+			break;
 		default:
 			elog(ERROR, "SPOCK %s: unknown action of type %c",
 				 MySubscription->name, action);
@@ -2491,6 +3129,166 @@ replication_handler(StringInfo s)
 	}
 }
 
+/*
+ * Can the change be applied as part of a chunk of the exception handling
+ * replay?
+ *
+ * Only DISCARD mode qualifies, TRANSDISCARD and SUB_DISABLE roll back each
+ * change right after applying it. Changes of our own tables, like the queued
+ * DDL, are always applied on their own.
+ */
+static bool
+exception_chunk_eligible(StringInfo s)
+{
+	StringInfoData copy;
+	SpockRelation *rel;
+	uint32		relid;
+	char		action;
+
+	if (!MyApplyWorker->use_try_block || exception_behaviour != DISCARD)
+		return false;
+
+	action = s->data[s->cursor];
+	if (action != 'I' && action != 'U' && action != 'D')
+		return false;
+
+	copy = *s;
+	copy.cursor++;				/* action */
+	(void) pq_getmsgbyte(&copy);	/* flags */
+	relid = pq_getmsgint(&copy, 4);
+
+	rel = spock_relation_lookup(relid);
+	return rel != NULL && strcmp(rel->nspname, EXTENSION_NAME) != 0;
+}
+
+/*
+ * Apply a message read from the replay queue or the stream, adding row
+ * changes of the exception handling replay to the open chunk.
+ *
+ * If a change of the chunk fails, the chunk is rolled back and the replay
+ * continues at its start. The number of changes up to and including the
+ * failing one is remembered so that the next chunk stops right before it;
+ * the failing change is then applied by itself through the per-change path.
+ */
+static void
+exception_chunk_apply(StringInfo s)
+{
+	bool		failed = false;
+
+	if (!exception_chunk_eligible(s))
+	{
+		exception_chunk_close();
+		exception_chunk_suspect = 0;
+		replication_handler(s);
+		return;
+	}
+
+	if (exception_chunk_suspect == 1)
+	{
+		/* This is the change which failed, give it a subtransaction alone */
+		exception_chunk_close();
+		exception_chunk_suspect = 0;
+		replication_handler(s);
+		return;
+	}
+
+	if (!exception_chunk_open)
+	{
+		if (!IsTransactionState())
+		{
+			StartTransactionCommand();
+			spock_apply_heap_begin();
+		}
+
+		exception_chunk_start = apply_replay_pos;
+		exception_chunk_action_counter = xact_action_counter;
+		exception_chunk_command_counter = exception_command_counter;
+		exception_chunk_had_exception = xact_had_exception;
+		exception_chunk_nchanges = 0;
+
+		BeginInternalSubTransaction(NULL);
+		exception_chunk_open = true;
+
+		/* The chunk may be rolled back and replayed, count it once */
+		spock_stats_hold();
+	}
+
+	exception_chunk_nchanges++;
+
+	PG_TRY();
+	{
+		replication_handler(s);
+	}
+	PG_CATCH();
+	{
+		MemoryContextSwitchTo(MessageContext);
+		FlushErrorState();
+		failed = true;
+	}
+	PG_END_TRY();
+
+	if (failed)
+	{
+		RollbackAndReleaseCurrentSubTransaction();
+		MemoryContextSwitchTo(MessageContext);
+		MemoryContextReset(ApplyOperationContext);
+		exception_chunk_open = false;
+		spock_stats_release(false);
+
+		/* Relations the failed change had open are closed by now */
+		spock_relation_cache_reset_open();
+
+		xact_action_counter = exception_chunk_action_counter;
+		exception_command_counter = exception_chunk_command_counter;
+		xact_had_exception = exception_chunk_had_exception;
+
+		elog(DEBUG1, "SPOCK %s: change %d of exception handling chunk failed, replaying the chunk",
+			 MySubscription->name, exception_chunk_nchanges);
+
+		exception_chunk_suspect = exception_chunk_nchanges;
+		exception_chunk_size = Max(exception_chunk_nchanges / 2, 2);
+
+		apply_replay_seek(&exception_chunk_start);
+	}
+	else if (exception_chunk_suspect > 0)
+	{
+		/* Stop right before the change that failed */
+		if (--exception_chunk_suspect == 1)
+			exception_chunk_close();
+	}
+	else if (exception_chunk_nchanges >= exception_chunk_size)
+	{
+		exception_chunk_close();
+		exception_chunk_size = Min(exception_chunk_size * 2,
+								   EXCEPTION_CHUNK_MAX_SIZE);
+	}
+}
+
+/* Commit the open chunk of the exception handling replay, if any */
+static void
+exception_chunk_close(void)
+{
+	if (!exception_chunk_open)
+		return;
+
+	ReleaseCurrentSubTransaction();
+	exception_chunk_open = false;
+	spock_stats_release(true);
+}
+
+/*
+ * Forget about the chunk state, the subtransaction of an open chunk has been
+ * aborted with the transaction.
+ */
+static void
+exception_chunk_reset(void)
+{
+	exception_chunk_open = false;
+	exception_chunk_suspect = 0;
+	exception_chunk_size = EXCEPTION_CHUNK_INITIAL_SIZE;
+	spock_stats_release(false);
+}
+
 /*
  * Figure out which write/flush positions to report to the walsender process.
  *
@@ -2513,6 +3311,8 @@ get_flush_position(XLogRecPtr *write, XLogRecPtr *flush)
 	*write = InvalidXLogRecPtr;
 	*flush = InvalidXLogRecPtr;
 
+	parallel_apply_collect();
+
 	dlist_foreach_modify(iter, &lsn_mapping)
 	{
 		SPKFlushPosition *pos =
@@ -2540,7 +3340,8 @@ get_flush_position(XLogRecPtr *write, XLogRecPtr *flush)
 		}
 	}
 
-	return dlist_is_empty(&lsn_mapping);
+	return dlist_is_empty(&lsn_mapping) && !spock_apply_parallel_busy() &&
+		coalesce_nxacts == 0;
 }
 
 /*
@@ -2649,6 +3450,7 @@ send_feedback(PGconn *conn, XLogRecPtr recvpos, int64 now, bool force)
 
 	XLogRecPtr	writepos;
 	XLogRecPtr	flushpos;
+	XLogRecPtr	readpos;
 
 	/*
 	 * In case of any syncrounoun replica is attached get the  LSN from the
@@ -2676,6 +3478,12 @@ send_feedback(PGconn *conn, XLogRecPtr recvpos, int64 now, bool force)
 	if (flushpos < last_flushpos)
 		flushpos = last_flushpos;
 
+	/*
+	 * Messages read ahead, see apply_readahead(), are received but not
+	 * handled yet. They only count as written, never as flushed.
+	 */
+	readpos = Max(recvpos, apply_recv_lsn);
+
 	/* if we've already reported everything we're good */
 	if (!force &&
 		writepos == last_writepos &&
@@ -2693,7 +3501,7 @@ send_feedback(PGconn *conn, XLogRecPtr recvpos, int64 now, bool force)
 		resetStringInfo(reply_message);
 
 	pq_sendbyte(reply_message, 'r');
-	pq_sendint64(reply_message, recvpos);	/* write */
+	pq_sendint64(reply_message, readpos);	/* write */
 	pq_sendint64(reply_message, flushpos);	/* flush */
 	pq_sendint64(reply_message, writepos);	/* apply */
 	pq_sendint64(reply_message, now);	/* sendTime */
@@ -2702,7 +3510,7 @@ send_feedback(PGconn *conn, XLogRecPtr recvpos, int64 now, bool force)
 	elog(DEBUG2, "SPOCK %s: sending feedback (force %d) to recv %X/%X, "
 		 "write %X/%X, flush %X/%X, max_waiting_lsn %X/%X",
 		 MySubscription->name, force,
-		 (uint32) (recvpos >> 32), (uint32) recvpos,
+		 (uint32) (readpos >> 32), (uint32) readpos,
 		 (uint32) (writepos >> 32), (uint32) writepos,
 		 (uint32) (flushpos >> 32), (uint32) flushpos,
 		 (uint32) (max_recvpos >> 32), (uint32) max_recvpos
@@ -2724,6 +3532,7 @@ send_feedback(PGconn *conn, XLogRecPtr recvpos, int64 now, bool force)
 		last_writepos = writepos;
 	if (flushpos > last_flushpos)
 		last_flushpos = flushpos;
+	apply_last_feedback = now;
 
 	return true;
 }
@@ -2746,74 +3555,894 @@ UpdateWorkerStats(XLogRecPtr last_received, XLogRecPtr last_inserted)
 }
 
 /*
- * Apply main loop.
+ * Relcache invalidation callback for ParallelRelSafeHash.
  */
-void
-apply_work(PGconn *streamConn)
+static void
+parallel_rel_safe_invalidate_cb(Datum arg, Oid reloid)
 {
-	int			fd;
-	XLogRecPtr	last_received = InvalidXLogRecPtr;
-	XLogRecPtr	last_inserted = InvalidXLogRecPtr;
-	TimestampTz last_receive_timestamp = GetCurrentTimestamp();
-	bool		need_replay;
-	ErrorData  *edata = NULL;
+	ParallelRelSafeValid = false;
+}
 
-	applyconn = streamConn;
-	fd = PQsocket(applyconn);
+/*
+ * Are the remote replica identity columns, which the row keys of parallel
+ * apply are computed from, the columns of the local replica identity index
+ * the rows are looked up with? Otherwise changes with different keys could
+ * still touch the same local row.
+ */
+static bool
+parallel_apply_identity_match(SpockRelation *rel, Relation localrel,
+							  Oid replidx)
+{
+	Relation	idxrel;
+	int			nremote = 0;
+	bool		match = true;
+	int			i;
 
-	/* Init the ApplyReplayContext used to replay after an exception */
-	ApplyReplayContext = AllocSetContextCreate(TopMemoryContext,
-											   "ApplyReplayContext",
-											   ALLOCSET_DEFAULT_SIZES);
+	/* Without remote identity changes are tracked per relation anyway. */
+	if (rel->attidentity == NULL)
+		return true;
 
-	/* Init the MessageContext which we use for easier cleanup. */
-	MessageContext = AllocSetContextCreate(TopMemoryContext,
-										   "MessageContext",
-										   ALLOCSET_DEFAULT_SIZES);
+	if (!OidIsValid(replidx))
+	{
+		for (i = 0; i < rel->natts; i++)
+		{
+			if (rel->attidentity[i])
+				return false;
+		}
+		return true;
+	}
 
-	/* Init the ApplyOperationContext for individual operations like DML */
-	ApplyOperationContext = AllocSetContextCreate(TopMemoryContext,
-												  "ApplyOperationContext",
-												  ALLOCSET_DEFAULT_SIZES);
+	idxrel = index_open(replidx, AccessShareLock);
+	for (i = 0; i < rel->natts && match; i++)
+	{
+		AttrNumber	attnum;
+		int			j;
 
-	MemoryContextSwitchTo(MessageContext);
+		if (!rel->attidentity[i])
+			continue;
+		nremote++;
 
-	/* mark as idle, before starting to loop */
-	pgstat_report_activity(STATE_IDLE, NULL);
+		attnum = get_attnum(RelationGetRelid(localrel), rel->attnames[i]);
+		match = false;
+		for (j = 0; j < idxrel->rd_index->indnkeyatts; j++)
+		{
+			if (attnum != InvalidAttrNumber &&
+				idxrel->rd_index->indkey.values[j] == attnum)
+				match = true;
+		}
+	}
+	if (nremote != idxrel->rd_index->indnkeyatts)
+		match = false;
+	index_close(idxrel, AccessShareLock);
 
-	if (MyApplyWorker->apply_group == NULL)
-		spock_apply_worker_attach();	/* Attach this worker. */
+	return match;
+}
 
-stream_replay:
+/*
+ * Can the changes of the remote relation be applied in parallel with other
+ * transactions writing different rows of it?
+ *
+ * This is the case when the local table is a plain table whose only unique
+ * index is the replica identity one, made of the remote replica identity
+ * columns, and which has no triggers firing on replica. Otherwise two
+ * transactions writing different rows could still conflict or see each
+ * other's changes.
+ */
+static bool
+parallel_apply_relation_safe(uint32 relid)
+{
+	SpockRelation *rel;
+	ParallelRelSafeEntry *entry;
+	bool		found;
 
-	need_replay = false;
+	rel = spock_relation_lookup(relid);
+	if (rel == NULL || strcmp(rel->nspname, EXTENSION_NAME) == 0)
+		return false;
 
-	PG_TRY();
+	if (ParallelRelSafeHash == NULL)
 	{
-		while (!got_SIGTERM)
-		{
-			int			rc;
-			int			r;
+		HASHCTL		ctl;
+
+		MemSet(&ctl, 0, sizeof(ctl));
+		ctl.keysize = sizeof(uint32);
+		ctl.entrysize = sizeof(ParallelRelSafeEntry);
+		ctl.hcxt = TopMemoryContext;
+		ParallelRelSafeHash = hash_create("spock parallel apply relations",
+										  128, &ctl,
+										  HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+		CacheRegisterRelcacheCallback(parallel_rel_safe_invalidate_cb,
+									  (Datum) 0);
+		ParallelRelSafeValid = true;
+	}
+	else if (!ParallelRelSafeValid)
+	{
+		HASH_SEQ_STATUS status;
+		ParallelRelSafeEntry *e;
 
-			MySpockWorker->worker_status = SPOCK_WORKER_STATUS_RUNNING;
+		hash_seq_init(&status, ParallelRelSafeHash);
+		while ((e = (ParallelRelSafeEntry *) hash_seq_search(&status)) != NULL)
+			hash_search(ParallelRelSafeHash, &e->relid, HASH_REMOVE, NULL);
+		ParallelRelSafeValid = true;
+	}
+
+	entry = hash_search(ParallelRelSafeHash, &relid, HASH_ENTER, &found);
+	if (!found)
+	{
+		RangeVar   *rv;
+		Relation	localrel;
+
+		entry->safe = false;
+
+		StartTransactionCommand();
+		rv = makeRangeVar(rel->nspname, rel->relname, -1);
+		localrel = table_openrv_extended(rv, AccessShareLock, true);
+		if (localrel != NULL)
+		{
+			List	   *indexes = RelationGetIndexList(localrel);
+			Oid			replidx = RelationGetReplicaIndex(localrel);
+			ListCell   *lc;
+			int			nunique = 0;
+			bool		has_triggers = false;
 
 			/*
-			 * Background workers mustn't call usleep() or any direct
-			 * equivalent instead, they may wait on their process latch, which
-			 * sleeps as necessary, but is awakened if postmaster dies.  That
-			 * way the background process goes away immediately in an
-			 * emergency.
+			 * Changes are tracked by replica identity only, so any other
+			 * unique index could make two transactions collide.
 			 */
-			rc = WaitLatchOrSocket(&MyProc->procLatch,
-								   WL_SOCKET_READABLE | WL_LATCH_SET |
-								   WL_TIMEOUT | WL_POSTMASTER_DEATH,
-								   fd, 1000L);
+			foreach(lc, indexes)
+			{
+				Relation	idxrel;
 
-			ResetLatch(&MyProc->procLatch);
+				if (lfirst_oid(lc) == replidx)
+					continue;
 
-			CHECK_FOR_INTERRUPTS();
+				idxrel = index_open(lfirst_oid(lc), AccessShareLock);
+				if (idxrel->rd_index->indisunique)
+					nunique++;
+				index_close(idxrel, AccessShareLock);
+			}
 
-			Assert(CurrentMemoryContext == MessageContext);
+			if (localrel->trigdesc != NULL)
+			{
+				TriggerDesc *trigdesc = localrel->trigdesc;
+				int			i;
+
+				for (i = 0; i < trigdesc->numtriggers; i++)
+				{
+					Trigger    *trigger = &trigdesc->triggers[i];
+
+					if (trigger->tgenabled != TRIGGER_FIRES_ON_ORIGIN &&
+						trigger->tgenabled != TRIGGER_DISABLED)
+					{
+						has_triggers = true;
+						break;
+					}
+				}
+			}
+
+			entry->safe = localrel->rd_rel->relkind == RELKIND_RELATION &&
+				nunique == 0 && !has_triggers &&
+				parallel_apply_identity_match(rel, localrel, replidx);
+
+			table_close(localrel, AccessShareLock);
+		}
+		CommitTransactionCommand();
+		MemoryContextSwitchTo(MessageContext);
+	}
+
+	return entry->safe;
+}
+
+/*
+ * Should the transaction starting with the given BEGIN message be handed to
+ * a parallel apply worker?
+ */
+static bool
+parallel_apply_candidate(StringInfo s)
+{
+	StringInfoData copy = *s;
+	XLogRecPtr	commit_lsn;
+	TimestampTz commit_time;
+	TransactionId xid;
+
+	if (spock_apply_parallel_workers <= 0)
+		return false;
+
+	/*
+	 * The first transaction after startup and transactions in exception
+	 * handling mode are always applied by the apply worker itself. So are
+	 * transactions needing anything else than plain apply.
+	 */
+	if (first_begin_at_startup ||
+		MyApplyWorker->use_try_block ||
+		coalesce_nxacts > 0 ||
+		MySpockWorker->worker_type != SPOCK_WORKER_APPLY ||
+		MyApplyWorker->replay_stop_lsn != InvalidXLogRecPtr ||
+		MyApplyWorker->sync_pending ||
+		SyncingTables != NIL ||
+		apply_delay > 0)
+		return false;
+
+	(void) pq_getmsgbyte(&copy);	/* action */
+	spock_read_begin(&copy, &commit_lsn, &commit_time, &xid);
+
+	if (MySubscription->skiplsn == commit_lsn)
+		return false;
+
+	/* Applying serially after a parallel apply failure? */
+	if (commit_lsn < exception_log_ptr[my_exception_log_index].serial_apply_lsn)
+		return false;
+
+	/* Notice local DDL affecting ParallelRelSafeHash. */
+	AcceptInvalidationMessages();
+
+	return spock_apply_parallel_start(apply_session_origin);
+}
+
+/*
+ * Push the flush positions of transactions committed by parallel apply
+ * workers to lsn_mapping, in the order they were received.
+ */
+static void
+parallel_apply_collect(void)
+{
+	XLogRecPtr	remote_end;
+	XLogRecPtr	local_end;
+
+	while (spock_apply_parallel_next_finished(&remote_end, &local_end))
+	{
+		SPKFlushPosition *flushpos;
+
+		flushpos = (SPKFlushPosition *)
+			MemoryContextAlloc(TopMemoryContext, sizeof(SPKFlushPosition));
+		flushpos->local_end = local_end;
+		flushpos->remote_end = remote_end;
+		dlist_push_tail(&lsn_mapping, &flushpos->node);
+
+		if (WalSndCtl->sync_standbys_status & SYNC_STANDBY_DEFINED)
+			append_feedback_position(local_end);
+	}
+}
+
+/*
+ * Hand the buffered transaction ending with the given COMMIT message to a
+ * parallel apply worker, or replay it from the queue if it has to be
+ * applied serially.
+ */
+static void
+parallel_apply_dispatch(StringInfo s)
+{
+	StringInfoData copy = *s;
+	XLogRecPtr	commit_lsn;
+	XLogRecPtr	end_lsn;
+	TimestampTz commit_time;
+	XLogRecPtr	remote_insert_lsn;
+	ApplyReplayEntry *entry;
+	int			hdrlen;
+	int			worker;
+
+	if (parallel_serial)
+	{
+		/* Apply it ourselves once everything before it is committed. */
+		spock_apply_parallel_wait_all();
+		parallel_apply_collect();
+
+		apply_replay_rewind(parallel_begin_entry);
+		parallel_begin_entry = NULL;
+		return;
+	}
+
+	/* Spilling the transaction makes it serial, see apply_replay_append() */
+	Assert(apply_replay_file < 0);
+
+	(void) pq_getmsgbyte(&copy);	/* action */
+	spock_read_commit(&copy, &commit_lsn, &end_lsn, &commit_time,
+					  &remote_insert_lsn);
+
+	worker = spock_apply_parallel_dispatch_begin(end_lsn);
+
+	/* Skip the 'w' header, see apply_work(). */
+	hdrlen = 1 + 3 * sizeof(int64);
+	if (spock_apply_get_proto_version() >= 5)
+		hdrlen += sizeof(int64);
+
+	for (entry = parallel_begin_entry; entry != NULL; entry = entry->next)
+	{
+		StringInfo	msg = &entry->copydata;
+
+		/* Workers got RELATION messages already. */
+		if (msg->data[hdrlen] == 'R')
+			continue;
+
+		spock_apply_parallel_send(worker, msg->data + hdrlen,
+								  msg->len - hdrlen, entry->next == NULL);
+	}
+
+	parallel_begin_entry = NULL;
+	apply_replay_queue_reset();
+}
+
+/*
+ * Decide what to do with a message received from the stream when parallel
+ * apply is enabled.
+ *
+ * Transactions are buffered in the replay queue, while collecting the rows
+ * they write, until COMMIT arrives. Then they are either handed to a
+ * parallel apply worker or, if they contain anything else than row changes
+ * of tables we can track, replayed from the queue and applied by us as
+ * usual.
+ *
+ * Returns true if the message was consumed, false if it should be applied
+ * right away.
+ */
+static bool
+parallel_apply_route(StringInfo s, bool from_stream)
+{
+	StringInfoData copy;
+	char		action;
+
+	if (!from_stream)
+		return false;
+
+	action = s->data[s->cursor];
+
+	if (action == 'R')
+	{
+		uint32		relid;
+
+		/* The remote replica identity may have changed. */
+		copy = *s;
+		(void) pq_getmsgbyte(&copy);	/* action */
+		(void) pq_getmsgbyte(&copy);	/* flags */
+		relid = pq_getmsgint(&copy, 4);
+		if (ParallelRelSafeHash != NULL)
+			hash_search(ParallelRelSafeHash, &relid, HASH_REMOVE, NULL);
+
+		spock_apply_parallel_relation(s);
+
+		if (!parallel_buffering)
+			return false;
+
+		/* We need the relation for key extraction. */
+		copy = *s;
+		(void) pq_getmsgbyte(&copy);
+		(void) spock_read_rel(&copy);
+		return true;
+	}
+
+	if (!parallel_buffering)
+	{
+		/* The dispatch needs the whole transaction in memory. */
+		if (action != 'B' || apply_replay_file >= 0 ||
+			!parallel_apply_candidate(s))
+			return false;
+
+		parallel_buffering = true;
+		parallel_serial = false;
+		parallel_begin_entry = apply_replay_tail;
+		spock_apply_parallel_txn_reset();
+		return true;
+	}
+
+	switch (action)
+	{
+		case 'I':
+		case 'U':
+		case 'D':
+			if (!parallel_serial)
+			{
+				uint32		relid;
+				uint32		keys[2];
+				int			nkeys;
+
+				copy = *s;
+				(void) pq_getmsgbyte(&copy);
+				nkeys = spock_read_change_keys(&copy, action, &relid, keys);
+
+				if (parallel_apply_relation_safe(relid))
+					spock_apply_parallel_txn_add(relid, nkeys, keys);
+				else
+					parallel_serial = true;
+			}
+			break;
+		case 'O':
+		case 'L':
+			break;
+		case 'C':
+			parallel_buffering = false;
+			parallel_apply_dispatch(s);
+			break;
+		default:
+			/* TRUNCATE, generic messages, ... */
+			parallel_serial = true;
+			break;
+	}
+
+	return true;
+}
+
+/*
+ * Spool the message if it belongs to a block of a streamed in-progress
+ * transaction, see spock_apply_stream.c.
+ *
+ * Returns true if the message was consumed.
+ */
+static bool
+apply_stream_message(StringInfo s)
+{
+	char		action = s->data[s->cursor];
+	TransactionId xid;
+	TransactionId subxid;
+	bool		first_segment;
+
+	if (action != 's' && action != 'x' && action != 'e' && action != 'a')
+		return false;
+
+	stream_spooling = true;
+
+	(void) pq_getmsgbyte(s);
+
+	switch (action)
+	{
+		case 's':
+			spock_read_stream_start(s, &xid, &first_segment);
+			spock_apply_stream_start(xid, first_segment);
+			break;
+		case 'x':
+			xid = spock_read_stream_change(s);
+			spock_apply_stream_write(xid, s);
+			break;
+		case 'e':
+			spock_apply_stream_stop();
+			break;
+		case 'a':
+			spock_read_stream_abort(s, &xid, &subxid);
+			spock_apply_stream_abort(xid, subxid);
+			break;
+	}
+
+	stream_spooling = false;
+
+	return true;
+}
+
+/*
+ * Hold the message back if it starts a transaction whose commit timestamp
+ * plus apply_delay has not passed yet, or if messages are held back already,
+ * see spock_apply_delay.c. feedback_lsn is the position received before it.
+ *
+ * Returns true if the message was consumed.
+ */
+static bool
+apply_delay_hold(StringInfo s, XLogRecPtr feedback_lsn)
+{
+	TimestampTz apply_at = 0;
+
+	if (apply_delay <= 0)
+		return false;
+
+	if (s->data[s->cursor] == 'B')
+	{
+		StringInfoData copy = *s;
+		XLogRecPtr	commit_lsn;
+		TimestampTz commit_time;
+		TransactionId xid;
+
+		(void) pq_getmsgbyte(&copy);	/* action */
+		spock_read_begin(&copy, &commit_lsn, &commit_time, &xid);
+		apply_at = TimestampTzPlusMilliseconds(commit_time, apply_delay);
+	}
+
+	if (!spock_apply_delay_pending() && apply_at <= GetCurrentTimestamp())
+		return false;
+
+	spock_apply_delay_push(s, apply_at, feedback_lsn);
+
+	return true;
+}
+
+/*
+ * Return the next held back message if its time has come, else NULL.
+ */
+static ApplyReplayEntry *
+apply_delay_fetch(void)
+{
+	char	   *buf;
+	int			len;
+
+	if (!spock_apply_delay_pending())
+		return NULL;
+
+	buf = spock_apply_delay_pop(GetCurrentTimestamp(), &len);
+	if (buf == NULL)
+		return NULL;
+
+	return apply_replay_entry_create(len, buf);
+}
+
+/*
+ * The position to report to the provider: what was received, but not past
+ * the first message held back by apply_delay, which is not applied yet.
+ */
+static XLogRecPtr
+apply_delay_feedback_pos(XLogRecPtr recvpos)
+{
+	if (spock_apply_delay_pending())
+		return Min(recvpos, spock_apply_delay_feedback_lsn());
+
+	return recvpos;
+}
+
+/*
+ * Queue a PQgetCopyData() result read ahead.
+ */
+static void
+apply_recv_push(int r, char *buf, TimestampTz received)
+{
+	ApplyRecvEntry *entry;
+
+	if (apply_recv_count == apply_recv_size)
+	{
+		int			newsize = Max(apply_recv_size * 2, 64);
+		ApplyRecvEntry *queue;
+		int			i;
+
+		queue = MemoryContextAlloc(TopMemoryContext,
+								   newsize * sizeof(ApplyRecvEntry));
+		for (i = 0; i < apply_recv_count; i++)
+			queue[i] = apply_recv_queue[(apply_recv_head + i) % apply_recv_size];
+
+		if (apply_recv_queue != NULL)
+			pfree(apply_recv_queue);
+		apply_recv_queue = queue;
+		apply_recv_size = newsize;
+		apply_recv_head = 0;
+	}
+
+	entry = &apply_recv_queue[(apply_recv_head + apply_recv_count) % apply_recv_size];
+	entry->r = r;
+	entry->buf = buf;
+	entry->received = received;
+	apply_recv_count++;
+	if (r > 0)
+		apply_recv_bytes += r;
+}
+
+/*
+ * Read what the provider sent meanwhile off the socket, while we are busy
+ * applying. The walsender keeps sending instead of stalling on a full TCP
+ * window, and the network transfer overlaps with the apply.
+ *
+ * Called between messages by apply_work(), and from within operations
+ * covering many changes through spock_apply_poll_stream(). Up to
+ * spock.apply_readahead_size of messages are kept; past that, the provider
+ * waits for us as before. Keepalives asking for a reply are answered right
+ * away, reporting what was read as written and what was handled so far as
+ * applied, and are not answered again once dequeued.
+ */
+static void
+apply_readahead(void)
+{
+	Size		limit = (Size) spock_apply_readahead_size * 1024;
+	TimestampTz now;
+	bool		reply_requested = false;
+
+	if (limit == 0 || apply_recv_bytes >= limit)
+		return;
+
+	/* Stream ended or failed, nothing more to read */
+	if (apply_recv_count > 0 &&
+		apply_recv_queue[(apply_recv_head + apply_recv_count - 1) % apply_recv_size].r < 0)
+		return;
+
+	now = GetCurrentTimestamp();
+	if (!TimestampDifferenceExceeds(apply_recv_last_read, now,
+									APPLY_READAHEAD_INTERVAL_MS))
+		return;
+	apply_recv_last_read = now;
+
+	/* A broken connection is noticed when we get to read it regularly. */
+	if (!PQconsumeInput(applyconn))
+		return;
+
+	while (apply_recv_bytes < limit)
+	{
+		char	   *buf = NULL;
+		int			r = PQgetCopyData(applyconn, &buf, 1);
+
+		if (r == 0)
+		{
+			if (buf != NULL)
+				PQfreemem(buf);
+			break;
+		}
+
+		if (r > 0 && (buf[0] == 'w' || buf[0] == 'k'))
+		{
+			StringInfoData hdr;
+			XLogRecPtr	lsn;
+
+			/* 'w', dataStart, walEnd, ... or 'k', walEnd, ... */
+			hdr.data = buf;
+			hdr.len = r;
+			hdr.maxlen = r;
+			hdr.cursor = 1;
+			lsn = pq_getmsgint64(&hdr);
+			if (buf[0] == 'w')
+				lsn = Max(lsn, pq_getmsgint64(&hdr));
+			apply_recv_lsn = Max(apply_recv_lsn, lsn);
+
+			/* 'k', walEnd, sendTime, replyRequested */
+			if (r == 18 && buf[0] == 'k' && buf[17])
+			{
+				reply_requested = true;
+
+				/* Answered below, not again when it is dequeued */
+				buf[17] = 0;
+			}
+		}
+
+		apply_recv_push(r, buf, now);
+
+		if (r < 0)
+			break;
+	}
+
+	if (reply_requested)
+		send_feedback(applyconn, apply_delay_feedback_pos(apply_feedback_lsn),
+					  now, true);
+}
+
+/*
+ * Keep reading the stream ahead from within an operation that takes a
+ * while, such as applying a streamed transaction or waiting for parallel
+ * apply workers.
+ *
+ * Reading ahead may be disabled or have filled its queue, so also make
+ * sure the provider hears from us before its wal_sender_timeout.
+ */
+void
+spock_apply_poll_stream(void)
+{
+	TimestampTz now;
+
+	if (applyconn == NULL || is_parallel_apply_worker)
+		return;
+
+	apply_readahead();
+
+	now = GetCurrentTimestamp();
+	if (TimestampDifferenceExceeds(apply_last_feedback, now,
+								   wal_sender_timeout / 2))
+		send_feedback(applyconn, apply_delay_feedback_pos(apply_feedback_lsn),
+					  now, true);
+}
+
+/*
+ * Receive the next message of the stream like PQgetCopyData() in async mode,
+ * taking the ones read ahead first. *received is set to the time the message
+ * was read off the socket.
+ */
+static int
+apply_recv(char **buf, TimestampTz *received)
+{
+	ApplyRecvEntry *entry;
+
+	if (apply_recv_count == 0)
+	{
+		*received = GetCurrentTimestamp();
+		return PQgetCopyData(applyconn, buf, 1);
+	}
+
+	entry = &apply_recv_queue[apply_recv_head];
+	*buf = entry->buf;
+	*received = entry->received;
+	if (entry->r > 0)
+		apply_recv_bytes -= entry->r;
+
+	apply_recv_head = (apply_recv_head + 1) % apply_recv_size;
+	apply_recv_count--;
+
+	return entry->r;
+}
+
+/*
+ * Restore the original form of a message the provider compressed, see
+ * spock_compress.c, so that what is queued, spooled or applied later never
+ * needs decompressing.
+ *
+ * Returns buf if there is nothing to do, otherwise the restored message,
+ * which replaces buf and is allocated with malloc() as well.
+ */
+static char *
+apply_decompress(char *buf, int *len)
+{
+	char	   *raw;
+	int			rawlen;
+	int			wirelen;
+	instr_time	start;
+	instr_time	duration;
+
+	if (buf[0] != 'w' || *len <= APPLY_MSG_BODY_OFFSET)
+		return buf;
+
+	wirelen = *len - APPLY_MSG_BODY_OFFSET;
+	handle_stream_stats_counter(MySubscription->id,
+								SPOCK_STATS_STREAM_WIRE_BYTES, wirelen);
+
+	if (buf[APPLY_MSG_BODY_OFFSET] != SPOCK_COMPRESSED_MSG)
+	{
+		handle_stream_stats_counter(MySubscription->id,
+									SPOCK_STATS_STREAM_BYTES, wirelen);
+		return buf;
+	}
+
+	INSTR_TIME_SET_CURRENT(start);
+
+	rawlen = spock_decompressed_size(buf + APPLY_MSG_BODY_OFFSET, wirelen);
+
+	raw = malloc(APPLY_MSG_BODY_OFFSET + rawlen + 1);
+	if (raw == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OUT_OF_MEMORY),
+				 errmsg("out of memory")));
+
+	memcpy(raw, buf, APPLY_MSG_BODY_OFFSET);
+	spock_decompress(buf + APPLY_MSG_BODY_OFFSET, wirelen,
+					 raw + APPLY_MSG_BODY_OFFSET, rawlen);
+	raw[APPLY_MSG_BODY_OFFSET + rawlen] = '\0';
+
+	PQfreemem(buf);
+	*len = APPLY_MSG_BODY_OFFSET + rawlen;
+
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, start);
+	handle_stream_stats_counter(MySubscription->id, SPOCK_STATS_COMPRESS_TIME,
+								(int64) INSTR_TIME_GET_MICROSEC(duration));
+	handle_stream_stats_counter(MySubscription->id, SPOCK_STATS_STREAM_BYTES,
+								rawlen);
+
+	return raw;
+}
+
+/*
+ * Set up the apply state of a parallel apply worker, see
+ * spock_apply_parallel_main().
+ */
+void
+apply_parallel_worker_init(void)
+{
+	ApplyReplayContext = AllocSetContextCreate(TopMemoryContext,
+											   "ApplyReplayContext",
+											   ALLOCSET_DEFAULT_SIZES);
+	MessageContext = AllocSetContextCreate(TopMemoryContext,
+										   "MessageContext",
+										   ALLOCSET_DEFAULT_SIZES);
+	ApplyOperationContext = AllocSetContextCreate(TopMemoryContext,
+												  "ApplyOperationContext",
+												  ALLOCSET_DEFAULT_SIZES);
+
+	StartTransactionCommand();
+	QueueRelid = get_queue_table_oid();
+	CommitTransactionCommand();
+
+	/*
+	 * The shared exception log entry belongs to the apply worker, which
+	 * handles all exceptions. Give handle_begin() a private one to scribble
+	 * on.
+	 */
+	exception_log_ptr = MemoryContextAllocZero(TopMemoryContext,
+											   sizeof(SpockExceptionLog));
+	my_exception_log_index = 0;
+	first_begin_at_startup = false;
+}
+
+/*
+ * Apply a message received from the apply worker in a parallel apply
+ * worker. The message starts with the action byte.
+ */
+void
+apply_parallel_worker_message(StringInfo s)
+{
+	MemoryContext oldctx = MemoryContextSwitchTo(MessageContext);
+
+	if (s->data[s->cursor] == 'R')
+	{
+		/*
+		 * Relations are sent to all workers when seen, not as part of the
+		 * transaction, so there is no predecessor to wait for.
+		 */
+		(void) pq_getmsgbyte(s);
+		(void) spock_read_rel(s);
+	}
+	else
+		replication_handler(s);
+
+	MemoryContextSwitchTo(oldctx);
+}
+
+/*
+ * Apply main loop.
+ */
+void
+apply_work(PGconn *streamConn)
+{
+	int			fd;
+	XLogRecPtr	last_received = InvalidXLogRecPtr;
+	XLogRecPtr	last_inserted = InvalidXLogRecPtr;
+	TimestampTz last_receive_timestamp = GetCurrentTimestamp();
+	bool		need_replay;
+	bool		delay_turn = false;
+	ErrorData  *edata = NULL;
+
+	applyconn = streamConn;
+	fd = PQsocket(applyconn);
+
+	/* Init the ApplyReplayContext used to replay after an exception */
+	ApplyReplayContext = AllocSetContextCreate(TopMemoryContext,
+											   "ApplyReplayContext",
+											   ALLOCSET_DEFAULT_SIZES);
+
+	/* Init the MessageContext which we use for easier cleanup. */
+	MessageContext = AllocSetContextCreate(TopMemoryContext,
+										   "MessageContext",
+										   ALLOCSET_DEFAULT_SIZES);
+
+	/* Init the ApplyOperationContext for individual operations like DML */
+	ApplyOperationContext = AllocSetContextCreate(TopMemoryContext,
+												  "ApplyOperationContext",
+												  ALLOCSET_DEFAULT_SIZES);
+
+	/* Spooling of streamed in-progress transactions */
+	spock_apply_stream_init();
+
+	/* Buffering of transactions held back by apply_delay */
+	spock_apply_delay_init();
+
+	MemoryContextSwitchTo(MessageContext);
+
+	/* mark as idle, before starting to loop */
+	pgstat_report_activity(STATE_IDLE, NULL);
+
+	if (MyApplyWorker->apply_group == NULL)
+		spock_apply_worker_attach();	/* Attach this worker. */
+
+stream_replay:
+
+	need_replay = false;
+
+	PG_TRY();
+	{
+		while (!got_SIGTERM)
+		{
+			int			rc;
+			int			r;
+			long		timeout = 1000L;
+
+			MySpockWorker->worker_status = SPOCK_WORKER_STATUS_RUNNING;
+
+			/* Wake up when the next held back transaction is due */
+			if (spock_apply_delay_pending())
+				timeout = Min(timeout,
+							  TimestampDifferenceMilliseconds(GetCurrentTimestamp(),
+															  spock_apply_delay_next_time()));
+
+			/*
+			 * Background workers mustn't call usleep() or any direct
+			 * equivalent instead, they may wait on their process latch, which
+			 * sleeps as necessary, but is awakened if postmaster dies.  That
+			 * way the background process goes away immediately in an
+			 * emergency.
+			 */
+			rc = WaitLatchOrSocket(&MyProc->procLatch,
+								   WL_SOCKET_READABLE | WL_LATCH_SET |
+								   WL_TIMEOUT | WL_POSTMASTER_DEATH,
+								   fd, timeout);
+
+			ResetLatch(&MyProc->procLatch);
+
+			CHECK_FOR_INTERRUPTS();
+
+			Assert(CurrentMemoryContext == MessageContext);
 
 			if (ConfigReloadPending)
 			{
@@ -2849,6 +4478,9 @@ stream_replay:
 			{
 				TimestampTz timeout;
 
+				/* Nothing arrived for a while, publish pending counters */
+				spock_stats_flush(true);
+
 				timeout = TimestampTzPlusMilliseconds(last_receive_timestamp,
 													  (wal_sender_timeout * 3) / 2);
 				if (GetCurrentTimestamp() > timeout)
@@ -2865,21 +4497,39 @@ stream_replay:
 			for (;;)
 			{
 				ApplyReplayEntry *entry;
-				bool		queue_append;
+				bool		queue_append = false;
+				bool		from_delay = false;
 				StringInfo	msg;
 				int			c;
 
 				if (got_SIGTERM)
 					break;
 
-				if (apply_replay_next == NULL)
+				/* Keep the stream flowing while we work, replaying or not */
+				apply_feedback_lsn = last_received;
+				apply_readahead();
+
+				/* In replay mode present the next queue entry */
+				entry = apply_replay_fetch();
+
+				/*
+				 * Held back transactions which are due take turns with the
+				 * stream, so that keepalives are still answered while a
+				 * backlog of them is applied.
+				 */
+				if (entry == NULL && delay_turn)
+				{
+					entry = apply_delay_fetch();
+					from_delay = queue_append = (entry != NULL);
+				}
+				delay_turn = !delay_turn;
+
+				if (entry == NULL)
 				{
 					char	   *buf;
 
 					/* We are not in replay mode so receive from the stream */
-					r = PQgetCopyData(applyconn, &buf, 1);
-
-					last_receive_timestamp = GetCurrentTimestamp();
+					r = apply_recv(&buf, &last_receive_timestamp);
 
 					/* Check for errors */
 					if (r == -1)
@@ -2906,26 +4556,30 @@ stream_replay:
 					}
 					else if (r == 0)
 					{
-						/* need to wait for new data */
 						if (buf != NULL)
 							PQfreemem(buf);
-						break;
-					}
 
-					/*
-					 * We have a valid message, create an apply queue entry
-					 * but don't add it to the queue yet.
-					 */
-					entry = apply_replay_entry_create(r, buf);
+						/*
+						 * Apply a held back message meanwhile, or wait for
+						 * new data.
+						 */
+						entry = apply_delay_fetch();
+						if (entry == NULL)
+							break;
+						from_delay = true;
+					}
+					else
+					{
+						/*
+						 * We have a valid message, create an apply queue
+						 * entry but don't add it to the queue yet.
+						 */
+						if (apply_compression != SPOCK_COMPRESSION_NONE)
+							buf = apply_decompress(buf, &r);
+						entry = apply_replay_entry_create(r, buf);
+					}
 					queue_append = true;
 				}
-				else
-				{
-					/* We are in replay mode so present the next queue entry */
-					entry = apply_replay_next;
-					apply_replay_next = apply_replay_next->next;
-					queue_append = false;
-				}
 
 				if (ConfigReloadPending)
 				{
@@ -2942,70 +4596,84 @@ stream_replay:
 				{
 					XLogRecPtr	start_lsn;
 					XLogRecPtr	end_lsn;
+					XLogRecPtr	insert_lsn = InvalidXLogRecPtr;
+					XLogRecPtr	prev_received = last_received;
 
 					start_lsn = pq_getmsgint64(msg);
 					end_lsn = pq_getmsgint64(msg);
 					pq_getmsgint64(msg);	/* sendTime */
 
 					/*
-					 * Call maybe_send_feedback before last_received is
-					 * updated. This ordering guarantees that feedback LSN
-					 * never advertises a position beyond what has actually
-					 * been received and processed. Prevents skipping over
-					 * unapplied changes due to premature flush LSN.
+					 * Protocol version 5+ includes remote_insert_lsn at the
+					 * beginning of all messages. Protocol version 4 only
+					 * includes it at the end of COMMIT messages (handled in
+					 * handle_commit).
 					 */
-					maybe_send_feedback(applyconn, last_received,
-										&last_receive_timestamp);
+					if (spock_apply_get_proto_version() >= 5)
+						insert_lsn = pq_getmsgint64(msg);
 
-					if (last_received < start_lsn)
-						last_received = start_lsn;
+					/* A held back message was accounted for when received */
+					if (!from_delay)
+					{
+						/*
+						 * Call maybe_send_feedback before last_received is
+						 * updated. This ordering guarantees that feedback LSN
+						 * never advertises a position beyond what has
+						 * actually been received and processed. Prevents
+						 * skipping over unapplied changes due to premature
+						 * flush LSN.
+						 */
+						maybe_send_feedback(applyconn,
+											apply_delay_feedback_pos(last_received),
+											&last_receive_timestamp);
 
-					if (last_received < end_lsn)
-						last_received = end_lsn;
+						if (last_received < start_lsn)
+							last_received = start_lsn;
 
-					/*
-					 * Append the entry to the end of the replay queue if we
-					 * read it from the stream. Dynamic allocation means no
-					 * fixed size limit - queue grows as needed. Note:
-					 * spock_replay_queue_size is deprecated and no longer
-					 * checked.
-					 */
-					if (queue_append)
-					{
-						apply_replay_bytes += msg->len;
+						if (last_received < end_lsn)
+							last_received = end_lsn;
 
-						if (apply_replay_head == NULL)
-						{
-							apply_replay_head = apply_replay_tail = entry;
-						}
+						/*
+						 * Update statistics before applying the record to let
+						 * the apply machinery to check consistency of these
+						 * values.
+						 */
+						if (spock_apply_get_proto_version() >= 5)
+							last_inserted = insert_lsn;
 						else
-						{
-							apply_replay_tail->next = entry;
-							apply_replay_tail = entry;
-						}
+							last_inserted = last_received;
+						UpdateWorkerStats(last_received, last_inserted);
 					}
 
-					/*
-					 * Update statistics before applying the record to let the
-					 * apply machinery to check consistency of these values.
-					 *
-					 * Protocol version 5+ includes remote_insert_lsn at the
-					 * beginning of all messages. Protocol version 4 only
-					 * includes it at the end of COMMIT messages (handled in
-					 * handle_commit).
-					 */
-					if (spock_apply_get_proto_version() >= 5)
-						last_inserted = pq_getmsgint64(msg);
+					if (queue_append && !from_delay &&
+						apply_delay_hold(msg, prev_received))
+					{
+						/* Held back, applied once its time has come */
+						apply_replay_entry_free(entry);
+					}
+					else if (queue_append && apply_stream_message(msg))
+					{
+						/* Spooled, it is not part of the queued transaction */
+						apply_replay_entry_free(entry);
+					}
 					else
-						last_inserted = last_received;
-					UpdateWorkerStats(last_received, last_inserted);
-
-					replication_handler(msg);
+					{
+						/*
+						 * Append the entry to the end of the replay queue if
+						 * we read it from the stream. Past
+						 * spock.replay_queue_memory_limit it is written to
+						 * the spill file instead, and we continue with a
+						 * copy.
+						 */
+						if (queue_append)
+						{
+							entry = apply_replay_append(entry);
+							msg = &entry->copydata;
+						}
 
-					/*
-					 * Note: No overflow handling needed - dynamic allocation
-					 * used
-					 */
+						if (!parallel_apply_route(msg, queue_append))
+							exception_chunk_apply(msg);
+					}
 				}
 				else if (c == 'k')
 				{
@@ -3016,7 +4684,7 @@ stream_replay:
 					 /* timestamp = */ pq_getmsgint64(msg);
 					reply_requested = pq_getmsgbyte(msg);
 
-					send_feedback(applyconn, endpos,
+					send_feedback(applyconn, apply_delay_feedback_pos(endpos),
 								  GetCurrentTimestamp(),
 								  reply_requested);
 
@@ -3054,6 +4722,13 @@ stream_replay:
 				CHECK_FOR_INTERRUPTS();
 			}
 
+			/*
+			 * Nothing more to apply for now, commit what was left open. Past
+			 * a BEGIN, the commit of that transaction takes care of it.
+			 */
+			if (!in_remote_transaction)
+				apply_coalesce_finish();
+
 			if (xact_had_exception)
 			{
 				/*
@@ -3093,13 +4768,14 @@ stream_replay:
 				if (!MyApplyWorker->use_try_block ||
 					exception_behaviour == DISCARD)
 				{
-					send_feedback(applyconn, last_received, GetCurrentTimestamp(),
-								  false);
+					send_feedback(applyconn,
+								  apply_delay_feedback_pos(last_received),
+								  GetCurrentTimestamp(), false);
 				}
 			}
 
-			if (!in_remote_transaction)
-				process_syncing_tables(last_received);
+			if (!in_remote_transaction && !parallel_buffering)
+				process_syncing_tables(apply_delay_feedback_pos(last_received));
 
 			/* We must not have switched out of MessageContext by mistake */
 			Assert(CurrentMemoryContext == MessageContext);
@@ -3123,6 +4799,55 @@ stream_replay:
 		MemoryContextSwitchTo(MessageContext);
 		edata = CopyErrorData();
 
+		parallel_buffering = false;
+		change_batch_discard();
+		exception_chunk_reset();
+
+		/*
+		 * Streamed changes are not in the replay queue, so we can't recover
+		 * from failing to spool one. Exit, the provider will send the
+		 * transaction again.
+		 */
+		if (stream_spooling)
+			PG_RE_THROW();
+
+		/*
+		 * Transactions left open by apply_coalesce_add() were rolled back
+		 * along with the failing one, and are no longer in the replay queue.
+		 * Restart, and apply them one by one up to the failing one.
+		 */
+		if (coalesce_nxacts > 0)
+		{
+			SpockExceptionLog *exception_log;
+
+			exception_log = &exception_log_ptr[my_exception_log_index];
+			exception_log->serial_apply_lsn =
+				Max(exception_log->serial_apply_lsn,
+					replorigin_session_origin_lsn);
+
+			elog(LOG, "SPOCK %s: error while coalescing transactions, transactions up to %X/%X will be applied one by one",
+				 MySubscription->name,
+				 LSN_FORMAT_ARGS(replorigin_session_origin_lsn));
+			PG_RE_THROW();
+		}
+
+		/*
+		 * Transactions handed to parallel apply workers may or may not have
+		 * been committed, so we can't replay from the queue. Make sure we
+		 * apply all of them serially after the restart, so that a failing
+		 * one goes through the regular exception handling.
+		 */
+		if (spock_apply_parallel_busy())
+		{
+			exception_log_ptr[my_exception_log_index].serial_apply_lsn =
+				spock_apply_parallel_last_dispatched();
+
+			elog(LOG, "SPOCK %s: error during parallel apply, transactions up to %X/%X will be applied serially",
+				 MySubscription->name,
+				 LSN_FORMAT_ARGS(spock_apply_parallel_last_dispatched()));
+			PG_RE_THROW();
+		}
+
 		/*
 		 * use_try_block == true indicates either that an exception occurred
 		 * during a DML operation, or that we were replaying previously failed
@@ -3193,6 +4918,7 @@ stream_replay:
 		 * exception-handling mode by replaying from the queue.
 		 */
 		AbortOutOfAnyTransaction();
+		apply_coalesce_reset();
 
 		MemoryContextSwitchTo(MessageContext);
 		elog(LOG, "SPOCK: caught initial exception - %s", edata->message);
@@ -3224,7 +4950,7 @@ stream_replay:
 		MemoryContextReset(ApplyOperationContext);
 		spock_relation_cache_reset();
 
-		apply_replay_next = apply_replay_head;
+		apply_replay_rewind(apply_replay_head);
 		in_remote_transaction = false;
 		first_begin_at_startup = true;
 		remote_origin_lsn = InvalidXLogRecPtr;
@@ -3550,6 +5276,17 @@ process_syncing_tables(XLogRecPtr end_lsn)
 	Assert(CurrentMemoryContext == MessageContext);
 	Assert(!IsTransactionState());
 
+	/*
+	 * Table synchronization expects everything received so far to be
+	 * applied.
+	 */
+	if ((MyApplyWorker->sync_pending || SyncingTables != NIL) &&
+		spock_apply_parallel_busy())
+	{
+		spock_apply_parallel_wait_all();
+		parallel_apply_collect();
+	}
+
 	/* First check if we need to update the cached information. */
 	if (MyApplyWorker->sync_pending)
 	{
@@ -3831,6 +5568,7 @@ spock_apply_main(Datum main_arg)
 		 MySubscription->slot_name, originid);
 	replorigin_session_setup(originid);
 	replorigin_session_origin = originid;
+	apply_session_origin = originid;
 	origin_startpos = replorigin_session_get_progress(false);
 
 	/* Start the replication. */
@@ -3905,6 +5643,281 @@ apply_replay_entry_free(ApplyReplayEntry * entry)
 	pfree(entry);
 }
 
+/* Remove the replay spill file when the apply worker exits */
+static void
+apply_replay_file_cleanup(int code, Datum arg)
+{
+	if (apply_replay_file < 0)
+		return;
+
+	if (unlink(apply_replay_file_path) != 0 && errno != ENOENT)
+		elog(WARNING, "Failed to clean up spock replay spill file \"%s\" on exit: %m",
+			 apply_replay_file_path);
+}
+
+/* Create the replay spill file for the current transaction */
+static void
+apply_replay_file_open(void)
+{
+	static bool cleanup_registered = false;
+
+	Assert(apply_replay_file < 0);
+
+	snprintf(apply_replay_file_path, MAXPGPATH, "%s/spock-replay-%d.tmp",
+			 spock_temp_directory, MyProcPid);
+	canonicalize_path(apply_replay_file_path);
+
+	apply_replay_file = PathNameOpenFile(apply_replay_file_path,
+										 O_RDWR | O_CREAT | O_TRUNC | PG_BINARY);
+	if (apply_replay_file < 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not create file \"%s\": %m",
+						apply_replay_file_path)));
+
+	if (!cleanup_registered)
+	{
+		on_proc_exit(apply_replay_file_cleanup, (Datum) 0);
+		cleanup_registered = true;
+	}
+
+	/* Buffers used for writing and reading back spilled messages */
+	if (apply_replay_file_entry == NULL)
+	{
+		MemoryContext oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+
+		apply_replay_file_entry = palloc(sizeof(ApplyReplayEntry));
+		initStringInfo(&apply_replay_file_entry->copydata);
+		apply_replay_file_entry->next = NULL;
+		initStringInfo(&apply_replay_file_wbuf);
+
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	apply_replay_file_size = 0;
+	apply_replay_file_readpos = -1;
+
+	elog(DEBUG1, "SPOCK %s: replay queue exceeds %d kB, spilling to \"%s\"",
+		 MySubscription->name, spock_replay_queue_memory_limit,
+		 apply_replay_file_path);
+}
+
+/* Write out the buffered spilled messages */
+static void
+apply_replay_file_flush(void)
+{
+	int			nbytes = apply_replay_file_wbuf.len;
+	int			written;
+
+	if (nbytes == 0)
+		return;
+
+	errno = 0;
+	written = FileWrite(apply_replay_file, apply_replay_file_wbuf.data,
+						nbytes, apply_replay_file_size - nbytes,
+						WAIT_EVENT_BUFFILE_WRITE);
+	if (written != nbytes)
+	{
+		/* if write didn't set errno, assume problem is no disk space */
+		if (errno == 0)
+			errno = ENOSPC;
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not write to file \"%s\": %m",
+						apply_replay_file_path)));
+	}
+
+	resetStringInfo(&apply_replay_file_wbuf);
+}
+
+/* Read the next nbytes of the spill file during replay */
+static void
+apply_replay_file_read(char *buf, int nbytes)
+{
+	int			nread;
+
+	nread = FileRead(apply_replay_file, buf, nbytes,
+					 apply_replay_file_readpos, WAIT_EVENT_BUFFILE_READ);
+	if (nread < 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not read file \"%s\": %m",
+						apply_replay_file_path)));
+	if (nread != nbytes)
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 errmsg("could not read file \"%s\": read %d of %d",
+						apply_replay_file_path, nread, nbytes)));
+
+	apply_replay_file_readpos += nbytes;
+}
+
+/* Close and remove the spill file of the finished transaction */
+static void
+apply_replay_file_close(void)
+{
+	if (apply_replay_file < 0)
+		return;
+
+	FileClose(apply_replay_file);
+	apply_replay_file = -1;
+
+	if (unlink(apply_replay_file_path) != 0 && errno != ENOENT)
+		ereport(WARNING,
+				(errcode_for_file_access(),
+				 errmsg("could not remove file \"%s\": %m",
+						apply_replay_file_path)));
+
+	resetStringInfo(&apply_replay_file_wbuf);
+	apply_replay_file_size = 0;
+	apply_replay_file_readpos = -1;
+}
+
+/*
+ * Add a message received from the stream to the replay queue.
+ *
+ * Messages are linked into the queue as long as it stays within
+ * spock.replay_queue_memory_limit. After that, this and all following
+ * messages of the transaction are appended to the spill file and the
+ * received buffer is released; the caller continues with the returned copy,
+ * which is only valid until the next message is queued or replayed.
+ */
+static ApplyReplayEntry *
+apply_replay_append(ApplyReplayEntry * entry)
+{
+	StringInfo	msg = &entry->copydata;
+	StringInfo	copy;
+	uint32		len = msg->len;
+
+	if (apply_replay_file < 0 &&
+		(spock_replay_queue_memory_limit < 0 ||
+		 apply_replay_bytes + len <=
+		 (Size) spock_replay_queue_memory_limit * 1024))
+	{
+		apply_replay_bytes += len;
+		apply_replay_pos.entry = entry;
+		apply_replay_pos.fileoff = -1;
+
+		if (apply_replay_head == NULL)
+		{
+			apply_replay_head = apply_replay_tail = entry;
+		}
+		else
+		{
+			apply_replay_tail->next = entry;
+			apply_replay_tail = entry;
+		}
+
+		return entry;
+	}
+
+	if (apply_replay_file < 0)
+		apply_replay_file_open();
+
+	/* Too big to be buffered for a parallel apply worker */
+	if (parallel_buffering)
+		parallel_serial = true;
+
+	apply_replay_pos.entry = NULL;
+	apply_replay_pos.fileoff = apply_replay_file_size;
+
+	appendBinaryStringInfo(&apply_replay_file_wbuf, (char *) &len, sizeof(len));
+	appendBinaryStringInfo(&apply_replay_file_wbuf, msg->data, len);
+	apply_replay_file_size += sizeof(len) + len;
+
+	if (apply_replay_file_wbuf.len >= APPLY_REPLAY_FILE_WBUF_SIZE)
+		apply_replay_file_flush();
+
+	copy = &apply_replay_file_entry->copydata;
+	resetStringInfo(copy);
+	appendBinaryStringInfo(copy, msg->data, len);
+	copy->cursor = msg->cursor;
+
+	apply_replay_entry_free(entry);
+
+	return apply_replay_file_entry;
+}
+
+/*
+ * Return the next message to replay, first from the in-memory queue and then
+ * from the spill file, or NULL when we are not replaying (anymore).
+ *
+ * Messages read from the spill file are only valid until the next call.
+ */
+static ApplyReplayEntry *
+apply_replay_fetch(void)
+{
+	ApplyReplayEntry *entry = apply_replay_next;
+	StringInfo	msg;
+	uint32		len;
+
+	if (entry != NULL)
+	{
+		apply_replay_next = entry->next;
+		apply_replay_pos.entry = entry;
+		apply_replay_pos.fileoff = -1;
+		return entry;
+	}
+
+	if (apply_replay_file_readpos < 0)
+		return NULL;
+
+	if (apply_replay_file_readpos >= apply_replay_file_size)
+	{
+		/* Replayed everything, continue with the stream */
+		apply_replay_file_readpos = -1;
+		return NULL;
+	}
+
+	apply_replay_pos.entry = NULL;
+	apply_replay_pos.fileoff = apply_replay_file_readpos;
+
+	apply_replay_file_read((char *) &len, sizeof(len));
+
+	msg = &apply_replay_file_entry->copydata;
+	resetStringInfo(msg);
+	enlargeStringInfo(msg, len);
+	apply_replay_file_read(msg->data, len);
+	msg->len = len;
+	msg->data[len] = '\0';
+
+	return apply_replay_file_entry;
+}
+
+/* Start replaying the queue from the given entry, then the spill file */
+static void
+apply_replay_rewind(ApplyReplayEntry * from)
+{
+	apply_replay_next = from;
+
+	if (apply_replay_file >= 0)
+	{
+		apply_replay_file_flush();
+		apply_replay_file_readpos = 0;
+	}
+}
+
+/*
+ * Continue replaying at the given position, taken from apply_replay_pos
+ * earlier in the current transaction.
+ */
+static void
+apply_replay_seek(ApplyReplayPos * pos)
+{
+	if (pos->entry != NULL)
+	{
+		apply_replay_rewind(pos->entry);
+		return;
+	}
+
+	Assert(apply_replay_file >= 0);
+	Assert(pos->fileoff >= 0 && pos->fileoff < apply_replay_file_size);
+
+	apply_replay_next = NULL;
+	apply_replay_file_flush();
+	apply_replay_file_readpos = pos->fileoff;
+}
+
 /* Free all queued messages and reset the apply replay queue */
 static void
 apply_replay_queue_reset(void)
@@ -3920,6 +5933,13 @@ apply_replay_queue_reset(void)
 	apply_replay_tail = NULL;
 	apply_replay_next = NULL;
 	apply_replay_bytes = 0;
+	apply_replay_pos.entry = NULL;
+	apply_replay_pos.fileoff = -1;
+
+	apply_replay_file_close();
+
+	/* Streamed transactions applied with the queued one are done, too */
+	spock_apply_stream_cleanup();
 
 	MemoryContextReset(ApplyReplayContext);
 }
@@ -0,0 +1,310 @@
+/*-------------------------------------------------------------------------
+ *
+ * spock_apply_delay.c
+ * 		spock buffering of transactions held back by apply_delay
+ *
+ * A subscription with apply_delay must not apply a remote transaction before
+ * its commit timestamp plus the delay has passed. Rather than stopping to
+ * read from the provider in the meantime, the apply worker keeps receiving
+ * and appends the messages of transactions which are not due yet to a spool
+ * file in spock.temp_directory. The spooled messages are handed back in
+ * order once their time has come, so the worker keeps answering keepalives
+ * and the provider keeps sending while a transaction waits.
+ *
+ * Each message is stored with the time it may be applied at, only set for
+ * BEGIN, and the position up to which everything received before it has
+ * been applied, which is what the worker can report as flushed while the
+ * message is pending.
+ *
+ * Copyright (c) 2022-2026, pgEdge, Inc.
+ * Portions Copyright (c) 1996-2021, PostgreSQL Global Development Group
+ * Portions Copyright (c) 1994, The Regents of the University of California
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include <unistd.h>
+
+#include "miscadmin.h"
+#include "pgstat.h"
+
+#include "storage/fd.h"
+#include "storage/ipc.h"
+
+#include "utils/memutils.h"
+
+#include "spock_apply_delay.h"
+#include "spock.h"
+
+/* Size of the buffers used to write and read back the spool file */
+#define DELAY_SPOOL_BUF_SIZE		(64 * 1024)
+
+/* Give the disk space back once the queue drains after growing past this */
+#define DELAY_SPOOL_TRUNCATE_SIZE	(16 * DELAY_SPOOL_BUF_SIZE)
+
+/* Spooled in front of each message */
+typedef struct SpockDelayHeader
+{
+	uint32		len;
+	TimestampTz apply_at;		/* 0 if not before its predecessor */
+	XLogRecPtr	feedback_lsn;
+} SpockDelayHeader;
+
+static MemoryContext DelayContext = NULL;
+
+static File delay_file = -1;
+static char delay_path[MAXPGPATH];
+static off_t delay_size = 0;	/* including what's still in the buffer */
+static int64 delay_count = 0;	/* messages spooled and not handed back */
+static StringInfoData delay_wbuf;
+
+/* Read position in the spool file and the header of the next message */
+static off_t delay_fileoff = 0;
+static char *delay_rbuf = NULL;
+static int	delay_rbuf_len = 0;
+static int	delay_rbuf_off = 0;
+static SpockDelayHeader delay_head;
+static bool delay_head_valid = false;
+
+/* Remove the spool file when the apply worker exits */
+static void
+delay_on_exit(int code, Datum arg)
+{
+	if (delay_file < 0)
+		return;
+
+	if (unlink(delay_path) != 0 && errno != ENOENT)
+		elog(WARNING, "Failed to clean up spock delay spool file \"%s\" on exit: %m",
+			 delay_path);
+}
+
+/* Write out the buffered messages */
+static void
+delay_flush(void)
+{
+	int			nbytes = delay_wbuf.len;
+	int			written;
+
+	if (nbytes == 0)
+		return;
+
+	errno = 0;
+	written = FileWrite(delay_file, delay_wbuf.data, nbytes,
+						delay_size - nbytes, WAIT_EVENT_BUFFILE_WRITE);
+	if (written != nbytes)
+	{
+		/* if write didn't set errno, assume problem is no disk space */
+		if (errno == 0)
+			errno = ENOSPC;
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not write to file \"%s\": %m", delay_path)));
+	}
+
+	resetStringInfo(&delay_wbuf);
+}
+
+/* Copy the next nbytes of the spool file to dst */
+static void
+delay_read(char *dst, int nbytes)
+{
+	while (nbytes > 0)
+	{
+		int			n;
+
+		if (delay_rbuf_off == delay_rbuf_len)
+		{
+			off_t		left;
+			int			nread;
+
+			/* Caught up with the writer, read what it has buffered, too */
+			if (delay_fileoff == delay_size - delay_wbuf.len)
+				delay_flush();
+
+			left = delay_size - delay_fileoff;
+			n = (int) Min(left, (off_t) DELAY_SPOOL_BUF_SIZE);
+			nread = (n > 0) ?
+				FileRead(delay_file, delay_rbuf, n, delay_fileoff,
+						 WAIT_EVENT_BUFFILE_READ) : 0;
+			if (nread <= 0)
+			{
+				if (nread < 0)
+					ereport(ERROR,
+							(errcode_for_file_access(),
+							 errmsg("could not read file \"%s\": %m",
+									delay_path)));
+				ereport(ERROR,
+						(errcode(ERRCODE_DATA_CORRUPTED),
+						 errmsg("unexpected end of file \"%s\"", delay_path)));
+			}
+
+			delay_fileoff += nread;
+			delay_rbuf_len = nread;
+			delay_rbuf_off = 0;
+		}
+
+		n = Min(nbytes, delay_rbuf_len - delay_rbuf_off);
+		memcpy(dst, delay_rbuf + delay_rbuf_off, n);
+		delay_rbuf_off += n;
+		dst += n;
+		nbytes -= n;
+	}
+}
+
+/* Read the header of the next message, if not done yet */
+static SpockDelayHeader *
+delay_peek(void)
+{
+	Assert(delay_count > 0);
+
+	if (!delay_head_valid)
+	{
+		delay_read((char *) &delay_head, sizeof(SpockDelayHeader));
+		delay_head_valid = true;
+	}
+
+	return &delay_head;
+}
+
+/*
+ * Set up the buffering of delayed transactions in the apply worker.
+ */
+void
+spock_apply_delay_init(void)
+{
+	MemoryContext oldctx;
+
+	if (DelayContext != NULL)
+		return;
+
+	DelayContext = AllocSetContextCreate(TopMemoryContext,
+										 "spock delay spool",
+										 ALLOCSET_DEFAULT_SIZES);
+
+	oldctx = MemoryContextSwitchTo(DelayContext);
+	initStringInfo(&delay_wbuf);
+	delay_rbuf = palloc(DELAY_SPOOL_BUF_SIZE);
+	MemoryContextSwitchTo(oldctx);
+
+	on_proc_exit(delay_on_exit, (Datum) 0);
+}
+
+/*
+ * Are there spooled messages which were not handed back yet?
+ */
+bool
+spock_apply_delay_pending(void)
+{
+	return delay_count > 0;
+}
+
+/*
+ * Spool a message received from the provider, to be applied not before
+ * apply_at. feedback_lsn is the position received and applied before it.
+ */
+void
+spock_apply_delay_push(StringInfo msg, TimestampTz apply_at,
+					   XLogRecPtr feedback_lsn)
+{
+	SpockDelayHeader hdr;
+
+	Assert(DelayContext != NULL);
+
+	if (delay_file < 0)
+	{
+		snprintf(delay_path, MAXPGPATH, "%s/spock-delay-%d.tmp",
+				 spock_temp_directory, MyProcPid);
+		canonicalize_path(delay_path);
+
+		delay_file = PathNameOpenFile(delay_path,
+									  O_RDWR | O_CREAT | O_TRUNC | PG_BINARY);
+		if (delay_file < 0)
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("could not create file \"%s\": %m", delay_path)));
+	}
+
+	hdr.len = msg->len;
+	hdr.apply_at = apply_at;
+	hdr.feedback_lsn = feedback_lsn;
+
+	appendBinaryStringInfo(&delay_wbuf, (char *) &hdr, sizeof(hdr));
+	appendBinaryStringInfo(&delay_wbuf, msg->data, msg->len);
+	delay_size += sizeof(hdr) + msg->len;
+	delay_count++;
+
+	if (delay_wbuf.len >= DELAY_SPOOL_BUF_SIZE)
+		delay_flush();
+}
+
+/*
+ * Time at which the next spooled message may be applied.
+ */
+TimestampTz
+spock_apply_delay_next_time(void)
+{
+	return delay_peek()->apply_at;
+}
+
+/*
+ * Position which may be reported as flushed while messages are spooled.
+ */
+XLogRecPtr
+spock_apply_delay_feedback_lsn(void)
+{
+	return delay_peek()->feedback_lsn;
+}
+
+/*
+ * Hand back the next spooled message if it may be applied at the given time,
+ * otherwise return NULL.
+ *
+ * The message is allocated with malloc(), like the messages returned by
+ * PQgetCopyData(), and is released with PQfreemem() by the caller.
+ */
+char *
+spock_apply_delay_pop(TimestampTz now, int *len)
+{
+	SpockDelayHeader *hdr;
+	char	   *buf;
+
+	if (delay_count == 0)
+		return NULL;
+
+	hdr = delay_peek();
+	if (hdr->apply_at > now)
+		return NULL;
+
+	buf = malloc(hdr->len + 1);
+	if (buf == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OUT_OF_MEMORY),
+				 errmsg("out of memory")));
+
+	delay_read(buf, hdr->len);
+	buf[hdr->len] = '\0';
+	*len = hdr->len;
+
+	delay_head_valid = false;
+	delay_count--;
+
+	/* Everything was handed back, start over at the beginning of the file */
+	if (delay_count == 0)
+	{
+		Assert(delay_wbuf.len == 0);
+
+		if (delay_size > DELAY_SPOOL_TRUNCATE_SIZE &&
+			FileTruncate(delay_file, 0, WAIT_EVENT_DATA_FILE_TRUNCATE) < 0)
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("could not truncate file \"%s\": %m", delay_path)));
+
+		delay_size = 0;
+		delay_fileoff = 0;
+		delay_rbuf_len = 0;
+		delay_rbuf_off = 0;
+	}
+
+	return buf;
+}
@@ -19,10 +19,17 @@
 #include "pgstat.h"
 
 #include "access/commit_ts.h"
+#include "access/genam.h"
 #include "access/htup_details.h"
+#include "access/nbtree.h"
 #include "access/xact.h"
 
+#include "catalog/index.h"
 #include "catalog/namespace.h"
+#include "catalog/pg_am.h"
+#include "catalog/pg_type.h"
+
+#include "common/hashfn.h"
 
 #include "commands/dbcommands.h"
 #include "commands/sequence.h"
@@ -55,12 +62,16 @@
 #include "tcop/pquery.h"
 #include "tcop/utility.h"
 
+#include "utils/array.h"
 #include "utils/attoptcache.h"
 #include "utils/builtins.h"
+#include "utils/datum.h"
 #include "utils/jsonb.h"
 #include "utils/lsyscache.h"
 #include "utils/memutils.h"
+#include "utils/resowner.h"
 #include "utils/snapmgr.h"
+#include "utils/typcache.h"
 
 #include "spock_common.h"
 #include "spock_conflict.h"
@@ -77,12 +88,37 @@
 #include "spock_apply.h"
 #include "spock_exception_handler.h"
 
+/*
+ * Rows of a REPLICA IDENTITY FULL table without a usable index, by the hash
+ * of their columns. Built once a transaction has to search such a table
+ * sequentially more than once, see full_identity_hash_lookup().
+ */
+typedef struct FullIdentityHash
+{
+	MemoryContext cxt;			/* everything below, freed with the hash */
+	MemoryContext tmpcxt;		/* reset after hashing each tuple */
+	HTAB	   *tids;			/* FullIdentityHashEntry by hash */
+	FmgrInfo  **hashprocs;		/* per column, NULL if it isn't hashed */
+} FullIdentityHash;
+
+typedef struct FullIdentityHashEntry
+{
+	uint32		hash;			/* hash key */
+	ItemPointerData tid;
+	List	   *moretids;		/* ItemPointers of other rows with same hash */
+} FullIdentityHashEntry;
+
 typedef struct ApplyExecutionData
 {
 	EState	   *estate;			/* executor state, used to track resources */
 
 	SpockRelation *targetRel;	/* replication target rel */
 	ResultRelInfo *targetRelInfo;	/* ResultRelInfo for same */
+
+	/* Only set up for states kept until the end of the transaction */
+	bool		fullhash_allowed;
+	int			fullhash_seqscans;	/* sequential searches so far */
+	FullIdentityHash *fullhash;
 } ApplyExecutionData;
 
 typedef struct ApplyExecState
@@ -105,11 +141,77 @@ typedef struct ApplyMIState
 	TupleTableSlot **buffered_tuples;
 	int			maxbuffered_tuples;
 	int			nbuffered_tuples;
+
+	bool		probe_conflicts;	/* look for existing rows before insert */
+
+	/*
+	 * Hashes of the keys of the buffered tuples in the unique indexes, to
+	 * find two inserts of the same key within the batch.
+	 */
+	int			nkeyindexes;
+	int		   *keyindexes;		/* positions in ri_IndexRelationDescs */
+	uint32	   *keyhashes;		/* [nbuffered_tuples][nkeyindexes] */
+	bool	   *keyhashed;		/* false if NULLs keep the key distinct */
 } ApplyMIState;
 
+/* An UPDATE or DELETE queued by spock_apply_heap_batch_add() */
+typedef struct ApplyBatchChange
+{
+	SpockTupleData oldtup;
+	SpockTupleData newtup;		/* natts is 0 for DELETE */
+	ItemPointerData tid;		/* local tuple found by the batched lookup */
+} ApplyBatchChange;
+
+/* State related to batched UPDATE/DELETE */
+typedef struct ApplyBatchState
+{
+	SpockRelation *rel;
+	MemoryContext cxt;			/* copies of the queued tuples */
+	ApplyBatchChange *changes;
+	int			nchanges;
+} ApplyBatchState;
+
+/* Key of a queued change, sorted for matching the scanned tuples */
+typedef struct ApplyBatchKey
+{
+	Datum		key;
+	int			change;
+} ApplyBatchKey;
+
+typedef struct ApplyBatchKeyCmp
+{
+	FmgrInfo   *cmpproc;
+	Oid			collation;
+} ApplyBatchKeyCmp;
+
+#define APPLY_BATCH_MAX_CHANGES		1000
+
+/*
+ * Executor state for applying single row changes to a relation.
+ *
+ * Outside of exception handling it's kept for the rest of the transaction
+ * in ApplyExecCache, so that each change only does the actual tuple work
+ * instead of setting up the executor and opening all indexes again.
+ */
+typedef struct ApplyExecCacheEntry
+{
+	Oid			reloid;			/* hash key, or InvalidOid if not cached */
+	ApplyExecutionData *edata;
+	EPQState	epqstate;
+	TupleTableSlot *remoteslot;
+	int			ntupleslots;	/* es_tupleTable length after setup */
+	bool		valid;			/* false if relcache was invalidated */
+} ApplyExecCacheEntry;
+
 #define TTS_TUP(slot) (((HeapTupleTableSlot *)slot)->tuple)
 
 static ApplyMIState *spkmistate = NULL;
+static ApplyBatchState *spkbatchstate = NULL;
+
+static HTAB *ApplyExecCache = NULL;
+static bool ApplyExecCacheUsed = false;
+
+int			spock_replica_identity_full_hash_mem = 0;
 
 static void build_delta_tuple(SpockRelation *rel, SpockTupleData *oldtup,
 							  SpockTupleData *newtup, SpockTupleData *deltatup,
@@ -167,36 +269,268 @@ create_edata_for_relation(SpockRelation *rel)
 
 	estate->es_output_cid = GetCurrentCommandId(true);
 
-	/* Prepare to catch AFTER triggers. */
-	AfterTriggerBeginQuery();
-
 	/* other fields of edata remain NULL for now */
 
 	return edata;
 }
 
+
 /*
- * Finish any operations related to the executor state created by
- * create_edata_for_relation().
+ * Set up the executor state of an ApplyExecCacheEntry.
  */
 static void
-finish_edata(ApplyExecutionData *edata)
+apply_exec_setup(ApplyExecCacheEntry *entry, SpockRelation *rel)
 {
-	EState	   *estate = edata->estate;
+	EState	   *estate;
 
-	/* Handle any queued AFTER triggers. */
-	AfterTriggerEndQuery(estate);
+	entry->edata = create_edata_for_relation(rel);
+	estate = entry->edata->estate;
+	entry->remoteslot = ExecInitExtraTupleSlot(estate,
+											   RelationGetDescr(rel->rel),
+											   &TTSOpsVirtual);
+	EvalPlanQualInit(&entry->epqstate, estate, NULL, NIL, -1, NIL);
+	ExecOpenIndices(entry->edata->targetRelInfo, false);
+	entry->ntupleslots = list_length(estate->es_tupleTable);
+	entry->valid = true;
+}
+
+/*
+ * Release everything an ApplyExecCacheEntry holds.
+ */
+static void
+apply_exec_release(ApplyExecCacheEntry *entry)
+{
+	ResultRelInfo *relinfo = entry->edata->targetRelInfo;
+	EState	   *estate = entry->edata->estate;
+
+	ExecCloseIndices(relinfo);
+	EvalPlanQualEnd(&entry->epqstate);
+
+	/* Matches the reference taken in apply_exec_begin(). */
+	if (OidIsValid(entry->reloid))
+		RelationDecrementReferenceCount(relinfo->ri_RelationDesc);
 
 	/*
-	 * Cleanup.  It might seem that we should call ExecCloseResultRelations()
-	 * here, but we intentionally don't.  It would close the rel we added to
-	 * es_opened_result_relations above, which is wrong because we took no
-	 * corresponding refcount.  We rely on ExecCleanupTupleRouting() to close
-	 * any other relations opened during execution.
+	 * It might seem that we should call ExecCloseResultRelations() here, but
+	 * we intentionally don't.  It would close the rel we added to
+	 * es_opened_result_relations in create_edata_for_relation(), which is
+	 * wrong because we took no corresponding refcount.
 	 */
 	ExecResetTupleTable(estate->es_tupleTable, false);
 	FreeExecutorState(estate);
-	pfree(edata);
+	if (entry->edata->fullhash != NULL)
+		MemoryContextDelete(entry->edata->fullhash->cxt);
+	pfree(entry->edata);
+	entry->edata = NULL;
+}
+
+/*
+ * Release all executor states cached in the current transaction.
+ */
+static void
+apply_exec_cache_release(bool isCommit)
+{
+	HASH_SEQ_STATUS status;
+	ApplyExecCacheEntry *entry;
+	ResourceOwner oldowner = CurrentResourceOwner;
+
+	if (!ApplyExecCacheUsed)
+		return;
+
+	/* See apply_exec_begin() */
+	if (isCommit)
+		CurrentResourceOwner = TopTransactionResourceOwner;
+
+	hash_seq_init(&status, ApplyExecCache);
+	while ((entry = (ApplyExecCacheEntry *) hash_seq_search(&status)) != NULL)
+	{
+		/*
+		 * On abort, the resource owner already released the relations and
+		 * the memory goes away with the transaction.
+		 */
+		if (isCommit && entry->edata != NULL)
+			apply_exec_release(entry);
+
+		hash_search(ApplyExecCache, &entry->reloid, HASH_REMOVE, NULL);
+	}
+
+	CurrentResourceOwner = oldowner;
+	ApplyExecCacheUsed = false;
+}
+
+static void
+apply_exec_cache_xact_cb(XactEvent event, void *arg)
+{
+	switch (event)
+	{
+		case XACT_EVENT_PRE_COMMIT:
+			apply_exec_cache_release(true);
+			break;
+		case XACT_EVENT_ABORT:
+			apply_exec_cache_release(false);
+			break;
+		default:
+			break;
+	}
+}
+
+/*
+ * Get the executor state for applying a row change to the relation.
+ *
+ * The state comes from ApplyExecCache unless we are in exception handling
+ * mode, where changes run in subtransactions and anything they open is
+ * released with them. The subtransactions of coalesced remote transactions
+ * are only rolled back along with the whole transaction, so they use the
+ * cache too; what it holds belongs to the top transaction's resource owner.
+ */
+static ApplyExecCacheEntry *
+apply_exec_begin(SpockRelation *rel)
+{
+	ApplyExecCacheEntry *entry;
+	MemoryContext oldctx;
+	ResourceOwner oldowner;
+	Oid			reloid = RelationGetRelid(rel->rel);
+	bool		found;
+
+	if (MyApplyWorker->use_try_block ||
+		(GetCurrentTransactionNestLevel() > 1 &&
+		 !spock_apply_in_coalesced_subxact()))
+	{
+		entry = palloc0(sizeof(ApplyExecCacheEntry));
+		entry->reloid = InvalidOid;
+		apply_exec_setup(entry, rel);
+		AfterTriggerBeginQuery();
+		return entry;
+	}
+
+	if (ApplyExecCache == NULL)
+	{
+		HASHCTL		ctl;
+
+		MemSet(&ctl, 0, sizeof(ctl));
+		ctl.keysize = sizeof(Oid);
+		ctl.entrysize = sizeof(ApplyExecCacheEntry);
+		ctl.hcxt = TopMemoryContext;
+		ApplyExecCache = hash_create("spock apply executor state cache", 32,
+									 &ctl, HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+		RegisterXactCallback(apply_exec_cache_xact_cb, NULL);
+	}
+
+	oldowner = CurrentResourceOwner;
+	CurrentResourceOwner = TopTransactionResourceOwner;
+
+	entry = hash_search(ApplyExecCache, &reloid, HASH_ENTER, &found);
+	if (found && !entry->valid)
+	{
+		/* Relation changed, rebuild the state. */
+		apply_exec_release(entry);
+		found = false;
+	}
+
+	if (!found)
+	{
+		oldctx = MemoryContextSwitchTo(TopTransactionContext);
+
+		/*
+		 * Keep our own reference, the caller closes the relation after each
+		 * change.
+		 */
+		RelationIncrementReferenceCount(rel->rel);
+		apply_exec_setup(entry, rel);
+		entry->edata->fullhash_allowed = true;
+		ApplyExecCacheUsed = true;
+
+		MemoryContextSwitchTo(oldctx);
+	}
+	else
+	{
+		entry->edata->targetRel = rel;
+		entry->edata->estate->es_output_cid = GetCurrentCommandId(true);
+	}
+
+	CurrentResourceOwner = oldowner;
+
+	/* Prepare to catch AFTER triggers. */
+	AfterTriggerBeginQuery();
+
+	return entry;
+}
+
+/*
+ * Drop the slots used to look up local tuples since apply_exec_setup().
+ */
+static void
+apply_exec_drop_slots(ApplyExecCacheEntry *entry)
+{
+	EState	   *estate = entry->edata->estate;
+
+	while (list_length(estate->es_tupleTable) > entry->ntupleslots)
+	{
+		TupleTableSlot *slot = (TupleTableSlot *) llast(estate->es_tupleTable);
+
+		estate->es_tupleTable = list_delete_last(estate->es_tupleTable);
+		ExecDropSingleTupleTableSlot(slot);
+	}
+}
+
+/*
+ * Finish applying a row change started with apply_exec_begin().
+ */
+static void
+apply_exec_end(ApplyExecCacheEntry *entry)
+{
+	EState	   *estate = entry->edata->estate;
+
+	/* Handle queued AFTER triggers. */
+	AfterTriggerEndQuery(estate);
+
+	if (!OidIsValid(entry->reloid))
+	{
+		apply_exec_release(entry);
+		pfree(entry);
+		return;
+	}
+
+	apply_exec_drop_slots(entry);
+
+	ExecClearTuple(entry->remoteslot);
+	ResetPerTupleExprContext(estate);
+}
+
+/*
+ * Relcache invalidation: rebuild the cached executor state of the relation
+ * on next use. InvalidOid means all relations.
+ */
+void
+spock_apply_heap_invalidate(Oid reloid)
+{
+	HASH_SEQ_STATUS status;
+	ApplyExecCacheEntry *entry;
+
+	if (!ApplyExecCacheUsed)
+		return;
+
+	if (OidIsValid(reloid))
+	{
+		entry = hash_search(ApplyExecCache, &reloid, HASH_FIND, NULL);
+		if (entry != NULL)
+			entry->valid = false;
+		return;
+	}
+
+	hash_seq_init(&status, ApplyExecCache);
+	while ((entry = (ApplyExecCacheEntry *) hash_seq_search(&status)) != NULL)
+		entry->valid = false;
+}
+
+/*
+ * Release the cached executor states before running utility commands in
+ * the current transaction, they refuse to touch relations still in use.
+ */
+void
+spock_apply_heap_release_cache(void)
+{
+	apply_exec_cache_release(true);
 }
 
 /*
@@ -390,6 +724,294 @@ slot_modify_data(TupleTableSlot *slot, TupleTableSlot *srcslot,
 	ExecStoreVirtualTuple(slot);
 }
 
+/*
+ * Hash the columns of the tuple which have a hash function.
+ */
+static uint32
+full_identity_hash_slot(FullIdentityHash *fh, TupleTableSlot *slot)
+{
+	TupleDesc	desc = slot->tts_tupleDescriptor;
+	MemoryContext oldctx;
+	uint32		hash = 0;
+	int			i;
+
+	slot_getallattrs(slot);
+
+	oldctx = MemoryContextSwitchTo(fh->tmpcxt);
+	for (i = 0; i < desc->natts; i++)
+	{
+		uint32		colhash = 0;
+
+		if (fh->hashprocs[i] == NULL)
+			continue;
+
+		if (!slot->tts_isnull[i])
+			colhash = DatumGetUInt32(FunctionCall1Coll(fh->hashprocs[i],
+													   TupleDescAttr(desc, i)->attcollation,
+													   slot->tts_values[i]));
+		hash = hash_combine(hash, colhash);
+	}
+	MemoryContextSwitchTo(oldctx);
+	MemoryContextReset(fh->tmpcxt);
+
+	return hash;
+}
+
+/*
+ * Remember the row version at tid.
+ */
+static void
+full_identity_hash_add(FullIdentityHash *fh, TupleTableSlot *slot,
+					   ItemPointer tid)
+{
+	uint32		hash = full_identity_hash_slot(fh, slot);
+	FullIdentityHashEntry *entry;
+	bool		found;
+
+	entry = hash_search(fh->tids, &hash, HASH_ENTER, &found);
+	if (!found)
+	{
+		entry->tid = *tid;
+		entry->moretids = NIL;
+	}
+	else
+	{
+		MemoryContext oldctx = MemoryContextSwitchTo(fh->cxt);
+		ItemPointer moretid = palloc(sizeof(ItemPointerData));
+
+		*moretid = *tid;
+		entry->moretids = lappend(entry->moretids, moretid);
+		MemoryContextSwitchTo(oldctx);
+	}
+}
+
+/*
+ * Forget the n-th row of the entry, 0 being entry->tid.
+ */
+static void
+full_identity_hash_forget(FullIdentityHash *fh, FullIdentityHashEntry *entry,
+						  int n)
+{
+	if (n > 0)
+		entry->moretids = list_delete_nth_cell(entry->moretids, n - 1);
+	else if (entry->moretids != NIL)
+	{
+		entry->tid = *(ItemPointer) linitial(entry->moretids);
+		entry->moretids = list_delete_first(entry->moretids);
+	}
+	else
+		hash_search(fh->tids, &entry->hash, HASH_REMOVE, NULL);
+}
+
+/*
+ * Hash all rows of the relation visible now.
+ *
+ * Returns NULL if that takes more than spock.replica_identity_full_hash_mem.
+ */
+static FullIdentityHash *
+full_identity_hash_build(Relation localrel)
+{
+	TupleDesc	desc = RelationGetDescr(localrel);
+	Size		limit = (Size) spock_replica_identity_full_hash_mem * 1024;
+	FullIdentityHash *fh;
+	MemoryContext cxt;
+	MemoryContext oldctx;
+	HASHCTL		ctl;
+	Snapshot	snapshot;
+	TableScanDesc scan;
+	TupleTableSlot *slot;
+	uint64		ntuples = 0;
+	bool		toolarge = false;
+	int			i;
+
+	cxt = AllocSetContextCreate(TopTransactionContext,
+								"spock replica identity full hash",
+								ALLOCSET_DEFAULT_SIZES);
+	oldctx = MemoryContextSwitchTo(cxt);
+
+	fh = palloc0(sizeof(FullIdentityHash));
+	fh->cxt = cxt;
+	fh->tmpcxt = AllocSetContextCreate(cxt,
+									   "spock replica identity full hash tuple",
+									   ALLOCSET_SMALL_SIZES);
+	fh->hashprocs = palloc0(Max(desc->natts, 1) * sizeof(FmgrInfo *));
+	for (i = 0; i < desc->natts; i++)
+	{
+		Form_pg_attribute att = TupleDescAttr(desc, i);
+		TypeCacheEntry *typentry;
+
+		/* Not compared by spock_tuples_equal() either */
+		if (att->attisdropped || att->attgenerated)
+			continue;
+
+		typentry = lookup_type_cache(att->atttypid, TYPECACHE_HASH_PROC_FINFO);
+		if (OidIsValid(typentry->hash_proc_finfo.fn_oid))
+			fh->hashprocs[i] = &typentry->hash_proc_finfo;
+	}
+
+	MemSet(&ctl, 0, sizeof(ctl));
+	ctl.keysize = sizeof(uint32);
+	ctl.entrysize = sizeof(FullIdentityHashEntry);
+	ctl.hcxt = cxt;
+	fh->tids = hash_create("spock replica identity full rows", 1024, &ctl,
+						   HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+	MemoryContextSwitchTo(oldctx);
+
+	slot = table_slot_create(localrel, NULL);
+	snapshot = RegisterSnapshot(GetLatestSnapshot());
+	scan = table_beginscan(localrel, snapshot, 0, NULL);
+
+	while (table_scan_getnextslot(scan, ForwardScanDirection, slot))
+	{
+		CHECK_FOR_INTERRUPTS();
+
+		full_identity_hash_add(fh, slot, &slot->tts_tid);
+
+		if (++ntuples % 1024 == 0 &&
+			MemoryContextMemAllocated(cxt, true) > limit)
+		{
+			toolarge = true;
+			break;
+		}
+	}
+
+	table_endscan(scan);
+	UnregisterSnapshot(snapshot);
+	ExecDropSingleTupleTableSlot(slot);
+
+	if (toolarge)
+	{
+		elog(DEBUG1, "SPOCK: rows of relation \"%s\" don't fit in spock.replica_identity_full_hash_mem",
+			 RelationGetRelationName(localrel));
+		MemoryContextDelete(cxt);
+		return NULL;
+	}
+
+	return fh;
+}
+
+/*
+ * Look up the REPLICA IDENTITY FULL tuple in the hash of the relation's rows,
+ * building it first if the transaction searches the relation for the second
+ * time.
+ *
+ * The hash isn't kept exact: row versions found gone are dropped from it, the
+ * ones written by the transaction itself are added, and any others are left
+ * to the caller's sequential search on a miss.
+ */
+static bool
+full_identity_hash_lookup(ApplyExecutionData *edata, Relation localrel,
+						  TupleTableSlot *remoteslot,
+						  TupleTableSlot *localslot)
+{
+	FullIdentityHash *fh;
+	FullIdentityHashEntry *entry;
+	uint32		hash;
+	int			n;
+	bool		found = false;
+
+	if (edata->fullhash == NULL)
+	{
+		if (!edata->fullhash_allowed ||
+			spock_replica_identity_full_hash_mem <= 0 ||
+			++edata->fullhash_seqscans < 2)
+			return false;
+
+		edata->fullhash = full_identity_hash_build(localrel);
+		if (edata->fullhash == NULL)
+		{
+			/* Too large, don't try again in this transaction. */
+			edata->fullhash_allowed = false;
+			return false;
+		}
+	}
+
+	fh = edata->fullhash;
+	hash = full_identity_hash_slot(fh, remoteslot);
+	entry = hash_search(fh->tids, &hash, HASH_FIND, NULL);
+	if (entry == NULL)
+		return false;
+
+	PushActiveSnapshot(GetLatestSnapshot());
+
+	n = 0;
+	while (n <= list_length(entry->moretids))
+	{
+		ItemPointerData tid;
+
+		tid = (n == 0) ? entry->tid :
+			*(ItemPointer) list_nth(entry->moretids, n - 1);
+
+		if (!table_tuple_fetch_row_version(localrel, &tid, GetActiveSnapshot(),
+										   localslot))
+		{
+			/* Deleted or updated since, the version is of no use anymore. */
+			bool		last = (n == 0 && entry->moretids == NIL);
+
+			full_identity_hash_forget(fh, entry, n);
+			if (last)
+				break;
+			continue;
+		}
+
+		if (spock_tuples_equal(localslot, remoteslot))
+		{
+			TM_FailureData tmfd;
+
+			found = table_tuple_lock(localrel, &tid, GetActiveSnapshot(),
+									 localslot,
+									 GetCurrentCommandId(false),
+									 LockTupleExclusive,
+									 LockWaitBlock,
+									 0 /* don't follow updates */ ,
+									 &tmfd) == TM_Ok;
+
+			/* The caller is going to update or delete it. */
+			full_identity_hash_forget(fh, entry, n);
+			break;
+		}
+
+		n++;
+	}
+
+	PopActiveSnapshot();
+
+	return found;
+}
+
+/*
+ * Is any of the plain key columns of the index NULL in the tuple?
+ */
+static bool
+full_identity_key_has_nulls(Relation idxrel, TupleTableSlot *slot)
+{
+	int2vector *indkey = &idxrel->rd_index->indkey;
+	int			i;
+
+	slot_getallattrs(slot);
+
+	for (i = 0; i < IndexRelationGetNumberOfKeyAttributes(idxrel); i++)
+	{
+		AttrNumber	attno = indkey->values[i];
+
+		if (AttributeNumberIsValid(attno) && slot->tts_isnull[attno - 1])
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Add a row version the transaction wrote to the hash of the relation's rows.
+ */
+static void
+full_identity_hash_note(ApplyExecutionData *edata, TupleTableSlot *slot)
+{
+	if (edata->fullhash != NULL && ItemPointerIsValid(&slot->tts_tid))
+		full_identity_hash_add(edata->fullhash, slot, &slot->tts_tid);
+}
+
 /*
  * Try to find a tuple received from the publication side (in 'remoteslot') in
  * the corresponding local relation using either replica identity index,
@@ -428,16 +1050,43 @@ FindReplTupleInLocalRel(ApplyExecutionData *edata, Relation localrel,
 	else
 	{
 		/*
-		 * If we don't have a replica identity index, we must use the
-		 * RelationFindReplTupleSeq() function to find the tuple. However, for
-		 * INSERT statements, if there is no PK or RI, we do not need to find
-		 * the tuple using sequential scan.
+		 * If we don't have a replica identity index, the whole old tuple was
+		 * sent. Narrow down the candidates with any index on its columns, or
+		 * the hash of the relation's rows, before resorting to the
+		 * RelationFindReplTupleSeq() function. However, for INSERT
+		 * statements, if there is no PK or RI, we do not need to find the
+		 * tuple at all.
 		 */
-		if (!is_insert_stmt)
+		if (is_insert_stmt)
+			return false;
+
+		if (OidIsValid(edata->targetRel->fullidxoid))
 		{
+			Relation	idxrel = index_open(edata->targetRel->fullidxoid,
+											RowExclusiveLock);
+
+			/* Hash indexes can't be searched for NULLs. */
+			if (idxrel->rd_rel->relam == BTREE_AM_OID ||
+				!full_identity_key_has_nulls(idxrel, remoteslot))
+			{
+				found = SpockRelationFindReplTupleByFullIndex(estate, localrel,
+															  idxrel,
+															  LockTupleExclusive,
+															  remoteslot,
+															  *localslot);
+				/* Don't release lock until commit. */
+				index_close(idxrel, NoLock);
+				return found;
+			}
+
+			index_close(idxrel, NoLock);
+		}
+
+		found = full_identity_hash_lookup(edata, localrel, remoteslot,
+										  *localslot);
+		if (!found)
 			found = RelationFindReplTupleSeq(localrel, LockTupleExclusive,
 											 remoteslot, *localslot);
-		}
 	}
 
 	return found;
@@ -449,6 +1098,10 @@ FindReplTupleInLocalRel(ApplyExecutionData *edata, Relation localrel,
  *
  * This is a fallback mechanism when PK/RI indexes do not match. The caller must
  * ensure this function is only called in that context.
+ *
+ * The indexes and their scan keys come from the relation cache and the
+ * indexes themselves are the ones opened for the executor state, so a probe
+ * costs no more than the index scan.
  */
 static bool
 FindReplTupleByUCIndex(ApplyExecutionData *edata,
@@ -457,49 +1110,83 @@ FindReplTupleByUCIndex(ApplyExecutionData *edata,
 					   TupleTableSlot **localslot,
 					   Oid *indexoid)
 {
-	List	   *indexoidlist = NIL;
-	ListCell   *lc;
+	ResultRelInfo *relinfo = edata->targetRelInfo;
+	SpockUCIndex *ucindexes;
+	int			nucindexes;
+	int			i;
 	bool		found = false;
 
 	if (!check_all_uc_indexes)
 		elog(ERROR, "spock.check_all_uc_indexes must be enabled to call this function");
 
 	*indexoid = InvalidOid;
-	/* Get the list of index OIDs for the table from the relcache. */
-	indexoidlist = RelationGetIndexList(localrel);
+	ucindexes = spock_relation_get_uc_indexes(edata->targetRel, &nucindexes);
 
-	foreach(lc, indexoidlist)
+	for (i = 0; i < nucindexes; i++)
 	{
-		Relation	idxrel;
-
-		*indexoid = lfirst_oid(lc);
+		SpockUCIndex *uc = &ucindexes[i];
+		Relation	idxrel = NULL;
+		int			j;
 
-		/* Open the index. */
-		idxrel = index_open(*indexoid, RowExclusiveLock);
+		*indexoid = uc->indexoid;
 
-		if (!IsIndexUsableForInsertConflict(idxrel))
+		for (j = 0; j < relinfo->ri_NumIndices; j++)
 		{
-			index_close(idxrel, RowExclusiveLock);
-			continue;
+			if (RelationGetRelid(relinfo->ri_IndexRelationDescs[j]) == uc->indexoid)
+			{
+				idxrel = relinfo->ri_IndexRelationDescs[j];
+				break;
+			}
 		}
 
-		found = SpockRelationFindReplTupleByIndex(edata->estate, localrel, idxrel,
-												  LockTupleExclusive,
-												  remoteslot, *localslot);
+		/* Opened by ExecOpenIndices() in apply_exec_setup() */
+		if (idxrel == NULL)
+			elog(ERROR, "index %u of relation \"%s\" is not open",
+				 uc->indexoid, RelationGetRelationName(localrel));
+
+		found = SpockRelationFindReplTupleByIndexKey(edata->estate, localrel,
+													 idxrel, uc->skey,
+													 uc->nkeys,
+													 LockTupleExclusive,
+													 remoteslot, *localslot);
 		if (found)
-		{
-			/* Don't release lock until commit. */
-			index_close(idxrel, NoLock);
 			break;
-		}
-		index_close(idxrel, RowExclusiveLock);
 	}
 
-	list_free(indexoidlist);
-
 	return found;
 }
 
+/*
+ * Lock the local tuple found by the batched lookup of
+ * spock_apply_heap_batch_finish().
+ *
+ * Returns false if the tuple was changed since, including by an earlier
+ * change of the same batch. The caller looks it up again then.
+ */
+static bool
+FindReplTupleByTid(ApplyExecutionData *edata, Relation localrel,
+				   ItemPointer tid, TupleTableSlot **localslot)
+{
+	TM_FailureData tmfd;
+	TM_Result	res;
+
+	*localslot = table_slot_create(localrel, &edata->estate->es_tupleTable);
+
+	PushActiveSnapshot(GetLatestSnapshot());
+
+	res = table_tuple_lock(localrel, tid, GetActiveSnapshot(),
+						   *localslot,
+						   GetCurrentCommandId(false),
+						   LockTupleExclusive,
+						   LockWaitBlock,
+						   0 /* don't follow updates */ ,
+						   &tmfd);
+
+	PopActiveSnapshot();
+
+	return res == TM_Ok;
+}
+
 void
 spock_apply_heap_begin(void)
 {
@@ -594,15 +1281,16 @@ build_delta_tuple(SpockRelation *rel, SpockTupleData *oldtup,
 	bool		loc_isnull;
 
 	Assert(rel->natts <= tupdesc->natts);
-	memset(deltatup->values, 0, tupdesc->natts * sizeof(Datum));
-	memset(deltatup->nulls, 1, tupdesc->natts * sizeof(bool));
+	spock_tuple_data_init(deltatup, tupdesc->natts);
 
 	for (attidx = 0; attidx < rel->natts; attidx++)
 	{
 		int			remoteattnum = rel->attmap[attidx];
 
 		Assert(remoteattnum < tupdesc->natts);
-		if (rel->delta_apply_functions[remoteattnum] == InvalidOid)
+		/* Not a delta column, or sent as unchanged: keep the current value */
+		if (rel->delta_apply_functions[remoteattnum] == InvalidOid ||
+			!newtup->changed[remoteattnum])
 		{
 			deltatup->values[remoteattnum] = 0xdeadbeef;
 			deltatup->nulls[remoteattnum] = true;
@@ -697,7 +1385,8 @@ spock_handle_conflict_and_apply(SpockRelation *rel, EState *estate,
 								SpockTupleData *oldtup, SpockTupleData *newtup,
 								ResultRelInfo *relinfo, EPQState *epqstate,
 								Oid idxused,
-								bool is_insert)
+								bool is_insert,
+								ApplyExecutionData *edata)
 {
 	TransactionId xmin;
 	TimestampTz local_ts;
@@ -818,6 +1507,7 @@ spock_handle_conflict_and_apply(SpockRelation *rel, EState *estate,
 		EvalPlanQualSetSlot(epqstate, remoteslot);
 		ExecSimpleRelationUpdate(relinfo, estate, epqstate,
 								 localslot, remoteslot);
+		full_identity_hash_note(edata, remoteslot);
 
 		if (is_delta_apply)
 		{
@@ -864,6 +1554,8 @@ zero_datum_for_type(Oid typid)
 static void
 init_tuple_with_defaults(SpockTupleData *oldtup, TupleDesc tupdesc)
 {
+	spock_tuple_data_init(oldtup, tupdesc->natts);
+
 	for (int i = 0; i < tupdesc->natts; i++)
 	{
 		Form_pg_attribute att = TupleDescAttr(tupdesc, i);
@@ -883,24 +1575,25 @@ init_tuple_with_defaults(SpockTupleData *oldtup, TupleDesc tupdesc)
 void
 spock_apply_heap_insert(SpockRelation *rel, SpockTupleData *newtup)
 {
+	ApplyExecCacheEntry *aes;
 	ApplyExecutionData *edata;
 	EState	   *estate;
 	TupleTableSlot *remoteslot;
 	MemoryContext oldctx;
 	UserContext ucxt;
 
-	EPQState	epqstate;
+	EPQState   *epqstate;
 	TupleTableSlot *localslot;
 	ResultRelInfo *relinfo;
 	bool		found;
 	Oid			idxused;
 
-	/* Initialize the executor state. */
-	edata = create_edata_for_relation(rel);
+	/* Get the executor state. */
+	aes = apply_exec_begin(rel);
+	edata = aes->edata;
 	estate = edata->estate;
-	remoteslot = ExecInitExtraTupleSlot(estate,
-										RelationGetDescr(rel->rel),
-										&TTSOpsVirtual);
+	remoteslot = aes->remoteslot;
+	epqstate = &aes->epqstate;
 
 	/* update stats */
 	handle_stats_counter(rel->rel, MyApplyWorker->subid,
@@ -912,8 +1605,6 @@ spock_apply_heap_insert(SpockRelation *rel, SpockTupleData *newtup)
 	slot_fill_defaults(rel, estate, remoteslot);
 	MemoryContextSwitchTo(oldctx);
 
-	EvalPlanQualInit(&epqstate, estate, NULL, NIL, -1, NIL);
-	ExecOpenIndices(edata->targetRelInfo, false);
 	relinfo = edata->targetRelInfo;
 	idxused = edata->targetRel->idxoid;
 
@@ -950,8 +1641,8 @@ spock_apply_heap_insert(SpockRelation *rel, SpockTupleData *newtup)
 		 */
 		init_tuple_with_defaults(&oldtup, RelationGetDescr(rel->rel));
 		spock_handle_conflict_and_apply(rel, estate, localslot, remoteslot,
-										&oldtup, newtup, relinfo, &epqstate,
-										idxused, true);
+										&oldtup, newtup, relinfo, epqstate,
+										idxused, true, edata);
 	}
 	else
 	{
@@ -967,26 +1658,28 @@ spock_apply_heap_insert(SpockRelation *rel, SpockTupleData *newtup)
 		SwitchToUntrustedUser(rel->rel->rd_rel->relowner, &ucxt);
 		/* Do the actual INSERT */
 		ExecSimpleRelationInsert(edata->targetRelInfo, estate, remoteslot);
+		full_identity_hash_note(edata, remoteslot);
 		/* Switch back to the original user */
 		RestoreUserContext(&ucxt);
 	}
 
 	/* Cleanup */
-	ExecCloseIndices(edata->targetRelInfo);
-	EvalPlanQualEnd(&epqstate);
-	finish_edata(edata);
+	apply_exec_end(aes);
 }
 
 /*
  * Handle update via low level api.
- */
-void
-spock_apply_heap_update(SpockRelation *rel, SpockTupleData *oldtup,
-						SpockTupleData *newtup)
+ *
+ * tid, if valid, is where a batched lookup found the local tuple.
+ */
+static void
+apply_heap_update(SpockRelation *rel, SpockTupleData *oldtup,
+				  SpockTupleData *newtup, ItemPointer tid)
 {
+	ApplyExecCacheEntry *aes;
 	ApplyExecutionData *edata;
 	EState	   *estate;
-	EPQState	epqstate;
+	EPQState   *epqstate;
 	TupleTableSlot *remoteslot;
 	TupleTableSlot *localslot;
 	MemoryContext oldctx;
@@ -995,12 +1688,12 @@ spock_apply_heap_update(SpockRelation *rel, SpockTupleData *oldtup,
 	int			retry;
 	Oid			idxused;
 
-	/* Initialize the executor state. */
-	edata = create_edata_for_relation(rel);
+	/* Get the executor state. */
+	aes = apply_exec_begin(rel);
+	edata = aes->edata;
 	estate = edata->estate;
-	remoteslot = ExecInitExtraTupleSlot(estate,
-										RelationGetDescr(rel->rel),
-										&TTSOpsVirtual);
+	remoteslot = aes->remoteslot;
+	epqstate = &aes->epqstate;
 
 	/* update stats */
 	handle_stats_counter(rel->rel, MyApplyWorker->subid,
@@ -1020,14 +1713,14 @@ spock_apply_heap_update(SpockRelation *rel, SpockTupleData *oldtup,
 	MemoryContextSwitchTo(oldctx);
 
 	/* Find the current local tuple */
-	EvalPlanQualInit(&epqstate, estate, NULL, NIL, -1, NIL);
-	ExecOpenIndices(edata->targetRelInfo, false);
-
 	relinfo = edata->targetRelInfo;
 	idxused = edata->targetRel->idxoid;
 
+	found = ItemPointerIsValid(tid) &&
+		FindReplTupleByTid(edata, relinfo->ri_RelationDesc, tid, &localslot);
+
 	retry = 0;
-	while (retry < 5)
+	while (!found && retry < 5)
 	{
 		found = FindReplTupleInLocalRel(edata, relinfo->ri_RelationDesc,
 										edata->targetRel->idxoid,
@@ -1059,8 +1752,8 @@ spock_apply_heap_update(SpockRelation *rel, SpockTupleData *oldtup,
 	if (found)
 	{
 		spock_handle_conflict_and_apply(rel, estate, localslot, remoteslot,
-										oldtup, newtup, relinfo, &epqstate,
-										idxused, false);
+										oldtup, newtup, relinfo, epqstate,
+										idxused, false, edata);
 	}
 	else
 	{
@@ -1079,21 +1772,31 @@ spock_apply_heap_update(SpockRelation *rel, SpockTupleData *oldtup,
 	}
 
 	/* Cleanup. */
-	ExecCloseIndices(edata->targetRelInfo);
-	EvalPlanQualEnd(&epqstate);
-	finish_edata(edata);
+	apply_exec_end(aes);
 }
 
+void
+spock_apply_heap_update(SpockRelation *rel, SpockTupleData *oldtup,
+						SpockTupleData *newtup)
+{
+	ItemPointerData tid;
+
+	ItemPointerSetInvalid(&tid);
+	apply_heap_update(rel, oldtup, newtup, &tid);
+}
 
 /*
  * Handle delete via low level api.
+ *
+ * tid, if valid, is where a batched lookup found the local tuple.
  */
-void
-spock_apply_heap_delete(SpockRelation *rel, SpockTupleData *oldtup)
+static void
+apply_heap_delete(SpockRelation *rel, SpockTupleData *oldtup, ItemPointer tid)
 {
+	ApplyExecCacheEntry *aes;
 	ApplyExecutionData *edata;
 	EState	   *estate;
-	EPQState	epqstate;
+	EPQState   *epqstate;
 	TupleTableSlot *remoteslot;
 	TupleTableSlot *localslot;
 	MemoryContext oldctx;
@@ -1103,12 +1806,12 @@ spock_apply_heap_delete(SpockRelation *rel, SpockTupleData *oldtup)
 	bool		clear_localslot = false;
 	int			retry;
 
-	/* Initialize the executor state. */
-	edata = create_edata_for_relation(rel);
+	/* Get the executor state. */
+	aes = apply_exec_begin(rel);
+	edata = aes->edata;
 	estate = edata->estate;
-	remoteslot = ExecInitExtraTupleSlot(estate,
-										RelationGetDescr(rel->rel),
-										&TTSOpsVirtual);
+	remoteslot = aes->remoteslot;
+	epqstate = &aes->epqstate;
 
 	/* update stats */
 	handle_stats_counter(rel->rel, MyApplyWorker->subid,
@@ -1128,13 +1831,13 @@ spock_apply_heap_delete(SpockRelation *rel, SpockTupleData *oldtup)
 	MemoryContextSwitchTo(oldctx);
 
 	/* Find the current local tuple */
-	EvalPlanQualInit(&epqstate, estate, NULL, NIL, -1, NIL);
-	ExecOpenIndices(edata->targetRelInfo, false);
-
 	relinfo = edata->targetRelInfo;
 
+	found = ItemPointerIsValid(tid) &&
+		FindReplTupleByTid(edata, relinfo->ri_RelationDesc, tid, &localslot);
+
 	retry = 0;
-	while (retry < 5)
+	while (!found && retry < 5)
 	{
 		found = FindReplTupleInLocalRel(edata, relinfo->ri_RelationDesc,
 										edata->targetRel->idxoid,
@@ -1213,8 +1916,8 @@ spock_apply_heap_delete(SpockRelation *rel, SpockTupleData *oldtup)
 			SwitchToUntrustedUser(rel->rel->rd_rel->relowner, &ucxt);
 
 			/* Delete the tuple found */
-			EvalPlanQualSetSlot(&epqstate, remoteslot);
-			ExecSimpleRelationDelete(edata->targetRelInfo, estate, &epqstate,
+			EvalPlanQualSetSlot(epqstate, remoteslot);
+			ExecSimpleRelationDelete(edata->targetRelInfo, estate, epqstate,
 									 localslot);
 			RestoreUserContext(&ucxt);
 		}
@@ -1240,16 +1943,34 @@ spock_apply_heap_delete(SpockRelation *rel, SpockTupleData *oldtup)
 	}
 
 	/* Cleanup. */
-	ExecCloseIndices(edata->targetRelInfo);
-	EvalPlanQualEnd(&epqstate);
-	finish_edata(edata);
+	apply_exec_end(aes);
+}
+
+void
+spock_apply_heap_delete(SpockRelation *rel, SpockTupleData *oldtup)
+{
+	ItemPointerData tid;
+
+	ItemPointerSetInvalid(&tid);
+	apply_heap_delete(rel, oldtup, &tid);
 }
 
 bool
 spock_apply_heap_can_mi(SpockRelation *rel)
 {
-	/* Multi insert is only supported when conflicts result in errors. */
-	return spock_conflict_resolver == SPOCK_RESOLVE_ERROR;
+	TriggerDesc *trigdesc = rel->rel->trigdesc;
+
+	/* Conflicts error out when the buffered tuples are inserted. */
+	if (spock_conflict_resolver == SPOCK_RESOLVE_ERROR)
+		return true;
+
+	/*
+	 * Otherwise the tuples that already exist locally are resolved when the
+	 * batch is flushed, see spock_apply_heap_mi_probe(). BEFORE ROW INSERT
+	 * triggers would already have fired for them.
+	 */
+	return trigdesc == NULL ||
+		!(trigdesc->trig_insert_before_row || trigdesc->trig_insert_instead_row);
 }
 
 /*
@@ -1330,33 +2051,148 @@ spock_apply_heap_mi_start(SpockRelation *rel)
 	spkmistate->cid = GetCurrentCommandId(true);
 	spkmistate->bistate = GetBulkInsertState();
 
+	/* Rows can only be found by the replica identity or unique indexes. */
+	spkmistate->probe_conflicts =
+		spock_conflict_resolver != SPOCK_RESOLVE_ERROR &&
+		(OidIsValid(rel->idxoid) || check_all_uc_indexes);
+
 	/* Make the space for buffer. */
 	spkmistate->buffered_tuples = palloc0(spkmistate->maxbuffered_tuples * sizeof(TupleTableSlot *));
 	spkmistate->nbuffered_tuples = 0;
 
+	/*
+	 * The probe doesn't see the tuples buffered with it, so a key repeated
+	 * within the batch has to end it, see spock_apply_heap_mi_add_tuple().
+	 */
+	if (spkmistate->probe_conflicts && spkmistate->maxbuffered_tuples > 1)
+	{
+		int			i;
+
+		spkmistate->keyindexes = palloc(Max(resultRelInfo->ri_NumIndices, 1) *
+										sizeof(int));
+		for (i = 0; i < resultRelInfo->ri_NumIndices; i++)
+		{
+			Form_pg_index idx = resultRelInfo->ri_IndexRelationDescs[i]->rd_index;
+
+			if (idx->indisunique && idx->indimmediate)
+				spkmistate->keyindexes[spkmistate->nkeyindexes++] = i;
+		}
+
+		spkmistate->keyhashes = palloc(spkmistate->maxbuffered_tuples *
+									   Max(spkmistate->nkeyindexes, 1) *
+									   sizeof(uint32));
+		spkmistate->keyhashed = palloc(spkmistate->maxbuffered_tuples *
+									   Max(spkmistate->nkeyindexes, 1) *
+									   sizeof(bool));
+	}
+
 	MemoryContextSwitchTo(oldctx);
 }
 
-/* Write the buffered tuples. */
-static void
-spock_apply_heap_mi_flush(void)
+/*
+ * Hash the key of the tuple in the n-th unique index of the batch.
+ *
+ * Columns whose type's default hash function doesn't agree with the index's
+ * notion of equality are left out, which can only make more keys look alike.
+ * Returns false if the key contains NULLs which the index treats as
+ * distinct.
+ */
+static bool
+spock_apply_heap_mi_key_hash(int n, TupleTableSlot *slot, uint32 *hash)
 {
-	MemoryContext oldctx;
-	ResultRelInfo *resultRelInfo;
+	ResultRelInfo *relinfo = spkmistate->aestate->resultRelInfo;
+	EState	   *estate = spkmistate->aestate->estate;
+	int			pos = spkmistate->keyindexes[n];
+	Relation	idxrel = relinfo->ri_IndexRelationDescs[pos];
+	Datum		values[INDEX_MAX_KEYS];
+	bool		isnull[INDEX_MAX_KEYS];
+	int			nkeys = IndexRelationGetNumberOfKeyAttributes(idxrel);
 	int			i;
 
-	if (!spkmistate || spkmistate->nbuffered_tuples == 0)
-		return;
+	GetPerTupleExprContext(estate)->ecxt_scantuple = slot;
+	FormIndexDatum(relinfo->ri_IndexRelationInfo[pos], slot, estate,
+				   values, isnull);
 
-	/* update stats */
-	handle_stats_counter(spkmistate->rel->rel, MyApplyWorker->subid,
-						 SPOCK_STATS_INSERT_COUNT,
-						 spkmistate->nbuffered_tuples);
+	*hash = 0;
+	for (i = 0; i < nkeys; i++)
+	{
+		TypeCacheEntry *typentry;
+		uint32		colhash = 0;
+
+		if (isnull[i])
+		{
+			if (!idxrel->rd_index->indnullsnotdistinct)
+				return false;
+		}
+		else
+		{
+			typentry = lookup_type_cache(TupleDescAttr(RelationGetDescr(idxrel), i)->atttypid,
+										 TYPECACHE_BTREE_OPFAMILY |
+										 TYPECACHE_HASH_PROC_FINFO);
+			if (typentry->btree_opf == idxrel->rd_opfamily[i] &&
+				OidIsValid(typentry->hash_proc_finfo.fn_oid))
+				colhash = DatumGetUInt32(FunctionCall1Coll(&typentry->hash_proc_finfo,
+														   idxrel->rd_indcollation[i],
+														   values[i]));
+		}
+		*hash = hash_combine(*hash, colhash);
+	}
+
+	return true;
+}
+
+/*
+ * Does the tuple have the same key as a buffered one in any unique index?
+ *
+ * The hashes of its keys are stored for the next buffer position. Equal
+ * hashes are taken for equal keys, a collision only ends the batch early.
+ */
+static bool
+spock_apply_heap_mi_key_buffered(TupleTableSlot *slot)
+{
+	int			nkeyindexes = spkmistate->nkeyindexes;
+	uint32	   *hashes;
+	bool	   *hashed;
+	int			i;
+	int			j;
+
+	if (nkeyindexes == 0)
+		return false;
+
+	hashes = &spkmistate->keyhashes[spkmistate->nbuffered_tuples * nkeyindexes];
+	hashed = &spkmistate->keyhashed[spkmistate->nbuffered_tuples * nkeyindexes];
+
+	for (i = 0; i < nkeyindexes; i++)
+		hashed[i] = spock_apply_heap_mi_key_hash(i, slot, &hashes[i]);
+
+	for (j = 0; j < spkmistate->nbuffered_tuples; j++)
+	{
+		for (i = 0; i < nkeyindexes; i++)
+		{
+			if (hashed[i] && spkmistate->keyhashed[j * nkeyindexes + i] &&
+				hashes[i] == spkmistate->keyhashes[j * nkeyindexes + i])
+				return true;
+		}
+	}
+
+	return false;
+}
+
+/*
+ * Insert n buffered tuples starting with the first one.
+ */
+static void
+spock_apply_heap_mi_insert(int first, int n)
+{
+	TupleTableSlot **slots = &spkmistate->buffered_tuples[first];
+	ResultRelInfo *resultRelInfo;
+	MemoryContext oldctx;
+	int			i;
 
 	oldctx = MemoryContextSwitchTo(GetPerTupleMemoryContext(spkmistate->aestate->estate));
 	heap_multi_insert(spkmistate->rel->rel,
-					  spkmistate->buffered_tuples,
-					  spkmistate->nbuffered_tuples,
+					  slots,
+					  n,
 					  spkmistate->cid,
 					  0,		/* hi_options */
 					  spkmistate->bistate);
@@ -1370,14 +2206,14 @@ spock_apply_heap_mi_flush(void)
 	 */
 	if (resultRelInfo->ri_NumIndices > 0)
 	{
-		for (i = 0; i < spkmistate->nbuffered_tuples; i++)
+		for (i = 0; i < n; i++)
 		{
 			List	   *recheckIndexes = NIL;
 
 			recheckIndexes =
 				ExecInsertIndexTuples(
 									  resultRelInfo,
-									  spkmistate->buffered_tuples[i],
+									  slots[i],
 									  spkmistate->aestate->estate
 									  ,
 									  false
@@ -1389,7 +2225,7 @@ spock_apply_heap_mi_flush(void)
 #endif
 				);
 			SPKExecARInsertTriggers(spkmistate->aestate->estate, resultRelInfo,
-									spkmistate->buffered_tuples[i],
+									slots[i],
 									recheckIndexes);
 			list_free(recheckIndexes);
 		}
@@ -1402,13 +2238,115 @@ spock_apply_heap_mi_flush(void)
 	else if (resultRelInfo->ri_TrigDesc != NULL &&
 			 resultRelInfo->ri_TrigDesc->trig_insert_after_row)
 	{
-		for (i = 0; i < spkmistate->nbuffered_tuples; i++)
+		for (i = 0; i < n; i++)
 		{
 			SPKExecARInsertTriggers(spkmistate->aestate->estate, resultRelInfo,
-									spkmistate->buffered_tuples[i],
+									slots[i],
 									NIL);
 		}
 	}
+}
+
+/*
+ * Look up the buffered tuples in the local relation the same way
+ * spock_apply_heap_insert() does, one index descent per tuple. The ones that
+ * exist already go through conflict resolution, the others are inserted with
+ * heap_multi_insert(). The tuples buffered before a conflicting one are
+ * inserted before it is resolved, so the changes are made in the order the
+ * origin made them.
+ *
+ * No two buffered tuples have the same key in a unique index, see
+ * spock_apply_heap_mi_key_buffered(), so none of them can be found among the
+ * ones inserted before it.
+ */
+static void
+spock_apply_heap_mi_probe(void)
+{
+	SpockRelation *rel = spkmistate->rel;
+	ApplyExecCacheEntry *aes;
+	ApplyExecutionData *edata;
+	ResultRelInfo *relinfo;
+	TupleDesc	desc = RelationGetDescr(rel->rel);
+	SpockTupleData newtup;
+	int			first = 0;
+	int			i;
+
+	aes = apply_exec_begin(rel);
+	edata = aes->edata;
+	relinfo = edata->targetRelInfo;
+
+	/* All columns we got from the origin replace the local ones. */
+	newtup.natts = desc->natts;
+	newtup.changed = palloc(desc->natts * sizeof(bool));
+	memset(newtup.changed, true, desc->natts * sizeof(bool));
+
+	for (i = 0; i < spkmistate->nbuffered_tuples; i++)
+	{
+		TupleTableSlot *slot = spkmistate->buffered_tuples[i];
+		TupleTableSlot *localslot;
+		Oid			idxused = rel->idxoid;
+		bool		found;
+
+		found = FindReplTupleInLocalRel(edata, relinfo->ri_RelationDesc,
+										rel->idxoid, slot, &localslot, true);
+		if (!found && check_all_uc_indexes)
+			found = FindReplTupleByUCIndex(edata, relinfo->ri_RelationDesc,
+										   slot, &localslot, &idxused);
+
+		if (found)
+		{
+			SpockTupleData oldtup;
+
+			if (i > first)
+				spock_apply_heap_mi_insert(first, i - first);
+			first = i + 1;
+
+			slot_getallattrs(slot);
+			newtup.values = slot->tts_values;
+			newtup.nulls = slot->tts_isnull;
+			ExecCopySlot(aes->remoteslot, slot);
+
+			init_tuple_with_defaults(&oldtup, desc);
+			spock_handle_conflict_and_apply(rel, edata->estate, localslot,
+											aes->remoteslot, &oldtup, &newtup,
+											relinfo, &aes->epqstate,
+											idxused, true, edata);
+
+			/* Let the lookups of the next tuples see the change. */
+			CommandCounterIncrement();
+		}
+
+		apply_exec_drop_slots(aes);
+	}
+
+	apply_exec_end(aes);
+
+	if (spkmistate->nbuffered_tuples > first)
+		spock_apply_heap_mi_insert(first, spkmistate->nbuffered_tuples - first);
+}
+
+/* Write the buffered tuples. */
+static void
+spock_apply_heap_mi_flush(void)
+{
+	MemoryContext oldctx;
+
+	if (!spkmistate || spkmistate->nbuffered_tuples == 0)
+		return;
+
+	/* update stats */
+	handle_stats_counter(spkmistate->rel->rel, MyApplyWorker->subid,
+						 SPOCK_STATS_INSERT_COUNT,
+						 spkmistate->nbuffered_tuples);
+
+	if (spkmistate->probe_conflicts)
+	{
+		oldctx = MemoryContextSwitchTo(GetPerTupleMemoryContext(spkmistate->aestate->estate));
+		spock_apply_heap_mi_probe();
+		MemoryContextSwitchTo(oldctx);
+	}
+	else
+		spock_apply_heap_mi_insert(0, spkmistate->nbuffered_tuples);
 
 	spkmistate->nbuffered_tuples = 0;
 }
@@ -1470,6 +2408,21 @@ spock_apply_heap_mi_add_tuple(SpockRelation *rel,
 		ExecConstraints(aestate->resultRelInfo, slot,
 						aestate->estate);
 
+	/*
+	 * A tuple with the key of a buffered one has to find it in the table,
+	 * insert the batch first.
+	 */
+	if (spkmistate->probe_conflicts)
+	{
+		MemoryContextSwitchTo(GetPerTupleMemoryContext(aestate->estate));
+		if (spock_apply_heap_mi_key_buffered(slot))
+		{
+			spock_apply_heap_mi_flush();
+			(void) spock_apply_heap_mi_key_buffered(slot);
+		}
+		MemoryContextSwitchTo(TopTransactionContext);
+	}
+
 	if (spkmistate->buffered_tuples[spkmistate->nbuffered_tuples] == NULL)
 		spkmistate->buffered_tuples[spkmistate->nbuffered_tuples] = table_slot_create(rel->rel, NULL);
 	else
@@ -1498,7 +2451,295 @@ spock_apply_heap_mi_finish(SpockRelation *rel)
 			ExecDropSingleTupleTableSlot(spkmistate->buffered_tuples[i]);
 
 	pfree(spkmistate->buffered_tuples);
+	if (spkmistate->keyindexes)
+	{
+		pfree(spkmistate->keyindexes);
+		pfree(spkmistate->keyhashes);
+		pfree(spkmistate->keyhashed);
+	}
 	pfree(spkmistate);
 
 	spkmistate = NULL;
 }
+
+/*
+ * Can runs of UPDATE/DELETE changes to the relation be batched?
+ *
+ * The local tuples are looked up with one scan of the replica identity
+ * index, so it has to be a btree on a single column.
+ */
+bool
+spock_apply_heap_can_batch(SpockRelation *rel)
+{
+	Relation	idxrel;
+	bool		result;
+
+	if (!OidIsValid(rel->idxoid) ||
+		rel->rel->rd_rel->relkind != RELKIND_RELATION)
+		return false;
+
+	idxrel = index_open(rel->idxoid, RowExclusiveLock);
+	result = idxrel->rd_rel->relam == BTREE_AM_OID &&
+		IndexRelationGetNumberOfKeyAttributes(idxrel) == 1 &&
+		AttributeNumberIsValid(idxrel->rd_index->indkey.values[0]);
+	index_close(idxrel, NoLock);
+
+	return result;
+}
+
+/* Copy a tuple into the batch memory */
+static void
+batch_copy_tuple(SpockTupleData *dst, SpockTupleData *src, TupleDesc desc)
+{
+	int			i;
+
+	dst->natts = src->natts;
+	dst->values = palloc(src->natts * sizeof(Datum));
+	dst->nulls = palloc(src->natts * sizeof(bool));
+	dst->changed = palloc(src->natts * sizeof(bool));
+	memcpy(dst->values, src->values, src->natts * sizeof(Datum));
+	memcpy(dst->nulls, src->nulls, src->natts * sizeof(bool));
+	memcpy(dst->changed, src->changed, src->natts * sizeof(bool));
+
+	for (i = 0; i < src->natts; i++)
+	{
+		Form_pg_attribute att = TupleDescAttr(desc, i);
+
+		if (!src->nulls[i] && !att->attbyval)
+			dst->values[i] = datumCopy(src->values[i], false, att->attlen);
+	}
+}
+
+/*
+ * Queue an UPDATE (newtup set) or DELETE of the relation. It's applied by
+ * spock_apply_heap_batch_finish() with the rest of the run.
+ */
+void
+spock_apply_heap_batch_add(SpockRelation *rel, SpockTupleData *oldtup,
+						   SpockTupleData *newtup)
+{
+	ApplyBatchChange *change;
+	MemoryContext oldctx;
+	TupleDesc	desc = RelationGetDescr(rel->rel);
+
+	if (spkbatchstate == NULL)
+	{
+		spkbatchstate = MemoryContextAllocZero(TopMemoryContext,
+											   sizeof(ApplyBatchState));
+		spkbatchstate->cxt = AllocSetContextCreate(TopMemoryContext,
+												   "spock apply batch",
+												   ALLOCSET_DEFAULT_SIZES);
+		spkbatchstate->changes =
+			MemoryContextAlloc(TopMemoryContext,
+							   APPLY_BATCH_MAX_CHANGES * sizeof(ApplyBatchChange));
+	}
+
+	if (spkbatchstate->nchanges > 0 && spkbatchstate->rel != rel)
+		elog(ERROR, "SPOCK: batched changes of another relation pending");
+
+	if (spkbatchstate->nchanges >= APPLY_BATCH_MAX_CHANGES)
+		spock_apply_heap_batch_finish(rel);
+
+	spkbatchstate->rel = rel;
+	change = &spkbatchstate->changes[spkbatchstate->nchanges++];
+
+	oldctx = MemoryContextSwitchTo(spkbatchstate->cxt);
+	batch_copy_tuple(&change->oldtup, oldtup, desc);
+	if (newtup == oldtup)
+		change->newtup = change->oldtup;
+	else if (newtup != NULL)
+		batch_copy_tuple(&change->newtup, newtup, desc);
+	else
+		change->newtup.natts = 0;
+	ItemPointerSetInvalid(&change->tid);
+	MemoryContextSwitchTo(oldctx);
+}
+
+static int
+batch_key_cmp(const void *a, const void *b, void *arg)
+{
+	ApplyBatchKeyCmp *cmp = (ApplyBatchKeyCmp *) arg;
+
+	return DatumGetInt32(FunctionCall2Coll(cmp->cmpproc, cmp->collation,
+										   ((const ApplyBatchKey *) a)->key,
+										   ((const ApplyBatchKey *) b)->key));
+}
+
+/*
+ * Find the local tuples of the queued changes with one scan of the replica
+ * identity index, using an array of all their keys like "key = ANY(...)"
+ * does. The changes whose tuple is found get its TID.
+ *
+ * Tuples being changed by other transactions are left alone, the single
+ * lookup of the change waits for them.
+ */
+static void
+batch_lookup(ApplyBatchState *bs)
+{
+	Relation	rel = bs->rel->rel;
+	Relation	idxrel;
+	TupleDesc	desc = RelationGetDescr(rel);
+	AttrNumber	attno;
+	Form_pg_attribute att;
+	ApplyBatchKey *keys;
+	ApplyBatchKeyCmp cmp;
+	Datum	   *elems;
+	int			nkeys = 0;
+	Oid			elemtype;
+	int16		elemlen;
+	bool		elembyval;
+	char		elemalign;
+	ArrayType  *arr;
+	Oid			operator;
+	ScanKeyData skey;
+	SnapshotData snap;
+	IndexScanDesc scan;
+	TupleTableSlot *slot;
+	int			i;
+
+	idxrel = index_open(bs->rel->idxoid, RowExclusiveLock);
+	attno = idxrel->rd_index->indkey.values[0];
+	att = TupleDescAttr(desc, attno - 1);
+
+	keys = palloc(bs->nchanges * sizeof(ApplyBatchKey));
+	for (i = 0; i < bs->nchanges; i++)
+	{
+		SpockTupleData *oldtup = &bs->changes[i].oldtup;
+
+		if (oldtup->nulls[attno - 1])
+			continue;
+
+		keys[nkeys].key = oldtup->values[attno - 1];
+		keys[nkeys].change = i;
+		nkeys++;
+	}
+
+	if (nkeys == 0)
+	{
+		index_close(idxrel, NoLock);
+		return;
+	}
+
+	cmp.cmpproc = index_getprocinfo(idxrel, 1, BTORDER_PROC);
+	cmp.collation = idxrel->rd_indcollation[0];
+	qsort_arg(keys, nkeys, sizeof(ApplyBatchKey), batch_key_cmp, &cmp);
+
+	/*
+	 * The array is of the type the operator class compares, e.g. text for a
+	 * varchar column, unless that's a pseudo-type like anyarray.
+	 */
+	elemtype = idxrel->rd_opcintype[0];
+	if (IsPolymorphicType(elemtype))
+		elemtype = att->atttypid;
+	get_typlenbyvalalign(elemtype, &elemlen, &elembyval, &elemalign);
+
+	elems = palloc(nkeys * sizeof(Datum));
+	for (i = 0; i < nkeys; i++)
+		elems[i] = keys[i].key;
+	arr = construct_array(elems, nkeys, elemtype, elemlen, elembyval,
+						  elemalign);
+
+	operator = get_opfamily_member(idxrel->rd_opfamily[0],
+								   idxrel->rd_opcintype[0],
+								   idxrel->rd_opcintype[0],
+								   BTEqualStrategyNumber);
+	if (!OidIsValid(operator))
+		elog(ERROR, "missing operator %d(%u,%u) in opfamily %u",
+			 BTEqualStrategyNumber, idxrel->rd_opcintype[0],
+			 idxrel->rd_opcintype[0], idxrel->rd_opfamily[0]);
+
+	ScanKeyEntryInitialize(&skey, SK_SEARCHARRAY, 1, BTEqualStrategyNumber,
+						   InvalidOid, cmp.collation, get_opcode(operator),
+						   PointerGetDatum(arr));
+
+	InitDirtySnapshot(snap);
+	scan = index_beginscan(rel, idxrel, &snap, 1, 0);
+	index_rescan(scan, &skey, 1, NULL, 0);
+
+	slot = table_slot_create(rel, NULL);
+	while (index_getnext_slot(scan, ForwardScanDirection, slot))
+	{
+		ApplyBatchKey probe;
+		ApplyBatchKey *match;
+		bool		isnull;
+
+		if (TransactionIdIsValid(snap.xmin) || TransactionIdIsValid(snap.xmax))
+			continue;
+
+		probe.key = slot_getattr(slot, attno, &isnull);
+		if (isnull)
+			continue;
+
+		match = bsearch_arg(&probe, keys, nkeys, sizeof(ApplyBatchKey),
+							batch_key_cmp, &cmp);
+		if (match == NULL)
+			continue;
+
+		/* The same key may be changed more than once. */
+		while (match > keys && batch_key_cmp(match - 1, &probe, &cmp) == 0)
+			match--;
+		for (; match < keys + nkeys && batch_key_cmp(match, &probe, &cmp) == 0;
+			 match++)
+			bs->changes[match->change].tid = slot->tts_tid;
+	}
+
+	index_endscan(scan);
+	ExecDropSingleTupleTableSlot(slot);
+	index_close(idxrel, NoLock);
+
+	pfree(elems);
+	pfree(keys);
+}
+
+/*
+ * Apply the queued changes of the relation in order. The local tuples are
+ * looked up in one go first, then each change goes through the usual
+ * conflict detection and resolution. A change whose tuple wasn't found, or
+ * was changed since, looks it up on its own.
+ */
+void
+spock_apply_heap_batch_finish(SpockRelation *rel)
+{
+	ApplyBatchState *bs = spkbatchstate;
+	MemoryContext oldctx;
+	int			i;
+
+	if (bs == NULL || bs->nchanges == 0)
+		return;
+
+	Assert(bs->rel == rel);
+
+	oldctx = MemoryContextSwitchTo(bs->cxt);
+	batch_lookup(bs);
+	MemoryContextSwitchTo(oldctx);
+
+	for (i = 0; i < bs->nchanges; i++)
+	{
+		ApplyBatchChange *change = &bs->changes[i];
+
+		if (change->newtup.natts == 0)
+			apply_heap_delete(rel, &change->oldtup, &change->tid);
+		else
+			apply_heap_update(rel, &change->oldtup, &change->newtup,
+							  &change->tid);
+
+		/* Let the next change see this one. */
+		CommandCounterIncrement();
+	}
+
+	spock_apply_heap_batch_discard();
+}
+
+/*
+ * Forget the queued changes, e.g. after an error.
+ */
+void
+spock_apply_heap_batch_discard(void)
+{
+	if (spkbatchstate == NULL)
+		return;
+
+	spkbatchstate->nchanges = 0;
+	spkbatchstate->rel = NULL;
+	MemoryContextReset(spkbatchstate->cxt);
+}
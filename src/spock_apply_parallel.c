@@ -0,0 +1,1247 @@
+/*-------------------------------------------------------------------------
+ *
+ * spock_apply_parallel.c
+ * 		spock parallel apply of independent remote transactions
+ *
+ * The apply worker of a subscription (the leader here) keeps receiving the
+ * replication stream as usual. When spock.apply_parallel_workers is set it
+ * buffers each remote transaction in its replay queue until COMMIT, computes
+ * the set of rows the transaction writes from the replica identity columns
+ * and hands the whole transaction to an idle parallel apply worker, once all
+ * in-flight transactions writing any of the same rows are committed.
+ * Transactions that can't be reasoned about this way (DDL, TRUNCATE, queued
+ * SQL, tables being synchronized, ...) are still applied by the leader after
+ * all workers went idle.
+ *
+ * Workers share the replication origin session of the leader and commit in
+ * the order the transactions were received, so the origin progress, the
+ * feedback sent to the provider and the apply progress look exactly as with
+ * serial apply. The ordering is enforced with a heavyweight lock each worker
+ * holds for the transaction it applies; a successor waits on that lock before
+ * committing, which lets the deadlock detector resolve the case of a
+ * successor holding a row lock its predecessor needs. Any worker failure
+ * makes the leader exit; after the restart the leader applies the failed
+ * transactions itself so that the regular exception handling applies.
+ *
+ * Copyright (c) 2022-2026, pgEdge, Inc.
+ * Portions Copyright (c) 1996-2021, PostgreSQL Global Development Group
+ * Portions Copyright (c) 1994, The Regents of the University of California
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "miscadmin.h"
+#include "pgstat.h"
+
+#include "access/xact.h"
+#include "access/xlog.h"
+
+#include "libpq/pqformat.h"
+
+#include "postmaster/bgworker.h"
+#include "postmaster/interrupt.h"
+
+#include "replication/origin.h"
+
+#include "storage/condition_variable.h"
+#include "storage/dsm.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/lmgr.h"
+#include "storage/proc.h"
+#include "storage/shm_mq.h"
+#include "storage/shm_toc.h"
+#include "storage/spin.h"
+
+#include "tcop/tcopprot.h"
+
+#include "utils/guc.h"
+#include "utils/hsearch.h"
+#include "utils/memutils.h"
+
+#include "spock_node.h"
+#include "spock_proto_native.h"
+#include "spock_worker.h"
+#include "spock_apply.h"
+#include "spock_apply_parallel.h"
+#include "spock.h"
+
+PGDLLEXPORT void spock_apply_parallel_main(Datum main_arg);
+
+#define PARALLEL_APPLY_MAGIC			0x53504c50
+#define PARALLEL_APPLY_KEY_SHARED		1
+#define PARALLEL_APPLY_KEY_QUEUES		2
+
+/* Size of the message queue of each worker */
+#define PARALLEL_APPLY_QUEUE_SIZE		(1024 * 1024)
+
+/*
+ * Maximum number of row keys tracked per transaction; larger transactions
+ * are tracked per relation instead.
+ */
+#define PARALLEL_APPLY_MAX_TXN_KEYS		65536
+
+/* Number of tracked row keys above which committed ones get pruned */
+#define PARALLEL_APPLY_MAX_KEYS			(4 * PARALLEL_APPLY_MAX_TXN_KEYS)
+
+/* objid of the commit order lock, to tell it from core's parallel apply */
+#define PARALLEL_APPLY_LOCK_OBJID		0x5350
+
+#if PG_VERSION_NUM >= 160000
+#define SET_LOCKTAG_PARALLEL_APPLY(tag, dbid, subid, seq) \
+	SET_LOCKTAG_APPLY_TRANSACTION(tag, dbid, subid, (uint32) (seq), \
+								  PARALLEL_APPLY_LOCK_OBJID)
+#else
+#define SET_LOCKTAG_PARALLEL_APPLY(tag, dbid, subid, seq) \
+	SET_LOCKTAG_ADVISORY(tag, dbid, subid, (uint32) (seq), \
+						 PARALLEL_APPLY_LOCK_OBJID)
+#endif
+
+typedef enum ParallelApplyWorkerState
+{
+	PARALLEL_APPLY_STARTING,	/* not ready to receive transactions yet */
+	PARALLEL_APPLY_IDLE,		/* waiting for a transaction */
+	PARALLEL_APPLY_BUSY,		/* applying a transaction */
+	PARALLEL_APPLY_DONE			/* transaction committed, not yet seen by
+								 * the leader */
+} ParallelApplyWorkerState;
+
+typedef struct ParallelApplyWorkerSlot
+{
+	slock_t		mutex;
+
+	/* Protected by mutex. */
+	ParallelApplyWorkerState state;
+	uint64		seq;			/* transaction being applied */
+	int			prev_worker;	/* worker applying seq - 1, or -1 */
+	XLogRecPtr	local_end;		/* local commit end of the transaction */
+	bool		failed;
+
+	/* Last transaction the worker holds (or held) the order lock for. */
+	pg_atomic_uint64 started_seq;
+} ParallelApplyWorkerSlot;
+
+typedef struct ParallelApplyShared
+{
+	Oid			dboid;
+	Oid			subid;
+	int			leader_slot;	/* slot of the leader in SpockCtx->workers */
+	pid_t		leader_pid;
+	Latch	   *leader_latch;
+	RepOriginId originid;
+	uint32		proto_version;
+	int			nworkers;
+
+	/* Transactions are committed in order of their sequence number. */
+	pg_atomic_uint64 last_committed_seq;
+	ConditionVariable cv;
+
+	ParallelApplyWorkerSlot workers[FLEXIBLE_ARRAY_MEMBER];
+} ParallelApplyShared;
+
+/* Transaction handed to a worker, as tracked by the leader. */
+typedef struct ParallelApplyTxn
+{
+	uint64		seq;
+	int			worker;
+	XLogRecPtr	end_lsn;
+	XLogRecPtr	local_end;
+	bool		done;
+} ParallelApplyTxn;
+
+typedef struct ParallelApplyKey
+{
+	uint32		relid;
+	uint32		key;
+} ParallelApplyKey;
+
+typedef struct ParallelApplyKeyEntry
+{
+	ParallelApplyKey key;
+	uint64		seq;			/* last transaction writing the row */
+} ParallelApplyKeyEntry;
+
+typedef struct ParallelApplyRelEntry
+{
+	uint32		relid;
+	uint64		seq_any;		/* last transaction writing the relation */
+	uint64		seq_whole;		/* last one not tracked by rows */
+} ParallelApplyRelEntry;
+
+typedef struct ParallelApplyTxnRel
+{
+	uint32		relid;
+	bool		whole;
+} ParallelApplyTxnRel;
+
+typedef struct ParallelApplyRelMsg
+{
+	uint32		relid;
+	Size		len;
+	char	   *data;
+} ParallelApplyRelMsg;
+
+int			spock_apply_parallel_workers = 0;
+bool		is_parallel_apply_worker = false;
+
+/* Leader state */
+static MemoryContext ParallelApplyContext = NULL;
+static MemoryContext ParallelApplyTxnContext = NULL;
+static bool parallel_apply_unavailable = false;
+static dsm_segment *pa_seg = NULL;
+static ParallelApplyShared *pa_shared = NULL;
+static shm_mq_handle **pa_mqh = NULL;
+static BackgroundWorkerHandle **pa_handles = NULL;
+static uint64 pa_last_seq = 0;
+static XLogRecPtr pa_last_dispatched = InvalidXLogRecPtr;
+static List *pa_txns = NIL;		/* ParallelApplyTxn in dispatch order */
+static HTAB *pa_relmsgs = NULL;
+static bool pa_relmsgs_missed = false;	/* some were not kept */
+static HTAB *pa_keys = NULL;
+static HTAB *pa_rels = NULL;
+
+/* Write set of the transaction being received */
+static HTAB *pa_txn_rels = NULL;
+static ParallelApplyKey *pa_txn_keys = NULL;
+static int	pa_txn_nkeys = 0;
+static int	pa_txn_maxkeys = 0;
+static bool pa_txn_overflow = false;
+
+/* Worker state */
+static ParallelApplyShared *MyParallelShared = NULL;
+static ParallelApplyWorkerSlot *MyParallelSlot = NULL;
+
+#if PG_VERSION_NUM >= 160000
+static void parallel_apply_shutdown(int code, Datum arg);
+#endif
+static void parallel_apply_poll(void);
+static void parallel_apply_reset_keys(void);
+static void parallel_apply_worker_on_exit(int code, Datum arg);
+
+/*
+ * Create the hash tables tracking the rows written by in-flight
+ * transactions.
+ */
+static void
+parallel_apply_reset_keys(void)
+{
+	HASHCTL		ctl;
+
+	if (pa_keys != NULL)
+		hash_destroy(pa_keys);
+	if (pa_rels != NULL)
+		hash_destroy(pa_rels);
+
+	MemSet(&ctl, 0, sizeof(ctl));
+	ctl.keysize = sizeof(ParallelApplyKey);
+	ctl.entrysize = sizeof(ParallelApplyKeyEntry);
+	ctl.hcxt = ParallelApplyContext;
+	pa_keys = hash_create("spock parallel apply keys", 1024, &ctl,
+						  HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+	MemSet(&ctl, 0, sizeof(ctl));
+	ctl.keysize = sizeof(uint32);
+	ctl.entrysize = sizeof(ParallelApplyRelEntry);
+	ctl.hcxt = ParallelApplyContext;
+	pa_rels = hash_create("spock parallel apply relations", 128, &ctl,
+						  HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+}
+
+static void
+parallel_apply_init_context(void)
+{
+	HASHCTL		ctl;
+
+	if (ParallelApplyContext != NULL)
+		return;
+
+	ParallelApplyContext = AllocSetContextCreate(TopMemoryContext,
+												 "ParallelApplyContext",
+												 ALLOCSET_DEFAULT_SIZES);
+	ParallelApplyTxnContext = AllocSetContextCreate(ParallelApplyContext,
+													"ParallelApplyTxnContext",
+													ALLOCSET_DEFAULT_SIZES);
+
+	MemSet(&ctl, 0, sizeof(ctl));
+	ctl.keysize = sizeof(uint32);
+	ctl.entrysize = sizeof(ParallelApplyRelMsg);
+	ctl.hcxt = ParallelApplyContext;
+	pa_relmsgs = hash_create("spock parallel apply relation messages", 128,
+							 &ctl, HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+	parallel_apply_reset_keys();
+}
+
+static void
+parallel_apply_worker_failed(int worker)
+{
+	ereport(ERROR,
+			(errcode(ERRCODE_CONNECTION_FAILURE),
+			 errmsg("SPOCK %s: parallel apply worker %d exited unexpectedly",
+					MySubscription->name, worker)));
+}
+
+/*
+ * Send a message to a worker, erroring out if the worker is gone.
+ */
+static void
+parallel_apply_send(int worker, const char *data, Size len, bool flush)
+{
+	shm_mq_result res;
+
+	res = shm_mq_send(pa_mqh[worker], len, data, false, flush);
+	if (res != SHM_MQ_SUCCESS)
+		parallel_apply_worker_failed(worker);
+}
+
+#if PG_VERSION_NUM >= 160000
+/*
+ * Set up the shared state and register the workers.
+ */
+static bool
+parallel_apply_launch(RepOriginId originid)
+{
+	shm_toc_estimator e;
+	shm_toc    *toc;
+	Size		shared_size;
+	Size		segsize;
+	char	   *queues;
+	int			nworkers;
+	int			i;
+	HASH_SEQ_STATUS status;
+	ParallelApplyRelMsg *relmsg;
+
+	parallel_apply_init_context();
+
+	nworkers = spock_apply_parallel_workers;
+	shared_size = add_size(offsetof(ParallelApplyShared, workers),
+						   mul_size(sizeof(ParallelApplyWorkerSlot), nworkers));
+
+	shm_toc_initialize_estimator(&e);
+	shm_toc_estimate_chunk(&e, shared_size);
+	shm_toc_estimate_chunk(&e, mul_size(PARALLEL_APPLY_QUEUE_SIZE, nworkers));
+	shm_toc_estimate_keys(&e, 2);
+	segsize = shm_toc_estimate(&e);
+
+	pa_seg = dsm_create(segsize, 0);
+	dsm_pin_mapping(pa_seg);
+	toc = shm_toc_create(PARALLEL_APPLY_MAGIC, dsm_segment_address(pa_seg),
+						 segsize);
+
+	pa_shared = shm_toc_allocate(toc, shared_size);
+	pa_shared->dboid = MyDatabaseId;
+	pa_shared->subid = MyApplyWorker->subid;
+	pa_shared->leader_slot = MySpockWorker - &SpockCtx->workers[0];
+	pa_shared->leader_pid = MyProcPid;
+	pa_shared->leader_latch = &MyProc->procLatch;
+	pa_shared->originid = originid;
+	pa_shared->proto_version = spock_apply_get_proto_version();
+	pa_shared->nworkers = nworkers;
+	pg_atomic_init_u64(&pa_shared->last_committed_seq, pa_last_seq);
+	ConditionVariableInit(&pa_shared->cv);
+	for (i = 0; i < nworkers; i++)
+	{
+		ParallelApplyWorkerSlot *slot = &pa_shared->workers[i];
+
+		SpinLockInit(&slot->mutex);
+		slot->state = PARALLEL_APPLY_STARTING;
+		slot->seq = 0;
+		slot->prev_worker = -1;
+		slot->local_end = InvalidXLogRecPtr;
+		slot->failed = false;
+		pg_atomic_init_u64(&slot->started_seq, 0);
+	}
+	shm_toc_insert(toc, PARALLEL_APPLY_KEY_SHARED, pa_shared);
+
+	queues = shm_toc_allocate(toc, mul_size(PARALLEL_APPLY_QUEUE_SIZE, nworkers));
+	shm_toc_insert(toc, PARALLEL_APPLY_KEY_QUEUES, queues);
+
+	pa_mqh = MemoryContextAllocZero(ParallelApplyContext,
+									sizeof(shm_mq_handle *) * nworkers);
+	pa_handles = MemoryContextAllocZero(ParallelApplyContext,
+										sizeof(BackgroundWorkerHandle *) * nworkers);
+
+	before_shmem_exit(parallel_apply_shutdown, (Datum) 0);
+
+	for (i = 0; i < nworkers; i++)
+	{
+		BackgroundWorker bgw;
+		shm_mq	   *mq;
+
+		mq = shm_mq_create(queues + (Size) i * PARALLEL_APPLY_QUEUE_SIZE,
+						   PARALLEL_APPLY_QUEUE_SIZE);
+		shm_mq_set_sender(mq, MyProc);
+		pa_mqh[i] = shm_mq_attach(mq, pa_seg, NULL);
+
+		memset(&bgw, 0, sizeof(bgw));
+		bgw.bgw_flags = BGWORKER_SHMEM_ACCESS |
+			BGWORKER_BACKEND_DATABASE_CONNECTION;
+		bgw.bgw_start_time = BgWorkerStart_RecoveryFinished;
+		snprintf(bgw.bgw_library_name, BGW_MAXLEN, "%s",
+				 EXTENSION_NAME);
+		snprintf(bgw.bgw_function_name, BGW_MAXLEN,
+				 "spock_apply_parallel_main");
+		snprintf(bgw.bgw_name, BGW_MAXLEN,
+				 "spock parallel apply %u:%u %d", MyDatabaseId,
+				 MyApplyWorker->subid, i);
+		bgw.bgw_restart_time = BGW_NEVER_RESTART;
+		bgw.bgw_notify_pid = MyProcPid;
+		bgw.bgw_main_arg = UInt32GetDatum(dsm_segment_handle(pa_seg));
+		memcpy(bgw.bgw_extra, &i, sizeof(int));
+
+		if (!RegisterDynamicBackgroundWorker(&bgw, &pa_handles[i]))
+		{
+			ereport(WARNING,
+					(errcode(ERRCODE_CONFIGURATION_LIMIT_EXCEEDED),
+					 errmsg("SPOCK %s: could not start parallel apply workers, applying serially",
+							MySubscription->name),
+					 errhint("You might need to increase max_worker_processes.")));
+			parallel_apply_shutdown(0, (Datum) 0);
+			cancel_before_shmem_exit(parallel_apply_shutdown, (Datum) 0);
+			parallel_apply_unavailable = true;
+			return false;
+		}
+
+		shm_mq_set_handle(pa_mqh[i], pa_handles[i]);
+	}
+
+	/* Let the workers know the relations we have seen so far. */
+	hash_seq_init(&status, pa_relmsgs);
+	while ((relmsg = (ParallelApplyRelMsg *) hash_seq_search(&status)) != NULL)
+	{
+		for (i = 0; i < nworkers; i++)
+			parallel_apply_send(i, relmsg->data, relmsg->len, true);
+	}
+
+	elog(LOG, "SPOCK %s: started %d parallel apply workers",
+		 MySubscription->name, nworkers);
+
+	return true;
+}
+#endif
+
+/*
+ * Start the parallel apply workers of this apply worker, if not started yet.
+ *
+ * Returns false if parallel apply is disabled or can't be used.
+ */
+bool
+spock_apply_parallel_start(RepOriginId originid)
+{
+	if (pa_shared != NULL)
+		return true;
+
+	if (parallel_apply_unavailable || spock_apply_parallel_workers <= 0)
+		return false;
+
+#if PG_VERSION_NUM < 160000
+	/* Workers need to share the origin session of the apply worker. */
+	ereport(LOG,
+			(errmsg("SPOCK %s: spock.apply_parallel_workers requires PostgreSQL 16 or later, applying serially",
+					MySubscription->name)));
+	parallel_apply_unavailable = true;
+	return false;
+#else
+
+	/*
+	 * Workers learn about relations from the RELATION messages we kept,
+	 * which we only do while parallel apply is enabled.
+	 */
+	if (pa_relmsgs_missed)
+	{
+		ereport(LOG,
+				(errmsg("SPOCK %s: spock.apply_parallel_workers was enabled after the apply worker started, applying serially until it restarts",
+						MySubscription->name)));
+		parallel_apply_unavailable = true;
+		return false;
+	}
+
+	return parallel_apply_launch(originid);
+#endif
+}
+
+#if PG_VERSION_NUM >= 160000
+/*
+ * Terminate the workers and wait for them to exit, so that none of them
+ * outlives the origin session of the leader.
+ */
+static void
+parallel_apply_shutdown(int code, Datum arg)
+{
+	int			i;
+
+	if (pa_shared == NULL)
+		return;
+
+	for (i = 0; i < pa_shared->nworkers; i++)
+	{
+		if (pa_handles[i] != NULL)
+			TerminateBackgroundWorker(pa_handles[i]);
+	}
+
+	for (i = 0; i < pa_shared->nworkers; i++)
+	{
+		if (pa_handles[i] != NULL)
+			(void) WaitForBackgroundWorkerShutdown(pa_handles[i]);
+		pa_handles[i] = NULL;
+	}
+
+	dsm_detach(pa_seg);
+	pa_seg = NULL;
+	pa_shared = NULL;
+}
+#endif
+
+/*
+ * Have the parallel apply workers been started?
+ */
+bool
+spock_apply_parallel_active(void)
+{
+	return pa_shared != NULL;
+}
+
+/*
+ * Are there transactions handed to workers which were not reported back by
+ * spock_apply_parallel_next_finished() yet?
+ */
+bool
+spock_apply_parallel_busy(void)
+{
+	return pa_txns != NIL;
+}
+
+/*
+ * Remember a RELATION message and pass it on to all workers.
+ *
+ * The message is expected to start with the action byte.
+ */
+void
+spock_apply_parallel_relation(StringInfo s)
+{
+	StringInfoData copy = *s;
+	ParallelApplyRelMsg *relmsg;
+	uint32		relid;
+	bool		found;
+	int			i;
+
+	/*
+	 * Workers started later on need to know all relations. Nothing to keep
+	 * if they can't be started anymore.
+	 */
+	if (pa_shared == NULL &&
+		(spock_apply_parallel_workers <= 0 || parallel_apply_unavailable))
+	{
+		pa_relmsgs_missed = true;
+		return;
+	}
+
+	parallel_apply_init_context();
+
+	(void) pq_getmsgbyte(&copy);	/* action */
+	(void) pq_getmsgbyte(&copy);	/* flags */
+	relid = pq_getmsgint(&copy, 4);
+
+	relmsg = hash_search(pa_relmsgs, &relid, HASH_ENTER, &found);
+	if (found)
+		pfree(relmsg->data);
+	relmsg->len = s->len - s->cursor;
+	relmsg->data = MemoryContextAlloc(ParallelApplyContext, relmsg->len);
+	memcpy(relmsg->data, s->data + s->cursor, relmsg->len);
+
+	if (pa_shared == NULL)
+		return;
+
+	for (i = 0; i < pa_shared->nworkers; i++)
+		parallel_apply_send(i, relmsg->data, relmsg->len, true);
+}
+
+/*
+ * Start collecting the write set of a new remote transaction.
+ */
+void
+spock_apply_parallel_txn_reset(void)
+{
+	HASHCTL		ctl;
+
+	parallel_apply_init_context();
+	MemoryContextReset(ParallelApplyTxnContext);
+
+	MemSet(&ctl, 0, sizeof(ctl));
+	ctl.keysize = sizeof(uint32);
+	ctl.entrysize = sizeof(ParallelApplyTxnRel);
+	ctl.hcxt = ParallelApplyTxnContext;
+	pa_txn_rels = hash_create("spock parallel apply transaction relations",
+							  16, &ctl, HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+	pa_txn_maxkeys = 64;
+	pa_txn_keys = MemoryContextAlloc(ParallelApplyTxnContext,
+									 pa_txn_maxkeys * sizeof(ParallelApplyKey));
+	pa_txn_nkeys = 0;
+	pa_txn_overflow = false;
+}
+
+/*
+ * Add a change to the write set of the current transaction.
+ *
+ * nkeys == 0 means the change can't be tracked by rows and conflicts with
+ * everything written to the relation.
+ */
+void
+spock_apply_parallel_txn_add(uint32 relid, int nkeys, uint32 *keys)
+{
+	ParallelApplyTxnRel *rel;
+	bool		found;
+	int			i;
+
+	rel = hash_search(pa_txn_rels, &relid, HASH_ENTER, &found);
+	if (!found)
+		rel->whole = false;
+
+	if (nkeys == 0)
+	{
+		rel->whole = true;
+		return;
+	}
+
+	if (pa_txn_overflow)
+		return;
+
+	if (pa_txn_nkeys + nkeys > PARALLEL_APPLY_MAX_TXN_KEYS)
+	{
+		/* Too many rows, track the relations only. */
+		pa_txn_overflow = true;
+		return;
+	}
+
+	if (pa_txn_nkeys + nkeys > pa_txn_maxkeys)
+	{
+		pa_txn_maxkeys *= 2;
+		pa_txn_keys = repalloc(pa_txn_keys,
+							   pa_txn_maxkeys * sizeof(ParallelApplyKey));
+	}
+
+	for (i = 0; i < nkeys; i++)
+	{
+		pa_txn_keys[pa_txn_nkeys].relid = relid;
+		pa_txn_keys[pa_txn_nkeys].key = keys[i];
+		pa_txn_nkeys++;
+	}
+}
+
+/*
+ * Check the workers for committed transactions and failures.
+ */
+static void
+parallel_apply_poll(void)
+{
+	ListCell   *lc;
+	int			i;
+
+	foreach(lc, pa_txns)
+	{
+		ParallelApplyTxn *txn = (ParallelApplyTxn *) lfirst(lc);
+		ParallelApplyWorkerSlot *slot = &pa_shared->workers[txn->worker];
+
+		if (txn->done)
+			continue;
+
+		SpinLockAcquire(&slot->mutex);
+		if (slot->state == PARALLEL_APPLY_DONE && slot->seq == txn->seq)
+		{
+			txn->done = true;
+			txn->local_end = slot->local_end;
+			slot->state = PARALLEL_APPLY_IDLE;
+		}
+		SpinLockRelease(&slot->mutex);
+	}
+
+	for (i = 0; i < pa_shared->nworkers; i++)
+	{
+		ParallelApplyWorkerSlot *slot = &pa_shared->workers[i];
+		pid_t		pid;
+		bool		failed;
+
+		SpinLockAcquire(&slot->mutex);
+		failed = slot->failed;
+		SpinLockRelease(&slot->mutex);
+
+		if (failed ||
+			GetBackgroundWorkerPid(pa_handles[i], &pid) == BGWH_STOPPED)
+			parallel_apply_worker_failed(i);
+	}
+}
+
+/*
+ * Sleep until a worker reports progress.
+ */
+static void
+parallel_apply_wait(void)
+{
+	int			rc;
+
+	rc = WaitLatch(&MyProc->procLatch,
+				   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+				   1000L, PG_WAIT_EXTENSION);
+
+	if (rc & WL_POSTMASTER_DEATH)
+		proc_exit(1);
+
+	ResetLatch(&MyProc->procLatch);
+
+	CHECK_FOR_INTERRUPTS();
+
+	if (got_SIGTERM)
+		proc_exit(0);
+
+	/* Keep reading the stream and answering the provider meanwhile. */
+	spock_apply_poll_stream();
+}
+
+/*
+ * Pick a worker for the transaction whose write set was collected.
+ *
+ * Waits until every in-flight transaction writing any of the same rows is
+ * committed and a worker is idle, then registers the transaction. The
+ * caller sends the messages of the transaction with
+ * spock_apply_parallel_send().
+ */
+int
+spock_apply_parallel_dispatch_begin(XLogRecPtr end_lsn)
+{
+	uint64		depends_on = 0;
+	uint64		seq;
+	int			worker = -1;
+	HASH_SEQ_STATUS status;
+	ParallelApplyTxnRel *txnrel;
+	ParallelApplyWorkerSlot *slot;
+	ParallelApplyTxn *txn;
+	MemoryContext oldctx;
+	int			i;
+
+	Assert(pa_shared != NULL);
+
+	/* Find the last in-flight transaction we conflict with. */
+	hash_seq_init(&status, pa_txn_rels);
+	while ((txnrel = (ParallelApplyTxnRel *) hash_seq_search(&status)) != NULL)
+	{
+		ParallelApplyRelEntry *rel;
+
+		rel = hash_search(pa_rels, &txnrel->relid, HASH_FIND, NULL);
+		if (rel == NULL)
+			continue;
+
+		if (txnrel->whole || pa_txn_overflow)
+			depends_on = Max(depends_on, rel->seq_any);
+		else
+			depends_on = Max(depends_on, rel->seq_whole);
+	}
+
+	if (!pa_txn_overflow)
+	{
+		for (i = 0; i < pa_txn_nkeys; i++)
+		{
+			ParallelApplyKeyEntry *entry;
+
+			entry = hash_search(pa_keys, &pa_txn_keys[i], HASH_FIND, NULL);
+			if (entry != NULL)
+				depends_on = Max(depends_on, entry->seq);
+		}
+	}
+
+	/* Wait for it, and for an idle worker. */
+	for (;;)
+	{
+		parallel_apply_poll();
+
+		if (pg_atomic_read_u64(&pa_shared->last_committed_seq) >= depends_on)
+		{
+			for (i = 0; i < pa_shared->nworkers; i++)
+			{
+				slot = &pa_shared->workers[i];
+
+				SpinLockAcquire(&slot->mutex);
+				if (slot->state == PARALLEL_APPLY_IDLE)
+					worker = i;
+				SpinLockRelease(&slot->mutex);
+
+				if (worker >= 0)
+					break;
+			}
+
+			if (worker >= 0)
+				break;
+		}
+
+		parallel_apply_wait();
+	}
+
+	seq = ++pa_last_seq;
+
+	/* Register the write set. */
+	hash_seq_init(&status, pa_txn_rels);
+	while ((txnrel = (ParallelApplyTxnRel *) hash_seq_search(&status)) != NULL)
+	{
+		ParallelApplyRelEntry *rel;
+		bool		found;
+
+		rel = hash_search(pa_rels, &txnrel->relid, HASH_ENTER, &found);
+		if (!found)
+			rel->seq_whole = 0;
+		rel->seq_any = seq;
+		if (txnrel->whole || pa_txn_overflow)
+			rel->seq_whole = seq;
+	}
+
+	if (!pa_txn_overflow)
+	{
+		for (i = 0; i < pa_txn_nkeys; i++)
+		{
+			ParallelApplyKeyEntry *entry;
+
+			entry = hash_search(pa_keys, &pa_txn_keys[i], HASH_ENTER, NULL);
+			entry->seq = seq;
+		}
+	}
+
+	/* Hand the transaction to the worker. */
+	slot = &pa_shared->workers[worker];
+	SpinLockAcquire(&slot->mutex);
+	slot->state = PARALLEL_APPLY_BUSY;
+	slot->seq = seq;
+	slot->prev_worker = -1;
+	slot->local_end = InvalidXLogRecPtr;
+	SpinLockRelease(&slot->mutex);
+
+	if (pa_txns != NIL)
+	{
+		ParallelApplyTxn *prev = (ParallelApplyTxn *) llast(pa_txns);
+
+		Assert(prev->seq == seq - 1);
+		if (!prev->done)
+		{
+			SpinLockAcquire(&slot->mutex);
+			slot->prev_worker = prev->worker;
+			SpinLockRelease(&slot->mutex);
+		}
+	}
+
+	oldctx = MemoryContextSwitchTo(ParallelApplyContext);
+	txn = palloc(sizeof(ParallelApplyTxn));
+	txn->seq = seq;
+	txn->worker = worker;
+	txn->end_lsn = end_lsn;
+	txn->local_end = InvalidXLogRecPtr;
+	txn->done = false;
+	pa_txns = lappend(pa_txns, txn);
+	MemoryContextSwitchTo(oldctx);
+
+	pa_last_dispatched = end_lsn;
+
+	return worker;
+}
+
+/*
+ * Send one message of the transaction being dispatched to its worker.
+ *
+ * The message is expected to start with the action byte.
+ */
+void
+spock_apply_parallel_send(int worker, const char *data, Size len, bool flush)
+{
+	parallel_apply_send(worker, data, len, flush);
+}
+
+/*
+ * Wait until all transactions handed to workers are committed.
+ */
+void
+spock_apply_parallel_wait_all(void)
+{
+	for (;;)
+	{
+		ListCell   *lc;
+		bool		all_done = true;
+
+		if (pa_shared == NULL)
+			return;
+
+		parallel_apply_poll();
+
+		foreach(lc, pa_txns)
+		{
+			ParallelApplyTxn *txn = (ParallelApplyTxn *) lfirst(lc);
+
+			if (!txn->done)
+			{
+				all_done = false;
+				break;
+			}
+		}
+
+		if (all_done)
+			return;
+
+		parallel_apply_wait();
+	}
+}
+
+/*
+ * Return the oldest committed transaction not reported yet.
+ *
+ * Transactions are reported in the order they were received, so the
+ * caller can track the flush position the same way as for transactions
+ * it applied itself.
+ */
+bool
+spock_apply_parallel_next_finished(XLogRecPtr *remote_end,
+								   XLogRecPtr *local_end)
+{
+	ParallelApplyTxn *txn;
+
+	if (pa_txns == NIL)
+		return false;
+
+	parallel_apply_poll();
+
+	txn = (ParallelApplyTxn *) linitial(pa_txns);
+	if (!txn->done)
+		return false;
+
+	*remote_end = txn->end_lsn;
+	*local_end = txn->local_end;
+
+	pa_txns = list_delete_first(pa_txns);
+	pfree(txn);
+
+	/*
+	 * Once nothing is in flight, nothing can conflict with the recorded
+	 * writes anymore. Otherwise prune them if there are too many.
+	 */
+	if (pa_txns == NIL)
+	{
+		if (hash_get_num_entries(pa_keys) > 0 ||
+			hash_get_num_entries(pa_rels) > 0)
+			parallel_apply_reset_keys();
+	}
+	else if (hash_get_num_entries(pa_keys) > PARALLEL_APPLY_MAX_KEYS)
+	{
+		uint64		committed = pg_atomic_read_u64(&pa_shared->last_committed_seq);
+		HASH_SEQ_STATUS status;
+		ParallelApplyKeyEntry *entry;
+
+		hash_seq_init(&status, pa_keys);
+		while ((entry = (ParallelApplyKeyEntry *) hash_seq_search(&status)) != NULL)
+		{
+			if (entry->seq <= committed)
+				hash_search(pa_keys, &entry->key, HASH_REMOVE, NULL);
+		}
+	}
+
+	return true;
+}
+
+/*
+ * End LSN of the last transaction handed to a worker.
+ */
+XLogRecPtr
+spock_apply_parallel_last_dispatched(void)
+{
+	return pa_last_dispatched;
+}
+
+/*
+ * Called by a parallel apply worker before committing: wait until the
+ * transaction received before ours is committed.
+ */
+void
+spock_apply_parallel_wait_for_turn(void)
+{
+	uint64		seq;
+	uint64		prev;
+	int			prev_worker;
+	LOCKTAG		tag;
+
+	if (!is_parallel_apply_worker)
+		return;
+
+	SpinLockAcquire(&MyParallelSlot->mutex);
+	seq = MyParallelSlot->seq;
+	prev_worker = MyParallelSlot->prev_worker;
+	SpinLockRelease(&MyParallelSlot->mutex);
+
+	prev = seq - 1;
+	if (pg_atomic_read_u64(&MyParallelShared->last_committed_seq) >= prev)
+		return;
+
+	/* Wait for the predecessor to take its order lock... */
+	ConditionVariablePrepareToSleep(&MyParallelShared->cv);
+	for (;;)
+	{
+		ParallelApplyWorkerSlot *prev_slot;
+		bool		failed;
+
+		if (pg_atomic_read_u64(&MyParallelShared->last_committed_seq) >= prev)
+			break;
+
+		if (prev_worker < 0)
+			break;
+
+		prev_slot = &MyParallelShared->workers[prev_worker];
+		if (pg_atomic_read_u64(&prev_slot->started_seq) >= prev)
+			break;
+
+		SpinLockAcquire(&prev_slot->mutex);
+		failed = prev_slot->failed;
+		SpinLockRelease(&prev_slot->mutex);
+		if (failed)
+			break;
+
+		(void) ConditionVariableTimedSleep(&MyParallelShared->cv, 1000L,
+										   PG_WAIT_EXTENSION);
+	}
+	ConditionVariableCancelSleep();
+
+	/*
+	 * ... and wait on it, so that the deadlock detector knows we are waiting
+	 * for the predecessor.
+	 */
+	if (pg_atomic_read_u64(&MyParallelShared->last_committed_seq) < prev)
+	{
+		SET_LOCKTAG_PARALLEL_APPLY(tag, MyParallelShared->dboid,
+								   MyParallelShared->subid, prev);
+		(void) LockAcquire(&tag, AccessShareLock, false, false);
+		LockRelease(&tag, AccessShareLock, false);
+	}
+
+	if (pg_atomic_read_u64(&MyParallelShared->last_committed_seq) < prev)
+		ereport(ERROR,
+				(errmsg("SPOCK %s: previous transaction was not applied by parallel apply worker",
+						MySubscription->name)));
+}
+
+/*
+ * Take the order lock of the transaction we are about to apply.
+ */
+static void
+parallel_apply_begin_txn(uint64 seq)
+{
+	LOCKTAG		tag;
+
+	SET_LOCKTAG_PARALLEL_APPLY(tag, MyParallelShared->dboid,
+							   MyParallelShared->subid, seq);
+	(void) LockAcquire(&tag, AccessExclusiveLock, true, false);
+
+	pg_atomic_write_u64(&MyParallelSlot->started_seq, seq);
+	ConditionVariableBroadcast(&MyParallelShared->cv);
+}
+
+/*
+ * Report the transaction as committed and let the successor go.
+ */
+static void
+parallel_apply_end_txn(uint64 seq, XLogRecPtr local_end)
+{
+	LOCKTAG		tag;
+
+	Assert(pg_atomic_read_u64(&MyParallelShared->last_committed_seq) == seq - 1);
+	pg_atomic_write_u64(&MyParallelShared->last_committed_seq, seq);
+
+	SET_LOCKTAG_PARALLEL_APPLY(tag, MyParallelShared->dboid,
+							   MyParallelShared->subid, seq);
+	LockRelease(&tag, AccessExclusiveLock, true);
+
+	SpinLockAcquire(&MyParallelSlot->mutex);
+	MyParallelSlot->local_end = local_end;
+	MyParallelSlot->state = PARALLEL_APPLY_DONE;
+	SpinLockRelease(&MyParallelSlot->mutex);
+
+	ConditionVariableBroadcast(&MyParallelShared->cv);
+	SetLatch(MyParallelShared->leader_latch);
+}
+
+static void
+parallel_apply_worker_on_exit(int code, Datum arg)
+{
+	if (MyParallelSlot == NULL)
+		return;
+
+	if (code != 0)
+	{
+		SpinLockAcquire(&MyParallelSlot->mutex);
+		MyParallelSlot->failed = true;
+		SpinLockRelease(&MyParallelSlot->mutex);
+	}
+
+	ConditionVariableBroadcast(&MyParallelShared->cv);
+	SetLatch(MyParallelShared->leader_latch);
+}
+
+/*
+ * Entry point of a parallel apply worker.
+ */
+void
+spock_apply_parallel_main(Datum main_arg)
+{
+	dsm_segment *seg;
+	shm_toc    *toc;
+	char	   *queues;
+	shm_mq	   *mq;
+	shm_mq_handle *mqh;
+	SpockWorker *leader;
+	MemoryContext ParallelApplyMessageContext;
+	MemoryContext saved_ctx;
+	int			worker;
+	uint64		seq = 0;
+
+	memcpy(&worker, MyBgworkerEntry->bgw_extra, sizeof(int));
+
+	pqsignal(SIGTERM, die);
+	pqsignal(SIGHUP, SignalHandlerForConfigReload);
+	BackgroundWorkerUnblockSignals();
+
+	is_parallel_apply_worker = true;
+
+	seg = dsm_attach(DatumGetUInt32(main_arg));
+	if (seg == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("could not map dynamic shared memory segment")));
+	toc = shm_toc_attach(PARALLEL_APPLY_MAGIC, dsm_segment_address(seg));
+	if (toc == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("invalid magic number in dynamic shared memory segment")));
+
+	MyParallelShared = shm_toc_lookup(toc, PARALLEL_APPLY_KEY_SHARED, false);
+	MyParallelSlot = &MyParallelShared->workers[worker];
+	queues = shm_toc_lookup(toc, PARALLEL_APPLY_KEY_QUEUES, false);
+
+	before_shmem_exit(parallel_apply_worker_on_exit, (Datum) 0);
+
+	mq = (shm_mq *) (queues + (Size) worker * PARALLEL_APPLY_QUEUE_SIZE);
+	shm_mq_set_receiver(mq, MyProc);
+	mqh = shm_mq_attach(mq, seg, NULL);
+
+	/*
+	 * Act on behalf of the apply worker we serve, but on a private copy of
+	 * its worker struct: per-transaction state like use_try_block must not
+	 * leak between the processes.
+	 */
+	LWLockAcquire(SpockCtx->lock, LW_SHARED);
+	leader = spock_get_worker(MyParallelShared->leader_slot);
+	if (leader->proc == NULL || leader->proc->pid != MyParallelShared->leader_pid)
+	{
+		LWLockRelease(SpockCtx->lock);
+		proc_exit(0);
+	}
+	MySpockWorker = MemoryContextAlloc(TopMemoryContext, sizeof(SpockWorker));
+	memcpy(MySpockWorker, leader, sizeof(SpockWorker));
+	LWLockRelease(SpockCtx->lock);
+
+	MyApplyWorker = &MySpockWorker->worker.apply;
+	MyApplyWorker->use_try_block = false;
+	MyApplyWorker->replay_stop_lsn = InvalidXLogRecPtr;
+
+	BackgroundWorkerInitializeConnectionByOid(MyParallelShared->dboid,
+											  InvalidOid, 0);
+
+	SetConfigOption("application_name", MyBgworkerEntry->bgw_name,
+					PGC_BACKEND, PGC_S_OVERRIDE);
+
+	/* Same settings as the apply worker, see spock_apply_main(). */
+	SetConfigOption("synchronous_commit",
+					spock_synchronous_commit ? "local" : "off",
+					PGC_BACKEND, PGC_S_OVERRIDE);
+	SetConfigOption("session_replication_role", "replica",
+					PGC_SUSET, PGC_S_OVERRIDE);
+	SetConfigOption("check_function_bodies", "off",
+					PGC_INTERNAL, PGC_S_OVERRIDE);
+
+	StartTransactionCommand();
+	saved_ctx = MemoryContextSwitchTo(TopMemoryContext);
+	MySubscription = get_subscription(MyApplyWorker->subid);
+	MemoryContextSwitchTo(saved_ctx);
+
+	spock_apply_set_proto_version(MyParallelShared->proto_version);
+
+#if PG_VERSION_NUM >= 160000
+	replorigin_session_setup_shared(MyParallelShared->originid,
+									MyParallelShared->leader_pid);
+#endif
+	replorigin_session_origin = MyParallelShared->originid;
+	CommitTransactionCommand();
+
+	apply_parallel_worker_init();
+
+	ParallelApplyMessageContext = AllocSetContextCreate(TopMemoryContext,
+														"ParallelApplyMessageContext",
+														ALLOCSET_DEFAULT_SIZES);
+
+	elog(DEBUG1, "SPOCK %s: parallel apply worker %d started",
+		 MySubscription->name, worker);
+
+	SpinLockAcquire(&MyParallelSlot->mutex);
+	MyParallelSlot->state = PARALLEL_APPLY_IDLE;
+	SpinLockRelease(&MyParallelSlot->mutex);
+	SetLatch(MyParallelShared->leader_latch);
+
+	for (;;)
+	{
+		shm_mq_result res;
+		Size		nbytes;
+		void	   *data;
+		StringInfoData s;
+		char		action;
+
+		CHECK_FOR_INTERRUPTS();
+
+		if (ConfigReloadPending)
+		{
+			ConfigReloadPending = false;
+			ProcessConfigFile(PGC_SIGHUP);
+		}
+
+		res = shm_mq_receive(mqh, &nbytes, &data, false);
+		if (res != SHM_MQ_SUCCESS)
+			break;				/* the apply worker is gone */
+
+		/*
+		 * Tuple data may be referenced until the end of the transaction, but
+		 * the queue buffer is reused by the next message.
+		 */
+		saved_ctx = MemoryContextSwitchTo(ParallelApplyMessageContext);
+		s.data = palloc(nbytes);
+		memcpy(s.data, data, nbytes);
+		s.len = nbytes;
+		s.maxlen = nbytes;
+		s.cursor = 0;
+		MemoryContextSwitchTo(saved_ctx);
+
+		action = s.data[0];
+
+		if (action == 'B')
+		{
+			SpinLockAcquire(&MyParallelSlot->mutex);
+			seq = MyParallelSlot->seq;
+			SpinLockRelease(&MyParallelSlot->mutex);
+
+			parallel_apply_begin_txn(seq);
+		}
+		else if (action == 'C')
+			XactLastCommitEnd = InvalidXLogRecPtr;
+
+		apply_parallel_worker_message(&s);
+
+		if (action == 'C')
+		{
+			parallel_apply_end_txn(seq, XactLastCommitEnd);
+			MemoryContextReset(ParallelApplyMessageContext);
+		}
+		else if (action == 'R')
+			MemoryContextReset(ParallelApplyMessageContext);
+	}
+
+	proc_exit(0);
+}
@@ -0,0 +1,485 @@
+/*-------------------------------------------------------------------------
+ *
+ * spock_apply_stream.c
+ * 		spock spooling of streamed in-progress transactions
+ *
+ * When spock.stream_in_progress is on, the provider sends the changes of
+ * large transactions before they commit, in blocks delimited by STREAM START
+ * and STREAM STOP (see pg_decode_stream_start()). The apply worker writes
+ * them to a spool file per remote transaction in spock.temp_directory,
+ * truncates the file when a streamed subtransaction aborts and removes it
+ * when the whole transaction does.
+ *
+ * A streamed transaction that commits is sent as BEGIN, STREAM COMMIT,
+ * COMMIT. Handling STREAM COMMIT applies the spooled messages in order, so
+ * the rest of the apply machinery, including the replay queue used by the
+ * exception handling, sees an ordinary transaction. The spool file is kept
+ * until the replay queue is reset, as a replay has to apply it again.
+ *
+ * Copyright (c) 2022-2026, pgEdge, Inc.
+ * Portions Copyright (c) 1996-2021, PostgreSQL Global Development Group
+ * Portions Copyright (c) 1994, The Regents of the University of California
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include <unistd.h>
+
+#include "miscadmin.h"
+#include "pgstat.h"
+
+#include "storage/fd.h"
+#include "storage/ipc.h"
+
+#include "utils/hsearch.h"
+#include "utils/memutils.h"
+
+#include "spock_node.h"
+#include "spock_worker.h"
+#include "spock_apply_stream.h"
+#include "spock.h"
+
+/* Size of the buffers used to write and read back spool files */
+#define STREAM_SPOOL_BUF_SIZE		(64 * 1024)
+
+/* First spooled change of a streamed subtransaction */
+typedef struct SpockStreamSubXact
+{
+	TransactionId xid;
+	off_t		offset;
+} SpockStreamSubXact;
+
+/* A streamed remote transaction */
+typedef struct SpockStreamXact
+{
+	TransactionId xid;			/* hash key */
+	File		file;
+	off_t		size;			/* including what's still in the buffer */
+	bool		committed;		/* applied, remove with the replay queue */
+
+	/* Subtransactions in the order their first change was spooled */
+	SpockStreamSubXact *subxacts;
+	int			nsubxacts;
+	int			maxsubxacts;
+} SpockStreamXact;
+
+bool		spock_stream_in_progress = false;
+
+static HTAB *StreamXactHash = NULL;
+static MemoryContext StreamContext = NULL;
+
+/* Transaction whose block is being received */
+static SpockStreamXact *stream_current = NULL;
+static StringInfoData stream_wbuf;
+
+/* Transaction being applied and the read position in its spool */
+static SpockStreamXact *stream_replay = NULL;
+static off_t stream_replay_fileoff = 0;
+static char *stream_rbuf = NULL;
+static int	stream_rbuf_len = 0;
+static int	stream_rbuf_off = 0;
+static StringInfoData stream_msg;
+
+static void
+stream_spool_path(char *path, TransactionId xid)
+{
+	snprintf(path, MAXPGPATH, "%s/spock-stream-%d-%u.tmp",
+			 spock_temp_directory, MyProcPid, xid);
+	canonicalize_path(path);
+}
+
+/* Close and remove the spool file of a transaction and forget about it */
+static void
+stream_xact_remove(SpockStreamXact *sx)
+{
+	char		path[MAXPGPATH];
+
+	if (sx->file >= 0)
+		FileClose(sx->file);
+
+	stream_spool_path(path, sx->xid);
+	if (unlink(path) != 0 && errno != ENOENT)
+		ereport(WARNING,
+				(errcode_for_file_access(),
+				 errmsg("could not remove file \"%s\": %m", path)));
+
+	if (sx->subxacts != NULL)
+		pfree(sx->subxacts);
+
+	if (stream_replay == sx)
+		stream_replay = NULL;
+
+	hash_search(StreamXactHash, &sx->xid, HASH_REMOVE, NULL);
+}
+
+/* Remove the spool files when the apply worker exits */
+static void
+stream_on_exit(int code, Datum arg)
+{
+	HASH_SEQ_STATUS status;
+	SpockStreamXact *sx;
+
+	hash_seq_init(&status, StreamXactHash);
+	while ((sx = (SpockStreamXact *) hash_seq_search(&status)) != NULL)
+	{
+		char		path[MAXPGPATH];
+
+		stream_spool_path(path, sx->xid);
+		if (unlink(path) != 0 && errno != ENOENT)
+			elog(WARNING, "Failed to clean up spock stream spool file \"%s\" on exit: %m",
+				 path);
+	}
+}
+
+/* Write out the buffered messages of the current block */
+static void
+stream_flush(void)
+{
+	int			nbytes = stream_wbuf.len;
+	int			written;
+
+	if (nbytes == 0)
+		return;
+
+	Assert(stream_current != NULL);
+
+	errno = 0;
+	written = FileWrite(stream_current->file, stream_wbuf.data, nbytes,
+						stream_current->size - nbytes,
+						WAIT_EVENT_BUFFILE_WRITE);
+	if (written != nbytes)
+	{
+		char		path[MAXPGPATH];
+
+		/* if write didn't set errno, assume problem is no disk space */
+		if (errno == 0)
+			errno = ENOSPC;
+		stream_spool_path(path, stream_current->xid);
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not write to file \"%s\": %m", path)));
+	}
+
+	resetStringInfo(&stream_wbuf);
+}
+
+/* Copy the next nbytes of the spool being applied to dst */
+static void
+stream_read(char *dst, int nbytes)
+{
+	while (nbytes > 0)
+	{
+		int			n;
+
+		if (stream_rbuf_off == stream_rbuf_len)
+		{
+			off_t		left = stream_replay->size - stream_replay_fileoff;
+			int			nread;
+
+			n = (int) Min(left, (off_t) STREAM_SPOOL_BUF_SIZE);
+			nread = (n > 0) ?
+				FileRead(stream_replay->file, stream_rbuf, n,
+						 stream_replay_fileoff, WAIT_EVENT_BUFFILE_READ) : 0;
+			if (nread <= 0)
+			{
+				char		path[MAXPGPATH];
+
+				stream_spool_path(path, stream_replay->xid);
+				if (nread < 0)
+					ereport(ERROR,
+							(errcode_for_file_access(),
+							 errmsg("could not read file \"%s\": %m", path)));
+				ereport(ERROR,
+						(errcode(ERRCODE_DATA_CORRUPTED),
+						 errmsg("unexpected end of file \"%s\"", path)));
+			}
+
+			stream_replay_fileoff += nread;
+			stream_rbuf_len = nread;
+			stream_rbuf_off = 0;
+		}
+
+		n = Min(nbytes, stream_rbuf_len - stream_rbuf_off);
+		memcpy(dst, stream_rbuf + stream_rbuf_off, n);
+		stream_rbuf_off += n;
+		dst += n;
+		nbytes -= n;
+	}
+}
+
+/*
+ * Set up the spooling of streamed transactions in the apply worker.
+ */
+void
+spock_apply_stream_init(void)
+{
+	HASHCTL		ctl;
+	MemoryContext oldctx;
+
+	if (StreamXactHash != NULL)
+		return;
+
+	StreamContext = AllocSetContextCreate(TopMemoryContext,
+										  "spock stream spool",
+										  ALLOCSET_DEFAULT_SIZES);
+
+	MemSet(&ctl, 0, sizeof(ctl));
+	ctl.keysize = sizeof(TransactionId);
+	ctl.entrysize = sizeof(SpockStreamXact);
+	ctl.hcxt = StreamContext;
+	StreamXactHash = hash_create("spock streamed transactions", 16, &ctl,
+								 HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+	oldctx = MemoryContextSwitchTo(StreamContext);
+	initStringInfo(&stream_wbuf);
+	initStringInfo(&stream_msg);
+	stream_rbuf = palloc(STREAM_SPOOL_BUF_SIZE);
+	MemoryContextSwitchTo(oldctx);
+
+	on_proc_exit(stream_on_exit, (Datum) 0);
+}
+
+/*
+ * STREAM START: the following messages belong to the given transaction.
+ */
+void
+spock_apply_stream_start(TransactionId xid, bool first_segment)
+{
+	SpockStreamXact *sx;
+	bool		found;
+
+	if (stream_current != NULL)
+		elog(ERROR, "SPOCK %s: STREAM START for transaction %u while streaming transaction %u",
+			 MySubscription->name, xid, stream_current->xid);
+
+	sx = (SpockStreamXact *) hash_search(StreamXactHash, &xid, HASH_ENTER,
+										 &found);
+
+	if (!found)
+	{
+		char		path[MAXPGPATH];
+
+		sx->file = -1;
+		sx->size = 0;
+		sx->committed = false;
+		sx->subxacts = NULL;
+		sx->nsubxacts = 0;
+		sx->maxsubxacts = 0;
+
+		if (!first_segment)
+		{
+			hash_search(StreamXactHash, &xid, HASH_REMOVE, NULL);
+			elog(ERROR, "SPOCK %s: missing the start of streamed transaction %u",
+				 MySubscription->name, xid);
+		}
+
+		stream_spool_path(path, xid);
+		sx->file = PathNameOpenFile(path, O_RDWR | O_CREAT | O_TRUNC | PG_BINARY);
+		if (sx->file < 0)
+		{
+			hash_search(StreamXactHash, &xid, HASH_REMOVE, NULL);
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("could not create file \"%s\": %m", path)));
+		}
+	}
+	else if (first_segment)
+	{
+		/* The provider started over, e.g. after a reconnect */
+		if (FileTruncate(sx->file, 0, WAIT_EVENT_DATA_FILE_TRUNCATE) < 0)
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("could not truncate spool file of transaction %u: %m",
+							xid)));
+		sx->size = 0;
+		sx->nsubxacts = 0;
+	}
+
+	stream_current = sx;
+}
+
+/*
+ * STREAM CHANGE: spool the rest of the message for the transaction or its
+ * subtransaction xid.
+ */
+void
+spock_apply_stream_write(TransactionId xid, StringInfo s)
+{
+	SpockStreamXact *sx = stream_current;
+	uint32		len = s->len - s->cursor;
+
+	if (sx == NULL)
+		elog(ERROR, "SPOCK %s: streamed change outside of a STREAM block",
+			 MySubscription->name);
+
+	/* Remember where each subtransaction starts, for its abort */
+	if (xid != sx->xid &&
+		(sx->nsubxacts == 0 || sx->subxacts[sx->nsubxacts - 1].xid != xid))
+	{
+		int			i;
+
+		for (i = sx->nsubxacts - 1; i >= 0; i--)
+			if (sx->subxacts[i].xid == xid)
+				break;
+
+		if (i < 0)
+		{
+			if (sx->nsubxacts == sx->maxsubxacts)
+			{
+				sx->maxsubxacts = Max(16, sx->maxsubxacts * 2);
+				if (sx->subxacts == NULL)
+					sx->subxacts = MemoryContextAlloc(StreamContext,
+													  sx->maxsubxacts * sizeof(SpockStreamSubXact));
+				else
+					sx->subxacts = repalloc(sx->subxacts,
+											sx->maxsubxacts * sizeof(SpockStreamSubXact));
+			}
+			sx->subxacts[sx->nsubxacts].xid = xid;
+			sx->subxacts[sx->nsubxacts].offset = sx->size;
+			sx->nsubxacts++;
+		}
+	}
+
+	appendBinaryStringInfo(&stream_wbuf, (char *) &len, sizeof(len));
+	appendBinaryStringInfo(&stream_wbuf, s->data + s->cursor, len);
+	sx->size += sizeof(len) + len;
+
+	if (stream_wbuf.len >= STREAM_SPOOL_BUF_SIZE)
+		stream_flush();
+}
+
+/*
+ * STREAM STOP: end of the block.
+ */
+void
+spock_apply_stream_stop(void)
+{
+	if (stream_current == NULL)
+		elog(ERROR, "SPOCK %s: STREAM STOP outside of a STREAM block",
+			 MySubscription->name);
+
+	stream_flush();
+	stream_current = NULL;
+}
+
+/*
+ * STREAM ABORT: discard the transaction, or everything spooled since the
+ * first change of the aborted subtransaction.
+ */
+void
+spock_apply_stream_abort(TransactionId xid, TransactionId subxid)
+{
+	SpockStreamXact *sx;
+	int			i;
+
+	if (stream_current != NULL)
+		elog(ERROR, "SPOCK %s: STREAM ABORT inside of a STREAM block",
+			 MySubscription->name);
+
+	sx = (SpockStreamXact *) hash_search(StreamXactHash, &xid, HASH_FIND,
+										 NULL);
+
+	/* Nothing spooled, e.g. everything was filtered out */
+	if (sx == NULL)
+		return;
+
+	if (subxid == xid)
+	{
+		stream_xact_remove(sx);
+		return;
+	}
+
+	for (i = sx->nsubxacts - 1; i >= 0; i--)
+	{
+		if (sx->subxacts[i].xid == subxid)
+		{
+			/* Later subtransactions were nested in the aborted one */
+			sx->size = sx->subxacts[i].offset;
+			sx->nsubxacts = i;
+
+			if (FileTruncate(sx->file, sx->size, WAIT_EVENT_DATA_FILE_TRUNCATE) < 0)
+				ereport(ERROR,
+						(errcode_for_file_access(),
+						 errmsg("could not truncate spool file of transaction %u: %m",
+								xid)));
+			break;
+		}
+	}
+}
+
+/*
+ * STREAM COMMIT: start applying the spooled messages of the transaction, see
+ * spock_apply_stream_replay_next().
+ */
+void
+spock_apply_stream_replay_begin(TransactionId xid)
+{
+	SpockStreamXact *sx;
+
+	sx = (SpockStreamXact *) hash_search(StreamXactHash, &xid, HASH_FIND,
+										 NULL);
+	if (sx == NULL)
+		elog(ERROR, "SPOCK %s: no spooled changes for streamed transaction %u",
+			 MySubscription->name, xid);
+
+	sx->committed = true;
+
+	stream_replay = sx;
+	stream_replay_fileoff = 0;
+	stream_rbuf_len = 0;
+	stream_rbuf_off = 0;
+}
+
+/*
+ * Return the next spooled message of the transaction being applied, or NULL
+ * at the end. The message is valid until the next call.
+ */
+StringInfo
+spock_apply_stream_replay_next(void)
+{
+	uint32		len;
+
+	if (stream_replay == NULL)
+		return NULL;
+
+	if (stream_replay_fileoff - (stream_rbuf_len - stream_rbuf_off) >=
+		stream_replay->size)
+	{
+		stream_replay = NULL;
+		return NULL;
+	}
+
+	stream_read((char *) &len, sizeof(len));
+
+	resetStringInfo(&stream_msg);
+	enlargeStringInfo(&stream_msg, len);
+	stream_read(stream_msg.data, len);
+	stream_msg.len = len;
+	stream_msg.data[len] = '\0';
+
+	return &stream_msg;
+}
+
+/*
+ * Remove the spool files of the transactions applied since the last call.
+ * Called once the replay queue is reset, i.e. the transaction is done.
+ */
+void
+spock_apply_stream_cleanup(void)
+{
+	HASH_SEQ_STATUS status;
+	SpockStreamXact *sx;
+
+	if (StreamXactHash == NULL)
+		return;
+
+	stream_replay = NULL;
+
+	hash_seq_init(&status, StreamXactHash);
+	while ((sx = (SpockStreamXact *) hash_seq_search(&status)) != NULL)
+	{
+		if (sx->committed)
+			stream_xact_remove(sx);
+	}
+}
@@ -26,6 +26,7 @@
 #include "utils/pg_lsn.h"
 #include "utils/snapmgr.h"
 #include "utils/syscache.h"
+#include "utils/typcache.h"
 
 #include "spock_common.h"
 #include "spock_compat.h"
@@ -35,6 +36,16 @@ static StrategyNumber spock_get_equal_strategy_number(Oid opclass);
 #endif
 static int	spock_build_replindex_scan_key(ScanKey skey, Relation rel,
 										   Relation idxrel, TupleTableSlot *searchslot);
+static void spock_replindex_scan_key_fill(ScanKey skey, int nkeys,
+										  Relation idxrel,
+										  TupleTableSlot *searchslot);
+static bool spock_find_repl_tuple_by_index(EState *estate, Relation rel,
+										   Relation idxrel,
+										   ScanKey skey_template, int nkeys,
+										   LockTupleMode lockmode,
+										   TupleTableSlot *searchslot,
+										   TupleTableSlot *outslot,
+										   bool full_match);
 
 /*
  * Temporarily switch to a new user ID.
@@ -286,6 +297,55 @@ SpockPredicateMatches(EState *estate, ExprState *predExpr, TupleTableSlot *slot)
 	return ExecQual(predExpr, econtext);
 }
 
+/*
+ * Compare the tuples in the slots column by column, the way the sequential
+ * search for a replica identity FULL row does.
+ *
+ * Dropped and generated columns are ignored as the publisher doesn't send
+ * those, and unlike in SQL two NULLs count as equal.
+ */
+bool
+spock_tuples_equal(TupleTableSlot *slot1, TupleTableSlot *slot2)
+{
+	TupleDesc	desc = slot1->tts_tupleDescriptor;
+	int			attrnum;
+
+	Assert(desc->natts == slot2->tts_tupleDescriptor->natts);
+
+	slot_getallattrs(slot1);
+	slot_getallattrs(slot2);
+
+	for (attrnum = 0; attrnum < desc->natts; attrnum++)
+	{
+		Form_pg_attribute att = TupleDescAttr(desc, attrnum);
+		TypeCacheEntry *typentry;
+
+		if (att->attisdropped || att->attgenerated)
+			continue;
+
+		if (slot1->tts_isnull[attrnum] != slot2->tts_isnull[attrnum])
+			return false;
+
+		if (slot1->tts_isnull[attrnum])
+			continue;
+
+		typentry = lookup_type_cache(att->atttypid, TYPECACHE_EQ_OPR_FINFO);
+		if (!OidIsValid(typentry->eq_opr_finfo.fn_oid))
+			ereport(ERROR,
+					(errcode(ERRCODE_UNDEFINED_FUNCTION),
+					 errmsg("could not identify an equality operator for type %s",
+							format_type_be(att->atttypid))));
+
+		if (!DatumGetBool(FunctionCall2Coll(&typentry->eq_opr_finfo,
+											att->attcollation,
+											slot1->tts_values[attrnum],
+											slot2->tts_values[attrnum])))
+			return false;
+	}
+
+	return true;
+}
+
 /*
  * Search the relation 'rel' for tuple using the index.
  *
@@ -299,6 +359,67 @@ SpockRelationFindReplTupleByIndex(EState *estate,
 								  LockTupleMode lockmode,
 								  TupleTableSlot *searchslot,
 								  TupleTableSlot *outslot)
+{
+	Assert(idxrel->rd_index->indisunique);
+
+	return spock_find_repl_tuple_by_index(estate, rel, idxrel, NULL, 0,
+										  lockmode, searchslot, outslot, false);
+}
+
+/*
+ * Like SpockRelationFindReplTupleByIndex(), with the scan key prepared by
+ * spock_replindex_scan_key_init() in advance.
+ */
+bool
+SpockRelationFindReplTupleByIndexKey(EState *estate,
+									 Relation rel,
+									 Relation idxrel,
+									 ScanKey skey,
+									 int nkeys,
+									 LockTupleMode lockmode,
+									 TupleTableSlot *searchslot,
+									 TupleTableSlot *outslot)
+{
+	Assert(idxrel->rd_index->indisunique);
+
+	return spock_find_repl_tuple_by_index(estate, rel, idxrel, skey, nkeys,
+										  lockmode, searchslot, outslot, false);
+}
+
+/*
+ * Search the relation 'rel' for the replica identity FULL tuple searchslot
+ * using a possibly non-unique index on some of its columns.
+ *
+ * The index only narrows down the candidates, the tuple returned is the
+ * first one whose columns all match, like with RelationFindReplTupleSeq().
+ */
+bool
+SpockRelationFindReplTupleByFullIndex(EState *estate,
+									  Relation rel,
+									  Relation idxrel,
+									  LockTupleMode lockmode,
+									  TupleTableSlot *searchslot,
+									  TupleTableSlot *outslot)
+{
+	return spock_find_repl_tuple_by_index(estate, rel, idxrel, NULL, 0,
+										  lockmode, searchslot, outslot, true);
+}
+
+/*
+ * Workhorse of the functions above, full_match tells whether the whole tuple
+ * has to match or only the index keys. The scan key is built here unless
+ * skey_template is given.
+ */
+static bool
+spock_find_repl_tuple_by_index(EState *estate,
+							   Relation rel,
+							   Relation idxrel,
+							   ScanKey skey_template,
+							   int nkeys,
+							   LockTupleMode lockmode,
+							   TupleTableSlot *searchslot,
+							   TupleTableSlot *outslot,
+							   bool full_match)
 {
 	ScanKeyData skey[INDEX_MAX_KEYS];
 	int			skey_attoff;
@@ -308,7 +429,6 @@ SpockRelationFindReplTupleByIndex(EState *estate,
 	bool		found;
 	ExprState  *predExpr;
 
-	Assert(idxrel->rd_index->indisunique);
 	predExpr = SpockPreparePredicateExpr(idxrel, estate);
 
 	/*
@@ -324,7 +444,15 @@ SpockRelationFindReplTupleByIndex(EState *estate,
 	InitDirtySnapshot(snap);
 
 	/* Build scan key. */
-	skey_attoff = spock_build_replindex_scan_key(skey, rel, idxrel, searchslot);
+	if (skey_template != NULL)
+	{
+		skey_attoff = nkeys;
+		memcpy(skey, skey_template, nkeys * sizeof(ScanKeyData));
+		spock_replindex_scan_key_fill(skey, skey_attoff, idxrel, searchslot);
+	}
+	else
+		skey_attoff = spock_build_replindex_scan_key(skey, rel, idxrel,
+													 searchslot);
 
 	/* Start an index scan. */
 	scan = index_beginscan(rel, idxrel, &snap, skey_attoff, 0);
@@ -337,7 +465,12 @@ retry:
 	/* Try to find the tuple */
 	while (index_getnext_slot(scan, ForwardScanDirection, outslot))
 	{
-		if (!index_keys_have_nonnulls(outslot, searchslot, idxrel, skey, skey_attoff))
+		if (full_match)
+		{
+			if (!spock_tuples_equal(outslot, searchslot))
+				continue;
+		}
+		else if (!index_keys_have_nonnulls(outslot, searchslot, idxrel, skey, skey_attoff))
 			continue;
 
 		/* Skip if local tuple does not satisfy the index predicate */
@@ -439,6 +572,49 @@ spock_get_equal_strategy_number(Oid opclass)
 static int
 spock_build_replindex_scan_key(ScanKey skey, Relation rel, Relation idxrel,
 							   TupleTableSlot *searchslot)
+{
+	int			skey_attoff;
+
+	skey_attoff = spock_replindex_scan_key_init(skey, idxrel);
+	spock_replindex_scan_key_fill(skey, skey_attoff, idxrel, searchslot);
+
+	return skey_attoff;
+}
+
+/*
+ * Set the values to search for in a ScanKey prepared by
+ * spock_replindex_scan_key_init() from the tuple in searchslot.
+ */
+static void
+spock_replindex_scan_key_fill(ScanKey skey, int nkeys, Relation idxrel,
+							  TupleTableSlot *searchslot)
+{
+	int2vector *indkey = &idxrel->rd_index->indkey;
+	int			i;
+
+	for (i = 0; i < nkeys; i++)
+	{
+		int			table_attno = indkey->values[skey[i].sk_attno - 1];
+
+		skey[i].sk_argument = searchslot->tts_values[table_attno - 1];
+
+		/* Check for null value. */
+		skey[i].sk_flags &= ~(SK_ISNULL | SK_SEARCHNULL);
+		if (searchslot->tts_isnull[table_attno - 1])
+			skey[i].sk_flags |= (SK_ISNULL | SK_SEARCHNULL);
+	}
+}
+
+/*
+ * Setup the ScanKey for an equality search of the index, without the values
+ * to search for, see spock_replindex_scan_key_fill(). The operator lookups
+ * are what this costs, so the result may be kept as long as the index
+ * doesn't change; the function info is allocated in CurrentMemoryContext.
+ *
+ * Returns how many columns to use for the index scan.
+ */
+int
+spock_replindex_scan_key_init(ScanKey skey, Relation idxrel)
 {
 	int			index_attoff;
 	int			skey_attoff = 0;
@@ -508,14 +684,10 @@ spock_build_replindex_scan_key(ScanKey skey, Relation rel, Relation idxrel,
 					index_attoff + 1,
 					eq_strategy,
 					regop,
-					searchslot->tts_values[table_attno - 1]);
+					(Datum) 0);
 
 		skey[skey_attoff].sk_collation = idxrel->rd_indcollation[index_attoff];
 
-		/* Check for null value. */
-		if (searchslot->tts_isnull[table_attno - 1])
-			skey[skey_attoff].sk_flags |= (SK_ISNULL | SK_SEARCHNULL);
-
 		skey_attoff++;
 	}
 
@@ -0,0 +1,225 @@
+/*-------------------------------------------------------------------------
+ *
+ * spock_compress.c
+ * 		spock compression of replication stream messages
+ *
+ * A subscriber may ask the provider to compress the messages it sends, see
+ * spock.stream_compression. The provider then replaces the body of every
+ * message large enough to be worth it, everything after the remote insert
+ * LSN, with a compressed one:
+ *
+ *		'Z'			action byte of a compressed message
+ *		uint8		SpockCompression method
+ *		int32		length of the body before compression
+ *		...			the compressed body
+ *
+ * The apply worker restores the original message as soon as it is received,
+ * so the rest of the apply machinery never sees the compressed form.
+ *
+ * Copyright (c) 2022-2026, pgEdge, Inc.
+ * Portions Copyright (c) 1996-2021, PostgreSQL Global Development Group
+ * Portions Copyright (c) 1994, The Regents of the University of California
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#ifdef USE_LZ4
+#include <lz4.h>
+#endif
+#ifdef USE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "libpq/pqformat.h"
+
+#include "spock_compress.h"
+
+/* Favour speed, the stream is compressed on the fly */
+#define SPOCK_ZSTD_LEVEL	1
+
+int			spock_stream_compression = SPOCK_COMPRESSION_NONE;
+
+#ifdef USE_ZSTD
+static ZSTD_CCtx *zstd_cctx = NULL;
+static ZSTD_DCtx *zstd_dctx = NULL;
+#endif
+
+/*
+ * Look up a method by the name used in the startup parameters. Returns
+ * SPOCK_COMPRESSION_NONE for methods this build does not support.
+ */
+SpockCompression
+spock_compression_from_name(const char *name)
+{
+#ifdef USE_LZ4
+	if (strcmp(name, "lz4") == 0)
+		return SPOCK_COMPRESSION_LZ4;
+#endif
+#ifdef USE_ZSTD
+	if (strcmp(name, "zstd") == 0)
+		return SPOCK_COMPRESSION_ZSTD;
+#endif
+
+	return SPOCK_COMPRESSION_NONE;
+}
+
+const char *
+spock_compression_name(SpockCompression method)
+{
+	switch (method)
+	{
+		case SPOCK_COMPRESSION_NONE:
+			return "none";
+		case SPOCK_COMPRESSION_LZ4:
+			return "lz4";
+		case SPOCK_COMPRESSION_ZSTD:
+			return "zstd";
+	}
+
+	return "unknown";
+}
+
+/*
+ * Append the compressed form of srclen bytes at src to dst.
+ *
+ * Returns false and leaves dst alone if compressing doesn't make the message
+ * any shorter.
+ */
+bool
+spock_compress(SpockCompression method, const char *src, int srclen,
+			   StringInfo dst)
+{
+	int			start = dst->len;
+	int			avail = srclen - SPOCK_COMPRESSED_HDR_SIZE;
+	int			len = 0;
+
+	if (avail <= 0)
+		return false;
+
+	/* Room for whatever the library may write, we give up past avail anyway */
+	enlargeStringInfo(dst, SPOCK_COMPRESSED_HDR_SIZE + srclen);
+
+	pq_sendbyte(dst, SPOCK_COMPRESSED_MSG);
+	pq_sendbyte(dst, (uint8) method);
+	pq_sendint32(dst, srclen);
+
+	switch (method)
+	{
+#ifdef USE_LZ4
+		case SPOCK_COMPRESSION_LZ4:
+			len = LZ4_compress_default(src, dst->data + dst->len, srclen,
+									   avail);
+			break;
+#endif
+#ifdef USE_ZSTD
+		case SPOCK_COMPRESSION_ZSTD:
+			{
+				size_t		res;
+
+				if (zstd_cctx == NULL)
+				{
+					zstd_cctx = ZSTD_createCCtx();
+					if (zstd_cctx == NULL)
+						ereport(ERROR,
+								(errcode(ERRCODE_OUT_OF_MEMORY),
+								 errmsg("out of memory")));
+				}
+
+				res = ZSTD_compressCCtx(zstd_cctx, dst->data + dst->len, avail,
+										src, srclen, SPOCK_ZSTD_LEVEL);
+				len = ZSTD_isError(res) ? 0 : (int) res;
+				break;
+			}
+#endif
+		default:
+			elog(ERROR, "unsupported stream compression method %d", method);
+	}
+
+	/* Didn't fit, send the message as it is */
+	if (len <= 0 || len >= avail)
+	{
+		dst->len = start;
+		dst->data[start] = '\0';
+		return false;
+	}
+
+	dst->len += len;
+	dst->data[dst->len] = '\0';
+
+	return true;
+}
+
+/*
+ * Length of the message compressed by spock_compress() into srclen bytes at
+ * src, once decompressed.
+ */
+int
+spock_decompressed_size(const char *src, int srclen)
+{
+	uint32		rawlen;
+
+	if (srclen < SPOCK_COMPRESSED_HDR_SIZE || src[0] != SPOCK_COMPRESSED_MSG)
+		elog(ERROR, "invalid compressed message");
+
+	memcpy(&rawlen, src + 2, sizeof(rawlen));
+	rawlen = pg_ntoh32(rawlen);
+
+	if (rawlen > MaxAllocSize)
+		elog(ERROR, "invalid compressed message length %u", rawlen);
+
+	return (int) rawlen;
+}
+
+/*
+ * Decompress the message at src into the rawlen bytes at dst, rawlen being
+ * what spock_decompressed_size() returned for it.
+ */
+void
+spock_decompress(const char *src, int srclen, char *dst, int rawlen)
+{
+	SpockCompression method = (SpockCompression) (uint8) src[1];
+	int			len = -1;
+
+	src += SPOCK_COMPRESSED_HDR_SIZE;
+	srclen -= SPOCK_COMPRESSED_HDR_SIZE;
+
+	switch (method)
+	{
+#ifdef USE_LZ4
+		case SPOCK_COMPRESSION_LZ4:
+			len = LZ4_decompress_safe(src, dst, srclen, rawlen);
+			break;
+#endif
+#ifdef USE_ZSTD
+		case SPOCK_COMPRESSION_ZSTD:
+			{
+				size_t		res;
+
+				if (zstd_dctx == NULL)
+				{
+					zstd_dctx = ZSTD_createDCtx();
+					if (zstd_dctx == NULL)
+						ereport(ERROR,
+								(errcode(ERRCODE_OUT_OF_MEMORY),
+								 errmsg("out of memory")));
+				}
+
+				res = ZSTD_decompressDCtx(zstd_dctx, dst, rawlen, src, srclen);
+				len = ZSTD_isError(res) ? -1 : (int) res;
+				break;
+			}
+#endif
+		default:
+			ereport(ERROR,
+					(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+					 errmsg("received a message compressed with unsupported method %d",
+							method)));
+	}
+
+	if (len != rawlen)
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 errmsg("could not decompress %s message of %d bytes",
+						spock_compression_name(method), rawlen)));
+}
@@ -50,6 +50,7 @@
 #include "utils/typcache.h"
 
 #include "spock.h"
+#include "spock_apply.h"
 #include "spock_conflict.h"
 #include "spock_proto_native.h"
 #include "spock_node.h"
@@ -216,13 +217,16 @@ get_tuple_origin(SpockRelation *rel, HeapTuple local_tuple, ItemPointer tid,
 		return TransactionIdGetCommitTsData(*xmin, local_ts, local_origin);
 	}
 
-	if (TransactionIdEquals(*xmin, GetTopTransactionId()))
+	if (TransactionIdIsCurrentTransactionId(*xmin))
 	{
 		/*
 		 * The tuple was created by current xact, no commit timestamp yet.
+		 * With spock.apply_coalesce_xacts, that may be a previous remote
+		 * transaction of the same origin, which has a timestamp of its own.
 		 */
 		*local_origin = replorigin_session_origin;
-		*local_ts = replorigin_session_origin_timestamp;
+		if (!spock_apply_coalesced_commit_ts(*xmin, local_ts))
+			*local_ts = replorigin_session_origin_timestamp;
 		return true;
 	}
 
@@ -185,6 +185,9 @@ PG_FUNCTION_INFO_V1(delta_apply_money);
 /* Function to control REPAIR mode */
 PG_FUNCTION_INFO_V1(spock_repair_mode);
 
+/* Parallel initial data copy */
+PG_FUNCTION_INFO_V1(spock_sync_origin_session_share);
+
 /* Function to get a LSN based on commit timestamp */
 PG_FUNCTION_INFO_V1(spock_get_lsn_from_commit_ts);
 
@@ -3028,7 +3031,7 @@ get_channel_stats(PG_FUNCTION_ARGS)
 
 		/*
 		 * Acquire spinlock before reading counter values to prevent torn
-		 * reads. The writer (handle_stats_counter) uses entry->mutex to
+		 * reads. The writer (spock_stats_flush) uses entry->mutex to
 		 * protect counter updates, so we must use the same lock for reads
 		 * to ensure atomic access to 64-bit counter values.
 		 */
@@ -3215,6 +3218,35 @@ spock_repair_mode(PG_FUNCTION_ARGS)
 	PG_RETURN_LSN(lsn);
 }
 
+/*
+ * spock_sync_origin_session_share
+ *
+ * Join the replication origin session which the backend with the given PID
+ * has set up, so that the rows this backend writes are attributed to the
+ * same origin. Used by the additional target connections of a parallel
+ * initial data copy, see copy_tables_parallel().
+ */
+Datum
+spock_sync_origin_session_share(PG_FUNCTION_ARGS)
+{
+#if PG_VERSION_NUM >= 160000
+	Name		origin_name = PG_GETARG_NAME(0);
+	int			leader_pid = PG_GETARG_INT32(1);
+	RepOriginId originid;
+
+	originid = replorigin_by_name(NameStr(*origin_name), false);
+	replorigin_session_setup_shared(originid, leader_pid);
+	replorigin_session_origin = originid;
+
+	PG_RETURN_VOID();
+#else
+	ereport(ERROR,
+			(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+			 errmsg("sharing a replication origin session requires PostgreSQL 16 or later")));
+	PG_RETURN_VOID();			/* keep compiler quiet */
+#endif
+}
+
 /*
  * spock_create_sync_event
  *
@@ -3518,10 +3550,14 @@ get_apply_group_progress(PG_FUNCTION_ARGS)
 	hash_seq_init(&it, SpockGroupHash);
 	while ((e = (SpockGroupEntry *) hash_seq_search(&it)) != NULL)
 	{
-		SpockApplyProgress *sap = &e->progress;
+		SpockApplyProgress	progress;
+		SpockApplyProgress *sap = &progress;
 		Datum				values[_GP_LAST_];
 		bool				nulls[_GP_LAST_] = {0};
 
+		/* Consistent copy, without holding up apply commits */
+		spock_group_progress_read(e, &progress);
+
 		/*
 		 * Centralise conversion of local representation of the progress data
 		 * to an external representation. This is a good place to check
@@ -18,6 +18,7 @@
  *     Each entry (SpockGroupEntry) contains:
  *       * key                           -- identity
  *       * progress (SpockApplyProgress) -- last applied remote commit snapshot
+ *       * mutex, changecount            -- seqlock guarding progress
  *       * nattached, prev_processed_cv  -- apply-worker coordination (runtime)
  *
  * Persistence:
@@ -30,6 +31,9 @@
  * Notes:
  *   - Entries are never deleted during normal operation; pointers returned by
  *     spock_group_attach() are stable for the lifetime of the postmaster.
+ *   - apply_group_master_lock only covers the hash itself (insert, scan).
+ *     Progress updates and reads of a known entry never take it, so commits
+ *     of one subscription don't queue behind those of another.
  *   - File header contains version + system_identifier; mismatches cause the
  *     loader to skip the file.
  *
@@ -43,7 +47,9 @@
 #include "datatype/timestamp.h"
 #include "storage/fd.h"
 #include "storage/ipc.h"
+#include "port/atomics.h"
 #include "storage/shmem.h"
+#include "storage/spin.h"
 #include "utils/builtins.h"
 #include "utils/elog.h"
 #include "utils/guc.h"
@@ -91,6 +97,20 @@ init_progress_fields(SpockApplyProgress *progress)
 	progress->updated_by_decode = false;
 }
 
+/*
+ * Initialize a freshly inserted hash entry.  The key is already set.
+ */
+static void
+init_group_entry(SpockGroupEntry *entry)
+{
+	init_progress_fields(&entry->progress);
+
+	SpinLockInit(&entry->mutex);
+	pg_atomic_init_u32(&entry->changecount, 0);
+	pg_atomic_init_u32(&entry->nattached, 0);
+	ConditionVariableInit(&entry->prev_processed_cv);
+}
+
 /*
  * spock_group_shmem_request
  *
@@ -219,10 +239,7 @@ spock_group_attach(Oid dbid, Oid node_id, Oid remote_node_id)
 		 * New entry: the hash table already copied 'key' into
 		 * entry->progress.key, now initialize the remaining progress fields.
 		 */
-		init_progress_fields(&entry->progress);
-
-		pg_atomic_init_u32(&entry->nattached, 0);
-		ConditionVariableInit(&entry->prev_processed_cv);
+		init_group_entry(entry);
 	}
 
 	pg_atomic_add_fetch_u32(&entry->nattached, 1);
@@ -312,8 +329,8 @@ progress_update_struct(SpockApplyProgress *dest, const SpockApplyProgress *src)
  * spock_group_progress_update
  *
  * Update the progress snapshot for (dbid,node_id,remote_node_id).
- * Uses hash_search(HASH_ENTER) for table access, then copies 'sap' into the
- * entry's progress payload under the gate lock (writers EXCLUSIVE).
+ * The gate lock is only taken to find the entry (EXCLUSIVE if it has to be
+ * inserted), 'sap' is then merged into the payload via the entry's seqlock.
  *
  * Returns: true if the record already existed (updated), false if newly inserted.
  */
@@ -347,49 +364,61 @@ spock_group_progress_update(const SpockApplyProgress *sap)
 		return false;
 	}
 
-	/* Potential hash table change needs an exclusive lock */
-	LWLockAcquire(SpockCtx->apply_group_master_lock, LW_EXCLUSIVE);
-
+	/* Most of the time the entry exists, look it up in shared mode first */
+	LWLockAcquire(SpockCtx->apply_group_master_lock, LW_SHARED);
 	entry = (SpockGroupEntry *) hash_search(SpockGroupHash, &sap->key,
-											HASH_ENTER, &found);
-
-	/*
-	 * HASH_FIXED_SIZE hash tables can return NULL when full. Check for this
-	 * to prevent dereferencing NULL pointer.
-	 */
-	if (entry == NULL)
-	{
-		LWLockRelease(SpockCtx->apply_group_master_lock);
-		elog(WARNING, "SpockGroupHash is full, cannot update progress for group "
-			 "(dbid=%u, node_id=%u, remote_node_id=%u)",
-			 sap->key.dbid, sap->key.node_id, sap->key.remote_node_id);
-		return false;
-	}
+											HASH_FIND, &found);
+	LWLockRelease(SpockCtx->apply_group_master_lock);
 
 	if (!found)
 	{
+		/* Potential hash table change needs an exclusive lock */
+		LWLockAcquire(SpockCtx->apply_group_master_lock, LW_EXCLUSIVE);
+
+		entry = (SpockGroupEntry *) hash_search(SpockGroupHash, &sap->key,
+												HASH_ENTER, &found);
+
+		/*
+		 * HASH_FIXED_SIZE hash tables can return NULL when full. Check for
+		 * this to prevent dereferencing NULL pointer.
+		 */
+		if (entry == NULL)
+		{
+			LWLockRelease(SpockCtx->apply_group_master_lock);
+			elog(WARNING, "SpockGroupHash is full, cannot update progress for group "
+				 "(dbid=%u, node_id=%u, remote_node_id=%u)",
+				 sap->key.dbid, sap->key.node_id, sap->key.remote_node_id);
+			return false;
+		}
+
 		/*
 		 * New entry: the hash table already copied sap->key into
 		 * entry->progress.key, now initialize the remaining fields.
 		 */
-		init_progress_fields(&entry->progress);
+		if (!found)
+			init_group_entry(entry);
 
-		pg_atomic_init_u32(&entry->nattached, 0);
-		ConditionVariableInit(&entry->prev_processed_cv);
+		LWLockRelease(SpockCtx->apply_group_master_lock);
 	}
 
-	progress_update_struct(&entry->progress, sap);
-	LWLockRelease(SpockCtx->apply_group_master_lock);
+	/* Entries are never removed, so the pointer stays valid unlocked */
+	spock_group_progress_update_ptr(entry, sap);
 	return found;
 }
 
-/* Fast update when you already hold the pointer (apply hot path) */
+/*
+ * Fast update when you already hold the pointer (apply hot path).  Only
+ * writers of the same group wait for each other.
+ */
 void
 spock_group_progress_update_ptr(SpockGroupEntry *e,
 								const SpockApplyProgress *sap)
 {
 	Assert(e && sap);
-	LWLockAcquire(SpockCtx->apply_group_master_lock, LW_EXCLUSIVE);
+
+	SpinLockAcquire(&e->mutex);
+	pg_atomic_fetch_add_u32(&e->changecount, 1);
+
 	progress_update_struct(&e->progress, sap);
 
 	/* Insert LSN can't be less than the end of an inserted record */
@@ -397,7 +426,39 @@ spock_group_progress_update_ptr(SpockGroupEntry *e,
 		   e->progress.remote_commit_lsn == InvalidXLogRecPtr ||
 		   e->progress.remote_commit_lsn <= e->progress.remote_insert_lsn);
 
-	LWLockRelease(SpockCtx->apply_group_master_lock);
+	pg_atomic_fetch_add_u32(&e->changecount, 1);
+	SpinLockRelease(&e->mutex);
+}
+
+/*
+ * spock_group_progress_read
+ *
+ * Take a consistent copy of the group's progress without blocking writers.
+ * The copy is retried if a writer was active while it was taken.
+ */
+void
+spock_group_progress_read(SpockGroupEntry *e, SpockApplyProgress *sap)
+{
+	Assert(e && sap);
+
+	for (;;)
+	{
+		uint32		before;
+		uint32		after;
+
+		before = pg_atomic_read_u32(&e->changecount);
+		pg_read_barrier();
+
+		memcpy(sap, &e->progress, sizeof(SpockApplyProgress));
+
+		pg_read_barrier();
+		after = pg_atomic_read_u32(&e->changecount);
+
+		if (before == after && (before & 1) == 0)
+			break;
+
+		SPIN_DELAY();
+	}
 }
 
 /*
@@ -416,9 +477,10 @@ apply_worker_get_prev_remote_ts(void)
 
 	if (MyApplyWorker && MyApplyWorker->apply_group)
 	{
-		LWLockAcquire(SpockCtx->apply_group_master_lock, LW_SHARED);
-		prev_remote_ts = MyApplyWorker->apply_group->progress.prev_remote_ts;
-		LWLockRelease(SpockCtx->apply_group_master_lock);
+		SpockApplyProgress sap;
+
+		spock_group_progress_read(MyApplyWorker->apply_group, &sap);
+		prev_remote_ts = sap.prev_remote_ts;
 	}
 	else
 		/*
@@ -460,10 +522,12 @@ static void
 dump_one_group_cb(const SpockGroupEntry *entry, void *arg)
 {
 	DumpCtx	   *ctx = (DumpCtx *) arg;
+	SpockApplyProgress sap;
 
 	/* Only the progress payload goes to disk. It already contains the key. */
-	write_buf(ctx->fd, &entry->progress, sizeof(SpockApplyProgress),
-												SPOCK_RES_DUMPFILE "(data)");
+	spock_group_progress_read((SpockGroupEntry *) entry, &sap);
+	write_buf(ctx->fd, &sap, sizeof(SpockApplyProgress),
+			  SPOCK_RES_DUMPFILE "(data)");
 	ctx->count++;
 }
 
@@ -668,7 +732,7 @@ spock_group_progress_update_list(List *lst)
 	{
 		SpockApplyProgress *sap = (SpockApplyProgress *) lfirst(lc);
 
-		spock_apply_progress_add_to_wal(sap);
+		spock_apply_progress_add_to_wal(sap, true);
 
 		spock_group_progress_update(sap);
 
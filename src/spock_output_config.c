@@ -20,6 +20,7 @@
 #include "miscadmin.h"
 
 #include "spock.h"
+#include "spock_compress.h"
 #include "spock_output_config.h"
 #include "spock_output_proto.h"
 #include "spock_repset.h"
@@ -72,7 +73,10 @@ typedef enum OutputPluginParamKey
 	PARAM_NO_TXINFO,
 	PARAM_STARTUP_FORMAT,
 	PARAM_SPOCK_VERSION,
-	PARAM_SPOCK_VERSION_NUM
+	PARAM_SPOCK_VERSION_NUM,
+	PARAM_SPOCK_STREAM_IN_PROGRESS,
+	PARAM_SPOCK_COMPRESSION,
+	PARAM_SPOCK_UPDATE_CHANGED_COLUMNS_ONLY
 } OutputPluginParamKey;
 
 typedef struct OutputPluginParam
@@ -106,6 +110,9 @@ static OutputPluginParam param_lookup[] = {
 	{"startup_params_format", PARAM_STARTUP_FORMAT},
 	{"spock_version", PARAM_SPOCK_VERSION},
 	{"spock_version_num", PARAM_SPOCK_VERSION_NUM},
+	{"spock.stream_in_progress", PARAM_SPOCK_STREAM_IN_PROGRESS},
+	{"spock.compression", PARAM_SPOCK_COMPRESSION},
+	{"spock.update_changed_columns_only", PARAM_SPOCK_UPDATE_CHANGED_COLUMNS_ONLY},
 	{NULL, PARAM_UNRECOGNISED}
 };
 
@@ -306,6 +313,21 @@ process_parameters_v1(List *options, SpockOutputData *data)
 				data->spock_version_num = DatumGetUInt32(val);
 				break;
 
+			case PARAM_SPOCK_STREAM_IN_PROGRESS:
+				val = get_param_value(elem, false, OUTPUT_PARAM_TYPE_BOOL);
+				data->client_stream_in_progress = DatumGetBool(val);
+				break;
+
+			case PARAM_SPOCK_COMPRESSION:
+				val = get_param_value(elem, false, OUTPUT_PARAM_TYPE_STRING);
+				data->client_compression = DatumGetCString(val);
+				break;
+
+			case PARAM_SPOCK_UPDATE_CHANGED_COLUMNS_ONLY:
+				val = get_param_value(elem, false, OUTPUT_PARAM_TYPE_BOOL);
+				data->client_update_changed_only = DatumGetBool(val);
+				break;
+
 				/* Backwards compat. */
 			case PARAM_HOOKS_SETUP_FUNCTION:
 				break;
@@ -584,5 +606,13 @@ prepare_startup_message(SpockOutputData *data)
 
 	l = add_startup_msg_b(l, "no_txinfo", data->client_no_txinfo);
 
+	l = add_startup_msg_b(l, "stream_in_progress", data->allow_streaming);
+
+	l = add_startup_msg_s(l, "compression",
+						  (char *) spock_compression_name(data->compression));
+
+	l = add_startup_msg_b(l, "update_changed_columns_only",
+						  data->update_changed_only);
+
 	return l;
 }
@@ -20,9 +20,14 @@
 
 #include "miscadmin.h"
 #include "access/commit_ts.h"
+#include "access/rmgr.h"
 #include "access/xact.h"
+#include "access/xlog.h"
+#include "access/xlogrecovery.h"
+#include "access/xlogreader.h"
 #include "executor/executor.h"
 #include "catalog/namespace.h"
+#include "portability/instr_time.h"
 #include "storage/fd.h"
 #include "storage/lmgr.h"
 #include "utils/inval.h"
@@ -37,6 +42,7 @@
 
 #include "spock_output_plugin.h"
 #include "spock.h"
+#include "spock_compress.h"
 #include "spock_output_config.h"
 #include "spock_executor.h"
 #include "spock_node.h"
@@ -73,6 +79,16 @@ static void pg_decode_message(LogicalDecodingContext *ctx,
 static void pg_decode_truncate(LogicalDecodingContext *ctx, ReorderBufferTXN *txn,
 							   int nrelations, Relation relations[],
 							   ReorderBufferChange *change);
+static void pg_decode_stream_start(LogicalDecodingContext *ctx,
+								   ReorderBufferTXN *txn);
+static void pg_decode_stream_stop(LogicalDecodingContext *ctx,
+								  ReorderBufferTXN *txn);
+static void pg_decode_stream_abort(LogicalDecodingContext *ctx,
+								   ReorderBufferTXN *txn,
+								   XLogRecPtr abort_lsn);
+static void pg_decode_stream_commit(LogicalDecodingContext *ctx,
+									ReorderBufferTXN *txn,
+									XLogRecPtr commit_lsn);
 
 static bool pg_decode_origin_filter(LogicalDecodingContext *ctx,
 									RepOriginId origin_id);
@@ -82,10 +98,40 @@ static void send_startup_message(LogicalDecodingContext *ctx,
 static void maybe_send_schema(LogicalDecodingContext *ctx,
 							  ReorderBufferChange *change,
 							  Relation relation);
+static void output_prepare_write(LogicalDecodingContext *ctx,
+								 TransactionId xid, bool last_write);
+static void compress_prepare_write(LogicalDecodingContext *ctx,
+								   XLogRecPtr lsn, TransactionId xid,
+								   bool last_write);
+static void compress_write(LogicalDecodingContext *ctx, XLogRecPtr lsn,
+						   TransactionId xid, bool last_write);
+static bool decoding_caught_up(LogicalDecodingContext *ctx);
+static void stats_update_progress(LogicalDecodingContext *ctx, XLogRecPtr lsn,
+								  TransactionId xid, bool skipped_xact);
 static bool can_replicate_truncate(List *repsets);
 
 static bool startup_message_sent = false;
 
+/*
+ * The walsender's writers, which compress_prepare_write() and compress_write()
+ * take the place of once compression was negotiated, and where the message
+ * being written starts in ctx->out.
+ */
+static LogicalOutputPluginWriterPrepareWrite compress_next_prepare_write = NULL;
+static LogicalOutputPluginWriterWrite compress_next_write = NULL;
+static int	compress_msg_start = 0;
+static StringInfoData compress_buf;
+
+/* The walsender's progress callback, see stats_update_progress() */
+static LogicalOutputPluginWriterUpdateProgress stats_next_update_progress = NULL;
+
+/* Per streamed transaction state, kept in txn->output_plugin_private */
+typedef struct SpockStreamTxn
+{
+	/* Repair mode at the end of the last block of the transaction */
+	bool		repair_mode;
+} SpockStreamTxn;
+
 typedef struct SPKRelMetaCacheEntry
 {
 	Oid			relid;
@@ -93,6 +139,9 @@ typedef struct SPKRelMetaCacheEntry
 	bool		is_cached;
 	/* Entry is valid and not due to be purged */
 	bool		is_valid;
+	/* Column encoding plan, built on first use (see spock_write_tuple) */
+	SpockAttrEncoding *encoding;
+	MemoryContext encoding_cxt;
 } SPKRelMetaCacheEntry;
 
 #define RELMETACACHE_INITIAL_SIZE 128
@@ -113,13 +162,16 @@ static RepOriginId MyOutputNodeId = InvalidRepOriginId;
 
 static void spock_output_join_slot_group(NameData slot_name);
 static void spock_output_leave_slot_group(void);
+static bool slot_group_commit_claimed(LogicalDecodingContext *ctx);
 static void spock_output_plugin_on_exit(int code, Datum arg);
 
 static void relmetacache_init(MemoryContext decoding_context);
 static SPKRelMetaCacheEntry *relmetacache_get_relation(SpockOutputData *data,
 													   Relation rel);
 static void relmetacache_flush(void);
+static void relmetacache_forget_sent(void);
 static void relmetacache_prune(void);
+static void relmetacache_free_encoding(SPKRelMetaCacheEntry *hentry);
 
 static void spkReorderBufferCleanSerializedTXNs(const char *slotname);
 
@@ -137,6 +189,15 @@ _PG_output_plugin_init(OutputPluginCallbacks *cb)
 	cb->truncate_cb = pg_decode_truncate;
 	cb->filter_by_origin_cb = pg_decode_origin_filter;
 	cb->shutdown_cb = pg_decode_shutdown;
+
+	/* Streaming of in-progress transactions, enabled on request */
+	cb->stream_start_cb = pg_decode_stream_start;
+	cb->stream_stop_cb = pg_decode_stream_stop;
+	cb->stream_abort_cb = pg_decode_stream_abort;
+	cb->stream_commit_cb = pg_decode_stream_commit;
+	cb->stream_change_cb = pg_decode_change;
+	cb->stream_message_cb = pg_decode_message;
+	cb->stream_truncate_cb = pg_decode_truncate;
 }
 
 /*
@@ -240,6 +301,9 @@ pg_decode_startup(LogicalDecodingContext *ctx, OutputPluginOptions *opt,
 
 	ctx->output_plugin_private = data;
 
+	/* Only stream in-progress transactions if asked to, see below */
+	ctx->streaming = false;
+
 	/*
 	 * This is replication start and not slot initialization.
 	 *
@@ -499,10 +563,42 @@ pg_decode_startup(LogicalDecodingContext *ctx, OutputPluginOptions *opt,
 
 		data->forward_changeset_origins = true;
 
+		/*
+		 * Stream large in-progress transactions if the subscriber can spool
+		 * them. Only the native protocol knows how, and not within a
+		 * slot-group, where who sends a transaction is decided at its begin,
+		 * which for a streamed transaction is sent only at commit.
+		 */
+		data->allow_streaming = data->client_stream_in_progress &&
+			opt->output_type == OUTPUT_PLUGIN_BINARY_OUTPUT &&
+			slot_group == NULL;
+		ctx->streaming = data->allow_streaming;
+
+		/*
+		 * Compress the messages if the subscriber asked for a method this
+		 * build has. What is compressed follows the remote insert LSN, which
+		 * only protocol version 5 puts in front of every message.
+		 */
+		if (data->client_compression != NULL &&
+			opt->output_type == OUTPUT_PLUGIN_BINARY_OUTPUT &&
+			data->negotiated_proto_version >= 5)
+			data->compression =
+				spock_compression_from_name(data->client_compression);
+
+		/* Only the native protocol knows about unchanged columns */
+		data->update_changed_only = data->client_update_changed_only &&
+			opt->output_type == OUTPUT_PLUGIN_BINARY_OUTPUT;
+
 		if (started_tx)
 			CommitTransactionCommand();
 
 		relmetacache_init(ctx->context);
+
+		if (ctx->update_progress != NULL)
+		{
+			stats_next_update_progress = ctx->update_progress;
+			ctx->update_progress = stats_update_progress;
+		}
 	}
 
 	/* So we can identify the process type in Valgrind logs */
@@ -529,7 +625,8 @@ pg_decode_begin_txn(LogicalDecodingContext *ctx, ReorderBufferTXN *txn)
 	/*
 	 * Check if we are a member of a replication slot-group and if so, if
 	 * another member is already working on this transaction. If nobody does,
-	 * then claim this transaction for us and start working.
+	 * then claim this transaction for us and start working. Most of those
+	 * sent by another member never get here, see slot_group_commit_claimed().
 	 */
 	if (slot_group != NULL)
 	{
@@ -724,6 +821,9 @@ pg_decode_commit_txn(LogicalDecodingContext *ctx, ReorderBufferTXN *txn,
 	 */
 	relmetacache_prune();
 
+	/* Publish the channel counters of decoded rows now and then */
+	spock_stats_flush(decoding_caught_up(ctx));
+
 	Assert(CurrentMemoryContext == data->context);
 	MemoryContextSwitchTo(old_ctx);
 	MemoryContextReset(data->context);
@@ -788,7 +888,7 @@ pg_decode_message(LogicalDecodingContext *ctx,
 				data = (SpockOutputData *) ctx->output_plugin_private;
 				oldctx = MemoryContextSwitchTo(data->context);
 
-				OutputPluginPrepareWrite(ctx, true);
+				output_prepare_write(ctx, txn->xid, true);
 				spock_write_message(ctx->out,
 									txn->xid,
 									message_lsn,
@@ -940,18 +1040,17 @@ spock_change_filter(SpockOutputData *data, Relation relation,
 	}
 
 	/*
-	 * Proccess row filters. XXX: we could probably cache some of the executor
-	 * stuff.
+	 * Process row filters.  The expressions and the executor state are
+	 * prepared once per table by get_table_replication_info().
 	 */
-	if (list_length(tblinfo->row_filter) > 0)
+	if (tblinfo->row_filter_estate != NULL)
 	{
-		EState	   *estate;
-		ExprContext *econtext;
-		TupleDesc	tupdesc = RelationGetDescr(relation);
+		ExprContext *econtext = tblinfo->row_filter_econtext;
 		HeapTuple	oldtup = change->data.tp.oldtuple ?
 			ReorderBufferChangeHeapTuple(change, oldtuple) : NULL;
 		HeapTuple	newtup = change->data.tp.newtuple ?
 			ReorderBufferChangeHeapTuple(change, newtuple) : NULL;
+		bool		matched = true;
 
 		/* Skip empty changes. */
 		if (!newtup && !oldtup)
@@ -965,35 +1064,34 @@ spock_change_filter(SpockOutputData *data, Relation relation,
 		PushActiveSnapshot(GetTransactionSnapshot());
 #endif
 
-		estate = create_estate_for_relation(relation, false);
-		econtext = prepare_per_tuple_econtext(estate, tupdesc);
-
 		ExecStoreHeapTuple(newtup ? newtup : oldtup, econtext->ecxt_scantuple, false);
 
 		/* Next try the row_filters if there are any. */
-		foreach(lc, tblinfo->row_filter)
+		foreach(lc, tblinfo->row_filter_exprs)
 		{
-			Node	   *row_filter = (Node *) lfirst(lc);
-			ExprState  *exprstate = spock_prepare_row_filter(row_filter);
+			ExprState  *exprstate = (ExprState *) lfirst(lc);
 			Datum		res;
 			bool		isnull;
 
-			res = ExecEvalExpr(exprstate, econtext, &isnull);
+			res = ExecEvalExprSwitchContext(exprstate, econtext, &isnull);
 
 			/* NULL is same as false for our use. */
-			if (isnull)
-				return false;
-
-			if (!DatumGetBool(res))
-				return false;
+			if (isnull || !DatumGetBool(res))
+			{
+				matched = false;
+				break;
+			}
 		}
 
-		ExecDropSingleTupleTableSlot(econtext->ecxt_scantuple);
-		FreeExecutorState(estate);
+		ExecClearTuple(econtext->ecxt_scantuple);
+		ResetExprContext(econtext);
 
 #if PG_VERSION_NUM < 180000
 		PopActiveSnapshot();
 #endif
+
+		if (!matched)
+			return false;
 	}
 
 	/* Make sure caller is aware of any attribute filter. */
@@ -1031,13 +1129,32 @@ maybe_send_schema(LogicalDecodingContext *ctx, ReorderBufferChange *change,
 											 data->replication_sets);
 
 
-		OutputPluginPrepareWrite(ctx, false);
+		output_prepare_write(ctx, change->txn->xid, false);
 		data->api->write_rel(ctx->out, data, relation, tblinfo->att_list);
 		OutputPluginWrite(ctx, false);
 		cached_relmeta->is_cached = true;
 	}
 }
 
+/*
+ * Start writing a message of the transaction being decoded.
+ *
+ * Messages sent while streaming an in-progress transaction are wrapped in a
+ * STREAM CHANGE naming the (sub)transaction, so the subscriber can spool them
+ * and discard them if it aborts.
+ */
+static void
+output_prepare_write(LogicalDecodingContext *ctx, TransactionId xid,
+					 bool last_write)
+{
+	SpockOutputData *data = ctx->output_plugin_private;
+
+	OutputPluginPrepareWrite(ctx, last_write);
+
+	if (data->in_streaming)
+		spock_write_stream_change(ctx->out, xid);
+}
+
 static void
 pg_decode_change(LogicalDecodingContext *ctx, ReorderBufferTXN *txn,
 				 Relation relation, ReorderBufferChange *change)
@@ -1073,7 +1190,7 @@ pg_decode_change(LogicalDecodingContext *ctx, ReorderBufferTXN *txn,
 	switch (change->action)
 	{
 		case REORDER_BUFFER_CHANGE_INSERT:
-			OutputPluginPrepareWrite(ctx, true);
+			output_prepare_write(ctx, change->txn->xid, true);
 			data->api->write_insert(ctx->out, data, relation,
 									ReorderBufferChangeHeapTuple(change, newtuple),
 									att_list);
@@ -1086,7 +1203,7 @@ pg_decode_change(LogicalDecodingContext *ctx, ReorderBufferTXN *txn,
 				HeapTuple	oldtuple = change->data.tp.oldtuple ?
 					ReorderBufferChangeHeapTuple(change, oldtuple) : NULL;
 
-				OutputPluginPrepareWrite(ctx, true);
+				output_prepare_write(ctx, change->txn->xid, true);
 				data->api->write_update(ctx->out, data, relation, oldtuple,
 										ReorderBufferChangeHeapTuple(change, newtuple),
 										att_list);
@@ -1098,7 +1215,7 @@ pg_decode_change(LogicalDecodingContext *ctx, ReorderBufferTXN *txn,
 		case REORDER_BUFFER_CHANGE_DELETE:
 			if (change->data.tp.oldtuple)
 			{
-				OutputPluginPrepareWrite(ctx, true);
+				output_prepare_write(ctx, change->txn->xid, true);
 				data->api->write_delete(ctx->out, data, relation,
 										ReorderBufferChangeHeapTuple(change, oldtuple),
 										att_list);
@@ -1160,7 +1277,7 @@ pg_decode_truncate(LogicalDecodingContext *ctx, ReorderBufferTXN *txn,
 
 	if (nrelids > 0)
 	{
-		OutputPluginPrepareWrite(ctx, true);
+		output_prepare_write(ctx, change->txn->xid, true);
 		data->api->write_truncate(ctx->out, nrelids, relids,
 								  change->data.truncate.cascade,
 								  change->data.truncate.restart_seqs);
@@ -1171,6 +1288,191 @@ pg_decode_truncate(LogicalDecodingContext *ctx, ReorderBufferTXN *txn,
 	MemoryContextReset(data->context);
 }
 
+/*
+ * STREAM START callback
+ *
+ * Changes of a large in-progress transaction are about to be sent. The
+ * subscriber spools them until the transaction commits or aborts, see
+ * spock_apply_stream.c.
+ */
+static void
+pg_decode_stream_start(LogicalDecodingContext *ctx, ReorderBufferTXN *txn)
+{
+	SpockOutputData *data = (SpockOutputData *) ctx->output_plugin_private;
+	SpockStreamTxn *stxn = (SpockStreamTxn *) txn->output_plugin_private;
+	MemoryContext old_ctx;
+
+	Assert(data->allow_streaming && !data->in_streaming);
+
+	/* Repair mode lasts until the end of the transaction, not the block */
+	set_repair_mode(stxn != NULL && stxn->repair_mode);
+
+	old_ctx = MemoryContextSwitchTo(data->context);
+
+	if (!startup_message_sent)
+		send_startup_message(ctx, data, false /* can't be last message */ );
+
+	/*
+	 * Relation metadata in the block is applied only with the transaction,
+	 * so each block carries its own.
+	 */
+	relmetacache_forget_sent();
+
+	OutputPluginPrepareWrite(ctx, true);
+	spock_write_stream_start(ctx->out, txn->xid, !rbtxn_is_streamed(txn));
+	OutputPluginWrite(ctx, true);
+
+	data->in_streaming = true;
+
+	Assert(CurrentMemoryContext == data->context);
+	MemoryContextSwitchTo(old_ctx);
+}
+
+/*
+ * STREAM STOP callback
+ */
+static void
+pg_decode_stream_stop(LogicalDecodingContext *ctx, ReorderBufferTXN *txn)
+{
+	SpockOutputData *data = (SpockOutputData *) ctx->output_plugin_private;
+	SpockStreamTxn *stxn = (SpockStreamTxn *) txn->output_plugin_private;
+	MemoryContext old_ctx;
+
+	Assert(data->in_streaming);
+	data->in_streaming = false;
+
+	if (stxn == NULL)
+	{
+		stxn = MemoryContextAllocZero(ctx->context, sizeof(SpockStreamTxn));
+		txn->output_plugin_private = stxn;
+	}
+	stxn->repair_mode = spock_replication_repair_mode;
+	set_repair_mode(false);
+
+	/*
+	 * The subscriber hasn't applied the relation metadata sent in the block,
+	 * make sure the next transaction sends it again.
+	 */
+	relmetacache_forget_sent();
+
+	old_ctx = MemoryContextSwitchTo(data->context);
+
+	OutputPluginPrepareWrite(ctx, true);
+	spock_write_stream_stop(ctx->out);
+	OutputPluginWrite(ctx, true);
+
+	Assert(CurrentMemoryContext == data->context);
+	MemoryContextSwitchTo(old_ctx);
+	MemoryContextReset(data->context);
+}
+
+/*
+ * STREAM ABORT callback, for the streamed transaction or one of its
+ * subtransactions.
+ */
+static void
+pg_decode_stream_abort(LogicalDecodingContext *ctx, ReorderBufferTXN *txn,
+					   XLogRecPtr abort_lsn)
+{
+	SpockOutputData *data = (SpockOutputData *) ctx->output_plugin_private;
+	ReorderBufferTXN *toptxn = txn->toptxn ? txn->toptxn : txn;
+	MemoryContext old_ctx;
+
+	Assert(!data->in_streaming);
+
+	old_ctx = MemoryContextSwitchTo(data->context);
+
+	OutputPluginPrepareWrite(ctx, true);
+	spock_write_stream_abort(ctx->out, toptxn->xid, txn->xid);
+	OutputPluginWrite(ctx, true);
+
+	Assert(CurrentMemoryContext == data->context);
+	MemoryContextSwitchTo(old_ctx);
+	MemoryContextReset(data->context);
+
+	if (txn == toptxn && txn->output_plugin_private != NULL)
+	{
+		pfree(txn->output_plugin_private);
+		txn->output_plugin_private = NULL;
+	}
+}
+
+/*
+ * STREAM COMMIT callback
+ *
+ * The streamed transaction is sent like any other, with a STREAM COMMIT
+ * telling the subscriber to apply the spooled changes in place of them.
+ */
+static void
+pg_decode_stream_commit(LogicalDecodingContext *ctx, ReorderBufferTXN *txn,
+						XLogRecPtr commit_lsn)
+{
+	SpockOutputData *data = (SpockOutputData *) ctx->output_plugin_private;
+	MemoryContext old_ctx;
+
+	Assert(!data->in_streaming);
+
+	pg_decode_begin_txn(ctx, txn);
+
+	old_ctx = MemoryContextSwitchTo(data->context);
+
+	OutputPluginPrepareWrite(ctx, true);
+	spock_write_stream_commit(ctx->out, txn->xid);
+	OutputPluginWrite(ctx, true);
+
+	Assert(CurrentMemoryContext == data->context);
+	MemoryContextSwitchTo(old_ctx);
+
+	pg_decode_commit_txn(ctx, txn, commit_lsn);
+
+	/* Applying the transaction replaced the subscriber's relation metadata */
+	relmetacache_forget_sent();
+
+	if (txn->output_plugin_private != NULL)
+	{
+		pfree(txn->output_plugin_private);
+		txn->output_plugin_private = NULL;
+	}
+}
+
+/*
+ * Is the record being decoded the commit of a transaction our slot-group
+ * has already sent, see pg_decode_begin_txn()?
+ *
+ * The end of the commit record is the end_lsn the transaction is replayed
+ * with. Nothing is claimed here, a transaction which isn't skipped yet still
+ * goes through the check in pg_decode_begin_txn(). Members skipping a
+ * transaction there don't move last_commit_ts either, as the member which
+ * sent it or a later one has done that already.
+ */
+static bool
+slot_group_commit_claimed(LogicalDecodingContext *ctx)
+{
+	XLogReaderState *record = ctx->reader;
+	uint8		info;
+	bool		claimed;
+
+	if (slot_group == NULL || record == NULL || record->record == NULL ||
+		XLogRecGetRmid(record) != RM_XACT_ID)
+		return false;
+
+	info = XLogRecGetInfo(record) & XLOG_XACT_OPMASK;
+	if (info != XLOG_XACT_COMMIT && info != XLOG_XACT_COMMIT_PREPARED)
+		return false;
+
+	LWLockAcquire(slot_group->lock, LW_SHARED);
+	claimed = slot_group->last_lsn >= record->EndRecPtr;
+	LWLockRelease(slot_group->lock);
+
+	if (claimed)
+		elog(DEBUG1, "SPOCK: slot-group '%s' forgetting transaction with end_lsn %X/%X",
+			 NameStr(slot_group->name),
+			 (uint32) (record->EndRecPtr >> 32),
+			 (uint32) (record->EndRecPtr));
+
+	return claimed;
+}
+
 /*
  * Decide if the whole transaction with specific origin should be filtered out.
  */
@@ -1181,6 +1483,15 @@ pg_decode_origin_filter(LogicalDecodingContext *ctx,
 	SpockOutputData *data = ctx->output_plugin_private;
 	bool		ret;
 
+	/*
+	 * Transactions another member of our slot-group already sent are skipped
+	 * by pg_decode_begin_txn(). The filter is asked again when the commit
+	 * record is decoded, so tell there already and have the reorder buffer
+	 * forget the transaction instead of replaying all its changes to us.
+	 */
+	if (slot_group_commit_claimed(ctx))
+		return true;
+
 	if (origin_id == InvalidRepOriginId)
 		/* Never filter out locally originated tx's */
 		ret = false;
@@ -1221,9 +1532,118 @@ send_startup_message(LogicalDecodingContext *ctx,
 	list_free_deep(msg);
 
 	startup_message_sent = true;
+
+	/* Everything after the startup message may be compressed */
+	if (data->compression != SPOCK_COMPRESSION_NONE)
+	{
+		MemoryContext oldctx = MemoryContextSwitchTo(ctx->context);
+
+		initStringInfo(&compress_buf);
+		MemoryContextSwitchTo(oldctx);
+
+		compress_next_prepare_write = ctx->prepare_write;
+		compress_next_write = ctx->write;
+		ctx->prepare_write = compress_prepare_write;
+		ctx->write = compress_write;
+	}
+}
+
+/*
+ * Remember where the message about to be written starts.
+ */
+static void
+compress_prepare_write(LogicalDecodingContext *ctx, XLogRecPtr lsn,
+					   TransactionId xid, bool last_write)
+{
+	compress_next_prepare_write(ctx, lsn, xid, last_write);
+
+	compress_msg_start = ctx->out->len;
+}
+
+/*
+ * Compress the message written, except for its leading remote insert LSN,
+ * before handing it to the walsender.
+ */
+static void
+compress_write(LogicalDecodingContext *ctx, XLogRecPtr lsn,
+			   TransactionId xid, bool last_write)
+{
+	SpockOutputData *data = ctx->output_plugin_private;
+	StringInfo	out = ctx->out;
+	int			body = compress_msg_start + sizeof(int64);
+	int			rawlen = out->len - body;
+
+	if (rawlen >= SPOCK_COMPRESS_MIN_SIZE)
+	{
+		instr_time	start;
+		instr_time	duration;
+
+		INSTR_TIME_SET_CURRENT(start);
+
+		resetStringInfo(&compress_buf);
+		if (spock_compress(data->compression, out->data + body, rawlen,
+						   &compress_buf))
+		{
+			out->len = body;
+			appendBinaryStringInfo(out, compress_buf.data, compress_buf.len);
+		}
+
+		INSTR_TIME_SET_CURRENT(duration);
+		INSTR_TIME_SUBTRACT(duration, start);
+		handle_stream_stats_counter(InvalidOid, SPOCK_STATS_COMPRESS_TIME,
+									(int64) INSTR_TIME_GET_MICROSEC(duration));
+	}
+
+	if (rawlen > 0)
+	{
+		handle_stream_stats_counter(InvalidOid, SPOCK_STATS_STREAM_BYTES,
+									rawlen);
+		handle_stream_stats_counter(InvalidOid, SPOCK_STATS_STREAM_WIRE_BYTES,
+									out->len - body);
+	}
+
+	compress_next_write(ctx, lsn, xid, last_write);
 }
 
 
+/*
+ * Has decoding reached the end of the WAL written so far?
+ *
+ * The walsender waits for more WAL then, and no callback of ours runs until
+ * it arrives. Channel counters are otherwise published at most once per
+ * flush interval, so this is the last chance to publish those of the
+ * transactions just sent; and the walsender has the time to, as it is about
+ * to sleep.
+ */
+static bool
+decoding_caught_up(LogicalDecodingContext *ctx)
+{
+	XLogRecPtr	end_ptr;
+
+	if (RecoveryInProgress())
+		end_ptr = GetXLogReplayRecPtr(NULL);
+	else
+		end_ptr = GetFlushRecPtr(NULL);
+
+	return ctx->reader->EndRecPtr >= end_ptr;
+}
+
+/*
+ * Progress callback of the walsender.
+ *
+ * The walsender keeps reporting progress while it skips transactions,
+ * sending keepalives as needed, so publish the channel counters from there
+ * too, see decoding_caught_up().
+ */
+static void
+stats_update_progress(LogicalDecodingContext *ctx, XLogRecPtr lsn,
+					  TransactionId xid, bool skipped_xact)
+{
+	stats_next_update_progress(ctx, lsn, xid, skipped_xact);
+
+	spock_stats_flush(decoding_caught_up(ctx));
+}
+
 /*
  * Shutdown callback.
  */
@@ -1231,6 +1651,7 @@ static void
 pg_decode_shutdown(LogicalDecodingContext *ctx)
 {
 	relmetacache_flush();
+	spock_stats_flush(true);
 
 	spock_output_leave_slot_group();
 
@@ -1536,6 +1957,13 @@ relmetacache_get_relation(struct SpockOutputData *data,
 	if (!found || !hentry->is_valid)
 	{
 		Assert(hentry->relid = RelationGetRelid(rel));
+		if (!found)
+		{
+			hentry->encoding = NULL;
+			hentry->encoding_cxt = NULL;
+		}
+		else
+			relmetacache_free_encoding(hentry);
 		hentry->is_cached = false;
 		/* Only used for lazy purging of invalidations */
 		hentry->is_valid = true;
@@ -1547,6 +1975,72 @@ relmetacache_get_relation(struct SpockOutputData *data,
 }
 
 
+/*
+ * Return the column encoding plan of the relation for spock_write_tuple(),
+ * building it on first use.
+ *
+ * The plan lives in the relation's metadata cache entry and is thrown away
+ * together with the rest of the entry when the relation is invalidated.
+ */
+SpockAttrEncoding *
+spock_output_rel_encoding(SpockOutputData *data, Relation rel)
+{
+	SPKRelMetaCacheEntry *hentry;
+
+	hentry = relmetacache_get_relation(data, rel);
+
+	if (hentry->encoding == NULL)
+	{
+		MemoryContext oldctx;
+
+		/* A previous attempt may have failed half-way. */
+		if (hentry->encoding_cxt == NULL)
+			hentry->encoding_cxt = AllocSetContextCreate(RelMetaCacheContext,
+														 "spock output column encoding",
+														 ALLOCSET_SMALL_SIZES);
+		else
+			MemoryContextReset(hentry->encoding_cxt);
+		oldctx = MemoryContextSwitchTo(hentry->encoding_cxt);
+		hentry->encoding = spock_build_attr_encoding(data, rel);
+		MemoryContextSwitchTo(oldctx);
+	}
+
+	return hentry->encoding;
+}
+
+/*
+ * Release the column encoding plan of a cache entry.
+ *
+ * Only safe where the plan can't be in use, like relmetacache_prune().
+ */
+static void
+relmetacache_free_encoding(SPKRelMetaCacheEntry *hentry)
+{
+	if (hentry->encoding_cxt != NULL)
+		MemoryContextDelete(hentry->encoding_cxt);
+	hentry->encoding_cxt = NULL;
+	hentry->encoding = NULL;
+}
+
+/*
+ * Forget which relations the client has metadata for, so that it is sent
+ * again on next use. Used around streamed transactions, see
+ * pg_decode_stream_start().
+ */
+static void
+relmetacache_forget_sent(void)
+{
+	HASH_SEQ_STATUS status;
+	SPKRelMetaCacheEntry *hentry;
+
+	if (RelMetaCache == NULL)
+		return;
+
+	hash_seq_init(&status, RelMetaCache);
+	while ((hentry = (SPKRelMetaCacheEntry *) hash_seq_search(&status)) != NULL)
+		hentry->is_cached = false;
+}
+
 /*
  * Flush the relation metadata cache at the end of a decoding session.
  *
@@ -1571,6 +2065,7 @@ relmetacache_flush(void)
 	hash_seq_init(&status, RelMetaCache);
 	while ((hentry = (struct SPKRelMetaCacheEntry *) hash_seq_search(&status)) != NULL)
 	{
+		relmetacache_free_encoding(hentry);
 		if (hash_search(RelMetaCache,
 						(void *) &hentry->relid,
 						HASH_REMOVE,
@@ -1620,7 +2115,10 @@ relmetacache_prune(void)
 	while ((hentry = (struct SPKRelMetaCacheEntry *) hash_seq_search(&status)) != NULL)
 	{
 		if (!hentry->is_valid)
+		{
+			relmetacache_free_encoding(hentry);
 			relids_to_remove[idx++] = hentry->relid;
+		}
 	}
 
 	/* Second pass: remove entries */
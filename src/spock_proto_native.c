@@ -14,12 +14,15 @@
 #include "access/sysattr.h"
 #include "access/detoast.h"
 #include "catalog/pg_type.h"
+#include "common/hashfn.h"
 #include "libpq/pqformat.h"
 #include "nodes/parsenodes.h"
 #include "replication/origin.h"
 #include "replication/reorderbuffer.h"
 #include "utils/builtins.h"
+#include "utils/datum.h"
 #include "utils/lsyscache.h"
+#include "utils/memutils.h"
 #include "utils/rel.h"
 #include "utils/syscache.h"
 
@@ -44,6 +47,13 @@
 static uint32 spock_negotiated_proto_version = SPOCK_PROTO_VERSION_NUM;
 static uint32 spock_apply_proto_version = SPOCK_PROTO_MIN_VERSION_NUM;
 
+/*
+ * Arena for the SpockTupleData arrays of incoming changes.  It is reset each
+ * time a new INSERT/UPDATE/DELETE is read, so the memory of previous rows is
+ * reused instead of being allocated afresh for every change.
+ */
+static MemoryContext SpockTupleArena = NULL;
+
 /*
  * Protocol version management functions for publisher
  */
@@ -78,7 +88,7 @@ static void spock_write_attrs(StringInfo out, Relation rel,
 							  Bitmapset *att_list);
 static void spock_write_tuple(StringInfo out, SpockOutputData *data,
 							  Relation rel, HeapTuple tuple,
-							  Bitmapset *att_list);
+							  HeapTuple oldtuple, Bitmapset *att_list);
 static char decide_datum_transfer(Form_pg_attribute att,
 								  Form_pg_type typclass,
 								  bool allow_internal_basetypes,
@@ -87,9 +97,13 @@ static char decide_datum_transfer(Form_pg_attribute att,
 static void spock_read_attrs(StringInfo in, char ***attrnames,
 							 Oid **attrtypes,
 							 Oid **attrtypmods,
+							 bool **attidentity,
 							 int *nattrnames);
+static void spock_tuple_arena_reset(void);
 static void spock_read_tuple(StringInfo in, SpockRelation *rel,
 							 SpockTupleData *tuple);
+static bool spock_read_tuple_key(StringInfo in, SpockRelation *rel,
+								 uint32 *key);
 
 /*
  * Write functions
@@ -345,7 +359,7 @@ spock_write_insert(StringInfo out, SpockOutputData *data,
 	pq_sendint(out, RelationGetRelid(rel), 4);
 
 	pq_sendbyte(out, 'N');		/* new tuple follows */
-	spock_write_tuple(out, data, rel, newtuple, att_list);
+	spock_write_tuple(out, data, rel, newtuple, NULL, att_list);
 }
 
 /*
@@ -382,11 +396,20 @@ spock_write_update(StringInfo out, SpockOutputData *data,
 	if (oldtuple != NULL)
 	{
 		pq_sendbyte(out, 'K');	/* old key follows */
-		spock_write_tuple(out, data, rel, oldtuple, att_list);
+		spock_write_tuple(out, data, rel, oldtuple, NULL, att_list);
 	}
 
+	/*
+	 * With REPLICA IDENTITY FULL the old tuple has every column, so if the
+	 * subscriber asked for it, the columns the UPDATE didn't change are sent
+	 * as unchanged and it keeps the values of its local row for them.
+	 */
+	if (!data->update_changed_only ||
+		rel->rd_rel->relreplident != REPLICA_IDENTITY_FULL)
+		oldtuple = NULL;
+
 	pq_sendbyte(out, 'N');		/* new tuple follows */
-	spock_write_tuple(out, data, rel, newtuple, att_list);
+	spock_write_tuple(out, data, rel, newtuple, oldtuple, att_list);
 }
 
 /*
@@ -417,7 +440,7 @@ spock_write_delete(StringInfo out, SpockOutputData *data,
 	 * See notes on update for details
 	 */
 	pq_sendbyte(out, 'K');		/* old key follows */
-	spock_write_tuple(out, data, rel, oldtuple, att_list);
+	spock_write_tuple(out, data, rel, oldtuple, NULL, att_list);
 }
 
 /*
@@ -452,18 +475,26 @@ write_startup_message(StringInfo out, List *msg)
 
 /*
  * Write a tuple to the outputstream, in the most efficient format possible.
+ *
+ * If oldtuple is given, columns with the same value in it are sent as
+ * unchanged.
  */
 static void
 spock_write_tuple(StringInfo out, SpockOutputData *data,
-				  Relation rel, HeapTuple tuple, Bitmapset *att_list)
+				  Relation rel, HeapTuple tuple, HeapTuple oldtuple,
+				  Bitmapset *att_list)
 {
 	TupleDesc	desc;
+	SpockAttrEncoding *enc;
 	Datum		values[MaxTupleAttributeNumber];
 	bool		isnull[MaxTupleAttributeNumber];
+	Datum	   *oldvalues = NULL;
+	bool	   *oldisnull = NULL;
 	int			i;
 	uint16		nliveatts = 0;
 
 	desc = RelationGetDescr(rel);
+	enc = spock_output_rel_encoding(data, rel);
 
 	pq_sendbyte(out, 'T');		/* sending TUPLE */
 
@@ -471,7 +502,7 @@ spock_write_tuple(StringInfo out, SpockOutputData *data,
 	{
 		Form_pg_attribute att = TupleDescAttr(desc, i);
 
-		if (att->attisdropped || att->attgenerated)
+		if (enc[i].skip)
 			continue;
 		if (att_list &&
 			!bms_is_member(att->attnum - FirstLowInvalidHeapAttributeNumber,
@@ -492,15 +523,19 @@ spock_write_tuple(StringInfo out, SpockOutputData *data,
 	 */
 	heap_deform_tuple(tuple, desc, values, isnull);
 
+	if (oldtuple != NULL)
+	{
+		oldvalues = palloc(desc->natts * sizeof(Datum));
+		oldisnull = palloc(desc->natts * sizeof(bool));
+		heap_deform_tuple(oldtuple, desc, oldvalues, oldisnull);
+	}
+
 	for (i = 0; i < desc->natts; i++)
 	{
-		HeapTuple	typtup;
-		Form_pg_type typclass;
 		Form_pg_attribute att = TupleDescAttr(desc, i);
-		char		transfer_type;
 
 		/* skip dropped columns */
-		if (att->attisdropped || att->attgenerated)
+		if (enc[i].skip)
 			continue;
 		if (att_list &&
 			!bms_is_member(att->attnum - FirstLowInvalidHeapAttributeNumber,
@@ -517,17 +552,15 @@ spock_write_tuple(StringInfo out, SpockOutputData *data,
 			pq_sendbyte(out, 'u');	/* unchanged toast column */
 			continue;
 		}
+		else if (oldtuple != NULL && !oldisnull[i] &&
+				 datumIsEqual(values[i], oldvalues[i], att->attbyval,
+							  att->attlen))
+		{
+			pq_sendbyte(out, 'u');	/* unchanged column */
+			continue;
+		}
 
-		typtup = SearchSysCache1(TYPEOID, ObjectIdGetDatum(att->atttypid));
-		if (!HeapTupleIsValid(typtup))
-			elog(ERROR, "cache lookup failed for type %u", att->atttypid);
-		typclass = (Form_pg_type) GETSTRUCT(typtup);
-
-		transfer_type = decide_datum_transfer(att, typclass,
-											  data->allow_internal_basetypes,
-											  data->allow_binary_basetypes);
-
-		switch (transfer_type)
+		switch (enc[i].transfer)
 		{
 			case 'i':
 				pq_sendbyte(out, 'i');	/* internal-format binary data follows */
@@ -583,8 +616,7 @@ spock_write_tuple(StringInfo out, SpockOutputData *data,
 
 					pq_sendbyte(out, 'b');	/* binary send/recv data follows */
 
-					outputbytes = OidSendFunctionCall(typclass->typsend,
-													  values[i]);
+					outputbytes = SendFunctionCall(&enc[i].func, values[i]);
 
 					len = VARSIZE(outputbytes) - VARHDRSZ;
 					pq_sendint(out, len, 4);	/* length */
@@ -600,16 +632,13 @@ spock_write_tuple(StringInfo out, SpockOutputData *data,
 
 					pq_sendbyte(out, 't');	/* 'text' data follows */
 
-					outputstr = OidOutputFunctionCall(typclass->typoutput,
-													  values[i]);
+					outputstr = OutputFunctionCall(&enc[i].func, values[i]);
 					len = strlen(outputstr) + 1;
 					pq_sendint(out, len, 4);	/* length */
 					appendBinaryStringInfo(out, outputstr, len);	/* data */
 					pfree(outputstr);
 				}
 		}
-
-		ReleaseSysCache(typtup);
 	}
 }
 
@@ -634,6 +663,52 @@ spock_write_message(StringInfo out, TransactionId xid, XLogRecPtr lsn,
 	pq_sendbytes(out, message, sz);
 }
 
+/*
+ * Work out how each column of the relation is sent by spock_write_tuple().
+ *
+ * The result is allocated in CurrentMemoryContext, which is also used as the
+ * fn_mcxt of the send/output functions.
+ */
+SpockAttrEncoding *
+spock_build_attr_encoding(SpockOutputData *data, Relation rel)
+{
+	TupleDesc	desc = RelationGetDescr(rel);
+	SpockAttrEncoding *enc;
+	int			i;
+
+	enc = palloc0(Max(desc->natts, 1) * sizeof(SpockAttrEncoding));
+
+	for (i = 0; i < desc->natts; i++)
+	{
+		Form_pg_attribute att = TupleDescAttr(desc, i);
+		HeapTuple	typtup;
+		Form_pg_type typclass;
+
+		if (att->attisdropped || att->attgenerated)
+		{
+			enc[i].skip = true;
+			continue;
+		}
+
+		typtup = SearchSysCache1(TYPEOID, ObjectIdGetDatum(att->atttypid));
+		if (!HeapTupleIsValid(typtup))
+			elog(ERROR, "cache lookup failed for type %u", att->atttypid);
+		typclass = (Form_pg_type) GETSTRUCT(typtup);
+
+		enc[i].transfer = decide_datum_transfer(att, typclass,
+												data->allow_internal_basetypes,
+												data->allow_binary_basetypes);
+		if (enc[i].transfer == 'b')
+			fmgr_info(typclass->typsend, &enc[i].func);
+		else if (enc[i].transfer == 't')
+			fmgr_info(typclass->typoutput, &enc[i].func);
+
+		ReleaseSysCache(typtup);
+	}
+
+	return enc;
+}
+
 /*
  * Make the executive decision about which protocol to use.
  */
@@ -811,6 +886,8 @@ spock_read_insert(StringInfo in, LOCKMODE lockmode, SpockTupleData *newtup)
 		elog(ERROR, "expected new tuple but got %d",
 			 action);
 
+	spock_tuple_arena_reset();
+
 	rel = spock_relation_open(relid, lockmode);
 	if (unlikely(rel == NULL))
 	{
@@ -853,6 +930,8 @@ spock_read_update(StringInfo in, LOCKMODE lockmode, bool *hasoldtup,
 		elog(ERROR, "expected action 'N', 'O' or 'K', got %c",
 			 action);
 
+	spock_tuple_arena_reset();
+
 	rel = spock_relation_open(relid, lockmode);
 	if (unlikely(rel == NULL))
 	{
@@ -914,6 +993,8 @@ spock_read_delete(StringInfo in, LOCKMODE lockmode,
 	if (action != 'K' && action != 'O')
 		elog(ERROR, "expected action 'O' or 'K' %c", action);
 
+	spock_tuple_arena_reset();
+
 	rel = spock_relation_open(relid, lockmode);
 	if (unlikely(rel == NULL))
 	{
@@ -933,6 +1014,51 @@ spock_read_delete(StringInfo in, LOCKMODE lockmode,
 	return rel;
 }
 
+/*
+ * Release the tuple arrays handed out for the previously read change.
+ */
+static void
+spock_tuple_arena_reset(void)
+{
+	if (SpockTupleArena == NULL)
+		SpockTupleArena = AllocSetContextCreate(TopMemoryContext,
+												"SpockTupleArena",
+												ALLOCSET_DEFAULT_SIZES);
+	else
+		MemoryContextReset(SpockTupleArena);
+}
+
+/*
+ * Set up an empty tuple (all columns NULL and unchanged) for a relation with
+ * natts local attributes.
+ *
+ * The arrays live in the tuple arena and remain valid until the next change
+ * is read from the stream.
+ */
+void
+spock_tuple_data_init(SpockTupleData *tuple, int natts)
+{
+	char	   *buf;
+	Size		sz;
+
+	Assert(natts >= 0 && natts <= MaxTupleAttributeNumber);
+
+	if (SpockTupleArena == NULL)
+		spock_tuple_arena_reset();
+
+	sz = MAXALIGN(natts * sizeof(Datum)) + 2 * MAXALIGN(natts * sizeof(bool));
+	buf = MemoryContextAlloc(SpockTupleArena, Max(sz, 1));
+
+	tuple->natts = natts;
+	tuple->values = (Datum *) buf;
+	tuple->nulls = (bool *) (buf + MAXALIGN(natts * sizeof(Datum)));
+	tuple->changed = (bool *) (buf + MAXALIGN(natts * sizeof(Datum)) +
+							   MAXALIGN(natts * sizeof(bool)));
+
+	memset(tuple->values, 0, natts * sizeof(Datum));
+	memset(tuple->nulls, true, natts * sizeof(bool));
+	memset(tuple->changed, false, natts * sizeof(bool));
+}
 
 /*
  * Read tuple in remote format from stream.
@@ -952,14 +1078,12 @@ spock_read_tuple(StringInfo in, SpockRelation *rel,
 	if (action != 'T')
 		elog(ERROR, "expected TUPLE, got %c", action);
 
-	memset(tuple->nulls, 1, sizeof(tuple->nulls));
-	memset(tuple->changed, 0, sizeof(tuple->changed));
-
 	natts = pq_getmsgint(in, 2);
 	if (rel->natts != natts)
 		elog(ERROR, "tuple natts mismatch for relation (%s) between remote relation metadata cache (natts=%u) and remote tuple data (natts=%u)", rel->relname, rel->natts, natts);
 
 	desc = RelationGetDescr(rel->rel);
+	spock_tuple_data_init(tuple, desc->natts);
 
 	/* Read the data */
 	for (i = 0; i < natts; i++)
@@ -968,6 +1092,7 @@ spock_read_tuple(StringInfo in, SpockRelation *rel,
 		Oid			attrtype = rel->attrtypes[i];
 		Oid			attrtypmod = rel->attrtypmods[i];
 		Form_pg_attribute att = TupleDescAttr(desc, attid);
+		SpockAttrInput *input = &rel->attinput[i];
 		char		kind = pq_getmsgbyte(in);
 		const char *data;
 		int			len;
@@ -998,8 +1123,6 @@ spock_read_tuple(StringInfo in, SpockRelation *rel,
 				break;
 			case 'b':			/* binary send/recv format */
 				{
-					Oid			typreceive;
-					Oid			typioparam;
 					StringInfoData buf;
 
 					tuple->nulls[attid] = false;
@@ -1039,16 +1162,25 @@ spock_read_tuple(StringInfo in, SpockRelation *rel,
 										   NameStr(rel->rel->rd_rel->relname))));
 					}
 
-					getTypeBinaryInputInfo(att->atttypid,
-										   &typreceive, &typioparam);
+					if (input->kind != 'b')
+					{
+						Oid			typreceive;
+
+						getTypeBinaryInputInfo(att->atttypid,
+											   &typreceive, &input->typioparam);
+						fmgr_info_cxt(typreceive, &input->func,
+									  rel->attinput_cxt);
+						input->kind = 'b';
+					}
 
 					/* create StringInfo pointing into the bigger buffer */
 					initStringInfo(&buf);
 					/* and data */
 					buf.data = (char *) pq_getmsgbytes(in, len);
 					buf.len = len;
-					tuple->values[attid] = OidReceiveFunctionCall(
-																  typreceive, &buf, typioparam, att->atttypmod);
+					tuple->values[attid] = ReceiveFunctionCall(&input->func, &buf,
+															   input->typioparam,
+															   att->atttypmod);
 
 					if (buf.len != buf.cursor)
 						ereport(ERROR,
@@ -1060,19 +1192,28 @@ spock_read_tuple(StringInfo in, SpockRelation *rel,
 				}
 			case 't':			/* text format */
 				{
-					Oid			typinput;
-					Oid			typioparam;
-
 					tuple->nulls[attid] = false;
 					tuple->changed[attid] = true;
 
 					len = pq_getmsgint(in, 4);	/* read length */
 
-					getTypeInputInfo(att->atttypid, &typinput, &typioparam);
+					if (input->kind != 't')
+					{
+						Oid			typinput;
+
+						getTypeInputInfo(att->atttypid, &typinput,
+										 &input->typioparam);
+						fmgr_info_cxt(typinput, &input->func,
+									  rel->attinput_cxt);
+						input->kind = 't';
+					}
+
 					/* and data */
 					data = (char *) pq_getmsgbytes(in, len);
-					tuple->values[attid] = OidInputFunctionCall(
-																typinput, (char *) data, typioparam, att->atttypmod);
+					tuple->values[attid] = InputFunctionCall(&input->func,
+															 (char *) data,
+															 input->typioparam,
+															 att->atttypmod);
 				}
 				break;
 			default:
@@ -1081,6 +1222,66 @@ spock_read_tuple(StringInfo in, SpockRelation *rel,
 	}
 }
 
+/*
+ * Skip over a tuple in the stream, hashing the replica identity columns.
+ *
+ * Returns false if the relation has no replica identity columns or one of
+ * them was sent as NULL or unchanged.
+ */
+static bool
+spock_read_tuple_key(StringInfo in, SpockRelation *rel, uint32 *key)
+{
+	int			i;
+	int			natts;
+	char		action;
+	uint32		hash = 0;
+	bool		haskey = false;
+	bool		valid = true;
+
+	action = pq_getmsgbyte(in);
+	if (action != 'T')
+		elog(ERROR, "expected TUPLE, got %c", action);
+
+	natts = pq_getmsgint(in, 2);
+	if (rel->natts != natts)
+		elog(ERROR, "tuple natts mismatch for relation (%s) between remote relation metadata cache (natts=%u) and remote tuple data (natts=%u)", rel->relname, rel->natts, natts);
+
+	for (i = 0; i < natts; i++)
+	{
+		char		kind = pq_getmsgbyte(in);
+		const char *data;
+		int			len;
+
+		switch (kind)
+		{
+			case 'n':			/* null */
+			case 'u':			/* unchanged column */
+				if (rel->attidentity[i])
+					valid = false;
+				break;
+			case 'i':			/* internal binary format */
+			case 'b':			/* binary send/recv format */
+			case 't':			/* text format */
+				len = pq_getmsgint(in, 4);
+				data = pq_getmsgbytes(in, len);
+				if (rel->attidentity[i])
+				{
+					hash = hash_combine(hash,
+										hash_bytes((const unsigned char *) data,
+												   len));
+					haskey = true;
+				}
+				break;
+			default:
+				elog(ERROR, "unknown data representation type '%c'", kind);
+		}
+	}
+
+	*key = hash_combine(rel->remoteid, hash);
+
+	return valid && haskey;
+}
+
 /*
  * Read schema.relation from stream and return as SpockRelation opened in
  * lockmode.
@@ -1097,6 +1298,7 @@ spock_read_rel(StringInfo in)
 	char	  **attrnames;
 	Oid		   *attrtypes;
 	Oid		   *attrtypmods;
+	bool	   *attidentity;
 
 	/* read the flags */
 	flags = pq_getmsgbyte(in);
@@ -1113,27 +1315,28 @@ spock_read_rel(StringInfo in)
 	relname = (char *) pq_getmsgbytes(in, len);
 
 	/* Get attribute description */
-	spock_read_attrs(in, &attrnames, &attrtypes, &attrtypmods, &natts);
+	spock_read_attrs(in, &attrnames, &attrtypes, &attrtypmods, &attidentity,
+					 &natts);
 
-	spock_relation_cache_update(relid, schemaname, relname, natts, attrnames, attrtypes, attrtypmods);
+	spock_relation_cache_update(relid, schemaname, relname, natts, attrnames,
+								attrtypes, attrtypmods, attidentity);
 
 	return relid;
 }
 
 /*
  * Read relation attributes from the outputstream.
- *
- * TODO handle flags.
  */
 static void
 spock_read_attrs(StringInfo in, char ***attrnames, Oid **attrtypes,
-				 Oid **attrtypmods, int *nattrnames)
+				 Oid **attrtypmods, bool **attidentity, int *nattrnames)
 {
 	int			i;
 	uint16		nattrs;
 	char	  **attrs;
 	Oid		   *types;
 	Oid		   *typmods;
+	bool	   *identity;
 	char		blocktype;
 
 	blocktype = pq_getmsgbyte(in);
@@ -1144,6 +1347,7 @@ spock_read_attrs(StringInfo in, char ***attrnames, Oid **attrtypes,
 	attrs = palloc(nattrs * sizeof(char *));
 	types = (Oid *) palloc(nattrs * sizeof(Oid));
 	typmods = (Oid *) palloc(nattrs * sizeof(Oid));
+	identity = (bool *) palloc(nattrs * sizeof(bool));
 
 	/* read the attributes */
 	for (i = 0; i < nattrs; i++)
@@ -1153,8 +1357,8 @@ spock_read_attrs(StringInfo in, char ***attrnames, Oid **attrtypes,
 		blocktype = pq_getmsgbyte(in);	/* column definition follows */
 		if (blocktype != 'C')
 			elog(ERROR, "expected COLUMN, got %c", blocktype);
-		/* read flags (we ignore them so far) */
-		(void) pq_getmsgbyte(in);
+		/* read flags */
+		identity[i] = (pq_getmsgbyte(in) & IS_REPLICA_IDENTITY) != 0;
 
 		blocktype = pq_getmsgbyte(in);	/* column name block follows */
 		if (blocktype != 'N')
@@ -1171,9 +1375,72 @@ spock_read_attrs(StringInfo in, char ***attrnames, Oid **attrtypes,
 	*attrnames = attrs;
 	*attrtypes = types;
 	*attrtypmods = typmods;
+	*attidentity = identity;
 	*nattrnames = nattrs;
 }
 
+/*
+ * Compute the row keys touched by an INSERT, UPDATE or DELETE message
+ * without applying it.
+ *
+ * A key is a hash over the wire representation of the replica identity
+ * columns of a row. UPDATE yields the keys of both the old and the new row
+ * if the old key was sent. Returns the number of keys stored into keys, or
+ * 0 if the change can't be pinned to individual rows (the remote relation
+ * has no replica identity index or a key column was not sent), in which
+ * case the caller has to assume it touches the whole relation.
+ *
+ * The relation must have been seen in a RELATION message before.
+ */
+int
+spock_read_change_keys(StringInfo in, char action, uint32 *relid,
+					   uint32 keys[2])
+{
+	SpockRelation *rel;
+	char		tupaction;
+	int			nkeys = 0;
+	bool		valid = true;
+
+	(void) pq_getmsgbyte(in);	/* flags */
+	*relid = pq_getmsgint(in, 4);
+
+	rel = spock_relation_lookup(*relid);
+	if (rel == NULL || rel->attidentity == NULL)
+		return 0;
+
+	tupaction = pq_getmsgbyte(in);
+	switch (action)
+	{
+		case 'I':
+			if (tupaction != 'N')
+				elog(ERROR, "expected new tuple but got %d", tupaction);
+			valid = spock_read_tuple_key(in, rel, &keys[nkeys++]);
+			break;
+		case 'U':
+			if (tupaction == 'K' || tupaction == 'O')
+			{
+				valid = spock_read_tuple_key(in, rel, &keys[nkeys++]);
+				tupaction = pq_getmsgbyte(in);
+			}
+			if (tupaction != 'N')
+				elog(ERROR, "expected action 'N', got %c", tupaction);
+			if (!spock_read_tuple_key(in, rel, &keys[nkeys]))
+				valid = false;
+			else if (nkeys == 0 || keys[0] != keys[nkeys])
+				nkeys++;
+			break;
+		case 'D':
+			if (tupaction != 'K' && tupaction != 'O')
+				elog(ERROR, "expected action 'O' or 'K' %c", tupaction);
+			valid = spock_read_tuple_key(in, rel, &keys[nkeys++]);
+			break;
+		default:
+			elog(ERROR, "unexpected change action %c", action);
+	}
+
+	return valid ? nkeys : 0;
+}
+
 /*
  * Write TRUNCATE command to the outputstream.
  */
@@ -1226,3 +1493,181 @@ spock_read_truncate(StringInfo in, bool *cascade, bool *restart_seqs)
 
 	return relids;
 }
+
+/*
+ * Streaming of in-progress transactions.
+ *
+ * Changes of a large transaction may be sent before it commits, in blocks
+ * delimited by STREAM START and STREAM STOP. Each message inside a block is
+ * a regular protocol message prefixed with a STREAM CHANGE header naming the
+ * (sub)transaction it belongs to. The subscriber spools them and applies
+ * them when STREAM COMMIT arrives, which is sent between the usual BEGIN and
+ * COMMIT of the transaction. STREAM ABORT discards a (sub)transaction.
+ */
+
+/*
+ * Write STREAM START to the output stream.
+ */
+void
+spock_write_stream_start(StringInfo out, TransactionId xid,
+						 bool first_segment)
+{
+	uint8		flags = 0;
+
+	/* Protocol version 5+ includes remote_insert_lsn at the beginning */
+	if (spock_get_proto_version() >= 5)
+		pq_sendint64(out, GetXLogWriteRecPtr());
+
+	pq_sendbyte(out, 's');		/* STREAM START */
+	pq_sendbyte(out, flags);
+
+	pq_sendint32(out, xid);
+	pq_sendbyte(out, first_segment ? 1 : 0);
+}
+
+/*
+ * Write STREAM STOP to the output stream.
+ */
+void
+spock_write_stream_stop(StringInfo out)
+{
+	uint8		flags = 0;
+
+	/* Protocol version 5+ includes remote_insert_lsn at the beginning */
+	if (spock_get_proto_version() >= 5)
+		pq_sendint64(out, GetXLogWriteRecPtr());
+
+	pq_sendbyte(out, 'e');		/* STREAM STOP */
+	pq_sendbyte(out, flags);
+}
+
+/*
+ * Write STREAM ABORT of a transaction or one of its subtransactions to the
+ * output stream.
+ */
+void
+spock_write_stream_abort(StringInfo out, TransactionId xid,
+						 TransactionId subxid)
+{
+	uint8		flags = 0;
+
+	/* Protocol version 5+ includes remote_insert_lsn at the beginning */
+	if (spock_get_proto_version() >= 5)
+		pq_sendint64(out, GetXLogWriteRecPtr());
+
+	pq_sendbyte(out, 'a');		/* STREAM ABORT */
+	pq_sendbyte(out, flags);
+
+	pq_sendint32(out, xid);
+	pq_sendint32(out, subxid);
+}
+
+/*
+ * Write STREAM COMMIT to the output stream.
+ */
+void
+spock_write_stream_commit(StringInfo out, TransactionId xid)
+{
+	uint8		flags = 0;
+
+	/* Protocol version 5+ includes remote_insert_lsn at the beginning */
+	if (spock_get_proto_version() >= 5)
+		pq_sendint64(out, GetXLogWriteRecPtr());
+
+	pq_sendbyte(out, 'c');		/* STREAM COMMIT */
+	pq_sendbyte(out, flags);
+
+	pq_sendint32(out, xid);
+}
+
+/*
+ * Write the STREAM CHANGE header; the wrapped message is written right after
+ * it into the same buffer.
+ */
+void
+spock_write_stream_change(StringInfo out, TransactionId xid)
+{
+	uint8		flags = 0;
+
+	/* Protocol version 5+ includes remote_insert_lsn at the beginning */
+	if (spock_get_proto_version() >= 5)
+		pq_sendint64(out, GetXLogWriteRecPtr());
+
+	pq_sendbyte(out, 'x');		/* STREAM CHANGE */
+	pq_sendbyte(out, flags);
+
+	pq_sendint32(out, xid);
+}
+
+/*
+ * Read STREAM START from the stream.
+ */
+void
+spock_read_stream_start(StringInfo in, TransactionId *xid,
+						bool *first_segment)
+{
+	/* read flags */
+	uint8		flags = pq_getmsgbyte(in);
+
+	Assert(flags == 0);
+	(void) flags;				/* unused */
+
+	*xid = pq_getmsgint(in, 4);
+	*first_segment = (pq_getmsgbyte(in) == 1);
+}
+
+/*
+ * Read STREAM ABORT from the stream.
+ */
+void
+spock_read_stream_abort(StringInfo in, TransactionId *xid,
+						TransactionId *subxid)
+{
+	/* read flags */
+	uint8		flags = pq_getmsgbyte(in);
+
+	Assert(flags == 0);
+	(void) flags;				/* unused */
+
+	*xid = pq_getmsgint(in, 4);
+	*subxid = pq_getmsgint(in, 4);
+}
+
+/*
+ * Read STREAM COMMIT from the stream.
+ */
+TransactionId
+spock_read_stream_commit(StringInfo in)
+{
+	/* read flags */
+	uint8		flags = pq_getmsgbyte(in);
+
+	Assert(flags == 0);
+	(void) flags;				/* unused */
+
+	return pq_getmsgint(in, 4);
+}
+
+/*
+ * Read the STREAM CHANGE header from the stream, leaving the cursor at the
+ * action byte of the wrapped message.
+ */
+TransactionId
+spock_read_stream_change(StringInfo in)
+{
+	TransactionId xid;
+
+	/* read flags */
+	uint8		flags = pq_getmsgbyte(in);
+
+	Assert(flags == 0);
+	(void) flags;				/* unused */
+
+	xid = pq_getmsgint(in, 4);
+
+	/* The wrapped message has its own remote_insert_lsn, see apply_work() */
+	if (spock_apply_get_proto_version() >= 5)
+		(void) pq_getmsgint64(in);
+
+	return xid;
+}
@@ -11,10 +11,14 @@
  */
 #include "postgres.h"
 
+#include "access/genam.h"
 #include "access/heapam.h"
+#include "access/htup_details.h"
 #include "access/reloptions.h"
 
 #include "catalog/namespace.h"
+#include "catalog/pg_am.h"
+#include "catalog/pg_index.h"
 #include "catalog/pg_trigger.h"
 #include "commands/seclabel.h"
 #include "utils/attoptcache.h"
@@ -23,10 +27,12 @@
 #include "utils/hsearch.h"
 #include "utils/fmgroids.h"
 #include "utils/inval.h"
+#include "utils/memutils.h"
 #include "utils/rel.h"
 #include "utils/varlena.h"
 
 #include "spock.h"
+#include "spock_apply_heap.h"
 #include "spock_common.h"
 #include "spock_relcache.h"
 
@@ -36,6 +42,7 @@ static HTAB *SpockRelationHash = NULL;
 
 static void spock_relcache_init(void);
 static int	tupdesc_get_att_by_name(TupleDesc desc, const char *attname);
+static Oid	full_identity_index(SpockRelation *entry);
 
 static void
 relcache_free_entry(SpockRelation *entry)
@@ -55,8 +62,20 @@ relcache_free_entry(SpockRelation *entry)
 
 	if (entry->attmap)
 		pfree(entry->attmap);
+	if (entry->attidentity)
+		pfree(entry->attidentity);
 	if (entry->delta_apply_functions)
 		pfree(entry->delta_apply_functions);
+	if (entry->attinput_cxt)
+		MemoryContextDelete(entry->attinput_cxt);
+	entry->attinput_cxt = NULL;
+	entry->attinput = NULL;
+	if (entry->ucindex_cxt)
+		MemoryContextDelete(entry->ucindex_cxt);
+	entry->ucindex_cxt = NULL;
+	entry->ucindexes = NULL;
+	entry->nucindexes = 0;
+	entry->ucindexes_valid = false;
 
 	entry->natts = 0;
 	entry->reloid = InvalidOid;
@@ -143,6 +162,19 @@ spock_relation_open(uint32 remoteid, LOCKMODE lockmode)
 			}
 		}
 
+		/* Input functions depend on the local column types, start afresh. */
+		if (entry->attinput_cxt == NULL)
+			entry->attinput_cxt = AllocSetContextCreate(CacheMemoryContext,
+														"spock remote column input",
+														ALLOCSET_SMALL_SIZES);
+		else
+			MemoryContextReset(entry->attinput_cxt);
+		entry->attinput = MemoryContextAllocZero(entry->attinput_cxt,
+												 Max(entry->natts, 1) * sizeof(SpockAttrInput));
+
+		/* So do the scan keys of the unique indexes, built when needed. */
+		entry->ucindexes_valid = false;
+
 		relinfo = makeNode(ResultRelInfo);
 		InitResultRelInfo(relinfo, entry->rel, 1, NULL, 0);
 		entry->reloid = RelationGetRelid(entry->rel);
@@ -164,6 +196,11 @@ spock_relation_open(uint32 remoteid, LOCKMODE lockmode)
 		else
 			entry->idxoid = RelationGetReplicaIndex(relinfo->ri_RelationDesc);
 
+		entry->fullidxoid = InvalidOid;
+		if (!OidIsValid(entry->idxoid) &&
+			entry->rel->rd_rel->relreplident == REPLICA_IDENTITY_FULL)
+			entry->fullidxoid = full_identity_index(entry);
+
 		/* Cache trigger info. */
 		entry->hasTriggers = false;
 		if (entry->rel->trigdesc != NULL)
@@ -198,7 +235,8 @@ spock_relation_open(uint32 remoteid, LOCKMODE lockmode)
 void
 spock_relation_cache_update(uint32 remoteid, char *schemaname,
 							char *relname, int natts, char **attnames,
-							Oid *attrtypes, Oid *attrtypmods)
+							Oid *attrtypes, Oid *attrtypmods,
+							bool *attidentity)
 {
 	MemoryContext oldcontext;
 	SpockRelation *entry;
@@ -225,17 +263,29 @@ spock_relation_cache_update(uint32 remoteid, char *schemaname,
 	entry->attnames = palloc(natts * sizeof(char *));
 	entry->attrtypes = (Oid *) palloc(natts * sizeof(Oid));
 	entry->attrtypmods = (Oid *) palloc(natts * sizeof(Oid));
+	entry->attidentity = (bool *) palloc(natts * sizeof(bool));
 	for (i = 0; i < natts; i++)
 	{
 		entry->attnames[i] = pstrdup(attnames[i]);
 		entry->attrtypes[i] = attrtypes[i];
 		entry->attrtypmods[i] = attrtypmods[i];
+		entry->attidentity[i] = attidentity[i];
 	}
 	entry->attmap = palloc(natts * sizeof(int));
 	entry->has_delta_columns = false;
 	entry->delta_apply_functions = (Oid *) palloc0(entry->natts * sizeof(Oid));
 	MemoryContextSwitchTo(oldcontext);
 
+	if (!found)
+	{
+		entry->attinput = NULL;
+		entry->attinput_cxt = NULL;
+		entry->ucindexes = NULL;
+		entry->nucindexes = 0;
+		entry->ucindexes_valid = false;
+		entry->ucindex_cxt = NULL;
+	}
+
 	/* XXX Should we validate the relation against local schema here? */
 
 	entry->reloid = InvalidOid;
@@ -269,16 +319,42 @@ spock_relation_cache_updater(SpockRemoteRel *remoterel)
 	entry->attnames = palloc(remoterel->natts * sizeof(char *));
 	for (i = 0; i < remoterel->natts; i++)
 		entry->attnames[i] = pstrdup(remoterel->attnames[i]);
+	entry->attidentity = NULL;
 	entry->attmap = palloc(remoterel->natts * sizeof(int));
 	entry->has_delta_columns = false;
 	entry->delta_apply_functions = (Oid *) palloc0(entry->natts * sizeof(Oid));
 	MemoryContextSwitchTo(oldcontext);
 
+	if (!found)
+	{
+		entry->attinput = NULL;
+		entry->attinput_cxt = NULL;
+		entry->ucindexes = NULL;
+		entry->nucindexes = 0;
+		entry->ucindexes_valid = false;
+		entry->ucindex_cxt = NULL;
+	}
+
 	/* XXX Should we validate the relation against local schema here? */
 
 	entry->reloid = InvalidOid;
 }
 
+/*
+ * Look up the remote relation metadata without opening the local relation.
+ *
+ * Returns NULL if we haven't seen the relation yet.
+ */
+SpockRelation *
+spock_relation_lookup(uint32 remoteid)
+{
+	if (SpockRelationHash == NULL)
+		spock_relcache_init();
+
+	return (SpockRelation *) hash_search(SpockRelationHash, (void *) &remoteid,
+										 HASH_FIND, NULL);
+}
+
 void
 spock_relation_close(SpockRelation *rel, LOCKMODE lockmode)
 {
@@ -303,12 +379,41 @@ spock_relation_cache_reset(void)
 		entry->reloid = InvalidOid;
 }
 
+/*
+ * Forget the relations left open when a subtransaction was rolled back.
+ *
+ * Their Relation was released with the subtransaction's resource owner, so
+ * look them up afresh next time. The other entries stay valid.
+ */
+void
+spock_relation_cache_reset_open(void)
+{
+	HASH_SEQ_STATUS status;
+	SpockRelation *entry;
+
+	if (SpockRelationHash == NULL)
+		return;
+
+	hash_seq_init(&status, SpockRelationHash);
+
+	while ((entry = (SpockRelation *) hash_seq_search(&status)) != NULL)
+	{
+		if (entry->rel == NULL)
+			continue;
+
+		entry->rel = NULL;
+		entry->reloid = InvalidOid;
+	}
+}
 
 static void
 spock_relcache_invalidate_callback(Datum arg, Oid reloid)
 {
 	SpockRelation *entry;
 
+	/* Executor state built for the relation is stale as well. */
+	spock_apply_heap_invalidate(reloid);
+
 	/* Just to be sure. */
 	if (SpockRelationHash == NULL)
 		return;
@@ -386,6 +491,131 @@ tupdesc_get_att_by_name(TupleDesc desc, const char *attname)
 }
 
 
+/*
+ * Get the unique indexes spock.check_all_uc_indexes looks for conflicting
+ * rows in, with their scan keys prepared, for the open relation.
+ *
+ * These are computed once and kept until the relation mapping is rebuilt,
+ * which relcache invalidations of the relation cause.
+ */
+SpockUCIndex *
+spock_relation_get_uc_indexes(SpockRelation *entry, int *nindexes)
+{
+	Assert(entry->rel != NULL);
+
+	if (!entry->ucindexes_valid)
+	{
+		List	   *indexes;
+		ListCell   *lc;
+		MemoryContext oldctx;
+
+		if (entry->ucindex_cxt == NULL)
+			entry->ucindex_cxt = AllocSetContextCreate(CacheMemoryContext,
+													   "spock unique index scan keys",
+													   ALLOCSET_SMALL_SIZES);
+		else
+			MemoryContextReset(entry->ucindex_cxt);
+
+		indexes = RelationGetIndexList(entry->rel);
+
+		oldctx = MemoryContextSwitchTo(entry->ucindex_cxt);
+		entry->nucindexes = 0;
+		entry->ucindexes = palloc0(Max(list_length(indexes), 1) *
+								   sizeof(SpockUCIndex));
+
+		foreach(lc, indexes)
+		{
+			Relation	idxrel = index_open(lfirst_oid(lc), AccessShareLock);
+
+			if (IsIndexUsableForInsertConflict(idxrel))
+			{
+				SpockUCIndex *uc = &entry->ucindexes[entry->nucindexes++];
+				ScanKeyData skey[INDEX_MAX_KEYS];
+
+				uc->indexoid = RelationGetRelid(idxrel);
+				uc->nkeys = spock_replindex_scan_key_init(skey, idxrel);
+				uc->skey = palloc(uc->nkeys * sizeof(ScanKeyData));
+				memcpy(uc->skey, skey, uc->nkeys * sizeof(ScanKeyData));
+			}
+
+			index_close(idxrel, AccessShareLock);
+		}
+
+		MemoryContextSwitchTo(oldctx);
+		list_free(indexes);
+
+		entry->ucindexes_valid = true;
+	}
+
+	*nindexes = entry->nucindexes;
+	return entry->ucindexes;
+}
+
+/*
+ * Pick an index to look up the rows of a replica identity FULL table with.
+ *
+ * Without a replica identity index the whole old tuple is sent, so any index
+ * which can be searched for equality on columns we receive narrows down the
+ * rows to compare, unique or not. Partial indexes don't contain every row,
+ * and hash indexes can only be scanned with equality strategies resolved per
+ * access method, which needs PostgreSQL 17.
+ */
+static Oid
+full_identity_index(SpockRelation *entry)
+{
+	TupleDesc	desc = RelationGetDescr(entry->rel);
+	bool	   *received;
+	List	   *indexes;
+	ListCell   *lc;
+	Oid			result = InvalidOid;
+	int			i;
+
+	received = palloc0(desc->natts * sizeof(bool));
+	for (i = 0; i < entry->natts; i++)
+		received[entry->attmap[i]] = true;
+
+	indexes = RelationGetIndexList(entry->rel);
+	foreach(lc, indexes)
+	{
+		Relation	idxrel = index_open(lfirst_oid(lc), AccessShareLock);
+		Form_pg_index idx = idxrel->rd_index;
+		bool		unique = idx->indisunique;
+		bool		usable;
+
+		usable = idx->indisvalid && idx->indisready && idx->indislive &&
+			heap_attisnull(idxrel->rd_indextuple, Anum_pg_index_indpred, NULL) &&
+#if PG_VERSION_NUM >= 170000
+			(idxrel->rd_rel->relam == BTREE_AM_OID ||
+			 idxrel->rd_rel->relam == HASH_AM_OID) &&
+#else
+			idxrel->rd_rel->relam == BTREE_AM_OID &&
+#endif
+			AttributeNumberIsValid(idx->indkey.values[0]);
+
+		for (i = 0; usable && i < IndexRelationGetNumberOfKeyAttributes(idxrel); i++)
+		{
+			AttrNumber	attno = idx->indkey.values[i];
+
+			if (AttributeNumberIsValid(attno) && !received[attno - 1])
+				usable = false;
+		}
+
+		/* Prefer unique indexes, they need no more than one comparison. */
+		if (usable && (!OidIsValid(result) || unique))
+			result = RelationGetRelid(idxrel);
+
+		index_close(idxrel, AccessShareLock);
+
+		if (usable && unique)
+			break;
+	}
+
+	list_free(indexes);
+	pfree(received);
+
+	return result;
+}
+
 /*
  * Find a delta apply function (either custom or built in) by
  * the signature fname(typeoid, typeoid, typeoid).
@@ -28,6 +28,7 @@
 #include "catalog/objectaddress.h"
 #include "catalog/pg_type.h"
 
+#include "executor/executor.h"
 #include "executor/spi.h"
 
 #include "nodes/makefuncs.h"
@@ -43,6 +44,7 @@
 #include "utils/rel.h"
 
 #include "spock_dependency.h"
+#include "spock_executor.h"
 #include "spock_node.h"
 #include "spock_queue.h"
 #include "spock_relcache.h"
@@ -363,6 +365,41 @@ get_replication_sets(Oid nodeid, List *replication_set_names, bool missing_ok)
 	return replication_sets;
 }
 
+/*
+ * Plan the row filters of the table once and keep them, together with the
+ * executor state needed to evaluate them, in the cache entry.
+ *
+ * The scan slot uses a copy of the table's descriptor so that it does not
+ * hold a tupdesc pin across transactions.
+ */
+static void
+repset_prepare_row_filters(SpockTableRepInfo *entry, Relation table)
+{
+	MemoryContext oldctx;
+	EState	   *estate;
+	ListCell   *lc;
+
+	oldctx = MemoryContextSwitchTo(CacheMemoryContext);
+	estate = create_estate_for_relation(table, false);
+	entry->row_filter_estate = estate;
+
+	MemoryContextSwitchTo(estate->es_query_cxt);
+	entry->row_filter_econtext = GetPerTupleExprContext(estate);
+	entry->row_filter_econtext->ecxt_scantuple =
+		ExecInitExtraTupleSlot(estate,
+							   CreateTupleDescCopy(RelationGetDescr(table)),
+							   &TTSOpsHeapTuple);
+
+	foreach(lc, entry->row_filter)
+	{
+		Node	   *row_filter = (Node *) lfirst(lc);
+
+		entry->row_filter_exprs = lappend(entry->row_filter_exprs,
+										  spock_prepare_row_filter(row_filter));
+	}
+	MemoryContextSwitchTo(oldctx);
+}
+
 SpockTableRepInfo *
 get_table_replication_info(Oid nodeid, Relation table,
 						   List *subs_replication_sets)
@@ -396,6 +433,16 @@ get_table_replication_info(Oid nodeid, Relation table,
 	if (found && entry->isvalid)
 		return entry;
 
+	/*
+	 * The executor state of an invalidated entry is only released here, the
+	 * invalidation callback may fire while a row filter is being evaluated.
+	 */
+	if (found && entry->row_filter_estate != NULL)
+		FreeExecutorState(entry->row_filter_estate);
+	entry->row_filter_estate = NULL;
+	entry->row_filter_econtext = NULL;
+	entry->row_filter_exprs = NIL;
+
 	/* Fill the entry */
 	entry->reloid = reloid;
 	entry->replicate_insert = false;
@@ -506,6 +553,10 @@ get_table_replication_info(Oid nodeid, Relation table,
 
 	systable_endscan(scan);
 	table_close(repset_rel, RowExclusiveLock);
+
+	if (list_length(entry->row_filter) > 0)
+		repset_prepare_row_filters(entry, table);
+
 	entry->isvalid = true;
 
 	return entry;
@@ -166,17 +166,26 @@ spock_rmgr_cleanup(void)
 /*
  * spock_apply_progress_add_to_wal
  *
- * Emit and flush a progress record to WAL after committing a remote-origin
- * transaction locally. This makes the progress update durable and guarantees
- * redo will restore it after crash.
+ * Emit a progress record to WAL after committing a remote-origin transaction
+ * locally, so redo restores it after a crash.
  *
  *   - Must be called *after* CommitTransactionCommand() of the applied txn.
  *   - Uses info code SPOCK_RMGR_APPLY_PROGRESS (0x10).
  *
+ * With flush = false the record is not forced to disk here.  Waiting for an
+ * fsync per applied transaction would cap small-transaction apply at disk
+ * flush rate, so the record rides along with the commit record of the next
+ * applied transaction instead, and the WAL writer is told about it the same
+ * way as for an asynchronous commit, which bounds how long it can stay
+ * unflushed when apply goes idle.  A crash inside that window merely leaves
+ * the redone progress one transaction behind the replication origin, which
+ * the next applied transaction corrects; the same as crashing between the
+ * commit and the progress record.
+ *
  * Returns: the LSN of the inserted record.
  */
 XLogRecPtr
-spock_apply_progress_add_to_wal(const SpockApplyProgress *sap)
+spock_apply_progress_add_to_wal(const SpockApplyProgress *sap, bool flush)
 {
 	XLogRecPtr			lsn;
 
@@ -186,13 +195,10 @@ spock_apply_progress_add_to_wal(const SpockApplyProgress *sap)
 	XLogRegisterData((char *) sap, sizeof(SpockApplyProgress));
 	lsn = XLogInsert(SPOCK_RMGR_ID, SPOCK_RMGR_APPLY_PROGRESS);
 
-	/*
-	 * Force the WAL record to disk immediately. This ensures that progress
-	 * is durably recorded before we update the in-memory state and continue
-	 * processing. If we crash after updating memory but before the WAL
-	 * flushes, we could lose progress tracking and replay would be incorrect.
-	 */
-	XLogFlush(lsn);
+	if (flush)
+		XLogFlush(lsn);
+	else
+		XLogSetAsyncXactLSN(lsn);
 
 	return lsn;
 }
@@ -185,6 +185,110 @@ spock_get_remote_repset_table(PGconn *conn, RangeVar *rv,
 	return remoterel;
 }
 
+/*
+ * Fetch the on-disk size of the given tables, in list order. Partitioned
+ * tables count the size of all their partitions.
+ */
+int64 *
+spock_get_remote_table_sizes(PGconn *conn, List *tables)
+{
+	int64	   *sizes = palloc0(sizeof(int64) * Max(list_length(tables), 1));
+	PGresult   *res;
+	ListCell   *lc;
+	bool		first = true;
+	StringInfoData query;
+	StringInfoData relids;
+	int			i;
+
+	initStringInfo(&relids);
+	foreach(lc, tables)
+	{
+		SpockRemoteRel *remoterel = lfirst(lc);
+
+		if (first)
+			first = false;
+		else
+			appendStringInfoChar(&relids, ',');
+
+		appendStringInfo(&relids, "%u", remoterel->relid);
+	}
+
+	initStringInfo(&query);
+	appendStringInfo(&query,
+					 "SELECT coalesce(sum(pg_catalog.pg_relation_size(p.relid)), 0)"
+					 "  FROM unnest('{%s}'::pg_catalog.oid[]) WITH ORDINALITY AS t(relid, n)"
+					 "  LEFT JOIN LATERAL pg_catalog.pg_partition_tree(t.relid) p ON true"
+					 " GROUP BY t.n ORDER BY t.n",
+					 relids.data);
+
+	res = PQexec(conn, query.data);
+	if (PQresultStatus(res) != PGRES_TUPLES_OK ||
+		PQntuples(res) != list_length(tables))
+		elog(ERROR, "could not get table sizes: %s", PQresultErrorMessage(res));
+
+	for (i = 0; i < PQntuples(res); i++)
+		sizes[i] = strtoi64(PQgetvalue(res, i, 0), NULL, 10);
+
+	PQclear(res);
+
+	return sizes;
+}
+
+/*
+ * Fetch the types of the given columns of a table, in list order. Columns
+ * which don't exist or whose type has no binary output function are returned
+ * as InvalidOid.
+ */
+Oid *
+spock_get_remote_column_types(PGconn *conn, SpockRemoteRel *remoterel,
+							  List *attnames)
+{
+	Oid		   *types = palloc0(sizeof(Oid) * Max(list_length(attnames), 1));
+	PGresult   *res;
+	ListCell   *lc;
+	bool		first = true;
+	StringInfoData query;
+	StringInfoData names;
+	int			i;
+
+	initStringInfo(&names);
+	foreach(lc, attnames)
+	{
+		char	   *attname = strVal(lfirst(lc));
+		char	   *lit = PQescapeLiteral(conn, attname, strlen(attname));
+
+		if (first)
+			first = false;
+		else
+			appendStringInfoChar(&names, ',');
+
+		appendStringInfoString(&names, lit);
+		PQfreemem(lit);
+	}
+
+	initStringInfo(&query);
+	appendStringInfo(&query,
+					 "SELECT coalesce(CASE WHEN t.typsend <> 0 THEN a.atttypid END, 0)"
+					 "  FROM unnest(ARRAY[%s]::pg_catalog.name[]) WITH ORDINALITY AS c(attname, n)"
+					 "  LEFT JOIN pg_catalog.pg_attribute a ON a.attrelid = %u AND a.attname = c.attname"
+					 "  LEFT JOIN pg_catalog.pg_type t ON t.oid = a.atttypid"
+					 " ORDER BY c.n",
+					 names.data, remoterel->relid);
+
+	res = PQexec(conn, query.data);
+	if (PQresultStatus(res) != PGRES_TUPLES_OK ||
+		PQntuples(res) != list_length(attnames))
+		elog(ERROR, "could not get column types of table %s.%s: %s",
+			 remoterel->nspname, remoterel->relname,
+			 PQresultErrorMessage(res));
+
+	for (i = 0; i < PQntuples(res); i++)
+		types[i] = atooid(PQgetvalue(res, i, 0));
+
+	PQclear(res);
+
+	return types;
+}
 
 /*
  * Is the remote slot active?.
@@ -29,10 +29,12 @@
 #include "access/heapam.h"
 #include "access/skey.h"
 #include "access/stratnum.h"
+#include "access/transam.h"
 #include "access/xact.h"
 
 #include "catalog/indexing.h"
 #include "catalog/namespace.h"
+#include "catalog/pg_type.h"
 
 #include "commands/dbcommands.h"
 #include "commands/extension.h"
@@ -51,6 +53,7 @@
 
 #include "storage/fd.h"
 #include "storage/ipc.h"
+#include "storage/latch.h"
 #include "storage/proc.h"
 
 #include "tcop/utility.h"
@@ -61,6 +64,7 @@
 #include "utils/pg_lsn.h"
 #include "utils/rel.h"
 #include "utils/resowner.h"
+#include "utils/syscache.h"
 
 #include "spock_common.h"
 #include "spock_group.h"
@@ -85,6 +89,39 @@
 #define Anum_sync_status		5
 #define Anum_sync_statuslsn		6
 
+/* Flush the COPY data queued for a target connection every this many bytes */
+#define COPY_TARGET_PENDING_SIZE	(64 * 1024)
+
+/* Upper limit of the number of block ranges a table is split into */
+#define COPY_TABLE_MAX_RANGES		1024
+
+/*
+ * A table to copy, or a block range of a large table copied by several
+ * connections at once.
+ */
+typedef struct SpockCopyTable
+{
+	SpockRemoteRel *remoterel;
+	int64		size;
+	BlockNumber startblk;		/* range start, 0 for the whole table */
+	BlockNumber endblk;			/* range end, InvalidBlockNumber for none */
+	int		   *nremaining;		/* ranges of the table not yet copied, or
+								 * NULL if the table is not split */
+} SpockCopyTable;
+
+/* A connection pair used to copy table data, see copy_tables_parallel() */
+typedef struct SpockCopyConn
+{
+	PGconn	   *origin_conn;
+	PGconn	   *target_conn;
+	SpockCopyTable *table;		/* table being copied, NULL if idle */
+	int			pending;		/* bytes queued since the last flush */
+	bool		flushing;		/* waiting for target_conn to be writable */
+} SpockCopyConn;
+
+int			spock_sync_connections = 1;
+int			spock_sync_table_split_size = 1024;
+
 PGDLLEXPORT void spock_sync_main(Datum main_arg);
 
 static SpockSyncWorker *MySyncWorker = NULL;
@@ -283,9 +320,14 @@ dump_structure(SpockSubscription *sub, const char *destfile,
 	 */
 }
 
+/*
+ * Restore the given section of the dumped structure. With more than one job
+ * the objects are restored in parallel by that many connections, each in its
+ * own transaction, otherwise everything is applied in a single transaction.
+ */
 static void
 restore_structure(SpockSubscription *sub, const char *srcfile,
-				  const char *section)
+				  const char *section, int jobs)
 {
 	char	   *dsn;
 	char	   *err_msg;
@@ -317,8 +359,18 @@ restore_structure(SpockSubscription *sub, const char *srcfile,
 	/* stop execution on any error */
 	cmdargv[cmdargc++] = "--exit-on-error";
 
-	/* apply everything in single tx */
-	cmdargv[cmdargc++] = "-1";
+	if (jobs > 1)
+	{
+		/* restore in parallel jobs */
+		initStringInfo(&s);
+		appendStringInfo(&s, "--jobs=%d", jobs);
+		cmdargv[cmdargc++] = pstrdup(s.data);
+	}
+	else
+	{
+		/* apply everything in single tx */
+		cmdargv[cmdargc++] = "-1";
+	}
 
 	/* connection string */
 	initStringInfo(&s);
@@ -590,8 +642,12 @@ start_copy_origin_tx(PGconn *conn, const char *snapshot)
 	PQclear(res);
 }
 
+/*
+ * If leader_pid is set, the origin session of that backend (the first target
+ * connection of a parallel copy) is shared rather than set up.
+ */
 static void
-start_copy_target_tx(PGconn *conn, const char *origin_name)
+start_copy_target_tx(PGconn *conn, const char *origin_name, int leader_pid)
 {
 	PGresult   *res;
 	char	   *s;
@@ -615,9 +671,14 @@ start_copy_target_tx(PGconn *conn, const char *origin_name)
 	if (PQserverVersion(conn) >= 90500)
 	{
 		s = PQescapeLiteral(conn, origin_name, strlen(origin_name));
-		appendStringInfo(&query,
-						 "SELECT pg_catalog.pg_replication_origin_session_setup(%s);\n",
-						 s);
+		if (leader_pid != 0)
+			appendStringInfo(&query,
+							 "SELECT spock.sync_origin_session_share(%s, %d);\n",
+							 s, leader_pid);
+		else
+			appendStringInfo(&query,
+							 "SELECT pg_catalog.pg_replication_origin_session_setup(%s);\n",
+							 s);
 		PQfreemem(s);
 		appendStringInfo(&query,
 						 "SELECT pg_catalog.pg_replication_origin_xact_setup('0/0', 'epoch');");
@@ -647,7 +708,7 @@ finish_copy_origin_tx(PGconn *conn)
 }
 
 static void
-finish_copy_target_tx(PGconn *conn)
+finish_copy_target_tx(PGconn *conn, bool shared_origin)
 {
 	PGresult   *res;
 
@@ -660,9 +721,10 @@ finish_copy_target_tx(PGconn *conn)
 
 	/*
 	 * Resetting the origin explicitly before the backend exits will help
-	 * prevent races with other accesses to the same replication origin.
+	 * prevent races with other accesses to the same replication origin. A
+	 * shared origin session is released by the backend which set it up.
 	 */
-	if (PQserverVersion(conn) >= 90500)
+	if (PQserverVersion(conn) >= 90500 && !shared_origin)
 	{
 		res = PQexec(conn, "SELECT pg_catalog.pg_replication_origin_xact_reset();\n"
 					 "SELECT pg_catalog.pg_replication_origin_session_reset();\n");
@@ -692,7 +754,7 @@ physatt_in_attmap(SpockRelation *rel, int attid)
  * Create list of columns for COPY based on logical relation mapping.
  */
 static List *
-make_copy_attnamelist(SpockRelation *rel)
+make_copy_attnamelist(SpockRelation *rel, List **atttypes)
 {
 	List	   *attnamelist = NIL;
 	TupleDesc	desc = RelationGetDescr(rel->rel);
@@ -712,25 +774,118 @@ make_copy_attnamelist(SpockRelation *rel)
 
 		attnamelist = lappend(attnamelist,
 							  makeString(rel->attnames[remoteattnum]));
+		*atttypes = lappend_oid(*atttypes,
+								TupleDescAttr(desc, attnum)->atttypid);
 	}
 
 	return attnamelist;
 }
 
 /*
- * COPY single table over wire.
+ * Can the table be copied in binary format?
+ *
+ * Like the binary basetypes of spock_output_plugin.c, this requires the same
+ * major version on both nodes, as the binary representation of a type may
+ * change between major versions. Only builtin types are considered, whose
+ * OIDs are the same on both nodes; the binary representation of arrays and
+ * composite types embeds element type OIDs, which could be of user-defined
+ * types otherwise. Every column must have the same type on both nodes and
+ * the type must have binary I/O functions.
+ */
+static bool
+copy_table_use_binary(PGconn *origin_conn, SpockRemoteRel *remoterel,
+					  List *attnamelist, List *atttypes)
+{
+	Oid		   *remotetypes;
+	ListCell   *lc;
+	int			i = 0;
+
+	if (attnamelist == NIL)
+		return false;
+
+	if (PQserverVersion(origin_conn) / 100 != PG_VERSION_NUM / 100)
+		return false;
+
+	remotetypes = spock_get_remote_column_types(origin_conn, remoterel,
+												attnamelist);
+
+	foreach(lc, atttypes)
+	{
+		Oid			typid = lfirst_oid(lc);
+		HeapTuple	typtup;
+		Form_pg_type typclass;
+		bool		binary;
+
+		if (remotetypes[i++] != typid || typid >= FirstNormalObjectId)
+			return false;
+
+		typtup = SearchSysCache1(TYPEOID, ObjectIdGetDatum(typid));
+		if (!HeapTupleIsValid(typtup))
+			elog(ERROR, "cache lookup failed for type %u", typid);
+		typclass = (Form_pg_type) GETSTRUCT(typtup);
+
+		binary = OidIsValid(typclass->typreceive) &&
+			OidIsValid(typclass->typsend);
+
+		ReleaseSysCache(typtup);
+
+		if (!binary)
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * Record the state of the data copy of a table in spock.local_sync_status.
  */
 static void
-copy_table_data(PGconn *origin_conn, PGconn *target_conn,
-				SpockRemoteRel *remoterel, List *replication_sets)
+set_copy_table_sync_status(Oid subid, SpockRemoteRel *remoterel, char status,
+						   XLogRecPtr status_lsn)
 {
+	SpockSyncStatus *oldsync;
+
+	Assert(IsTransactionState());
+
+	oldsync = get_table_sync_status(subid, remoterel->nspname,
+									remoterel->relname, true);
+	if (oldsync)
+	{
+		set_table_sync_status(subid, remoterel->nspname, remoterel->relname,
+							  status, status_lsn);
+	}
+	else
+	{
+		SpockSyncStatus newsync;
+
+		memset(&newsync, 0, sizeof(SpockSyncStatus));
+		newsync.kind = SYNC_KIND_FULL;
+		newsync.subid = subid;
+		namestrcpy(&newsync.nspname, remoterel->nspname);
+		namestrcpy(&newsync.relname, remoterel->relname);
+		newsync.status = status;
+		newsync.statuslsn = status_lsn;
+		create_local_sync_status(&newsync);
+	}
+}
+
+/*
+ * Start the COPY of a single table over the wire.
+ */
+static void
+copy_table_begin(SpockCopyConn *cc, SpockCopyTable *table,
+				 List *replication_sets)
+{
+	SpockRemoteRel *remoterel = table->remoterel;
+	PGconn	   *origin_conn = cc->origin_conn;
+	PGconn	   *target_conn = cc->target_conn;
 	SpockRelation *rel;
 	PGresult   *res;
-	int			bytes;
-	char	   *copybuf;
 	List	   *attnamelist;
+	List	   *atttypes = NIL;
 	ListCell   *lc;
 	bool		first;
+	bool		binary;
 	StringInfoData query;
 	StringInfoData attlist;
 	MemoryContext curctx = CurrentMemoryContext,
@@ -747,7 +902,9 @@ copy_table_data(PGconn *origin_conn, PGconn *target_conn,
 				 errmsg("relation \"%s.%s\" does not exist",
 						remoterel->nspname, remoterel->relname)));
 
-	attnamelist = make_copy_attnamelist(rel);
+	attnamelist = make_copy_attnamelist(rel, &atttypes);
+	binary = copy_table_use_binary(origin_conn, remoterel, attnamelist,
+								   atttypes);
 
 	initStringInfo(&attlist);
 	first = true;
@@ -822,6 +979,21 @@ copy_table_data(PGconn *origin_conn, PGconn *target_conn,
 							 PQescapeIdentifier(origin_conn, remoterel->relname,
 												strlen(remoterel->relname)));
 		}
+		else if (table->nremaining != NULL)
+		{
+			/* Only copy the given block range of a split table. */
+			appendStringInfo(&query, "(SELECT %s FROM %s.%s WHERE ctid >= '(%u,0)'",
+							 list_length(attnamelist) ? attlist.data : "*",
+							 PQescapeIdentifier(origin_conn, remoterel->nspname,
+												strlen(remoterel->nspname)),
+							 PQescapeIdentifier(origin_conn, remoterel->relname,
+												strlen(remoterel->relname)),
+							 table->startblk);
+			if (table->endblk != InvalidBlockNumber)
+				appendStringInfo(&query, " AND ctid < '(%u,0)'",
+								 table->endblk);
+			appendStringInfoString(&query, ") ");
+		}
 		else
 		{
 			/* Otherwise just copy the table. */
@@ -836,6 +1008,8 @@ copy_table_data(PGconn *origin_conn, PGconn *target_conn,
 		}
 	}
 	appendStringInfoString(&query, "TO stdout");
+	if (binary)
+		appendStringInfoString(&query, " WITH (FORMAT binary)");
 
 
 	/* Execute COPY TO. */
@@ -847,6 +1021,7 @@ copy_table_data(PGconn *origin_conn, PGconn *target_conn,
 				 errdetail("Query '%s': %s", query.data,
 						   PQerrorMessage(origin_conn))));
 	}
+	PQclear(res);
 
 	/* Build COPY FROM query. */
 	resetStringInfo(&query);
@@ -858,6 +1033,8 @@ copy_table_data(PGconn *origin_conn, PGconn *target_conn,
 	if (list_length(attnamelist))
 		appendStringInfo(&query, "(%s) ", attlist.data);
 	appendStringInfoString(&query, "FROM stdin");
+	if (binary)
+		appendStringInfoString(&query, " WITH (FORMAT binary)");
 
 	/* Execute COPY FROM. */
 	res = PQexec(target_conn, query.data);
@@ -866,52 +1043,95 @@ copy_table_data(PGconn *origin_conn, PGconn *target_conn,
 		ereport(ERROR,
 				(errmsg("table copy failed"),
 				 errdetail("Query '%s': %s", query.data,
-						   PQerrorMessage(origin_conn))));
+						   PQerrorMessage(target_conn))));
 	}
+	PQclear(res);
+
+	/*
+	 * The data is passed on without blocking, so that one slow target
+	 * connection doesn't hold up the others, see copy_table_transfer().
+	 */
+	if (PQsetnonblocking(target_conn, 1) != 0)
+		ereport(ERROR,
+				(errmsg("could not set destination connection to nonblocking mode: %s",
+						PQerrorMessage(target_conn))));
 
-	while ((bytes = PQgetCopyData(origin_conn, &copybuf, false)) > 0)
+	cc->table = table;
+	cc->pending = 0;
+	cc->flushing = false;
+}
+
+/*
+ * Send out the data queued on the target connection of a finished table,
+ * waiting for the socket as necessary, and return to blocking mode.
+ */
+static void
+copy_target_flush(PGconn *target_conn)
+{
+	int			r;
+
+	while ((r = PQflush(target_conn)) > 0)
 	{
-		if (PQputCopyData(target_conn, copybuf, bytes) != 1)
-		{
-			ereport(ERROR,
-					(errmsg("writing to target table failed"),
-					 errdetail("destination connection reported: %s",
-							   PQerrorMessage(target_conn))));
-		}
-		PQfreemem(copybuf);
+		int			rc;
+
+		rc = WaitLatchOrSocket(MyLatch,
+							   WL_SOCKET_WRITEABLE | WL_LATCH_SET |
+							   WL_EXIT_ON_PM_DEATH,
+							   PQsocket(target_conn), -1L);
+		if (rc & WL_LATCH_SET)
+			ResetLatch(MyLatch);
 
 		CHECK_FOR_INTERRUPTS();
 	}
 
-	if (bytes != -1)
+	if (r < 0 || PQsetnonblocking(target_conn, 0) != 0)
+		ereport(ERROR,
+				(errmsg("writing to target table failed"),
+				 errdetail("destination connection reported: %s",
+						   PQerrorMessage(target_conn))));
+}
+
+/*
+ * Finish the COPY of the table once the origin has sent all of its data.
+ */
+static void
+copy_table_end(SpockCopyConn *cc)
+{
+	PGresult   *res;
+
+	/* The COPY TO can still fail after sending data, e.g. in a row filter. */
+	res = PQgetResult(cc->origin_conn);
+	if (PQresultStatus(res) != PGRES_COMMAND_OK)
 	{
+		char	   *msg = pstrdup(PQerrorMessage(cc->origin_conn));
+
+		PQclear(res);
 		ereport(ERROR,
 				(errmsg("reading from origin table failed"),
-				 errdetail("source connection returned %d: %s",
-						   bytes, PQerrorMessage(origin_conn))));
+				 errdetail("source connection reported: %s", msg)));
 	}
+	PQclear(res);
 
 	/* Send local finish */
-	if (PQputCopyEnd(target_conn, NULL) != 1)
+	if (PQputCopyEnd(cc->target_conn, NULL) != 1)
 	{
 		ereport(ERROR,
 				(errmsg("sending copy-completion to destination connection failed"),
 				 errdetail("destination connection reported: %s",
-						   PQerrorMessage(target_conn))));
+						   PQerrorMessage(cc->target_conn))));
 	}
 
-	/* Clear the initial COPY_IN result. */
-	PQclear(res);
+	copy_target_flush(cc->target_conn);
 
 	/*
 	 * Retrieve the final COPY result.  PQputCopyEnd only signals end-of-data
 	 * at the protocol level; the actual outcome (constraint violations, etc.)
 	 * is available only via PQgetResult.
 	 */
-	res = PQgetResult(target_conn);
+	res = PQgetResult(cc->target_conn);
 	if (PQresultStatus(res) != PGRES_COMMAND_OK)
 	{
-		char	   *msg = pstrdup(PQerrorMessage(target_conn));
+		char	   *msg = pstrdup(PQerrorMessage(cc->target_conn));
 
 		PQclear(res);
 		ereport(ERROR,
@@ -920,8 +1140,417 @@ copy_table_data(PGconn *origin_conn, PGconn *target_conn,
 	}
 	PQclear(res);
 
-	elog(INFO, "finished synchronization of data for table %s.%s",
-		 remoterel->nspname, remoterel->relname);
+	cc->table = NULL;
+}
+
+/*
+ * Pass on the data of the table being copied which is available without
+ * waiting.
+ *
+ * Returns true when the table is done. Otherwise the caller has to wait
+ * until the origin connection is readable, or the target connection is
+ * writable if cc->flushing is set.
+ */
+static bool
+copy_table_transfer(SpockCopyConn *cc)
+{
+	int			bytes;
+	char	   *copybuf;
+
+	if (cc->flushing)
+	{
+		int			r = PQflush(cc->target_conn);
+
+		if (r < 0)
+			ereport(ERROR,
+					(errmsg("writing to target table failed"),
+					 errdetail("destination connection reported: %s",
+							   PQerrorMessage(cc->target_conn))));
+		if (r > 0)
+			return false;
+
+		cc->flushing = false;
+	}
+
+	if (PQconsumeInput(cc->origin_conn) != 1)
+		ereport(ERROR,
+				(errmsg("reading from origin table failed"),
+				 errdetail("source connection reported: %s",
+						   PQerrorMessage(cc->origin_conn))));
+
+	while ((bytes = PQgetCopyData(cc->origin_conn, &copybuf, true)) > 0)
+	{
+		if (PQputCopyData(cc->target_conn, copybuf, bytes) != 1)
+		{
+			ereport(ERROR,
+					(errmsg("writing to target table failed"),
+					 errdetail("destination connection reported: %s",
+							   PQerrorMessage(cc->target_conn))));
+		}
+		PQfreemem(copybuf);
+
+		/*
+		 * Don't let data pile up in memory if the target can't keep up with
+		 * the origin.
+		 */
+		cc->pending += bytes;
+		if (cc->pending >= COPY_TARGET_PENDING_SIZE)
+		{
+			int			r = PQflush(cc->target_conn);
+
+			if (r < 0)
+				ereport(ERROR,
+						(errmsg("writing to target table failed"),
+						 errdetail("destination connection reported: %s",
+								   PQerrorMessage(cc->target_conn))));
+			cc->pending = 0;
+			if (r > 0)
+			{
+				cc->flushing = true;
+				return false;
+			}
+		}
+
+		CHECK_FOR_INTERRUPTS();
+	}
+
+	/* Need to wait for more data */
+	if (bytes == 0)
+		return false;
+
+	if (bytes != -1)
+	{
+		ereport(ERROR,
+				(errmsg("reading from origin table failed"),
+				 errdetail("source connection returned %d: %s",
+						   bytes, PQerrorMessage(cc->origin_conn))));
+	}
+
+	copy_table_end(cc);
+
+	return true;
+}
+
+/*
+ * Sort the tables to copy by size, descending. The ranges of a split table
+ * are all the same size except for the last one, which is smaller, so the
+ * first range of a table is always copied first.
+ */
+static int
+copy_table_size_cmp(const void *a, const void *b)
+{
+	const SpockCopyTable *ta = (const SpockCopyTable *) a;
+	const SpockCopyTable *tb = (const SpockCopyTable *) b;
+
+	if (ta->size > tb->size)
+		return -1;
+	if (ta->size < tb->size)
+		return 1;
+	if (ta->startblk < tb->startblk)
+		return -1;
+	if (ta->startblk > tb->startblk)
+		return 1;
+	return 0;
+}
+
+/*
+ * Number of block ranges to copy the table in.
+ */
+static int
+copy_table_nranges(SpockCopyTable *table, int64 split_size)
+{
+	int64		nblocks = table->size / BLCKSZ;
+	int64		blocks_per_range;
+	int64		n;
+
+	/* The row filter and partitions are handled by the COPY query. */
+	if (table->remoterel->relkind != RELKIND_RELATION ||
+		table->remoterel->hasRowFilter || nblocks == 0)
+		return 1;
+
+	n = Min((table->size + split_size - 1) / split_size,
+			COPY_TABLE_MAX_RANGES);
+	blocks_per_range = (nblocks + n - 1) / n;
+
+	return (int) ((nblocks + blocks_per_range - 1) / blocks_per_range);
+}
+
+/*
+ * Split the tables larger than spock.sync_table_split_size into block ranges
+ * which can be copied by different connections.
+ *
+ * The ranges are computed from the current size of the table; the last range
+ * has no upper bound so that the whole table is copied regardless.
+ */
+static SpockCopyTable *
+copy_tables_split(PGconn *origin_conn, SpockCopyTable *copytables,
+				  int *ntables)
+{
+	SpockCopyTable *ranges;
+	int64		split_size = (int64) spock_sync_table_split_size * 1024 * 1024;
+	int			nranges = 0;
+	int			i;
+
+	/*
+	 * TID range scans only exist since PostgreSQL 14, an older origin would
+	 * read the whole table for every range.
+	 */
+	if (split_size == 0 || PQserverVersion(origin_conn) < 140000)
+		return copytables;
+
+	for (i = 0; i < *ntables; i++)
+		nranges += copy_table_nranges(&copytables[i], split_size);
+
+	ranges = palloc0(sizeof(SpockCopyTable) * nranges);
+	nranges = 0;
+	for (i = 0; i < *ntables; i++)
+	{
+		SpockCopyTable *table = &copytables[i];
+		int			n = copy_table_nranges(table, split_size);
+		int64		blocks_per_range;
+		int			k;
+
+		if (n < 2)
+		{
+			ranges[nranges++] = *table;
+			continue;
+		}
+
+		blocks_per_range = (table->size / BLCKSZ + n - 1) / n;
+
+		table->nremaining = palloc(sizeof(int));
+		*table->nremaining = n;
+		for (k = 0; k < n; k++)
+		{
+			SpockCopyTable *range = &ranges[nranges++];
+
+			range->remoterel = table->remoterel;
+			range->nremaining = table->nremaining;
+			range->startblk = (BlockNumber) (k * blocks_per_range);
+			if (k < n - 1)
+			{
+				range->endblk = (BlockNumber) ((k + 1) * blocks_per_range);
+				range->size = blocks_per_range * BLCKSZ;
+			}
+			else
+			{
+				range->endblk = InvalidBlockNumber;
+				range->size = table->size - k * blocks_per_range * BLCKSZ;
+			}
+		}
+
+		elog(DEBUG1, "copying table %s.%s in %d block ranges",
+			 table->remoterel->nspname, table->remoterel->relname, n);
+	}
+
+	*ntables = nranges;
+	pfree(copytables);
+
+	return ranges;
+}
+
+/*
+ * COPY the given tables from origin node to target node.
+ *
+ * The first connection pair is set up by the caller. With
+ * spock.sync_connections above 1, up to that many pairs copy tables in
+ * parallel, largest tables first; large tables are split into block ranges
+ * copied by several pairs, see copy_tables_split(). The additional origin
+ * connections import the snapshot of the first one and the additional target
+ * connections join its replication origin session. The target transactions
+ * are committed once all tables are copied; the caller finishes the first
+ * origin connection.
+ *
+ * If subid is valid, the progress of each table is recorded in
+ * spock.local_sync_status, the end of its copy once it is committed.
+ */
+static void
+copy_tables_parallel(SpockSubscription *sub, const char *origin_dsn,
+					 const char *target_dsn, const char *origin_snapshot,
+					 const char *origin_name, PGconn *origin_conn,
+					 PGconn *target_conn, List *tables,
+					 List *replication_sets, Oid subid,
+					 XLogRecPtr status_lsn)
+{
+	SpockCopyTable *copytables;
+	SpockCopyConn *conns;
+	WaitEventSet *set;
+	int			ntables = 0;
+	int			nconns;
+	int			nactive = 0;
+	int			next = 0;
+	int			i;
+	ListCell   *lc;
+
+	/*
+	 * In case of table partitioning, we synchronize the partitioned (parent)
+	 * table and skip the partitions. Other tables are synchronized normally.
+	 */
+	copytables = palloc0(sizeof(SpockCopyTable) * Max(list_length(tables), 1));
+	foreach(lc, tables)
+	{
+		SpockRemoteRel *remoterel = lfirst(lc);
+
+		if (!remoterel->ispartition)
+			copytables[ntables++].remoterel = remoterel;
+	}
+
+	nconns = spock_sync_connections;
+	if (nconns > 1 && (origin_snapshot == NULL || ntables == 0))
+		nconns = 1;
+#if PG_VERSION_NUM < 160000
+	if (nconns > 1)
+	{
+		elog(LOG, "SPOCK %s: parallel data copy requires PostgreSQL 16 or later, using a single connection",
+			 sub->name);
+		nconns = 1;
+	}
+#endif
+
+	if (nconns > 1)
+	{
+		List	   *copylist = NIL;
+		int64	   *sizes;
+
+		for (i = 0; i < ntables; i++)
+			copylist = lappend(copylist, copytables[i].remoterel);
+		sizes = spock_get_remote_table_sizes(origin_conn, copylist);
+		for (i = 0; i < ntables; i++)
+			copytables[i].size = sizes[i];
+
+		copytables = copy_tables_split(origin_conn, copytables, &ntables);
+		qsort(copytables, ntables, sizeof(SpockCopyTable),
+			  copy_table_size_cmp);
+
+		nconns = Min(nconns, ntables);
+		elog(INFO, "copying data over %d connections", nconns);
+	}
+
+	conns = palloc0(sizeof(SpockCopyConn) * nconns);
+	conns[0].origin_conn = origin_conn;
+	conns[0].target_conn = target_conn;
+	for (i = 1; i < nconns; i++)
+	{
+		conns[i].origin_conn = spock_connect(origin_dsn, sub->name, "copy");
+		start_copy_origin_tx(conns[i].origin_conn, origin_snapshot);
+
+		conns[i].target_conn = spock_connect(target_dsn, sub->name, "copy");
+		start_copy_target_tx(conns[i].target_conn, origin_name,
+							 PQbackendPID(target_conn));
+	}
+
+	/*
+	 * Each connection pair waits for its origin connection to be readable, or
+	 * its target connection to be writeable while a COPY is being flushed.
+	 * The other socket only reports a closed connection.
+	 */
+	set = SPKCreateWaitEventSet(2 * nconns + 2);
+	AddWaitEventToSet(set, WL_LATCH_SET, PGINVALID_SOCKET, MyLatch, NULL);
+	AddWaitEventToSet(set, WL_EXIT_ON_PM_DEATH, PGINVALID_SOCKET, NULL, NULL);
+	for (i = 0; i < nconns; i++)
+	{
+		AddWaitEventToSet(set, WL_SOCKET_CLOSED,
+						  PQsocket(conns[i].origin_conn), NULL, NULL);
+		AddWaitEventToSet(set, WL_SOCKET_CLOSED,
+						  PQsocket(conns[i].target_conn), NULL, NULL);
+	}
+
+	while (next < ntables || nactive > 0)
+	{
+		WaitEvent	event;
+		bool		finished = false;
+
+		/* Hand out the remaining tables to idle connections. */
+		for (i = 0; i < nconns && next < ntables; i++)
+		{
+			SpockCopyTable *table;
+
+			if (conns[i].table != NULL)
+				continue;
+
+			table = &copytables[next++];
+			if (OidIsValid(subid) && table->startblk == 0)
+			{
+				StartTransactionCommand();
+				set_copy_table_sync_status(subid, table->remoterel,
+										   SYNC_STATUS_DATA, status_lsn);
+				CommitTransactionCommand();
+			}
+
+			copy_table_begin(&conns[i], table, replication_sets);
+			nactive++;
+		}
+
+		for (i = 0; i < nconns; i++)
+		{
+			SpockCopyTable *table = conns[i].table;
+
+			if (table == NULL || !copy_table_transfer(&conns[i]))
+				continue;
+
+			nactive--;
+			finished = true;
+
+			/* Wait for the other ranges of a split table. */
+			if (table->nremaining != NULL && --(*table->nremaining) > 0)
+				continue;
+
+			elog(INFO, "finished synchronization of data for table %s.%s",
+				 table->remoterel->nspname, table->remoterel->relname);
+		}
+
+		if (finished || nactive == 0)
+			continue;
+
+		/* Wait for any of the connections to be ready to continue. */
+		for (i = 0; i < nconns; i++)
+		{
+			bool		reading = conns[i].table != NULL && !conns[i].flushing;
+			bool		writing = conns[i].table != NULL && conns[i].flushing;
+
+			ModifyWaitEvent(set, 2 * i + 2,
+							reading ? WL_SOCKET_READABLE : WL_SOCKET_CLOSED,
+							NULL);
+			ModifyWaitEvent(set, 2 * i + 3,
+							writing ? WL_SOCKET_WRITEABLE : WL_SOCKET_CLOSED,
+							NULL);
+		}
+
+		(void) WaitEventSetWait(set, -1L, &event, 1, PG_WAIT_EXTENSION);
+
+		ResetLatch(MyLatch);
+		CHECK_FOR_INTERRUPTS();
+	}
+
+	FreeWaitEventSet(set);
+
+	/*
+	 * Commit the target connections, the additional ones first as they use
+	 * the origin session of the first one. The caller finishes the first
+	 * origin connection.
+	 */
+	for (i = 1; i < nconns; i++)
+	{
+		finish_copy_origin_tx(conns[i].origin_conn);
+		finish_copy_target_tx(conns[i].target_conn, true);
+	}
+	finish_copy_target_tx(target_conn, false);
+
+	/* The data is visible now, the tables can be caught up with. */
+	if (OidIsValid(subid))
+	{
+		StartTransactionCommand();
+		for (i = 0; i < ntables; i++)
+		{
+			if (copytables[i].startblk == 0)
+				set_copy_table_sync_status(subid, copytables[i].remoterel,
+										   SYNC_STATUS_SYNCDONE, status_lsn);
+		}
+		CommitTransactionCommand();
+	}
+
+	pfree(conns);
+	pfree(copytables);
 }
 
 /*
@@ -938,6 +1567,7 @@ copy_tables_data(SpockSubscription *sub, const char *origin_dsn,
 	PGconn	   *origin_conn;
 	PGconn	   *target_conn;
 	List	   *progress_entries_list = NIL;
+	List	   *remoterels = NIL;
 	ListCell   *lc;
 
 	/* Connect to origin node. */
@@ -946,33 +1576,26 @@ copy_tables_data(SpockSubscription *sub, const char *origin_dsn,
 
 	/* Connect to target node. */
 	target_conn = spock_connect(target_dsn, sub->name, "copy");
-	start_copy_target_tx(target_conn, origin_name);
+	start_copy_target_tx(target_conn, origin_name, 0);
 
-	/* Copy every table. */
 	foreach(lc, tables)
 	{
 		RangeVar   *rv = lfirst(lc);
-		SpockRemoteRel *remoterel;
-
-		remoterel = spock_get_remote_repset_table(origin_conn, rv,
-												  replication_sets);
-
-		/*
-		 * In case of table partitioning, we synchronize the partitioned
-		 * (parent) table and skip the partitions. Other tables are
-		 * synchronized normally.
-		 */
-		if (!remoterel->ispartition)
-			copy_table_data(origin_conn, target_conn, remoterel, replication_sets);
 
-		CHECK_FOR_INTERRUPTS();
+		remoterels = lappend(remoterels,
+							 spock_get_remote_repset_table(origin_conn, rv,
+														   replication_sets));
 	}
 
+	/* Copy every table. */
+	copy_tables_parallel(sub, origin_dsn, target_dsn, origin_snapshot,
+						 origin_name, origin_conn, target_conn, remoterels,
+						 replication_sets, InvalidOid, InvalidXLogRecPtr);
+
 	progress_entries_list = adjust_progress_info(origin_conn);
 
-	/* Finish the transactions and disconnect. */
+	/* Finish the transaction and disconnect. */
 	finish_copy_origin_tx(origin_conn);
-	finish_copy_target_tx(target_conn);
 
 	/*
 	 * Update replication progress. We must do it after commit of the COPY.
@@ -998,12 +1621,12 @@ static List *
 copy_replication_sets_data(SpockSubscription *sub, const char *origin_dsn,
 						   const char *target_dsn,
 						   const char *origin_snapshot,
-						   List *replication_sets, const char *origin_name)
+						   List *replication_sets, const char *origin_name,
+						   XLogRecPtr status_lsn)
 {
 	PGconn	   *origin_conn;
 	PGconn	   *target_conn;
 	List	   *tables;
-	ListCell   *lc;
 
 	/* Connect to origin node. */
 	origin_conn = spock_connect(origin_dsn, sub->name, "copy");
@@ -1048,27 +1671,15 @@ copy_replication_sets_data(SpockSubscription *sub, const char *origin_dsn,
 
 	/* Connect to target node. */
 	target_conn = spock_connect(target_dsn, sub->name, "copy");
-	start_copy_target_tx(target_conn, origin_name);
+	start_copy_target_tx(target_conn, origin_name, 0);
 
 	/* Copy every table. */
-	foreach(lc, tables)
-	{
-		SpockRemoteRel *remoterel = lfirst(lc);
+	copy_tables_parallel(sub, origin_dsn, target_dsn, origin_snapshot,
+						 origin_name, origin_conn, target_conn, tables,
+						 replication_sets, sub->id, status_lsn);
 
-		/*
-		 * In case of table partitioning, we synchronize the partitioned
-		 * (parent) table and skip the partitions. Other tables are
-		 * synchronized normally.
-		 */
-		if (!remoterel->ispartition)
-			copy_table_data(origin_conn, target_conn, remoterel, replication_sets);
-
-		CHECK_FOR_INTERRUPTS();
-	}
-
-	/* Finish the transactions and disconnect. */
+	/* Finish the transaction and disconnect. */
 	finish_copy_origin_tx(origin_conn);
-	finish_copy_target_tx(target_conn);
 
 	return tables;
 }
@@ -1272,7 +1883,7 @@ spock_sync_subscription(SpockSubscription *sub)
 					dump_structure(sub, tmpfile, snapshot);
 
 					/* Restore base pre-data structure (types, tables, etc). */
-					restore_structure(sub, tmpfile, "pre-data");
+					restore_structure(sub, tmpfile, "pre-data", 1);
 
 					CommitTransactionCommand();
 				}
@@ -1295,7 +1906,8 @@ spock_sync_subscription(SpockSubscription *sub)
 														sub->target_if->dsn,
 														snapshot,
 														sub->replication_sets,
-														sub->slot_name);
+														sub->slot_name,
+														lsn);
 
 					/*
 					 * Arrange replication status according to the just copied
@@ -1308,30 +1920,9 @@ spock_sync_subscription(SpockSubscription *sub)
 					foreach(lc, tables)
 					{
 						SpockRemoteRel *remoterel = lfirst(lc);
-						SpockSyncStatus *oldsync;
-
-						oldsync = get_table_sync_status(sub->id,
-														remoterel->nspname,
-														remoterel->relname, true);
-						if (oldsync)
-						{
-							set_table_sync_status(sub->id, remoterel->nspname,
-												  remoterel->relname,
-												  SYNC_STATUS_READY,
-												  lsn);
-						}
-						else
-						{
-							SpockSyncStatus newsync;
-
-							newsync.kind = SYNC_KIND_FULL;
-							newsync.subid = sub->id;
-							namestrcpy(&newsync.nspname, remoterel->nspname);
-							namestrcpy(&newsync.relname, remoterel->relname);
-							newsync.status = SYNC_STATUS_READY;
-							newsync.statuslsn = lsn;
-							create_local_sync_status(&newsync);
-						}
+
+						set_copy_table_sync_status(sub->id, remoterel,
+												   SYNC_STATUS_READY, lsn);
 					}
 					CommitTransactionCommand();
 				}
@@ -1346,7 +1937,12 @@ spock_sync_subscription(SpockSubscription *sub)
 					set_subscription_sync_status(sub->id, status);
 					CommitTransactionCommand();
 
-					restore_structure(sub, tmpfile, "post-data");
+					/*
+					 * Indexes are only built now that the data is loaded, so
+					 * build them using as many connections as the copy.
+					 */
+					restore_structure(sub, tmpfile, "post-data",
+									  spock_sync_connections);
 				}
 			}
 			PG_END_ENSURE_ERROR_CLEANUP_SUFFIX(spock_sync_tmpfile_cleanup_cb,
@@ -77,6 +77,29 @@ static void wait_for_worker_startup(SpockWorker *worker,
 									BackgroundWorkerHandle *handle);
 static void signal_worker_xact_callback(XactEvent event, void *arg);
 static uint32 spock_ch_stats_hash(const void *key, Size keysize);
+static void spock_stats_flush_on_exit(int code, Datum arg);
+
+/*
+ * Channel counters of this backend not yet added to SpockHash, see
+ * handle_stats_counter().
+ */
+typedef struct spockPendingStatsEntry
+{
+	spockStatsKey key;			/* hash key */
+
+	int64		counter[SPOCK_STATS_NUM_COUNTERS];
+} spockPendingStatsEntry;
+
+#define SPOCK_STATS_FLUSH_INTERVAL	1000	/* ms */
+
+static HTAB *PendingStatsHash = NULL;
+static bool have_pending_stats = false;
+static TimestampTz last_stats_flush = 0;
+static bool stats_flushing = false;
+
+/* Counters of work that may still be rolled back, see spock_stats_hold() */
+static HTAB *HeldStatsHash = NULL;
+static bool stats_held = false;
 
 void
 handle_sigterm(SIGNAL_ARGS)
@@ -878,12 +901,51 @@ spock_worker_type_name(SpockWorkerType type)
 	}
 }
 
-void
-handle_stats_counter(Relation relation, Oid subid, spockStatsType typ, int ntup)
+/*
+ * Find or create the backend-local entry for key in *hash.
+ */
+static spockPendingStatsEntry *
+stats_pending_entry(HTAB **hash, const char *name, spockStatsKey *key)
+{
+	spockPendingStatsEntry *entry;
+	bool		found;
+
+	if (*hash == NULL)
+	{
+		HASHCTL		ctl;
+
+		memset(&ctl, 0, sizeof(ctl));
+		ctl.keysize = sizeof(spockStatsKey);
+		ctl.entrysize = sizeof(spockPendingStatsEntry);
+		ctl.hcxt = TopMemoryContext;
+		*hash = hash_create(name, 64, &ctl,
+							HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+		/* Don't lose what is still pending when the process goes away */
+		if (hash == &PendingStatsHash)
+			before_shmem_exit(spock_stats_flush_on_exit, (Datum) 0);
+	}
+
+	entry = (spockPendingStatsEntry *) hash_search(*hash, key,
+												   HASH_ENTER, &found);
+	if (!found)
+		memset(entry->counter, 0, sizeof(entry->counter));
+
+	return entry;
+}
+
+/*
+ * Add value to a counter of the channel stats of the relation.
+ *
+ * Counters are only accumulated in backend-local memory here, so the per-row
+ * cost is a local hash lookup.  They reach the shared SpockHash through
+ * spock_stats_flush(), called at transaction boundaries.
+ */
+static void
+stats_count(Oid relid, Oid subid, spockStatsType typ, int64 value)
 {
-	bool		found = false;
 	spockStatsKey key;
-	spockStatsEntry *entry;
+	spockPendingStatsEntry *entry;
 
 	if (!spock_ch_stats)
 		return;
@@ -891,7 +953,101 @@ handle_stats_counter(Relation relation, Oid subid, spockStatsType typ, int ntup)
 	memset(&key, 0, sizeof(spockStatsKey));
 	key.dboid = MyDatabaseId;
 	key.subid = subid;
-	key.relid = RelationGetRelid(relation);
+	key.relid = relid;
+
+	if (stats_held)
+		entry = stats_pending_entry(&HeldStatsHash,
+									"spock held channel stats", &key);
+	else
+	{
+		entry = stats_pending_entry(&PendingStatsHash,
+									"spock pending channel stats", &key);
+		have_pending_stats = true;
+	}
+
+	entry->counter[typ] += value;
+}
+
+/*
+ * Keep the counters of the following work apart until spock_stats_release()
+ * tells whether it was kept, so that work rolled back and done again is
+ * counted once.
+ */
+void
+spock_stats_hold(void)
+{
+	Assert(!stats_held);
+	stats_held = true;
+}
+
+/*
+ * Add the counters held since spock_stats_hold() to the pending ones if keep,
+ * otherwise forget about them. No-op if nothing is held.
+ */
+void
+spock_stats_release(bool keep)
+{
+	HASH_SEQ_STATUS status;
+	spockPendingStatsEntry *held;
+
+	if (!stats_held)
+		return;
+	stats_held = false;
+
+	if (HeldStatsHash == NULL)
+		return;
+
+	hash_seq_init(&status, HeldStatsHash);
+	while ((held = (spockPendingStatsEntry *) hash_seq_search(&status)) != NULL)
+	{
+		if (keep)
+		{
+			spockPendingStatsEntry *entry;
+			int			i;
+
+			entry = stats_pending_entry(&PendingStatsHash,
+										"spock pending channel stats",
+										&held->key);
+			for (i = 0; i < SPOCK_STATS_NUM_COUNTERS; i++)
+				entry->counter[i] += held->counter[i];
+			have_pending_stats = true;
+		}
+
+		/* Removing the entry just returned by hash_seq_search is allowed */
+		if (hash_search(HeldStatsHash, &held->key,
+						HASH_REMOVE, NULL) == NULL)
+			elog(ERROR, "hash table corrupted");
+	}
+}
+
+/*
+ * Count ntup rows of the given kind for the relation.
+ */
+void
+handle_stats_counter(Relation relation, Oid subid, spockStatsType typ, int ntup)
+{
+	stats_count(RelationGetRelid(relation), subid, typ, ntup);
+}
+
+/*
+ * Count stream compression work of the subscription, InvalidOid in the
+ * walsender. It is kept in an entry of its own with relid InvalidOid.
+ */
+void
+handle_stream_stats_counter(Oid subid, spockStatsType typ, int64 value)
+{
+	stats_count(InvalidOid, subid, typ, value);
+}
+
+/*
+ * Add one backend-local entry to the shared channel stats hash.
+ */
+static void
+stats_flush_entry(spockPendingStatsEntry *pending)
+{
+	bool		found = false;
+	spockStatsEntry *entry;
+	int			i;
 
 	/*
 	 * We first try to find an existing entry while holding the SpockCtx lock
@@ -899,7 +1055,7 @@ handle_stats_counter(Relation relation, Oid subid, spockStatsType typ, int ntup)
 	 */
 	LWLockAcquire(SpockCtx->lock, LW_SHARED);
 
-	entry = (spockStatsEntry *) hash_search(SpockHash, &key,
+	entry = (spockStatsEntry *) hash_search(SpockHash, &pending->key,
 											HASH_FIND, &found);
 	if (!found)
 	{
@@ -924,7 +1080,7 @@ handle_stats_counter(Relation relation, Oid subid, spockStatsType typ, int ntup)
 			return;
 		}
 
-		entry = (spockStatsEntry *) hash_search(SpockHash, &key,
+		entry = (spockStatsEntry *) hash_search(SpockHash, &pending->key,
 												HASH_ENTER, &found);
 
 		/*
@@ -948,8 +1104,66 @@ handle_stats_counter(Relation relation, Oid subid, spockStatsType typ, int ntup)
 	}
 
 	SpinLockAcquire(&entry->mutex);
-	entry->counter[typ] += ntup;
+	for (i = 0; i < SPOCK_STATS_NUM_COUNTERS; i++)
+		entry->counter[i] += pending->counter[i];
 	SpinLockRelease(&entry->mutex);
 
 	LWLockRelease(SpockCtx->lock);
 }
+
+/*
+ * Move the backend-local channel counters to the shared SpockHash.
+ *
+ * Unless forced, this is a no-op if the previous flush happened less than
+ * SPOCK_STATS_FLUSH_INTERVAL ms ago, so busy processes take SpockCtx->lock
+ * for the stats at most that often.
+ */
+void
+spock_stats_flush(bool force)
+{
+	HASH_SEQ_STATUS status;
+	spockPendingStatsEntry *pending;
+	TimestampTz now;
+
+	if (!have_pending_stats)
+		return;
+
+	now = GetCurrentTimestamp();
+	if (!force &&
+		!TimestampDifferenceExceeds(last_stats_flush, now,
+									SPOCK_STATS_FLUSH_INTERVAL))
+		return;
+
+	stats_flushing = true;
+
+	hash_seq_init(&status, PendingStatsHash);
+	while ((pending = (spockPendingStatsEntry *) hash_seq_search(&status)) != NULL)
+	{
+		stats_flush_entry(pending);
+
+		/* Removing the entry just returned by hash_seq_search is allowed */
+		if (hash_search(PendingStatsHash, &pending->key,
+						HASH_REMOVE, NULL) == NULL)
+			elog(ERROR, "hash table corrupted");
+	}
+
+	stats_flushing = false;
+	have_pending_stats = false;
+	last_stats_flush = now;
+}
+
+static void
+spock_stats_flush_on_exit(int code, Datum arg)
+{
+	/*
+	 * Exiting on an ERROR, like apply workers do before they are restarted,
+	 * leaves the shared stats intact, so publish what was counted. Not if we
+	 * failed while updating them, though, the entry being updated would be
+	 * counted twice or we could wait for a lock we hold.
+	 */
+	if (SpockCtx == NULL || SpockHash == NULL || stats_flushing ||
+		LWLockHeldByMe(SpockCtx->lock))
+		return;
+
+	spock_stats_flush(true);
+}
@@ -0,0 +1,197 @@
+#!/usr/bin/perl
+# =============================================================================
+# Test: 018_parallel_apply.pl - Parallel apply of remote transactions
+# =============================================================================
+# This test verifies spock.apply_parallel_workers.
+#
+# Topology:
+#   n1 (provider) -> n2 (subscriber, 2 parallel apply workers)
+#
+# Test scenario:
+# 1. Enable parallel apply on n2 and check that the workers are started
+# 2. Run independent transactions from two concurrent sessions on n1, and a
+#    chain of transactions updating the same row; all of them must arrive,
+#    the dependent ones in the original order
+# 3. Make a transaction fail on n2 only; the apply worker must restart,
+#    apply the affected transactions serially and hand the failing one to
+#    the regular exception handling
+#
+# Parallel apply requires PostgreSQL 16 or later; on older servers only the
+# results of serial apply are checked.
+# =============================================================================
+
+use strict;
+use warnings;
+use Test::More tests => 20;
+use IPC::Run;
+use lib '.';
+use SpockTest qw(create_cluster cross_wire destroy_cluster system_or_bail
+                 get_test_config scalar_query psql_or_bail);
+
+create_cluster(2, 'Create 2-node cluster');
+cross_wire(2, ['n1', 'n2'], 'Cross-wire nodes');
+
+my $config = get_test_config();
+my $node_ports = $config->{node_ports};
+my $node_datadirs = $config->{node_datadirs};
+my $host = $config->{host};
+my $dbname = $config->{db_name};
+my $db_user = $config->{db_user};
+
+my $server_version = scalar_query(2, "SHOW server_version_num");
+my $parallel = $server_version >= 160000;
+
+# Server log of a node, as configured by create_postgresql_conf()
+sub server_log {
+    my ($node_num) = @_;
+    my $dir = $config->{log_dir};
+    $dir = "$node_datadirs->[$node_num - 1]/$dir" unless $dir =~ m{^/};
+    my $file = "$dir/00$node_ports->[$node_num - 1].log";
+    open(my $fh, '<', $file) or return '';
+    local $/;
+    my $content = <$fh>;
+    close($fh);
+    return $content;
+}
+
+sub wait_for_n2 {
+    my $lsn = scalar_query(1, "SELECT spock.sync_event()");
+    psql_or_bail(2, "CALL spock.wait_for_sync_event(true, 'n1', '$lsn'::pg_lsn, 600)");
+}
+
+# =============================================================================
+# SETUP: Enable parallel apply on n2
+# =============================================================================
+
+psql_or_bail(1, "CREATE TABLE test_parallel (id integer PRIMARY KEY, val integer NOT NULL)");
+psql_or_bail(1, "INSERT INTO test_parallel VALUES (0, 0)");
+psql_or_bail(1, q(
+CREATE PROCEDURE insert_rows(first integer, cnt integer)
+AS $$
+DECLARE
+	i integer := 0;
+BEGIN
+  WHILE i < cnt LOOP
+	INSERT INTO test_parallel VALUES (first + i, first + i);
+	COMMIT;
+	i := i + 1;
+  END LOOP;
+END;
+$$ LANGUAGE plpgsql;));
+wait_for_n2();
+
+# A new number of workers takes effect when the apply worker restarts
+psql_or_bail(2, "ALTER SYSTEM SET spock.apply_parallel_workers = 2");
+psql_or_bail(2, "SELECT pg_reload_conf()");
+psql_or_bail(2, "SELECT spock.sub_disable('sub_n2_n1')");
+psql_or_bail(2, "SELECT spock.sub_enable('sub_n2_n1')");
+system_or_bail 'sleep', '5';
+
+# The workers are started along with the first transaction
+psql_or_bail(1, "UPDATE test_parallel SET val = val WHERE id = 0");
+wait_for_n2();
+
+my $workers = scalar_query(2,
+    "SELECT count(*) FROM pg_stat_activity
+     WHERE application_name LIKE 'spock parallel apply%'");
+SKIP: {
+    skip "parallel apply requires PostgreSQL 16 or later", 2 unless $parallel;
+
+    is($workers, '2', 'Two parallel apply workers are running');
+    like(server_log(2), qr/started 2 parallel apply workers/,
+         'Apply worker logged the start of parallel apply workers');
+}
+
+# =============================================================================
+# TEST: Independent and dependent transactions
+# =============================================================================
+
+my ($stdout, $stderr) = ('', '');
+my $handle = IPC::Run::start(
+    [
+        'psql', '-X',
+        '-c', "CALL insert_rows(100000, 1000)",
+        '-h', $host, '-p', $node_ports->[0], '-U', $db_user, $dbname
+    ],
+    '>' => \$stdout,
+    '2>' => \$stderr);
+
+psql_or_bail(1, "CALL insert_rows(200000, 1000)");
+
+# Each update depends on the previous one
+psql_or_bail(1, q(
+DO $$
+BEGIN
+  FOR i IN 1..200 LOOP
+	UPDATE test_parallel SET val = val + 1 WHERE id = 0;
+	COMMIT;
+  END LOOP;
+END;
+$$;));
+
+$handle->finish;
+is($handle->full_result(0), 0, 'Concurrent session finished successfully');
+
+wait_for_n2();
+
+is(scalar_query(2, "SELECT count(*) FROM test_parallel"), '2001',
+   'All independent transactions were applied on n2');
+is(scalar_query(2, "SELECT val FROM test_parallel WHERE id = 0"), '200',
+   'Dependent transactions were applied in order on n2');
+is(scalar_query(2, "SELECT sum(val) FROM test_parallel"),
+   scalar_query(1, "SELECT sum(val) FROM test_parallel"),
+   'Data on n1 and n2 matches');
+
+# Commit timestamps come from the provider, whichever process applied them
+is(scalar_query(2,
+    "SELECT count(*) FROM test_parallel t1, test_parallel t2
+     WHERE t2.id = t1.id + 1 AND t1.id >= 200000
+       AND pg_xact_commit_timestamp(t2.xmin) < pg_xact_commit_timestamp(t1.xmin)"),
+   '0', 'Commit timestamps on n2 follow the provider commit order');
+
+# The origin progress covers all the transactions
+my $lsn = scalar_query(1, "SELECT pg_current_wal_lsn()");
+wait_for_n2();
+is(scalar_query(2,
+    "SELECT bool_and(remote_lsn >= '$lsn'::pg_lsn) FROM pg_replication_origin_status"),
+   't', 'Replication origin on n2 advanced past all the transactions');
+
+# =============================================================================
+# TEST: Serial apply after a parallel apply worker failure
+# =============================================================================
+
+psql_or_bail(2, "ALTER SYSTEM SET spock.exception_behaviour = 'discard'");
+psql_or_bail(2, "ALTER SYSTEM SET spock.exception_logging = 'all'");
+psql_or_bail(2, "SELECT pg_reload_conf()");
+psql_or_bail(2, "TRUNCATE spock.exception_log");
+
+# A constraint only n2 knows about
+psql_or_bail(2, "BEGIN; SELECT spock.repair_mode(true);
+                 ALTER TABLE test_parallel ADD CONSTRAINT val_check CHECK (val < 1000000);
+                 COMMIT");
+
+psql_or_bail(1, "CALL insert_rows(300000, 100)");
+psql_or_bail(1, "INSERT INTO test_parallel VALUES (1000000, 1000000)");
+psql_or_bail(1, "CALL insert_rows(400000, 100)");
+
+wait_for_n2();
+
+is(scalar_query(2, "SELECT count(*) FROM test_parallel WHERE id >= 300000"), '200',
+   'Transactions around the failing one were applied on n2');
+is(scalar_query(2, "SELECT count(*) FROM test_parallel WHERE id = 1000000"), '0',
+   'Failing transaction was discarded on n2');
+ok(scalar_query(2, "SELECT count(*) FROM spock.exception_log
+                    WHERE operation = 'INSERT' AND error_message LIKE '%val_check%'") > 0,
+   'Failure was recorded in the exception log');
+
+SKIP: {
+    skip "parallel apply requires PostgreSQL 16 or later", 1 unless $parallel;
+
+    like(server_log(2), qr/error during parallel apply, transactions up to \S+ will be applied serially/,
+         'Apply worker restarted to apply the transactions serially');
+}
+
+is(scalar_query(2, "SELECT status FROM spock.sub_show_status() WHERE subscription_name = 'sub_n2_n1'"),
+   'replicating', 'Subscription is still replicating');
+
+destroy_cluster('Destroy 2-node parallel apply test cluster');
@@ -0,0 +1,145 @@
+#!/usr/bin/perl
+# =============================================================================
+# Test: 019_stream_in_progress.pl - Streaming of large in-progress transactions
+# =============================================================================
+# This test verifies spock.stream_in_progress.
+#
+# Topology:
+#   n1 (provider, small logical_decoding_work_mem) -> n2 (subscriber)
+#
+# Test scenario:
+# 1. A large transaction kept open on n1 is streamed to n2 before it
+#    commits; a small transaction committed meanwhile is applied right away,
+#    and the large one is only applied once it commits
+# 2. A streamed transaction rolled back on n1 leaves nothing behind on n2
+# 3. A subtransaction rolled back within a streamed transaction is left out
+#    on n2, while the rest of the transaction is applied
+# =============================================================================
+
+use strict;
+use warnings;
+use Test::More tests => 20;
+use IPC::Run;
+use lib '.';
+use SpockTest qw(create_cluster cross_wire destroy_cluster system_or_bail
+                 get_test_config scalar_query psql_or_bail);
+
+create_cluster(2, 'Create 2-node cluster');
+cross_wire(2, ['n1', 'n2'], 'Cross-wire nodes');
+
+my $config = get_test_config();
+my $node_ports = $config->{node_ports};
+my $host = $config->{host};
+my $dbname = $config->{db_name};
+my $db_user = $config->{db_user};
+
+sub wait_for_n2 {
+    my $lsn = scalar_query(1, "SELECT spock.sync_event()");
+    psql_or_bail(2, "CALL spock.wait_for_sync_event(true, 'n1', '$lsn'::pg_lsn, 600)");
+}
+
+# =============================================================================
+# SETUP: Stream transactions decoded beyond 64kB
+# =============================================================================
+
+psql_or_bail(1, "CREATE TABLE test_stream (id integer PRIMARY KEY, data text)");
+psql_or_bail(1, "CREATE TABLE test_small (id integer PRIMARY KEY)");
+wait_for_n2();
+
+psql_or_bail(1, "ALTER SYSTEM SET logical_decoding_work_mem = '64kB'");
+psql_or_bail(1, "SELECT pg_reload_conf()");
+psql_or_bail(2, "ALTER SYSTEM SET spock.stream_in_progress = on");
+psql_or_bail(2, "SELECT pg_reload_conf()");
+
+# Both take effect when the apply worker reconnects
+psql_or_bail(2, "SELECT spock.sub_disable('sub_n2_n1')");
+psql_or_bail(2, "SELECT spock.sub_enable('sub_n2_n1')");
+system_or_bail 'sleep', '5';
+
+is(scalar_query(2, "SELECT status FROM spock.sub_show_status() WHERE subscription_name = 'sub_n2_n1'"),
+   'replicating', 'Subscription is replicating');
+
+my $slot_name = scalar_query(1, "SELECT spock.spock_gen_slot_name(current_database()::name, 'n1'::name, 'sub_n2_n1'::name)");
+
+# =============================================================================
+# TEST: Large transaction committed after a small one
+# =============================================================================
+
+my ($stdout, $stderr) = ('', '');
+my $handle = IPC::Run::start(
+    [
+        'psql', '-X',
+        '-c', "BEGIN;
+               INSERT INTO test_stream SELECT g, repeat('x', 100) FROM generate_series(1, 50000) g;
+               SELECT pg_sleep(15);
+               COMMIT;",
+        '-h', $host, '-p', $node_ports->[0], '-U', $db_user, $dbname
+    ],
+    '>' => \$stdout,
+    '2>' => \$stderr);
+
+# Let the large transaction get decoded and streamed
+system_or_bail 'sleep', '5';
+
+psql_or_bail(1, "INSERT INTO test_small VALUES (1)");
+wait_for_n2();
+
+is(scalar_query(2, "SELECT count(*) FROM test_small"), '1',
+   'Small transaction was applied while the large one is in progress');
+is(scalar_query(2, "SELECT count(*) FROM test_stream"), '0',
+   'Large transaction is not applied before it commits');
+
+$handle->finish;
+is($handle->full_result(0), 0, 'Large transaction committed on n1');
+
+wait_for_n2();
+
+is(scalar_query(2, "SELECT count(*) FROM test_stream"), '50000',
+   'Large transaction was applied on n2');
+
+my $data_query = "SELECT md5(string_agg(id || ':' || data, ',' ORDER BY id)) FROM test_stream";
+is(scalar_query(2, $data_query), scalar_query(1, $data_query),
+   'Data on n1 and n2 matches');
+
+ok(scalar_query(1, "SELECT stream_txns FROM pg_stat_replication_slots WHERE slot_name = '$slot_name'") > 0,
+   'Provider streamed the transaction');
+
+# =============================================================================
+# TEST: Streamed transaction rolled back
+# =============================================================================
+
+psql_or_bail(1, "BEGIN;
+                 INSERT INTO test_stream SELECT g, repeat('y', 100) FROM generate_series(100001, 150000) g;
+                 ROLLBACK;");
+psql_or_bail(1, "INSERT INTO test_small VALUES (2)");
+wait_for_n2();
+
+is(scalar_query(2, "SELECT count(*) FROM test_stream WHERE id > 100000"), '0',
+   'Rolled back transaction left no rows on n2');
+is(scalar_query(2, "SELECT count(*) FROM test_small"), '2',
+   'Following transaction was applied on n2');
+
+# =============================================================================
+# TEST: Subtransaction rolled back within a streamed transaction
+# =============================================================================
+
+psql_or_bail(1, "BEGIN;
+                 INSERT INTO test_stream SELECT g, repeat('a', 100) FROM generate_series(200001, 230000) g;
+                 SAVEPOINT s1;
+                 INSERT INTO test_stream SELECT g, repeat('b', 100) FROM generate_series(230001, 260000) g;
+                 ROLLBACK TO SAVEPOINT s1;
+                 UPDATE test_stream SET data = 'updated' WHERE id BETWEEN 1 AND 1000;
+                 DELETE FROM test_stream WHERE id BETWEEN 1001 AND 2000;
+                 COMMIT;");
+wait_for_n2();
+
+is(scalar_query(2, "SELECT count(*) FROM test_stream WHERE id BETWEEN 200001 AND 230000"), '30000',
+   'Changes before the savepoint were applied on n2');
+is(scalar_query(2, "SELECT count(*) FROM test_stream WHERE id > 230000"), '0',
+   'Changes of the rolled back subtransaction were left out on n2');
+is(scalar_query(2, "SELECT count(*) FROM test_stream WHERE data = 'updated'"), '1000',
+   'Updates after the savepoint were applied on n2');
+is(scalar_query(2, $data_query), scalar_query(1, $data_query),
+   'Data on n1 and n2 matches');
+
+destroy_cluster('Destroy 2-node streaming test cluster');
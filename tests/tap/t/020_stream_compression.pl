@@ -0,0 +1,134 @@
+#!/usr/bin/perl
+# =============================================================================
+# Test: 020_stream_compression.pl - Compression of the replication stream
+# =============================================================================
+# This test verifies spock.stream_compression.
+#
+# Topology:
+#   n1 (provider) -> n2 (subscriber asking for compressed messages)
+#
+# Test scenario:
+# 1. Ask for the first compression method the build has, replicate large
+#    compressible rows and small transactions, and check the data
+# 2. Check spock.channel_compression_stats on both nodes
+# 3. Go back to 'none' and check that the stream is no longer compressed
+#
+# The test is skipped if PostgreSQL was built without lz4 and zstd.
+# =============================================================================
+
+use strict;
+use warnings;
+use Test::More;
+use lib '.';
+use SpockTest qw(create_cluster cross_wire destroy_cluster system_or_bail
+                 get_test_config scalar_query psql_or_bail);
+
+my $config = get_test_config();
+
+# spock takes the compression methods from the PostgreSQL build
+my $configure = `$config->{pg_bin}/pg_config --configure`;
+my $method = $configure =~ /--with-lz4/ ? 'lz4' :
+             $configure =~ /--with-zstd/ ? 'zstd' : 'none';
+plan skip_all => 'PostgreSQL was built without lz4 and zstd' if $method eq 'none';
+plan tests => 15;
+
+create_cluster(2, 'Create 2-node cluster');
+cross_wire(2, ['n1', 'n2'], 'Cross-wire nodes');
+
+sub wait_for_n2 {
+    my $lsn = scalar_query(1, "SELECT spock.sync_event()");
+    psql_or_bail(2, "CALL spock.wait_for_sync_event(true, 'n1', '$lsn'::pg_lsn, 600)");
+}
+
+sub restart_sub_n2_n1 {
+    psql_or_bail(2, "SELECT spock.sub_disable('sub_n2_n1')");
+    psql_or_bail(2, "SELECT spock.sub_enable('sub_n2_n1')");
+    system_or_bail 'sleep', '5';
+}
+
+# =============================================================================
+# SETUP
+# =============================================================================
+
+psql_or_bail(1, "CREATE TABLE test_compression (id integer PRIMARY KEY, data text)");
+wait_for_n2();
+
+psql_or_bail(2, "ALTER SYSTEM SET spock.stream_compression = '$method'");
+psql_or_bail(2, "SELECT pg_reload_conf()");
+
+# Takes effect when the apply worker reconnects
+restart_sub_n2_n1();
+psql_or_bail(1, "SELECT spock.reset_channel_stats()");
+psql_or_bail(2, "SELECT spock.reset_channel_stats()");
+
+is(scalar_query(2, "SELECT status FROM spock.sub_show_status() WHERE subscription_name = 'sub_n2_n1'"),
+   'replicating', "Subscription is replicating with $method compression");
+
+# =============================================================================
+# TEST: Compressed stream
+# =============================================================================
+
+# Large and compressible rows
+psql_or_bail(1, "INSERT INTO test_compression
+                 SELECT g, repeat('spock ' || g % 10, 200) FROM generate_series(1, 2000) g");
+
+# Messages too short to be compressed
+psql_or_bail(1, q(
+DO $$
+BEGIN
+  FOR i IN 2001..2100 LOOP
+	INSERT INTO test_compression VALUES (i, 'short');
+	COMMIT;
+  END LOOP;
+END;
+$$;));
+
+psql_or_bail(1, "UPDATE test_compression SET data = upper(data) WHERE id <= 500");
+psql_or_bail(1, "DELETE FROM test_compression WHERE id BETWEEN 501 AND 600");
+
+wait_for_n2();
+
+my $data_query = "SELECT md5(string_agg(id || ':' || data, ',' ORDER BY id)) FROM test_compression";
+is(scalar_query(2, "SELECT count(*) FROM test_compression"), '2000',
+   'All changes were applied on n2');
+is(scalar_query(2, $data_query), scalar_query(1, $data_query),
+   'Data on n1 and n2 matches');
+
+# The walsender publishes its counters at commit once a second has passed
+system_or_bail 'sleep', '2';
+psql_or_bail(1, "INSERT INTO test_compression VALUES (3000, 'flush')");
+wait_for_n2();
+system_or_bail 'sleep', '2';
+
+my $stats_query = "SELECT stream_bytes > stream_wire_bytes AND compression_ratio > 2
+                   FROM spock.channel_compression_stats WHERE sub_name = %s";
+is(scalar_query(2, sprintf($stats_query, "'sub_n2_n1'")), 't',
+   'Subscriber received compressed messages');
+is(scalar_query(1, sprintf($stats_query, "'<output>'")), 't',
+   'Provider sent compressed messages');
+
+# =============================================================================
+# TEST: Back to an uncompressed stream
+# =============================================================================
+
+psql_or_bail(2, "ALTER SYSTEM SET spock.stream_compression = 'none'");
+psql_or_bail(2, "SELECT pg_reload_conf()");
+restart_sub_n2_n1();
+
+my $bytes = scalar_query(2, "SELECT stream_wire_bytes FROM spock.channel_compression_stats
+                             WHERE sub_name = 'sub_n2_n1'");
+
+psql_or_bail(1, "INSERT INTO test_compression
+                 SELECT g, repeat('spock ' || g % 10, 200) FROM generate_series(4001, 5000) g");
+wait_for_n2();
+system_or_bail 'sleep', '2';
+
+is(scalar_query(2, "SELECT count(*) FROM test_compression WHERE id > 4000"), '1000',
+   'Changes were applied on n2 without compression');
+is(scalar_query(2, $data_query), scalar_query(1, $data_query),
+   'Data on n1 and n2 matches');
+is(scalar_query(2, "SELECT stream_wire_bytes FROM spock.channel_compression_stats
+                    WHERE sub_name = 'sub_n2_n1'"), $bytes,
+   'Subscriber received no more compressed messages');
+
+destroy_cluster('Destroy 2-node compression test cluster');
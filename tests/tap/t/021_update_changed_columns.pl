@@ -0,0 +1,132 @@
+#!/usr/bin/perl
+# =============================================================================
+# Test: 021_update_changed_columns.pl - Updates sent with changed columns only
+# =============================================================================
+# This test verifies spock.update_changed_columns_only.
+#
+# Topology:
+#   n1 (provider) -> n2 (subscriber)
+#
+# Test scenario:
+# 1. Without the setting, a remote UPDATE winning a conflict overwrites the
+#    whole local row of a REPLICA IDENTITY FULL table
+# 2. With it, the columns the remote UPDATE didn't change keep their local
+#    values; tables with another replica identity are not affected
+# 3. Updates of single columns, to NULL, of TOASTed columns and updates
+#    changing nothing are replicated correctly
+# =============================================================================
+
+use strict;
+use warnings;
+use Test::More tests => 17;
+use lib '.';
+use SpockTest qw(create_cluster cross_wire destroy_cluster system_or_bail
+                 get_test_config scalar_query psql_or_bail);
+
+create_cluster(2, 'Create 2-node cluster');
+cross_wire(2, ['n1', 'n2'], 'Cross-wire nodes');
+
+sub wait_for_n2 {
+    my $lsn = scalar_query(1, "SELECT spock.sync_event()");
+    psql_or_bail(2, "CALL spock.wait_for_sync_event(true, 'n1', '$lsn'::pg_lsn, 600)");
+}
+
+# Change a row on n2 only
+sub local_update {
+    my ($sql) = @_;
+    psql_or_bail(2, "BEGIN; SELECT spock.repair_mode(true); $sql; COMMIT");
+}
+
+# =============================================================================
+# SETUP
+# =============================================================================
+
+psql_or_bail(1, "CREATE TABLE test_full (id integer PRIMARY KEY, a integer, b text, c text)");
+psql_or_bail(1, "ALTER TABLE test_full REPLICA IDENTITY FULL");
+psql_or_bail(1, "CREATE TABLE test_default (id integer PRIMARY KEY, a integer, b text)");
+psql_or_bail(1, "INSERT INTO test_full
+                 SELECT g, g, 'b' || g, string_agg(md5(g::text || i::text), '')
+                 FROM generate_series(1, 200) g, generate_series(1, 200) i GROUP BY g");
+psql_or_bail(1, "INSERT INTO test_default SELECT g, g, 'b' || g FROM generate_series(1, 10) g");
+wait_for_n2();
+
+is(scalar_query(2, "SELECT count(*) FROM test_full"), '200', 'Rows were replicated to n2');
+
+# =============================================================================
+# TEST: Conflicting UPDATE without the setting
+# =============================================================================
+
+local_update("UPDATE test_full SET b = 'local' WHERE id = 1");
+psql_or_bail(1, "UPDATE test_full SET a = -1 WHERE id = 1");
+wait_for_n2();
+
+is(scalar_query(2, "SELECT a || ':' || b FROM test_full WHERE id = 1"), '-1:b1',
+   'Remote UPDATE overwrote the whole local row');
+
+# =============================================================================
+# TEST: Conflicting UPDATE with the setting
+# =============================================================================
+
+psql_or_bail(2, "ALTER SYSTEM SET spock.update_changed_columns_only = on");
+psql_or_bail(2, "SELECT pg_reload_conf()");
+
+# Takes effect when the apply worker reconnects
+psql_or_bail(2, "SELECT spock.sub_disable('sub_n2_n1')");
+psql_or_bail(2, "SELECT spock.sub_enable('sub_n2_n1')");
+system_or_bail 'sleep', '5';
+
+is(scalar_query(2, "SELECT status FROM spock.sub_show_status() WHERE subscription_name = 'sub_n2_n1'"),
+   'replicating', 'Subscription is replicating');
+
+local_update("UPDATE test_full SET b = 'local' WHERE id = 2");
+psql_or_bail(1, "UPDATE test_full SET a = -2 WHERE id = 2");
+local_update("UPDATE test_default SET b = 'local' WHERE id = 2");
+psql_or_bail(1, "UPDATE test_default SET a = -2 WHERE id = 2");
+wait_for_n2();
+
+is(scalar_query(2, "SELECT a || ':' || b FROM test_full WHERE id = 2"), '-2:local',
+   'Remote UPDATE kept the local value of the column it did not change');
+is(scalar_query(2, "SELECT a || ':' || b FROM test_default WHERE id = 2"), '-2:b2',
+   'Tables with another replica identity are not affected');
+
+# =============================================================================
+# TEST: Updates of various columns
+# =============================================================================
+
+psql_or_bail(1, "UPDATE test_full SET a = a + 1000 WHERE id > 10");
+psql_or_bail(1, "UPDATE test_full SET b = NULL WHERE id BETWEEN 11 AND 20");
+psql_or_bail(1, "UPDATE test_full SET b = 'again ' || id WHERE id BETWEEN 15 AND 20");
+psql_or_bail(1, "UPDATE test_full SET c = reverse(c) WHERE id BETWEEN 21 AND 30");
+psql_or_bail(1, "UPDATE test_full SET a = a, b = b WHERE id BETWEEN 31 AND 40");
+psql_or_bail(1, "UPDATE test_full SET a = NULL, c = 'short' WHERE id BETWEEN 41 AND 50");
+psql_or_bail(1, "UPDATE test_full SET id = id + 1000 WHERE id BETWEEN 51 AND 60");
+psql_or_bail(1, q(
+DO $$
+BEGIN
+  FOR i IN 61..70 LOOP
+	UPDATE test_full SET a = a + 1 WHERE id = i;
+	UPDATE test_full SET a = a + 1 WHERE id = i;
+	COMMIT;
+  END LOOP;
+END;
+$$;));
+wait_for_n2();
+
+my $data_query = "SELECT md5(string_agg(id || ':' || coalesce(a::text, 'null') || ':' ||
+                                        coalesce(b, 'null') || ':' || md5(c), ','
+                                        ORDER BY id))
+                  FROM test_full WHERE id > 10";
+is(scalar_query(2, $data_query), scalar_query(1, $data_query),
+   'Data on n1 and n2 matches');
+is(scalar_query(2, "SELECT count(*) FROM test_full WHERE b IS NULL"), '4',
+   'Columns set to NULL were replicated');
+is(scalar_query(2, "SELECT count(*) FROM test_full WHERE id > 1000"), '10',
+   'Updates of the primary key were replicated');
+my $toast_query = "SELECT md5(string_agg(c, ',' ORDER BY id)) FROM test_full WHERE id BETWEEN 21 AND 30";
+is(scalar_query(2, $toast_query), scalar_query(1, $toast_query),
+   'Updates of TOASTed columns were replicated');
+is(scalar_query(2, "SELECT sum(a) FROM test_full WHERE id BETWEEN 61 AND 70"),
+   scalar_query(1, "SELECT sum(a) FROM test_full WHERE id BETWEEN 61 AND 70"),
+   'Successive updates of the same row were replicated');
+
+destroy_cluster('Destroy 2-node changed columns test cluster');
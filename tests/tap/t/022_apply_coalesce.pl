@@ -0,0 +1,224 @@
+#!/usr/bin/perl
+# =============================================================================
+# Test: 022_apply_coalesce.pl - Committing small remote transactions together
+# =============================================================================
+# This test verifies spock.apply_coalesce_xacts.
+#
+# Topology:
+#   n1 -> n2 -> n3, forward_origins='all' on both subscriptions
+#   n3 commits up to 50 consecutive remote transactions together
+#
+# Test scenario:
+# 1. Run many single-row transactions on n1 and n2 at the same time; n3
+#    receives those of n2 interleaved with those of n1 forwarded by n2.
+#    Coalesced groups must end at each forwarded transaction, and every
+#    row on n3 must keep the xid, commit timestamp and origin of its own
+#    remote transaction.
+# 2. Run DDL between small transactions on n2; it ends the group too.
+# 3. Check that the replication origin advanced past everything.
+# 4. Make a transaction inside a group fail on n3 only; the apply worker
+#    must restart, apply the transactions one by one and hand the failing
+#    one to the regular exception handling.
+# =============================================================================
+
+use strict;
+use warnings;
+use Test::More tests => 24;
+use IPC::Run;
+use lib '.';
+use SpockTest qw(create_cluster destroy_cluster system_or_bail
+                 get_test_config scalar_query psql_or_bail);
+
+create_cluster(3, 'Create 3-node cluster');
+
+my $config = get_test_config();
+my $node_ports = $config->{node_ports};
+my $node_datadirs = $config->{node_datadirs};
+my $host = $config->{host};
+my $dbname = $config->{db_name};
+my $db_user = $config->{db_user};
+
+my $conn_n1 = "host=$host port=$node_ports->[0] dbname=$dbname";
+my $conn_n2 = "host=$host port=$node_ports->[1] dbname=$dbname";
+
+# Server log of a node, as configured by create_postgresql_conf()
+sub server_log {
+    my ($node_num) = @_;
+    my $dir = $config->{log_dir};
+    $dir = "$node_datadirs->[$node_num - 1]/$dir" unless $dir =~ m{^/};
+    my $file = "$dir/00$node_ports->[$node_num - 1].log";
+    open(my $fh, '<', $file) or return '';
+    local $/;
+    my $content = <$fh>;
+    close($fh);
+    return $content;
+}
+
+sub wait_for_n3 {
+    my $lsn = scalar_query(1, "SELECT spock.sync_event()");
+    psql_or_bail(2, "CALL spock.wait_for_sync_event(true, 'n1', '$lsn'::pg_lsn, 600)");
+    $lsn = scalar_query(2, "SELECT spock.sync_event()");
+    psql_or_bail(3, "CALL spock.wait_for_sync_event(true, 'n2', '$lsn'::pg_lsn, 600)");
+}
+
+# =============================================================================
+# SETUP
+# =============================================================================
+
+for my $node (1 .. 3) {
+    psql_or_bail($node, "SELECT spock.repset_create('coalesce_set')");
+    psql_or_bail($node, "CREATE TABLE test_coalesce (id integer PRIMARY KEY, node text, val integer)");
+    psql_or_bail($node, "SELECT spock.repset_add_table('coalesce_set', 'test_coalesce')");
+    psql_or_bail($node, q(
+CREATE PROCEDURE insert_rows(first integer, cnt integer, node text)
+AS $$
+DECLARE
+	i integer := 0;
+BEGIN
+  WHILE i < cnt LOOP
+	INSERT INTO test_coalesce VALUES (first + i, node, first + i);
+	COMMIT;
+	i := i + 1;
+  END LOOP;
+END;
+$$ LANGUAGE plpgsql;));
+}
+pass('Created test table and procedure on all nodes');
+
+psql_or_bail(2, "SELECT spock.sub_create('sub_n1_n2', '$conn_n1', ARRAY['coalesce_set', 'ddl_sql'], false, false, ARRAY['all'])");
+psql_or_bail(3, "SELECT spock.sub_create('sub_n2_n3', '$conn_n2', ARRAY['coalesce_set', 'ddl_sql'], false, false, ARRAY['all'])");
+
+psql_or_bail(3, "ALTER SYSTEM SET spock.apply_coalesce_xacts = 50");
+psql_or_bail(3, "ALTER SYSTEM SET spock.apply_coalesce_timeout = 1000");
+psql_or_bail(3, "SELECT pg_reload_conf()");
+system_or_bail 'sleep', '5';
+
+is(scalar_query(3, "SELECT status FROM spock.sub_show_status() WHERE subscription_name = 'sub_n2_n3'"),
+   'replicating', 'Subscription n2->n3 is replicating');
+
+# =============================================================================
+# TEST: Local and forwarded transactions
+# =============================================================================
+
+my ($stdout, $stderr) = ('', '');
+my $handle = IPC::Run::start(
+    [
+        'psql', '-X',
+        '-c', "CALL insert_rows(100000, 500, 'n1')",
+        '-h', $host, '-p', $node_ports->[0], '-U', $db_user, $dbname
+    ],
+    '>' => \$stdout,
+    '2>' => \$stderr);
+
+psql_or_bail(2, "CALL insert_rows(200000, 500, 'n2')");
+
+$handle->finish;
+is($handle->full_result(0), 0, 'Session on n1 finished successfully');
+
+wait_for_n3();
+
+is(scalar_query(3, "SELECT count(*) FROM test_coalesce"), '1000',
+   'All transactions were applied on n3');
+
+my @groups = (server_log(3) =~ /committing (\d+) coalesced transactions/g);
+ok((grep { $_ > 1 } @groups) > 0, 'Transactions were committed together on n3');
+
+# Each remote transaction keeps a local xid of its own
+is(scalar_query(3, "SELECT count(DISTINCT xmin::text) FROM test_coalesce"), '1000',
+   'Every transaction has its own xid on n3');
+
+# n2 applies one by one, so it has the timestamps of the origin nodes
+my $ts_query = "SELECT md5(string_agg(id || ':' || pg_xact_commit_timestamp(xmin), ',' ORDER BY id)) FROM test_coalesce";
+is(scalar_query(3, $ts_query), scalar_query(2, $ts_query),
+   'Commit timestamps on n3 match those on n2');
+
+my $origin_n1 = scalar_query(3, "SELECT spock.spock_gen_slot_name(current_database()::name, 'n1'::name, 'sub_n2_n3'::name)");
+my $origin_n2 = scalar_query(3, "SELECT spock.spock_gen_slot_name(current_database()::name, 'n2'::name, 'sub_n2_n3'::name)");
+is(scalar_query(3,
+    "SELECT count(*) FROM test_coalesce t,
+            spock.xact_commit_timestamp_origin(t.xmin) x,
+            pg_replication_origin o
+     WHERE o.roident = x.roident
+       AND o.roname = CASE t.node WHEN 'n1' THEN '$origin_n1' ELSE '$origin_n2' END"),
+   '1000', 'Every row on n3 has the origin of its own transaction');
+
+# =============================================================================
+# TEST: DDL between small transactions
+# =============================================================================
+
+psql_or_bail(2, q(
+DO $$
+BEGIN
+  FOR i IN 1..50 LOOP
+	INSERT INTO test_coalesce VALUES (300000 + i, 'n2', i);
+	COMMIT;
+  END LOOP;
+  ALTER TABLE test_coalesce ADD COLUMN note text;
+  COMMIT;
+  FOR i IN 51..100 LOOP
+	INSERT INTO test_coalesce VALUES (300000 + i, 'n2', i, 'after ddl');
+	COMMIT;
+  END LOOP;
+END;
+$$;));
+
+my $lsn = scalar_query(2, "SELECT pg_current_wal_lsn()");
+wait_for_n3();
+
+is(scalar_query(3, "SELECT count(*) FROM test_coalesce WHERE id > 300000"), '100',
+   'Transactions around the DDL were applied on n3');
+is(scalar_query(3, "SELECT count(*) FROM test_coalesce WHERE note = 'after ddl'"), '50',
+   'Transactions following the DDL were applied with the new column on n3');
+
+# =============================================================================
+# TEST: Replication origin progress
+# =============================================================================
+
+is(scalar_query(3,
+    "SELECT s.remote_lsn >= '$lsn'::pg_lsn
+     FROM pg_replication_origin o
+     JOIN pg_replication_origin_status s ON s.local_id = o.roident
+     WHERE o.roname = '$origin_n2'"),
+   't', 'Replication origin on n3 advanced past the last transaction');
+
+# =============================================================================
+# TEST: Failure inside a group
+# =============================================================================
+
+psql_or_bail(3, "ALTER SYSTEM SET spock.exception_behaviour = 'discard'");
+psql_or_bail(3, "ALTER SYSTEM SET spock.exception_logging = 'all'");
+psql_or_bail(3, "SELECT pg_reload_conf()");
+psql_or_bail(3, "TRUNCATE spock.exception_log");
+
+# A constraint only n3 knows about
+psql_or_bail(3, "BEGIN; SELECT spock.repair_mode(true);
+                 ALTER TABLE test_coalesce ADD CONSTRAINT val_check CHECK (val < 1000000);
+                 COMMIT");
+
+psql_or_bail(2, q(
+DO $$
+BEGIN
+  FOR i IN 1..40 LOOP
+	INSERT INTO test_coalesce VALUES (400000 + i, 'n2',
+		CASE WHEN i = 20 THEN 1000000 ELSE i END);
+	COMMIT;
+  END LOOP;
+END;
+$$;));
+
+wait_for_n3();
+
+is(scalar_query(3, "SELECT count(*) FROM test_coalesce WHERE id > 400000"), '39',
+   'Transactions around the failing one were applied on n3');
+is(scalar_query(3, "SELECT count(*) FROM test_coalesce WHERE id = 400020"), '0',
+   'Failing transaction was discarded on n3');
+ok(scalar_query(3, "SELECT count(*) FROM spock.exception_log
+                    WHERE operation = 'INSERT' AND error_message LIKE '%val_check%'") > 0,
+   'Failure was recorded in the exception log');
+like(server_log(3), qr/error while coalescing transactions, transactions up to \S+ will be applied one by one/,
+     'Apply worker restarted to apply the transactions one by one');
+
+is(scalar_query(3, "SELECT status FROM spock.sub_show_status() WHERE subscription_name = 'sub_n2_n3'"),
+   'replicating', 'Subscription n2->n3 is still replicating');
+
+destroy_cluster('Destroy 3-node apply coalesce test cluster');
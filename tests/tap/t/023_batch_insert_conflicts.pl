@@ -0,0 +1,121 @@
+#!/usr/bin/perl
+# =============================================================================
+# Test: 023_batch_insert_conflicts.pl - Conflicts of batched inserts
+# =============================================================================
+# This test verifies that inserts applied in batches (spock.batch_inserts)
+# resolve conflicts with last_update_wins the same way inserts applied one
+# at a time do.
+#
+# Topology:
+#   n1 (provider) -> n2 (subscriber)
+#
+# Test scenario:
+# 1. n2 has rows with the keys of some of the inserts and a unique index of
+#    its own, checked with spock.check_all_uc_indexes
+# 2. A transaction on n1 inserts rows conflicting with the local rows, and
+#    rows repeating a key of the local-only index within the batch
+# 3. The rows and the order of the changes on n2 are the same with and
+#    without batching
+# =============================================================================
+
+use strict;
+use warnings;
+use Test::More tests => 13;
+use lib '.';
+use SpockTest qw(create_cluster cross_wire destroy_cluster system_or_bail
+                 get_test_config scalar_query psql_or_bail);
+
+create_cluster(2, 'Create 2-node cluster');
+cross_wire(2, ['n1', 'n2'], 'Cross-wire nodes');
+
+sub wait_for_n2 {
+    my $lsn = scalar_query(1, "SELECT spock.sync_event()");
+    psql_or_bail(2, "CALL spock.wait_for_sync_event(true, 'n1', '$lsn'::pg_lsn, 600)");
+}
+
+# Change n2 only
+sub local_change {
+    my ($sql) = @_;
+    psql_or_bail(2, "BEGIN; SELECT spock.repair_mode(true); $sql; COMMIT");
+}
+
+sub restart_sub {
+    psql_or_bail(2, "SELECT pg_reload_conf()");
+    psql_or_bail(2, "SELECT spock.sub_disable('sub_n2_n1')");
+    psql_or_bail(2, "SELECT spock.sub_enable('sub_n2_n1')");
+    system_or_bail 'sleep', '5';
+}
+
+# The same transaction is applied to both tables, batched and not
+sub remote_inserts {
+    my ($table) = @_;
+    psql_or_bail(1, "BEGIN;
+                     INSERT INTO $table SELECT g, g, 'remote' FROM generate_series(1, 30) g;
+                     INSERT INTO $table SELECT g, 1000 + g % 10, 'dup ' || g
+                     FROM generate_series(101, 130) g;
+                     COMMIT");
+}
+
+# =============================================================================
+# SETUP
+# =============================================================================
+
+foreach my $table ('test_batch', 'test_single') {
+    psql_or_bail(1, "CREATE TABLE $table (id integer PRIMARY KEY, u integer, v text)");
+}
+wait_for_n2();
+
+local_change("CREATE UNLOGGED TABLE change_log (seq serial, tbl text, id integer)");
+local_change("CREATE FUNCTION log_change() RETURNS trigger LANGUAGE plpgsql AS \$\$
+              BEGIN
+                INSERT INTO change_log (tbl, id) VALUES (TG_TABLE_NAME, NEW.id);
+                RETURN NULL;
+              END \$\$");
+foreach my $table ('test_batch', 'test_single') {
+    local_change("CREATE UNIQUE INDEX ${table}_u ON $table (u)");
+    local_change("INSERT INTO $table VALUES (15, 15, 'local'), (200, 20, 'local')");
+    local_change("CREATE TRIGGER ${table}_log AFTER INSERT OR UPDATE ON $table
+                  FOR EACH ROW EXECUTE FUNCTION log_change()");
+    local_change("ALTER TABLE $table ENABLE ALWAYS TRIGGER ${table}_log");
+}
+
+psql_or_bail(2, "ALTER SYSTEM SET spock.check_all_uc_indexes = on");
+restart_sub();
+
+is(scalar_query(2, "SELECT status FROM spock.sub_show_status() WHERE subscription_name = 'sub_n2_n1'"),
+   'replicating', 'Subscription is replicating');
+
+# =============================================================================
+# TEST: Batched inserts
+# =============================================================================
+
+remote_inserts('test_batch');
+wait_for_n2();
+
+is(scalar_query(2, "SELECT v FROM test_batch WHERE id = 15"), 'remote',
+   'Insert of an existing key overwrote the older local row');
+is(scalar_query(2, "SELECT count(*) = count(DISTINCT u) FROM test_batch"), 't',
+   'Keys repeated within the batch did not violate the local unique index');
+
+# =============================================================================
+# TEST: The same inserts one at a time
+# =============================================================================
+
+psql_or_bail(2, "ALTER SYSTEM SET spock.batch_inserts = off");
+restart_sub();
+
+remote_inserts('test_single');
+wait_for_n2();
+
+is(scalar_query(2, "SELECT status FROM spock.sub_show_status() WHERE subscription_name = 'sub_n2_n1'"),
+   'replicating', 'Subscription is still replicating');
+
+my $data_query = "SELECT string_agg(id || ':' || u || ':' || v, ',' ORDER BY id) FROM";
+is(scalar_query(2, "$data_query test_batch"), scalar_query(2, "$data_query test_single"),
+   'Batched and single inserts left the same rows');
+
+my $log_query = "SELECT string_agg(id::text, ',' ORDER BY seq) FROM change_log WHERE tbl =";
+is(scalar_query(2, "$log_query 'test_batch'"), scalar_query(2, "$log_query 'test_single'"),
+   'Batched and single inserts changed the rows in the same order');
+
+destroy_cluster('Destroy 2-node batch insert conflicts test cluster');
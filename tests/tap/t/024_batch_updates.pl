@@ -0,0 +1,105 @@
+#!/usr/bin/perl
+# =============================================================================
+# Test: 024_batch_updates.pl - Runs of updates and deletes looked up together
+# =============================================================================
+# This test verifies spock.batch_updates.
+#
+# Topology:
+#   n1 (provider) -> n2 (subscriber)
+#
+# Test scenario:
+# 1. A transaction on n1 updates and deletes runs of rows longer than the
+#    batching threshold of 5 changes, changing some of the rows twice
+# 2. One of the deleted rows is missing on n2
+# 3. The rows on n2 are the same with and without batching, and match n1;
+#    a varchar key is looked up with the type its operator class compares
+# =============================================================================
+
+use strict;
+use warnings;
+use Test::More tests => 13;
+use lib '.';
+use SpockTest qw(create_cluster cross_wire destroy_cluster system_or_bail
+                 get_test_config scalar_query psql_or_bail);
+
+create_cluster(2, 'Create 2-node cluster');
+cross_wire(2, ['n1', 'n2'], 'Cross-wire nodes');
+
+sub wait_for_n2 {
+    my $lsn = scalar_query(1, "SELECT spock.sync_event()");
+    psql_or_bail(2, "CALL spock.wait_for_sync_event(true, 'n1', '$lsn'::pg_lsn, 600)");
+}
+
+# The same transaction is applied to both tables, batched and not
+sub remote_changes {
+    my ($table) = @_;
+    psql_or_bail(1, "BEGIN;
+                     UPDATE $table SET a = a + 1 WHERE id <= 20;
+                     UPDATE $table SET a = a * 10 WHERE id BETWEEN 5 AND 10;
+                     DELETE FROM $table WHERE id BETWEEN 15 AND 25;
+                     UPDATE $table SET b = 'again' WHERE id BETWEEN 26 AND 40;
+                     DELETE FROM $table WHERE id BETWEEN 38 AND 45;
+                     COMMIT");
+}
+
+my $data_query = "SELECT string_agg(id || ':' || a || ':' || b, ',' ORDER BY id) FROM";
+
+# =============================================================================
+# SETUP
+# =============================================================================
+
+foreach my $table ('test_batch', 'test_single') {
+    psql_or_bail(1, "CREATE TABLE $table (id integer PRIMARY KEY, a integer, b text)");
+    psql_or_bail(1, "INSERT INTO $table SELECT g, g, 'b' || g FROM generate_series(1, 50) g");
+}
+psql_or_bail(1, "CREATE TABLE test_varchar (k varchar(10) PRIMARY KEY, a integer)");
+psql_or_bail(1, "INSERT INTO test_varchar SELECT 'k' || g, g FROM generate_series(1, 50) g");
+wait_for_n2();
+
+is(scalar_query(2, "SELECT count(*) FROM test_batch"), '50', 'Rows were replicated to n2');
+
+# The row is missing on n2 only
+foreach my $table ('test_batch', 'test_single') {
+    psql_or_bail(2, "BEGIN; SELECT spock.repair_mode(true); DELETE FROM $table WHERE id = 42; COMMIT");
+}
+
+# =============================================================================
+# TEST: Batched updates and deletes
+# =============================================================================
+
+remote_changes('test_batch');
+psql_or_bail(1, "BEGIN;
+                 UPDATE test_varchar SET a = -a WHERE k LIKE 'k1%';
+                 DELETE FROM test_varchar WHERE k LIKE 'k2%';
+                 COMMIT");
+wait_for_n2();
+
+is(scalar_query(2, "SELECT count(*) FROM test_batch WHERE id BETWEEN 15 AND 25 OR id BETWEEN 38 AND 45"),
+   '0', 'Deleted rows are gone');
+is(scalar_query(2, "$data_query test_batch"), scalar_query(1, "$data_query test_batch"),
+   'Batched changes match n1');
+is(scalar_query(2, "SELECT status FROM spock.sub_show_status() WHERE subscription_name = 'sub_n2_n1'"),
+   'replicating', 'Delete of the missing row was skipped');
+my $varchar_query = "SELECT string_agg(k || ':' || a, ',' ORDER BY k) FROM test_varchar";
+is(scalar_query(2, $varchar_query), scalar_query(1, $varchar_query),
+   'Batched changes by a varchar key match n1');
+
+# =============================================================================
+# TEST: The same changes one at a time
+# =============================================================================
+
+psql_or_bail(2, "ALTER SYSTEM SET spock.batch_updates = off");
+psql_or_bail(2, "SELECT pg_reload_conf()");
+
+# Takes effect when the apply worker reconnects
+psql_or_bail(2, "SELECT spock.sub_disable('sub_n2_n1')");
+psql_or_bail(2, "SELECT spock.sub_enable('sub_n2_n1')");
+system_or_bail 'sleep', '5';
+
+remote_changes('test_single');
+wait_for_n2();
+
+is(scalar_query(2, "$data_query test_batch"), scalar_query(2, "$data_query test_single"),
+   'Batched and single changes left the same rows');
+
+destroy_cluster('Destroy 2-node batch updates test cluster');
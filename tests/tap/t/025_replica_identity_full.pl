@@ -0,0 +1,116 @@
+#!/usr/bin/perl
+# =============================================================================
+# Test: 025_replica_identity_full.pl - Row lookup of REPLICA IDENTITY FULL tables
+# =============================================================================
+# This test verifies how the rows of REPLICA IDENTITY FULL tables without a
+# replica identity index on the subscriber are found.
+#
+# Topology:
+#   n1 (provider) -> n2 (subscriber)
+#
+# Test scenario:
+# 1. n2 has no primary key on the tables, one of them has a non-unique index
+#    instead, the other none, which is looked up through the hash of its rows
+#    (spock.replica_identity_full_hash_mem)
+# 2. n2 has two copies of some of the rows, some with NULLs
+# 3. Updates and deletes of n1 change exactly one of the copies, and any row
+#    with NULLs, on n2
+# =============================================================================
+
+use strict;
+use warnings;
+use Test::More tests => 17;
+use lib '.';
+use SpockTest qw(create_cluster cross_wire destroy_cluster system_or_bail
+                 get_test_config scalar_query psql_or_bail);
+
+create_cluster(2, 'Create 2-node cluster');
+cross_wire(2, ['n1', 'n2'], 'Cross-wire nodes');
+
+sub wait_for_n2 {
+    my $lsn = scalar_query(1, "SELECT spock.sync_event()");
+    psql_or_bail(2, "CALL spock.wait_for_sync_event(true, 'n1', '$lsn'::pg_lsn, 600)");
+}
+
+# Change n2 only
+sub local_change {
+    my ($sql) = @_;
+    psql_or_bail(2, "BEGIN; SELECT spock.repair_mode(true); $sql; COMMIT");
+}
+
+# =============================================================================
+# SETUP
+# =============================================================================
+
+foreach my $table ('full_index', 'full_hash') {
+    psql_or_bail(1, "CREATE TABLE $table (id integer PRIMARY KEY, a integer, b text)");
+    psql_or_bail(1, "ALTER TABLE $table REPLICA IDENTITY FULL");
+    psql_or_bail(1, "INSERT INTO $table
+                     SELECT g, g % 7, CASE WHEN g % 5 = 0 THEN NULL ELSE 'b' || g % 20 END
+                     FROM generate_series(1, 200) g");
+}
+wait_for_n2();
+
+is(scalar_query(2, "SELECT count(*) FROM full_index"), '200', 'Rows of full_index were replicated to n2');
+is(scalar_query(2, "SELECT count(*) FROM full_hash"), '200', 'Rows of full_hash were replicated to n2');
+
+foreach my $table ('full_index', 'full_hash') {
+    local_change("ALTER TABLE $table DROP CONSTRAINT ${table}_pkey");
+    # Row 10 has a NULL
+    local_change("INSERT INTO $table SELECT * FROM $table WHERE id IN (3, 10)");
+}
+local_change("CREATE INDEX full_index_b ON full_index (b)");
+
+psql_or_bail(2, "ALTER SYSTEM SET spock.replica_identity_full_hash_mem = '1MB'");
+psql_or_bail(2, "SELECT pg_reload_conf()");
+
+# Takes effect when the apply worker reconnects
+psql_or_bail(2, "SELECT spock.sub_disable('sub_n2_n1')");
+psql_or_bail(2, "SELECT spock.sub_enable('sub_n2_n1')");
+system_or_bail 'sleep', '5';
+
+# =============================================================================
+# TEST: Updates and deletes
+# =============================================================================
+
+foreach my $table ('full_index', 'full_hash') {
+    psql_or_bail(1, "BEGIN;
+                     UPDATE $table SET a = a + 100 WHERE id % 3 = 0;
+                     DELETE FROM $table WHERE id % 10 = 0;
+                     UPDATE $table SET b = NULL WHERE id BETWEEN 41 AND 45;
+                     UPDATE $table SET b = 'was null' WHERE b IS NULL AND id > 150;
+                     COMMIT");
+}
+wait_for_n2();
+
+foreach my $table ('full_index', 'full_hash') {
+    my $data_query = "SELECT string_agg(id || ':' || a || ':' || coalesce(b, 'null'), ',' ORDER BY id)
+                      FROM $table WHERE id NOT IN (3, 10)";
+    is(scalar_query(2, $data_query), scalar_query(1, $data_query),
+       "Rows of $table match n1");
+    is(scalar_query(2, "SELECT string_agg(a::text, ',' ORDER BY a) FROM $table WHERE id = 3"),
+       '3,103', "One of the two copies of a row of $table was updated");
+    is(scalar_query(2, "SELECT count(*) FROM $table WHERE id = 10"), '1',
+       "One of the two copies of a row of $table with a NULL was deleted");
+}
+
+is(scalar_query(2, "SELECT status FROM spock.sub_show_status() WHERE subscription_name = 'sub_n2_n1'"),
+   'replicating', 'Subscription is replicating');
+
+# More rows than fit in spock.replica_identity_full_hash_mem
+psql_or_bail(2, "ALTER SYSTEM SET spock.replica_identity_full_hash_mem = '64kB'");
+psql_or_bail(2, "SELECT pg_reload_conf()");
+psql_or_bail(2, "SELECT spock.sub_disable('sub_n2_n1')");
+psql_or_bail(2, "SELECT spock.sub_enable('sub_n2_n1')");
+system_or_bail 'sleep', '5';
+
+psql_or_bail(1, "INSERT INTO full_hash SELECT g, g % 7, 'b' || g FROM generate_series(1001, 3000) g");
+psql_or_bail(1, "UPDATE full_hash SET a = -a WHERE id > 1000");
+wait_for_n2();
+
+my $large_query = "SELECT string_agg(id || ':' || a || ':' || coalesce(b, 'null'), ',' ORDER BY id)
+                   FROM full_hash WHERE id NOT IN (3, 10)";
+is(scalar_query(2, $large_query), scalar_query(1, $large_query),
+   'Rows of full_hash match n1 when they do not fit in the hash');
+
+destroy_cluster('Destroy 2-node replica identity full test cluster');